@@ -57,6 +57,7 @@ public:
 
 	propVect(size_t n, Type t) { v.resize(n, t); };
 	propVect(propVect &a) { v.assign(a.v.begin(), a.v.end()); };
+	propVect& operator=(const propVect &a) { v.assign(a.v.begin(), a.v.end()); return(*this); };
 	propVect(std::vector<Type> &a) { assign(a.v.begin(), a.v.end()); };
 
 	inline operator std::vector<Type>&(void) { return v; }
@@ -0,0 +1,573 @@
+/*
+* Header-only benchmarks against a simulated crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "crazyflie.h"
+#include "swarm.h"
+#include "swarmlink.h"
+#include "simlink.h"
+#include "udplink.h"
+#include "messageout.h"
+#include <string>
+#include <vector>
+#include <ctime>
+
+/**
+* Times of a run of connect and disconnect cycles, in milliseconds.
+*/
+struct ConnectCycleResult
+{
+	int32_t cycles = 0;				/**< Cycles run. */
+	int32_t ready = 0;				/**< Cycles that reached ready. */
+	double firstReadyMs = 0;		/**< Connect to ready of the first cycle, which fetches the TOCs. */
+	double averageReadyMs = 0;		/**< Average connect to ready of the later cycles. */
+	double maxReadyMs = 0;			/**< Longest connect to ready of the later cycles. */
+	double averageDisconnectMs = 0;	/**< Average time in disconnect(). */
+	double maxDisconnectMs = 0;		/**< Longest time in disconnect(). */
+};
+
+/**
+* Bring-up and traffic of a swarm run through one process.
+*/
+struct SwarmScalingResult
+{
+	int32_t drones = 0;				/**< Drones connected. */
+	int32_t ready = 0;				/**< Drones that reached ready. */
+	double allReadyMs = 0;			/**< connectAll until every drone was ready or timed out. */
+	double maxReadyMs = 0;			/**< Longest connect to ready of a drone. */
+	double rxPerSecond = 0;			/**< Packets received each second by all the drones. */
+	double txPerSecond = 0;			/**< Packets sent each second by all the drones. */
+	double processCpuPercent = 0;	/**< Process cpu time over wall time while measuring, 100 for one core. */
+};
+
+/**
+* Decode times of one log block layout, in nanoseconds per block.
+*/
+struct LogDecodeResult
+{
+	int32_t variables = 0;							/**< Variables in the block. */
+	cfLog::LogDecodeShape shape = cfLog::DECODE_NONE;	/**< The kernel the plan compiled to. */
+	double eachNs = 0;								/**< Setting each variable in turn. */
+	double planNs = 0;								/**< Decoding with the compiled plan. */
+	bool matches = false;							/**< Both paths set the same values. */
+};
+
+/**
+* Dispatch times of a decoded log block to its subscribers, in nanoseconds per block.
+*/
+struct LogDispatchResult
+{
+	int32_t subscribers = 0;		/**< Subscribers of the block. */
+	double dispatchNs = 0;			/**< Passing the block to every subscriber. */
+	bool calledAll = false;			/**< Each subscriber was called for each block. */
+	bool withinTarget = false;		/**< dispatchNs is under 100 nanoseconds. */
+};
+
+/**
+* The radio use of the standard telemetry set, fetched as the TOC types
+* and as the narrowest types that meet its ranges and tolerances.
+*/
+struct LogNarrowingResult
+{
+	LogPlanStats toc;				/**< Every variable fetched as its TOC type. */
+	LogPlanStats narrow;			/**< Every variable fetched as its narrowest type. */
+	double gain = 0;				/**< Samples each second carried by the same packets each second, narrow over toc. */
+};
+
+/**
+* Benchmarks of the client against a SimLink, no Crazyradio is needed.
+*/
+struct Benchmarks
+{
+	/**
+	* Connects a CrazyFlie to a SimLink until it is ready and disconnects it, many times.
+	* The first cycle fetches the TOCs, the later cycles load them from the cache.
+	* @param The number of cycles.
+	* @param The simulated crazyflie.
+	* @param The directory for the cached TOCs.
+	* @param The longest wait for each cycle to be ready in milliseconds.
+	* @returns The times of the cycles.
+	*/
+	static ConnectCycleResult connect_cycles(int32_t cycles, SimSettings settings,
+		std::string directory, int32_t timeoutMs = 10000)
+	{
+		ConnectCycleResult result;
+		CrazyFlie cf;
+		cf.defaultDirectory = directory;
+		cf.linkFactory = createSimLink;
+		cf.linkContext = &settings;
+		double totalReadyMs = 0;
+		double totalDisconnectMs = 0;
+		for (int32_t i = 0; i < cycles; i++)
+		{
+			int64_t startNs = steadyNowNs();
+			bool ready = cf.connect_uri("sim://0") && cf.portConnect->wait_ready(timeoutMs);
+			double readyMs = (double)(steadyNowNs() - startNs) * 1.0e-6;
+			int64_t disconnectNs = steadyNowNs();
+			cf.disconnect();
+			double disconnectMs = (double)(steadyNowNs() - disconnectNs) * 1.0e-6;
+
+			result.cycles++;
+			if (ready)
+			{
+				result.ready++;
+				if (i == 0)
+				{
+					result.firstReadyMs = readyMs;
+				}
+				else
+				{
+					totalReadyMs += readyMs;
+					if (readyMs > result.maxReadyMs)
+					{
+						result.maxReadyMs = readyMs;
+					}
+				}
+			}
+			totalDisconnectMs += disconnectMs;
+			if (disconnectMs > result.maxDisconnectMs)
+			{
+				result.maxDisconnectMs = disconnectMs;
+			}
+		}
+		if (result.cycles > 1)
+		{
+			result.averageReadyMs = totalReadyMs / (double)(result.cycles - 1);
+		}
+		if (result.cycles > 0)
+		{
+			result.averageDisconnectMs = totalDisconnectMs / (double)result.cycles;
+		}
+		return(result);
+	}
+
+	/**
+	* Connects a swarm through the same PortConnect, cfLog and Param code
+	* used with the radio, then measures its traffic for a time.
+	* With a linkFactory of createUdpLink and the uris of UdpLink::fleet_uris,
+	* it drives software in the loop firmware, with createSimLink it needs nothing else.
+	* @param The uris of the drones.
+	* @param Creates the link of each drone, NULL for a link chosen by the uri.
+	* @param Passed to the linkFactory.
+	* @param The directory for the cached TOCs.
+	* @param The reactor threads pumping every drone, 0 for the threads of each drone.
+	* @param The time traffic is measured in milliseconds.
+	* @param The most drones brought up at a time.
+	* @returns The bring-up time and traffic of the swarm.
+	*/
+	static SwarmScalingResult swarm_scaling(std::vector<std::string> uris, LinkFactory linkFactory,
+		void* linkContext, std::string directory, int32_t reactors = SwarmLink::DEFAULT_REACTORS,
+		int32_t measureMs = 2000, int32_t maxParallel = Swarm::DEFAULT_PARALLEL)
+	{
+		SwarmScalingResult result;
+		SwarmLink swarmLink;
+		Swarm swarm;
+		swarm.defaultDirectory = directory;
+		swarm.linkFactory = linkFactory;
+		swarm.linkContext = linkContext;
+		if (reactors > 0)
+		{
+			swarmLink.start(reactors);
+			swarm.pump = &swarmLink;
+		}
+		int64_t startNs = steadyNowNs();
+		result.ready = swarm.connectAll(uris, maxParallel);
+		result.allReadyMs = (double)(steadyNowNs() - startNs) * 1.0e-6;
+		result.drones = (int32_t)uris.size();
+		for (SwarmBringUp& drone : swarm.bringUp)
+		{
+			if (drone.ready && drone.readyMs - drone.startMs > result.maxReadyMs)
+			{
+				result.maxReadyMs = drone.readyMs - drone.startMs;
+			}
+		}
+
+		int64_t measureNs = steadyNowNs();
+		double cpuStart = _process_cpu_seconds();
+		std::vector<uint64_t> rxStart;
+		std::vector<uint64_t> txStart;
+		for (CrazyFlie* drone : swarm.drones)
+		{
+			rxStart.push_back(_packets(drone, true));
+			txStart.push_back(_packets(drone, false));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(measureMs));
+		double seconds = (double)(steadyNowNs() - measureNs) * 1.0e-9;
+		for (size_t i = 0; i < swarm.drones.size(); i++)
+		{
+			result.rxPerSecond += (double)(_packets(swarm.drones[i], true) - rxStart[i]) / seconds;
+			result.txPerSecond += (double)(_packets(swarm.drones[i], false) - txStart[i]) / seconds;
+		}
+		result.processCpuPercent = (_process_cpu_seconds() - cpuStart) / seconds * 100.0;
+		swarm.disconnectAll();
+		swarmLink.stop();
+		return(result);
+	}
+
+	/**
+	* Times the decode of a log block by setting each variable in turn
+	* against the compiled decode plan, no link is needed.
+	* @param The type of each variable of the block.
+	* @param The blocks decoded by each path.
+	* @returns The decode times.
+	*/
+	static LogDecodeResult log_decode(std::vector<typeDex> layout, int32_t iterations = 1000000)
+	{
+		LogDecodeResult result;
+		std::vector<cfLog::LogVariable> variables(layout.size());
+		cfLog::LogConfig config("decode", 10);
+		for (size_t i = 0; i < layout.size(); i++)
+		{
+			variables[i].name = "decode.v" + std::to_string(i);
+			variables[i].fetch_as = layout[i];
+			config.add_variable(&variables[i]);
+		}
+		config._compile_plan();
+		result.variables = (int32_t)layout.size();
+		result.shape = config.plan.shape;
+
+		uint8_t data[cfLog::LogConfig::MAX_LEN * 2];
+		for (size_t i = 0; i < sizeof(data); i++)
+		{
+			data[i] = (uint8_t)(i * 37 + 11);
+		}
+		std::vector<uint64_t> eachValues(layout.size());
+		int64_t startNs = steadyNowNs();
+		for (int32_t i = 0; i < iterations; i++)
+		{
+			config._unpack_each(data, sizeof(data), (uint32_t)i);
+		}
+		result.eachNs = (double)(steadyNowNs() - startNs) / (double)(iterations > 0 ? iterations : 1);
+		for (size_t i = 0; i < variables.size(); i++)
+		{
+			eachValues[i] = variables[i]._value;
+		}
+		startNs = steadyNowNs();
+		for (int32_t i = 0; i < iterations; i++)
+		{
+			config.unpack_log_data(data, sizeof(data), (uint32_t)i);
+		}
+		result.planNs = (double)(steadyNowNs() - startNs) / (double)(iterations > 0 ? iterations : 1);
+		result.matches = config.decoded.count == variables.size();
+		for (size_t i = 0; i < variables.size() && result.matches; i++)
+		{
+			uint32_t timestamp = 0;
+			result.matches = variables[i]._value == eachValues[i] &&
+				variables[i].fetchFloat(timestamp) == config.decoded.values[i];
+		}
+		return(result);
+	}
+
+	/**
+	* Times the dispatch of a decoded log block to its subscribers, no link is needed.
+	* @param The number of subscribers, at most LogConfig::MAX_SUBSCRIBERS.
+	* @param The blocks dispatched.
+	* @returns The dispatch time.
+	*/
+	static LogDispatchResult log_dispatch(int32_t subscribers, int32_t iterations = 1000000)
+	{
+		LogDispatchResult result;
+		std::vector<cfLog::LogVariable> variables(4);
+		std::vector<uint64_t> calls(subscribers > 0 ? subscribers : 0);
+		cfLog::LogConfig config("dispatch", 10);
+		for (size_t i = 0; i < variables.size(); i++)
+		{
+			variables[i].name = "dispatch.v" + std::to_string(i);
+			variables[i].fetch_as = tdFloat32;
+			config.add_variable(&variables[i]);
+		}
+		config._compile_plan();
+		for (size_t i = 0; i < calls.size(); i++)
+		{
+			if (config.subscribe(_count_dispatch, &calls[i]) >= 0)
+			{
+				result.subscribers++;
+			}
+		}
+		int64_t startNs = steadyNowNs();
+		for (int32_t i = 0; i < iterations; i++)
+		{
+			config._dispatch((uint32_t)i);
+		}
+		result.dispatchNs = (double)(steadyNowNs() - startNs) / (double)(iterations > 0 ? iterations : 1);
+		result.calledAll = result.subscribers == (int32_t)calls.size();
+		for (size_t i = 0; i < calls.size() && result.calledAll; i++)
+		{
+			result.calledAll = calls[i] == (uint64_t)iterations;
+		}
+		result.withinTarget = result.dispatchNs < 100.0;
+		return(result);
+	}
+
+	/**
+	* Counts the blocks passed to a subscriber of log_dispatch.
+	* @param The count of the subscriber.
+	* @param The block.
+	*/
+	static void _count_dispatch(void* context, const cfLog::LogData&)
+	{
+		(*(uint64_t*)context)++;
+	}
+
+	/**
+	* Plans the standard telemetry set on a SimLink twice, once as the TOC types
+	* and once narrowed to its ranges and tolerances, and compares their radio use.
+	* @param The simulated crazyflie.
+	* @param The directory for the cached TOCs.
+	* @param The longest wait for each connect to be ready in milliseconds.
+	* @returns The radio use of both plans.
+	*/
+	static LogNarrowingResult log_narrowing(SimSettings settings, std::string directory, int32_t timeoutMs = 10000)
+	{
+		LogNarrowingResult result;
+		for (int32_t pass = 0; pass < 2; pass++)
+		{
+			CrazyFlie cf;
+			cf.defaultDirectory = directory;
+			cf.linkFactory = createSimLink;
+			cf.linkContext = &settings;
+			standard_telemetry(cf.logPlanner, pass == 1);
+			if (cf.connect_uri("sim://0") && cf.portConnect->wait_ready(timeoutMs))
+			{
+				(pass == 1 ? result.narrow : result.toc) = cf.logPlanner.stats();
+			}
+			cf.disconnect();
+		}
+		double tocRate = result.toc.samples_per_packet();
+		result.gain = tocRate > 0 ? result.narrow.samples_per_packet() / tocRate : 0;
+		return(result);
+	}
+
+	/**
+	* Requests the standard telemetry set: the state estimate every 20 ms,
+	* the ranges every 100 ms and the battery every 500 ms.
+	* @param The planner to add the variables to.
+	* @param true to give each variable its range and tolerance, false to keep the TOC types.
+	*/
+	static void standard_telemetry(LogPlanner& planner, bool narrow)
+	{
+		static const char* positions[] = { "stateEstimate.x", "stateEstimate.y", "stateEstimate.z",
+			"stateEstimate.vx", "stateEstimate.vy", "stateEstimate.vz" };
+		static const char* angles[] = { "stateEstimate.roll", "stateEstimate.pitch", "stateEstimate.yaw" };
+		static const char* ranges[] = { "range.front", "range.back", "range.up", "range.left",
+			"range.right", "range.zrange" };
+		for (const char* name : positions)
+		{
+			// metres and metres per second within a room, to the centimetre.
+			if (narrow)
+			{
+				planner.add_range(name, 20, -10.0f, 10.0f, 0.01f);
+			}
+			else
+			{
+				planner.add(name, 20);
+			}
+		}
+		for (const char* name : angles)
+		{
+			// degrees, to a fifth of a degree.
+			if (narrow)
+			{
+				planner.add_range(name, 20, -180.0f, 180.0f, 0.2f);
+			}
+			else
+			{
+				planner.add(name, 20);
+			}
+		}
+		for (const char* name : ranges)
+		{
+			// millimetres, the sensors read to 4 metres.
+			if (narrow)
+			{
+				planner.add_range(name, 100, 0.0f, 4000.0f, 1.0f);
+			}
+			else
+			{
+				planner.add(name, 100);
+			}
+		}
+		if (narrow)
+		{
+			planner.add_range("pm.vbat", 500, 0.0f, 5.0f, 0.01f);
+			planner.add_range("pm.batteryLevel", 500, 0.0f, 100.0f, 1.0f);
+		}
+		else
+		{
+			planner.add("pm.vbat", 500);
+			planner.add("pm.batteryLevel", 500);
+		}
+	}
+
+	/**
+	* Counts the packets of a drone on every port and channel.
+	* @param The drone.
+	* @param true for received packets, false for sent packets.
+	* @returns The packets of the session, 0 if it is not connected.
+	*/
+	static uint64_t _packets(CrazyFlie* drone, bool received)
+	{
+		uint64_t result = 0;
+		if (drone->portConnect != NULL)
+		{
+			LinkMetrics& metrics = drone->portConnect->linkMetrics;
+			for (uint8_t port = 0; port < PORT_COUNT; port++)
+			{
+				for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+				{
+					result += received ? metrics.channels[port][channel].rxPackets : metrics.channels[port][channel].txPackets;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* @returns The cpu time used by the process in seconds.
+	*/
+	static double _process_cpu_seconds()
+	{
+#if defined(_WIN32)
+		FILETIME created;
+		FILETIME exited;
+		FILETIME kernel;
+		FILETIME user;
+		GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+		uint64_t ticks = ((uint64_t)kernel.dwHighDateTime << 32) + kernel.dwLowDateTime +
+			((uint64_t)user.dwHighDateTime << 32) + user.dwLowDateTime;
+		return((double)ticks * 1.0e-7);
+#else
+		return((double)std::clock() / (double)CLOCKS_PER_SEC);
+#endif
+	}
+
+	/**
+	* Writes the bring-up and traffic of a swarm to messageOut.
+	* @param The result to write.
+	*/
+	static void report(SwarmScalingResult& result)
+	{
+		messageOut << "swarm drones ";
+		messageOut << result.drones;
+		messageOut << " ready ";
+		messageOut << result.ready;
+		messageOut << " in ";
+		messageOut << result.allReadyMs;
+		messageOut << " ms, slowest drone ";
+		messageOut << result.maxReadyMs;
+		messageOut << " ms\n\r";
+		messageOut << "rx ";
+		messageOut << result.rxPerSecond;
+		messageOut << " tx ";
+		messageOut << result.txPerSecond;
+		messageOut << " packets/s, cpu ";
+		messageOut << result.processCpuPercent;
+		messageOut << " %\n\r";
+	}
+
+	/**
+	* Writes the radio use of the standard telemetry set to messageOut.
+	* @param The result to write.
+	*/
+	static void report(LogNarrowingResult& result)
+	{
+		messageOut << "telemetry toc types blocks ";
+		messageOut << result.toc.blocks;
+		messageOut << " bytes ";
+		messageOut << result.toc.bytes;
+		messageOut << " samples/packet ";
+		messageOut << result.toc.samples_per_packet();
+		messageOut << "\n\r";
+		messageOut << "telemetry narrowed blocks ";
+		messageOut << result.narrow.blocks;
+		messageOut << " bytes ";
+		messageOut << result.narrow.bytes;
+		messageOut << " samples/packet ";
+		messageOut << result.narrow.samples_per_packet();
+		messageOut << "\n\r";
+		messageOut << "samples/s gain at the same packet rate ";
+		messageOut << result.gain;
+		messageOut << "\n\r";
+	}
+
+	/**
+	* Writes the decode times of a log block layout to messageOut.
+	* @param The result to write.
+	*/
+	static void report(LogDecodeResult& result)
+	{
+		messageOut << "log decode variables ";
+		messageOut << result.variables;
+		messageOut << " shape ";
+		messageOut << (int32_t)result.shape;
+		messageOut << " each ";
+		messageOut << result.eachNs;
+		messageOut << " ns plan ";
+		messageOut << result.planNs;
+		messageOut << " ns";
+		messageOut << (result.matches ? "\n\r" : " values differ\n\r");
+	}
+
+	/**
+	* Writes the dispatch time of a log block to messageOut.
+	* @param The result to write.
+	*/
+	static void report(LogDispatchResult& result)
+	{
+		messageOut << "log dispatch subscribers ";
+		messageOut << result.subscribers;
+		messageOut << " dispatch ";
+		messageOut << result.dispatchNs;
+		messageOut << " ns";
+		messageOut << (result.withinTarget ? " within target" : " over target");
+		messageOut << (result.calledAll ? "\n\r" : " calls missed\n\r");
+	}
+
+	/**
+	* Writes the times of a connect cycle run to messageOut.
+	* @param The times to write.
+	*/
+	static void report(ConnectCycleResult& result)
+	{
+		messageOut << "connect cycles ";
+		messageOut << result.cycles;
+		messageOut << " ready ";
+		messageOut << result.ready;
+		messageOut << "\n\r";
+		messageOut << "first ready ";
+		messageOut << result.firstReadyMs;
+		messageOut << " ms, ready average ";
+		messageOut << result.averageReadyMs;
+		messageOut << " max ";
+		messageOut << result.maxReadyMs;
+		messageOut << " ms\n\r";
+		messageOut << "disconnect average ";
+		messageOut << result.averageDisconnectMs;
+		messageOut << " max ";
+		messageOut << result.maxDisconnectMs;
+		messageOut << " ms\n\r";
+	}
+};
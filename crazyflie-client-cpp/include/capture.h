@@ -0,0 +1,571 @@
+/*
+* Header-only implementation of CRTP packet capture and replay for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "crtplink.h"
+#include "portdispatch.h"
+#include "messageout.h"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/**
+* The header at the start of a capture file.
+*/
+struct CaptureHeader
+{
+	char magic[8];				/**< "CRTPCAP" */
+	uint32_t version;			/**< Format version, 1. */
+	uint32_t recordSize;		/**< sizeof(CaptureRecord). */
+	uint64_t capacity;			/**< Records the file has room for. */
+	uint64_t count;				/**< Records written, set when the capture is closed. */
+	int64_t startNs;			/**< steady_clock time the capture was opened. */
+	uint8_t reserved[24];		/**< Pads the header to 64 bytes. */
+};
+
+/**
+* One captured packet, the raw CRTP bytes
+* with the header byte first.
+*/
+struct CaptureRecord
+{
+	int64_t timeNs;				/**< Nanoseconds since the capture was opened. */
+	uint8_t direction;			/**< PacketCapture::CAPTURE_TX or CAPTURE_RX. */
+	uint8_t size;				/**< Raw bytes in data. */
+	uint8_t valid;				/**< Set last, once the record is complete. */
+	uint8_t reserved[5];		/**< Pads to the data. */
+	uint8_t data[CRTP_MAXSIZE];	/**< The raw packet. */
+};
+
+/**
+* Appends every packet sent and received to a memory mapped capture file.
+* Writers claim records with one atomic add, so the transmit and port
+* threads record without a lock. The file is sized for a fixed number
+* of records when it is opened, packets past the end are counted in
+* dropped and not recorded.
+*/
+class PacketCapture
+{
+public:
+	const static uint8_t CAPTURE_TX = 0;							/**< Sent to the crazyflie. */
+	const static uint8_t CAPTURE_RX = 1;							/**< Received from the crazyflie. */
+	const static uint64_t DEFAULT_CAPACITY = 1 << 20;				/**< Records in a capture by default. */
+
+	CaptureHeader* header;				/**< The mapped header. */
+	CaptureRecord* records;				/**< The mapped records. */
+	uint64_t capacity;					/**< Records the file has room for. */
+	size_t mappedSize;					/**< Bytes mapped. */
+	std::atomic<uint64_t> next = 0;		/**< The next record to claim. */
+	std::atomic<uint64_t> dropped = 0;	/**< Packets not recorded because the file was full. */
+	std::string path;					/**< The capture file. */
+#if defined(_WIN32)
+	HANDLE file;						/**< The open capture file. */
+	HANDLE mapping;						/**< The file mapping. */
+#else
+	int file;							/**< The open capture file. */
+#endif
+
+	/**
+	* Constructor
+	*/
+	PacketCapture()
+	{
+		header = NULL;
+		records = NULL;
+		capacity = 0;
+		mappedSize = 0;
+#if defined(_WIN32)
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#else
+		file = -1;
+#endif
+	}
+
+	/**
+	* Destructor
+	*/
+	~PacketCapture()
+	{
+		close();
+	}
+
+	/**
+	* Creates a capture file and maps it.
+	* @param The path of the capture file.
+	* @param The number of records to make room for.
+	* @returns true if the file is ready for recording.
+	*/
+	bool open(const std::string& _path, uint64_t _capacity = DEFAULT_CAPACITY)
+	{
+		bool result = false;
+		close();
+		path = _path;
+		capacity = _capacity;
+		mappedSize = sizeof(CaptureHeader) + (size_t)capacity * sizeof(CaptureRecord);
+		void* view = NULL;
+#if defined(_WIN32)
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			LARGE_INTEGER size;
+			size.QuadPart = (LONGLONG)mappedSize;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+			if (mapping != NULL)
+			{
+				view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mappedSize);
+			}
+		}
+#else
+		file = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file >= 0 && ftruncate(file, (off_t)mappedSize) == 0)
+		{
+			view = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+			if (view == MAP_FAILED)
+			{
+				view = NULL;
+			}
+		}
+#endif
+		if (view != NULL)
+		{
+			header = (CaptureHeader*)view;
+			records = (CaptureRecord*)((uint8_t*)view + sizeof(CaptureHeader));
+			memcpy(header->magic, "CRTPCAP", 8);
+			header->version = 1;
+			header->recordSize = sizeof(CaptureRecord);
+			header->capacity = capacity;
+			header->count = 0;
+			header->startNs = steadyNowNs();
+			next = 0;
+			dropped = 0;
+			result = true;
+		}
+		else
+		{
+			messageOut << "Could not open the capture: ";
+			messageOut << path;
+			messageOut << "\n\r";
+			close();
+		}
+		return(result);
+	}
+
+	/**
+	* @returns true while recording.
+	*/
+	bool isOpen()
+	{
+		return(header != NULL);
+	}
+
+	/**
+	* Appends a packet. May be called from any thread.
+	* @param CAPTURE_TX or CAPTURE_RX.
+	* @param The packet.
+	*/
+	void record(uint8_t direction, const Packet& pk)
+	{
+		if (header != NULL && pk.size() > 0)
+		{
+			uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+			if (index < capacity)
+			{
+				CaptureRecord& record = records[index];
+				record.timeNs = steadyNowNs() - header->startNs;
+				record.direction = direction;
+				record.size = (uint8_t)pk.size();
+				memcpy(record.data, pk.raw(), pk.size());
+				std::atomic_thread_fence(std::memory_order_release);
+				record.valid = 1;
+			}
+			else
+			{
+				dropped++;
+			}
+		}
+	}
+
+	/**
+	* @returns The number of records written.
+	*/
+	uint64_t count()
+	{
+		uint64_t result = next;
+		return(result < capacity ? result : capacity);
+	}
+
+	/**
+	* Writes the record count, unmaps and trims the file.
+	* No packets may be recorded while closing.
+	*/
+	void close()
+	{
+		uint64_t written = count();
+		size_t usedSize = sizeof(CaptureHeader) + (size_t)written * sizeof(CaptureRecord);
+		if (header != NULL)
+		{
+			header->count = written;
+		}
+#if defined(_WIN32)
+		if (header != NULL)
+		{
+			UnmapViewOfFile(header);
+		}
+		if (mapping != NULL)
+		{
+			CloseHandle(mapping);
+			mapping = NULL;
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			LARGE_INTEGER size;
+			size.QuadPart = (LONGLONG)usedSize;
+			SetFilePointerEx(file, size, NULL, FILE_BEGIN);
+			SetEndOfFile(file);
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (header != NULL)
+		{
+			munmap(header, mappedSize);
+		}
+		if (file >= 0)
+		{
+			if (ftruncate(file, (off_t)usedSize) != 0)
+			{
+				messageOut << "Could not trim the capture.\n\r";
+			}
+			::close(file);
+			file = -1;
+		}
+#endif
+		header = NULL;
+		records = NULL;
+	}
+};
+
+/**
+* A CrtpLink that records every packet of another link to a PacketCapture.
+* Set PortConnect::capture to record a session.
+*/
+class CaptureLink : public CrtpLink
+{
+public:
+	CrtpLink* link;				/**< The recorded link, owned by the CaptureLink. */
+	PacketCapture* capture;		/**< The capture, not owned. */
+
+	/**
+	* Constructor
+	* @param The link to record, deleted with the CaptureLink.
+	* @param The capture to record to.
+	*/
+	CaptureLink(CrtpLink* _link, PacketCapture* _capture)
+	{
+		link = _link;
+		capture = _capture;
+	}
+
+	/**
+	* Destructor
+	*/
+	~CaptureLink()
+	{
+		delete link;
+	}
+
+	/**
+	* Virtual CrtpLink call, records and sends the packet.
+	* @param The packet to send.
+	*/
+	void send(const Packet& pk)
+	{
+		capture->record(PacketCapture::CAPTURE_TX, pk);
+		link->send(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, receives and records a packet.
+	* @param The longest wait in milliseconds.
+	* @returns The packet, with a size of 0 if none arrived.
+	*/
+	Packet receive(uint32_t timeoutMs)
+	{
+		Packet pk = link->receive(timeoutMs);
+		if (pk.size() > 0)
+		{
+			capture->record(PacketCapture::CAPTURE_RX, pk);
+		}
+		return(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, receives and records a batch of packets.
+	* @param The packets to fill.
+	* @param The number of packets to fill.
+	* @param The longest wait for the first packet in milliseconds.
+	* @returns The number of packets received.
+	*/
+	size_t receive_batch(Packet** packets, size_t maxPackets, uint32_t timeoutMs)
+	{
+		size_t count = link->receive_batch(packets, maxPackets, timeoutMs);
+		for (size_t i = 0; i < count; i++)
+		{
+			capture->record(PacketCapture::CAPTURE_RX, *packets[i]);
+		}
+		return(count);
+	}
+
+	/**
+	* Virtual CrtpLink call, closes the recorded link.
+	*/
+	void close()
+	{
+		link->close();
+	}
+
+	/**
+	* @returns The uri of the recorded link.
+	*/
+	std::string uri()
+	{
+		return(link->uri());
+	}
+
+	/**
+	* Virtual CrtpLink call, reads the statistics of the recorded link.
+	* @param The returned statistics.
+	* @returns false if the recorded link keeps none.
+	*/
+	bool statistics(Connection::Statistics& stats)
+	{
+		return(link->statistics(stats));
+	}
+};
+
+/**
+* A CrtpLink that plays back the received packets of a capture file.
+* With a speed of 1 the packets arrive at their captured times, higher
+* speeds play faster, and a speed of 0 returns every packet at once
+* for offline decoding benchmarks. Sent packets are counted and dropped.
+* Use createReplayLink as the PortConnect::linkFactory with the
+* ReplayLink settings as its context.
+*/
+class ReplayLink : public CrtpLink
+{
+public:
+	std::vector<CaptureRecord> records;	/**< The received packets of the capture in order. */
+	std::atomic<size_t> nextRecord = 0;	/**< The next packet to return. */
+	std::atomic<uint64_t> sent = 0;		/**< Packets sent to the link. */
+	std::atomic<bool> closed = false;	/**< True once closed. */
+	std::string path;					/**< The capture file. */
+	double speed = 1.0;					/**< Playback speed, 0 for as fast as possible. */
+	int64_t startNs = 0;				/**< steady_clock time playback started. */
+
+	/**
+	* Constructor
+	* @param The capture file to play.
+	* @param The playback speed, 0 for as fast as possible.
+	*/
+	ReplayLink(const std::string& _path, double _speed = 1.0)
+	{
+		path = _path;
+		speed = _speed;
+		load(path);
+		startNs = steadyNowNs();
+	}
+
+	/**
+	* Reads the received packets of a capture file.
+	* @param The capture file.
+	* @returns true if the capture was read.
+	*/
+	bool load(const std::string& _path)
+	{
+		bool result = false;
+		records.clear();
+		std::ifstream stream(_path, std::ios::binary);
+		CaptureHeader fileHeader;
+		if (stream.read((char*)&fileHeader, sizeof(fileHeader)) &&
+			memcmp(fileHeader.magic, "CRTPCAP", 8) == 0 &&
+			fileHeader.recordSize == sizeof(CaptureRecord))
+		{
+			uint64_t count = fileHeader.count > 0 ? fileHeader.count : fileHeader.capacity;
+			records.reserve((size_t)count);
+			CaptureRecord record;
+			for (uint64_t i = 0; i < count; i++)
+			{
+				if (!stream.read((char*)&record, sizeof(record)) || record.valid == 0)
+				{
+					break;
+				}
+				if (record.direction == PacketCapture::CAPTURE_RX)
+				{
+					records.push_back(record);
+				}
+			}
+			result = true;
+		}
+		else
+		{
+			messageOut << "Could not read the capture: ";
+			messageOut << _path;
+			messageOut << "\n\r";
+		}
+		return(result);
+	}
+
+	/**
+	* Plays the capture again from the start.
+	*/
+	void rewind()
+	{
+		nextRecord = 0;
+		startNs = steadyNowNs();
+	}
+
+	/**
+	* @returns true once every packet has been returned.
+	*/
+	bool finished()
+	{
+		return(nextRecord >= records.size());
+	}
+
+	/**
+	* Virtual CrtpLink call, counts and drops the packet.
+	* @param The packet to send.
+	*/
+	void send(const Packet&)
+	{
+		sent++;
+	}
+
+	/**
+	* Virtual CrtpLink call, returns the next captured packet once it is due.
+	* @param The longest wait in milliseconds.
+	* @returns The packet, with a size of 0 if none is due.
+	*/
+	Packet receive(uint32_t timeoutMs)
+	{
+		Packet pk;
+		size_t index = nextRecord;
+		if (!closed && index < records.size())
+		{
+			CaptureRecord& record = records[index];
+			bool due = speed <= 0.0;
+			if (!due)
+			{
+				int64_t dueNs = startNs + (int64_t)((double)record.timeNs / speed);
+				int64_t waitNs = dueNs - steadyNowNs();
+				if (waitNs > 0 && timeoutMs > 0)
+				{
+					int64_t maxWaitNs = (int64_t)timeoutMs * 1000000;
+					std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs < maxWaitNs ? waitNs : maxWaitNs));
+					waitNs = dueNs - steadyNowNs();
+				}
+				due = waitNs <= 0;
+			}
+			if (due)
+			{
+				pk = Packet(record.data, record.size);
+				nextRecord = index + 1;
+			}
+		}
+		else if (timeoutMs > 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs < 10 ? timeoutMs : 10));
+		}
+		return(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, stops playback.
+	*/
+	void close()
+	{
+		closed = true;
+	}
+
+	/**
+	* @returns The capture file.
+	*/
+	std::string uri()
+	{
+		return(path);
+	}
+};
+
+/**
+* Settings for createReplayLink.
+*/
+struct ReplaySettings
+{
+	std::string path;		/**< The capture file, or empty to use the uri. */
+	double speed = 1.0;		/**< Playback speed, 0 for as fast as possible. */
+};
+
+/**
+* A LinkFactory that opens a ReplayLink.
+* @param ReplaySettings, or NULL to play the uri at its captured speed.
+* @param The uri, used as the capture file when the settings have no path.
+* @returns The new ReplayLink.
+*/
+inline CrtpLink* createReplayLink(void* context, const std::string& uri)
+{
+	ReplaySettings* settings = (ReplaySettings*)context;
+	std::string path = uri;
+	double speed = 1.0;
+	if (settings != NULL)
+	{
+		if (settings->path.size() > 0)
+		{
+			path = settings->path;
+		}
+		speed = settings->speed;
+	}
+	return(new ReplayLink(path, speed));
+}
@@ -0,0 +1,649 @@
+/*
+* Header-only implementation of the coroutine api for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+
+/**
+* The coroutine api needs C++20, it is empty when built as C++17.
+*/
+#if defined(__cpp_impl_coroutine)
+
+#include "crazyflie.h"
+#include "pendingrequests.h"
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+
+template <class T> struct CfTask;
+class CfExecutor;
+
+/**
+* Promise parts shared by every CfTask.
+* Tasks start suspended and resume the awaiting coroutine when done.
+*/
+struct CfTaskPromiseBase
+{
+	std::coroutine_handle<> continuation;	/**< The coroutine awaiting this task. */
+	bool detached = false;					/**< true if the executor owns the task. */
+
+	/**
+	* Resumes the awaiting coroutine, or frees a detached task.
+	*/
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return(false); }
+
+		template <class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+		{
+			std::coroutine_handle<> result = std::noop_coroutine();
+			CfTaskPromiseBase& promise = handle.promise();
+			if (promise.continuation)
+			{
+				result = promise.continuation;
+			}
+			else if (promise.detached)
+			{
+				handle.destroy();
+			}
+			return(result);
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+/**
+* Promise for a task returning a value.
+*/
+template <class T>
+struct CfTaskPromise : public CfTaskPromiseBase
+{
+	T value{};		/**< The returned value. */
+
+	CfTask<T> get_return_object();
+	void return_value(T _value) { value = std::move(_value); }
+};
+
+/**
+* Promise for a task without a value.
+*/
+template <>
+struct CfTaskPromise<void> : public CfTaskPromiseBase
+{
+	CfTask<void> get_return_object();
+	void return_void() {}
+};
+
+/**
+* A coroutine that can be awaited or run on a CfExecutor.
+*/
+template <class T = void>
+struct CfTask
+{
+	typedef CfTaskPromise<T> promise_type;
+
+	std::coroutine_handle<promise_type> handle;		/**< The coroutine. */
+
+	/**
+	* Constructor
+	*/
+	CfTask(std::coroutine_handle<promise_type> _handle = nullptr)
+	{
+		handle = _handle;
+	}
+
+	/**
+	* Move constructor
+	*/
+	CfTask(CfTask&& task) noexcept
+	{
+		handle = task.handle;
+		task.handle = nullptr;
+	}
+
+	CfTask(const CfTask&) = delete;
+	CfTask& operator=(const CfTask&) = delete;
+
+	/**
+	* Destructor
+	*/
+	~CfTask()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	/**
+	* Checks if the task has finished.
+	* @returns true if the task returned.
+	*/
+	bool done()
+	{
+		return(!handle || handle.done());
+	}
+
+	bool await_ready() { return(done()); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		handle.promise().continuation = caller;
+		return(handle);
+	}
+
+	T await_resume()
+	{
+		if constexpr (!std::is_void<T>::value)
+		{
+			return(std::move(handle.promise().value));
+		}
+	}
+};
+
+template <class T>
+inline CfTask<T> CfTaskPromise<T>::get_return_object()
+{
+	return(CfTask<T>(std::coroutine_handle<CfTaskPromise<T>>::from_promise(*this)));
+}
+
+inline CfTask<void> CfTaskPromise<void>::get_return_object()
+{
+	return(CfTask<void>(std::coroutine_handle<CfTaskPromise<void>>::from_promise(*this)));
+}
+
+/**
+* Runs coroutines on the thread that calls run_once() or run_until().
+* Coroutines waiting with until() are checked every pollMs, coroutines
+* waiting with when() are checked each time the executor is signalled,
+* coroutines waiting for a request resume when the reply arrives.
+* One executor can drive the bring-up of many drones at once.
+*/
+class CfExecutor
+{
+public:
+
+	/**
+	* A coroutine waiting for a condition or a time.
+	*/
+	struct Waiter
+	{
+		std::function<bool()> predicate;		/**< The condition, empty to wait for the deadline. */
+		int64_t deadlineNs = 0;					/**< Time the wait ends. */
+		bool* result = NULL;					/**< Set true if the condition became true. */
+		bool polled = true;						/**< Checked every pollMs, otherwise only when signalled. */
+		std::coroutine_handle<> handle;			/**< The waiting coroutine. */
+	};
+
+	/**
+	* Awaits a condition or a timeout.
+	*/
+	struct UntilAwaiter
+	{
+		CfExecutor* executor;
+		std::function<bool()> predicate;
+		int64_t deadlineNs;
+		bool polled = true;
+		bool result = false;
+
+		bool await_ready()
+		{
+			result = predicate ? predicate() : false;
+			return(result);
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			Waiter waiter;
+			waiter.predicate = predicate;
+			waiter.deadlineNs = deadlineNs;
+			waiter.result = &result;
+			waiter.polled = polled;
+			waiter.handle = handle;
+			executor->waiters.push_back(waiter);
+		}
+
+		bool await_resume() { return(result); }
+	};
+
+	/**
+	* Awaits the reply to a request sent with PortConnect::send_request.
+	*/
+	struct RequestAwaiter
+	{
+		CfExecutor* executor;
+		PortConnect* portConnect;
+		Packet pk;
+		uint8_t match;
+		uint32_t timeoutMs;
+		int32_t retries;
+		int32_t status = PendingRequests::REQUEST_CANCELLED;
+		Packet reply;
+		std::coroutine_handle<> handle;
+
+		RequestAwaiter(CfExecutor* _executor, PortConnect* _portConnect, Packet& _pk, uint8_t _match,
+			uint32_t _timeoutMs, int32_t _retries)
+			: executor(_executor), portConnect(_portConnect), pk(_pk), match(_match),
+			timeoutMs(_timeoutMs), retries(_retries)
+		{
+		}
+
+		bool await_ready() { return(portConnect == NULL); }
+
+		void await_suspend(std::coroutine_handle<> _handle)
+		{
+			handle = _handle;
+			if (!portConnect->send_request(pk, match, _request_done, this, timeoutMs, retries))
+			{
+				executor->post(handle);
+			}
+		}
+
+		/**
+		* The status of the request.
+		* @returns PendingRequests::REQUEST_DONE if the reply arrived.
+		*/
+		int32_t await_resume() { return(status); }
+
+		/**
+		* Called when the request completes, resumes the awaiting coroutine.
+		*/
+		static void _request_done(void* context, int32_t status, Packet& pk)
+		{
+			RequestAwaiter* awaiter = (RequestAwaiter*)context;
+			awaiter->status = status;
+			awaiter->reply = pk;
+			awaiter->executor->post(awaiter->handle);
+		}
+	};
+
+	uint32_t pollMs = 1;							/**< Time between checks of waiting conditions. */
+	std::deque<std::coroutine_handle<>> ready;		/**< Coroutines ready to resume. */
+	std::vector<Waiter> waiters;					/**< Coroutines waiting for a condition, used only on the executor thread. */
+	std::mutex readyMutex;							/**< Guards ready and signalled. */
+	std::condition_variable readyCondition;			/**< Signalled when a coroutine is ready or the executor is signalled. */
+	bool signalled = false;							/**< The conditions of when() waiters may have changed. */
+
+	/**
+	* Queues a coroutine to resume, may be called from any thread.
+	* @param The coroutine.
+	*/
+	void post(std::coroutine_handle<> handle)
+	{
+		{
+			std::lock_guard<std::mutex> guard(readyMutex);
+			ready.push_back(handle);
+		}
+		readyCondition.notify_one();
+	}
+
+	/**
+	* Checks the conditions of the when() waiters on the next pass,
+	* may be called from any thread.
+	*/
+	void signal()
+	{
+		{
+			std::lock_guard<std::mutex> guard(readyMutex);
+			signalled = true;
+		}
+		readyCondition.notify_one();
+	}
+
+	/**
+	* A LifecycleCallback that signals the executor.
+	* @param The CfExecutor.
+	*/
+	static void _signal(void* context)
+	{
+		((CfExecutor*)context)->signal();
+	}
+
+	/**
+	* Starts a task that the executor owns until it returns.
+	* @param The task.
+	*/
+	template <class T>
+	void spawn(CfTask<T> task)
+	{
+		if (task.handle)
+		{
+			task.handle.promise().detached = true;
+			post(task.handle);
+			task.handle = nullptr;
+		}
+	}
+
+	/**
+	* Waits until a condition is true.
+	* @param The condition, checked on the executor thread.
+	* @param The longest time to wait in milliseconds.
+	* @returns An awaiter returning false on timeout.
+	*/
+	UntilAwaiter until(std::function<bool()> predicate, uint32_t timeoutMs)
+	{
+		return(UntilAwaiter{ this, predicate, steadyNowNs() + (int64_t)timeoutMs * 1000000 });
+	}
+
+	/**
+	* Waits until a condition is true, checking it only when the
+	* executor is signalled, such as by a PortConnect lifecycle change.
+	* @param The condition, checked on the executor thread.
+	* @param The longest time to wait in milliseconds.
+	* @returns An awaiter returning false on timeout.
+	*/
+	UntilAwaiter when(std::function<bool()> predicate, uint32_t timeoutMs)
+	{
+		return(UntilAwaiter{ this, predicate, steadyNowNs() + (int64_t)timeoutMs * 1000000, false });
+	}
+
+	/**
+	* Waits without blocking the executor thread.
+	* @param The time to wait in milliseconds.
+	* @returns An awaiter.
+	*/
+	UntilAwaiter sleep(uint32_t ms)
+	{
+		return(UntilAwaiter{ this, std::function<bool()>(), steadyNowNs() + (int64_t)ms * 1000000, false });
+	}
+
+	/**
+	* Sends a request and waits for its reply.
+	* @param The connection.
+	* @param The request.
+	* @param The reply layout, PendingRequests::MATCH_* flags.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @returns An awaiter returning the request status.
+	*/
+	RequestAwaiter request(PortConnect* portConnect, Packet& pk, uint8_t match,
+		uint32_t timeoutMs = PendingRequests::DEFAULT_TIMEOUT_MS,
+		int32_t retries = PendingRequests::DEFAULT_RETRIES)
+	{
+		return(RequestAwaiter(this, portConnect, pk, match, timeoutMs, retries));
+	}
+
+	/**
+	* Resumes every ready coroutine and every waiter whose
+	* condition is true or whose deadline passed.
+	* Waits for work if there is none.
+	* @param The longest time to wait for work in milliseconds.
+	* @returns The number of coroutines resumed.
+	*/
+	int32_t run_once(uint32_t maxWaitMs = 10)
+	{
+		int32_t count = 0;
+		std::deque<std::coroutine_handle<>> resumable;
+		bool check = false;
+		{
+			std::lock_guard<std::mutex> guard(readyMutex);
+			resumable.swap(ready);
+			check = signalled;
+			signalled = false;
+		}
+		int64_t nowNs = steadyNowNs();
+		for (size_t i = 0; i < waiters.size();)
+		{
+			Waiter& waiter = waiters[i];
+			bool isTrue = ((waiter.polled || check) && waiter.predicate) ? waiter.predicate() : false;
+			if (isTrue || nowNs >= waiter.deadlineNs)
+			{
+				*waiter.result = isTrue;
+				resumable.push_back(waiter.handle);
+				waiters[i] = waiters.back();
+				waiters.pop_back();
+			}
+			else
+			{
+				i++;
+			}
+		}
+		for (size_t i = 0; i < resumable.size(); i++)
+		{
+			resumable[i].resume();
+			count++;
+		}
+		if (count == 0)
+		{
+			int64_t waitNs = (int64_t)maxWaitMs * 1000000;
+			for (size_t i = 0; i < waiters.size(); i++)
+			{
+				int64_t untilNs = waiters[i].polled ? (int64_t)pollMs * 1000000 : waiters[i].deadlineNs - nowNs;
+				waitNs = std::min(waitNs, std::max(untilNs, (int64_t)0));
+			}
+			std::unique_lock<std::mutex> lock(readyMutex);
+			readyCondition.wait_for(lock, std::chrono::nanoseconds(waitNs), [this] {
+				return(!ready.empty() || signalled);
+				});
+		}
+		return(count);
+	}
+
+	/**
+	* Runs until a condition is true.
+	* @param The condition, checked on the executor thread.
+	*/
+	void run_until(std::function<bool()> done)
+	{
+		while (!done())
+		{
+			run_once();
+		}
+	}
+
+	/**
+	* Runs a task to completion on the calling thread.
+	* @param The task.
+	* @returns The value the task returned.
+	*/
+	template <class T>
+	T run(CfTask<T>& task)
+	{
+		post(task.handle);
+		run_until([&task] { return(task.done()); });
+		return(task.await_resume());
+	}
+};
+
+/**
+* A param value read or written by the coroutine api.
+*/
+struct ParamResult
+{
+	bool valid = false;		/**< true if the value arrived. */
+	double value = 0;		/**< The value. */
+};
+
+/**
+* Coroutine api for a CrazyFlie.
+* Every call returns a CfTask that is awaited from another
+* CfTask or run on the executor, for example
+* co_await drone.connectAsync(uri) or co_await drone.get("stabilizer.estimator").
+* The AsyncCrazyFlie must outlive its tasks.
+*/
+class AsyncCrazyFlie
+{
+public:
+
+	CfExecutor* executor;		/**< The executor the tasks run on. */
+	CrazyFlie* cf;				/**< The drone. */
+
+	/**
+	* Constructor
+	* @param The executor the tasks run on.
+	* @param The drone.
+	*/
+	AsyncCrazyFlie(CfExecutor* _executor, CrazyFlie* _cf)
+	{
+		executor = _executor;
+		cf = _cf;
+	}
+
+	/**
+	* Destructor
+	*/
+	~AsyncCrazyFlie()
+	{
+		if (cf->portConnect != NULL)
+		{
+			cf->portConnect->set_lifecycle_callback(NULL, NULL);
+		}
+	}
+
+	/**
+	* Signals the executor when the lifecycle of the session changes,
+	* so the when() waiters of the tasks are checked.
+	*/
+	void _watch()
+	{
+		if (cf->portConnect != NULL)
+		{
+			cf->portConnect->set_lifecycle_callback(CfExecutor::_signal, executor);
+		}
+	}
+
+	/**
+	* The retransmits of a request that should complete within a time.
+	* @param The longest wait in milliseconds.
+	* @returns The number of retransmits at the default timeout.
+	*/
+	static int32_t _retries(uint32_t timeoutMs)
+	{
+		int32_t tries = (int32_t)(timeoutMs / PendingRequests::DEFAULT_TIMEOUT_MS);
+		return(tries > 1 ? tries - 1 : 0);
+	}
+
+	/**
+	* Connects to a drone by uri without blocking the executor.
+	* @param The uri of the drone.
+	* @param The longest wait for the protocol version in milliseconds.
+	* @returns true if connected.
+	*/
+	CfTask<bool> connectAsync(std::string uri, uint32_t timeoutMs = 100)
+	{
+		bool result = false;
+		cf->_prepare_connect();
+		_watch();
+		messageOut << "connecting...\n\r";
+		if (cf->portConnect->open(uri, cf, cf->platform, cf->log, cf->param))
+		{
+			PortConnect* portConnect = cf->portConnect;
+			if (co_await executor->when([portConnect] { return(portConnect->version_ready()); }, timeoutMs))
+			{
+				result = portConnect->complete_connect();
+			}
+		}
+		co_return result;
+	}
+
+	/**
+	* Waits until the log TOC, param TOC and param values are ready.
+	* @param The longest wait in milliseconds.
+	* @returns true if ready.
+	*/
+	CfTask<bool> waitReady(uint32_t timeoutMs = 10000)
+	{
+		CrazyFlie* _cf = cf;
+		_watch();
+		bool result = co_await executor->when([_cf] {
+			return(_cf->param != NULL && _cf->param->updateState == Param::ALL_PARAMS_DONE);
+			}, timeoutMs);
+		co_return result;
+	}
+
+	/**
+	* Fetches the log TOC again, reading it from the cache if the crc matches.
+	* @param The longest wait in milliseconds.
+	* @returns true if the TOC is complete.
+	*/
+	CfTask<bool> fetchToc(uint32_t timeoutMs = 10000)
+	{
+		bool result = false;
+		cfLog* log = cf->log;
+		if (log != NULL && log->portConnect != NULL)
+		{
+			_watch();
+			log->resetComplete = false;
+			log->refresh_toc();
+			result = co_await executor->when([log] { return((bool)log->resetComplete); }, timeoutMs);
+		}
+		co_return result;
+	}
+
+	/**
+	* Reads a param from the drone.
+	* @param The complete name (group.name) of the param.
+	* @param The longest wait in milliseconds.
+	* @returns The value, valid is false if the param is unknown or timed out.
+	*/
+	CfTask<ParamResult> get(std::string completeName, uint32_t timeoutMs = 1000)
+	{
+		ParamResult result;
+		Param* param = cf->param;
+		uint16_t ident = NO_IDENT;
+		Packet pk;
+		if (param != NULL && param->resetComplete && param->read_request(completeName, ident, pk))
+		{
+			CfExecutor::RequestAwaiter request = executor->request(cf->portConnect, pk, param->reply_match(),
+				PendingRequests::DEFAULT_TIMEOUT_MS, _retries(timeoutMs));
+			if (co_await request == PendingRequests::REQUEST_DONE)
+			{
+				result.valid = param->read_reply(ident, request.reply, result.value);
+			}
+		}
+		co_return result;
+	}
+
+	/**
+	* Writes a param to the drone.
+	* @param The complete name (group.name) of the param.
+	* @param The value to write.
+	* @param The longest wait in milliseconds.
+	* @returns true if the drone acknowledged the write.
+	*/
+	CfTask<bool> set(std::string completeName, double value, uint32_t timeoutMs = 1000)
+	{
+		bool result = false;
+		Param* param = cf->param;
+		Packet pk;
+		if (param != NULL && param->resetComplete && param->write_request(completeName, value, pk))
+		{
+			int32_t status = co_await executor->request(cf->portConnect, pk, param->reply_match(),
+				PendingRequests::DEFAULT_TIMEOUT_MS, _retries(timeoutMs));
+			result = (status == PendingRequests::REQUEST_DONE);
+		}
+		co_return result;
+	}
+};
+
+#endif
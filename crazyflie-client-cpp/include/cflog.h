@@ -26,11 +26,17 @@
 #include"portconnect.h"
 #include "lttype.h"
 #include "logtoc.h"
+#include "toccache.h"
+#include "loghistory.h"
 
 
 #include <vector>
 #include <string>
 #include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <cstring>
 #include <errno.h>
 #include "messageout.h"
 
@@ -76,6 +82,7 @@ public:
 		uint8_t _type;
 		uint8_t ctype;
 		std::atomic<uint64_t> _value;
+		LogHistory* history;		/**< The last samples when enabled, NULL by default. */
 
 		/**
 		* Constructor for LogVariable
@@ -87,6 +94,7 @@ public:
 			_type = TOC_TYPE;
 			_value = (0LL);
 			ctype = 0;
+			history = NULL;
 		}
 
 		/**
@@ -102,6 +110,62 @@ public:
 			int64_t val = a._value;
 			ctype = a.ctype;
 			_value = val;
+			history = NULL;
+		}
+
+		/**
+		* Destructor for LogVariable
+		*/
+		~LogVariable()
+		{
+			if (history != NULL)
+			{
+				delete history;
+				history = NULL;
+			}
+		}
+
+		/**
+		* Keeps the last samples of this variable, so a consumer slower
+		* than the block period can drain every sample.
+		* Call before the LogConfig is added.
+		* @param The number of samples kept, rounded up to a power of two.
+		*/
+		void enable_history(uint32_t capacity)
+		{
+			if (history == NULL)
+			{
+				history = new LogHistory(capacity);
+			}
+		}
+
+		/**
+		* Copies the samples kept since the last drain, oldest first.
+		* Called from one consumer thread.
+		* @param The buffer for the samples.
+		* @param The size of the buffer.
+		* @returns The number of samples copied, 0 if the history is not enabled.
+		*/
+		size_t drain(LogSample* samples, size_t maxSamples)
+		{
+			size_t result = 0;
+			if (history != NULL)
+			{
+				const size_t CHUNK = 64;
+				uint64_t packed[CHUNK];
+				size_t count = 1;
+				while (result < maxSamples && count > 0)
+				{
+					size_t chunk = maxSamples - result < CHUNK ? maxSamples - result : CHUNK;
+					count = history->drain(packed, chunk);
+					for (size_t i = 0; i < count; i++)
+					{
+						samples[result + i].value = _to_float(packed[i], samples[result + i].timestamp);
+					}
+					result += count;
+				}
+			}
+			return(result);
 		}
 
 		/**
@@ -143,6 +207,10 @@ public:
 				vbuffer[i] = buffer[i];
 			}
 			_value = value;
+			if (history != NULL)
+			{
+				history->push((uint64_t)value);
+			}
 			return(count);
 		}
 
@@ -153,6 +221,17 @@ public:
 		* @returns The value of the variable as a float
 		*/
 		float fetchFloat(uint32_t& timestamp)
+		{
+			return(_to_float(_value, timestamp));
+		}
+
+		/**
+		* Unpacks a value of this variable as a float
+		* @param The packed value and time
+		* @param The time for this value (returned)
+		* @returns The value as a float
+		*/
+		float _to_float(uint64_t packed, uint32_t& timestamp)
 		{
 			union
 			{
@@ -160,7 +239,7 @@ public:
 				uint32_t times[2];
 				uint8_t buffer[8];
 			};
-			value = _value;
+			value = packed;
 
 			timestamp = times[1];
 			float floatValue = 0;
@@ -302,6 +381,234 @@ public:
 		}
 	};
 
+	/**
+	* One variable of a LogDecodePlan.
+	*/
+	struct LogDecodeStep
+	{
+		uint8_t offset = 0;				/**< Byte offset of the value in the block data. */
+		uint8_t size = 0;				/**< Bytes of the value. */
+		typeDex fetch_as = tdNone;		/**< The type of the value. */
+		LogVariable* variable = NULL;	/**< The variable that keeps the value. */
+	};
+
+	/**
+	* The decode kernel a LogDecodePlan uses.
+	*/
+	enum LogDecodeShape : uint8_t
+	{
+		DECODE_NONE = 0,		/**< Not compiled, each variable is set on its own. */
+		DECODE_MIXED = 1,		/**< Variables of several types. */
+		DECODE_FLOAT32 = 2,		/**< Only float32 variables. */
+		DECODE_FLOAT16 = 3,		/**< Only float16 variables. */
+	};
+
+	/**
+	* The layout of a log block, compiled when the block is added,
+	* so each block that arrives is decoded without looking up types.
+	* Decodes the latest block into one contiguous array of floats, a slot
+	* for each variable in block order, and sets the value of each variable.
+	* No buffer of earlier blocks is kept: the subscribers see each block
+	* as it is decoded, and the history ring of a variable keeps its samples,
+	* so a block-wide array of many samples would only copy them again.
+	*/
+	struct LogDecodePlan
+	{
+		LogDecodeShape shape = DECODE_NONE;		/**< The decode kernel. */
+		uint32_t length = 0;					/**< Bytes of block data. */
+		std::vector<LogDecodeStep> steps;		/**< A step for each variable, in block order. */
+
+		/**
+		* Compiles the layout of the variables of a block.
+		* @param The variables, with their types known.
+		* @returns true if every variable has a type.
+		*/
+		bool compile(const std::vector<LogVariable*>& variables)
+		{
+			bool result = true;
+			steps.clear();
+			length = 0;
+			bool allFloat32 = true;
+			bool allFloat16 = true;
+			for (LogVariable* var : variables)
+			{
+				if (var->fetch_as > gMaxType)
+				{
+					result = false;
+					break;
+				}
+				LogDecodeStep step;
+				step.offset = (uint8_t)length;
+				step.size = types[var->fetch_as].size;
+				step.fetch_as = var->fetch_as;
+				step.variable = var;
+				steps.push_back(step);
+				length += step.size;
+				allFloat32 = allFloat32 && var->fetch_as == tdFloat32;
+				allFloat16 = allFloat16 && var->fetch_as == tdFloat16;
+			}
+			if (!result || steps.size() == 0)
+			{
+				shape = DECODE_NONE;
+			}
+			else if (allFloat32)
+			{
+				shape = DECODE_FLOAT32;
+			}
+			else if (allFloat16)
+			{
+				shape = DECODE_FLOAT16;
+			}
+			else
+			{
+				shape = DECODE_MIXED;
+			}
+			return(result);
+		}
+
+		/**
+		* Decodes a block with the compiled kernel.
+		* @param The block data after the timestamp.
+		* @param The timestamp of the block.
+		* @param The returned value of each step as a float.
+		*/
+		void decode(const uint8_t* data, uint32_t timestamp, float* values)
+		{
+			uint64_t time = (uint64_t)timestamp << 32;
+			size_t count = steps.size();
+			switch (shape)
+			{
+			case DECODE_FLOAT32:
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					uint32_t bits = 0;
+					memcpy(&bits, data + i * 4, 4);
+					memcpy(values + i, &bits, 4);
+					_store(steps[i].variable, time | bits);
+				}
+			}
+			break;
+			case DECODE_FLOAT16:
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					uint16_t bits = 0;
+					memcpy(&bits, data + i * 2, 2);
+					values[i] = PackUtils::unPackFloat16((uint32_t)bits);
+					_store(steps[i].variable, time | bits);
+				}
+			}
+			break;
+			case DECODE_MIXED:
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					LogDecodeStep& step = steps[i];
+					uint64_t bits = 0;
+					memcpy(&bits, data + step.offset, step.size);
+					values[i] = _to_float(step.fetch_as, bits);
+					_store(step.variable, time | bits);
+				}
+			}
+			break;
+			default:
+				break;
+			}
+		}
+
+		/**
+		* Sets the packed value and time of a variable.
+		* @param The variable.
+		* @param The packed value and time.
+		*/
+		static void _store(LogVariable* var, uint64_t packed)
+		{
+			var->_value.store(packed, std::memory_order_relaxed);
+			if (var->history != NULL)
+			{
+				var->history->push(packed);
+			}
+		}
+
+		/**
+		* Converts the raw bytes of a value to a float.
+		* @param The type of the value.
+		* @param The raw bytes, in the low bytes.
+		* @returns The value as a float.
+		*/
+		static float _to_float(typeDex fetch_as, uint64_t bits)
+		{
+			float result = 0;
+			switch (fetch_as)
+			{
+			case tdUint8:
+				result = (float)(uint8_t)bits;
+				break;
+			case tdUint16:
+				result = (float)(uint16_t)bits;
+				break;
+			case tdUint32:
+				result = (float)(uint32_t)bits;
+				break;
+			case tdInt8:
+				result = (float)(int8_t)(uint8_t)bits;
+				break;
+			case tdInt16:
+				result = (float)(int16_t)(uint16_t)bits;
+				break;
+			case tdInt32:
+				result = (float)(int32_t)(uint32_t)bits;
+				break;
+			case tdFloat16:
+				result = PackUtils::unPackFloat16((uint32_t)bits);
+				break;
+			case tdFloat32:
+			{
+				uint32_t bits32 = (uint32_t)bits;
+				memcpy(&result, &bits32, 4);
+			}
+			break;
+			default:
+				break;
+			}
+			return(result);
+		}
+	};
+
+	struct LogConfig;
+
+	/**
+	* A view of one decoded log block, passed to its subscribers.
+	* Valid only during the callback.
+	*/
+	struct LogData
+	{
+		const static uint8_t MAX_VALUES = 26;	/**< A block carries at most 26 bytes of values. */
+
+		LogConfig* config = NULL;				/**< The block, config->variables[i] holds values[i]. */
+		uint32_t timestamp = 0;					/**< The crazyflie time of the block in milliseconds. */
+		uint32_t count = 0;						/**< The number of values. */
+		float values[MAX_VALUES];				/**< The value of each variable as a float. */
+	};
+
+	/**
+	* Called from the log thread when a block arrives.
+	* Must not block, the next block waits for it.
+	* @param The context given to subscribe.
+	* @param The decoded block.
+	*/
+	typedef void (*LogDataCallback)(void* context, const LogData& data);
+
+	/**
+	* A callback with its context, written and read as one unit.
+	*/
+	struct LogSubscriber
+	{
+		LogDataCallback callback = NULL;		/**< The function to call. */
+		void* context = NULL;					/**< The context passed to the function. */
+	};
+
 	/**
 	* Holds list of LogVariables
 	* and provides functions to ask and recieve them
@@ -310,6 +617,7 @@ public:
 	{
 		const static uint8_t NoID = 0xff;
 		const static uint8_t MAX_LEN = 26;
+		const static int32_t MAX_SUBSCRIBERS = 8;
 
 		std::string name;
 		std::vector<LogVariable*> variables;
@@ -327,6 +635,22 @@ public:
 		uint8_t err_no = 0;
 		uint8_t id = NoID;
 
+		std::atomic<bool> hasTimestamp = false;			/**< lastTimestamp holds the previous sample. */
+		uint32_t lastTimestamp = 0;						/**< Firmware timestamp of the previous sample in milliseconds. */
+		std::atomic<uint64_t> samples = 0;				/**< Samples received. */
+		std::atomic<uint64_t> lostSamples = 0;			/**< Samples missing from the timestamps. */
+		std::atomic<uint64_t> shortSamples = 0;			/**< Samples dropped for being shorter than the block. */
+
+		LogSubscriber subscribers[MAX_SUBSCRIBERS];		/**< Written only while the slot is free and no dispatch reads it. */
+		std::atomic<uint32_t> subscribed = 0;			/**< A bit for each slot in use. */
+		uint32_t retiring = 0;							/**< A bit for each slot released while a dispatch may still read it. */
+		uint32_t retiredInDispatch = 0;					/**< Slots released by a subscriber, freed when its dispatch ends. */
+		std::mutex subscribeMutex;						/**< Held while a slot is taken or released. */
+		std::atomic<uint64_t> dispatchSequence = 0;		/**< Odd while the subscribers are called. */
+
+		LogDecodePlan plan;			/**< The layout of the block, compiled by cfLog::add_config. */
+		LogData decoded;			/**< Only the latest block decoded by the plan, read in a subscriber callback. */
+
 		/**
 		* Constructor for LogConfig
 		*/
@@ -402,6 +726,175 @@ public:
 			variables.push_back(memVar);
 		}
 
+		/**
+		* Keeps the last samples of each variable added so far.
+		* Call before this LogConfig is added.
+		* @param The number of samples kept for each variable.
+		*/
+		void enable_history(uint32_t capacity)
+		{
+			for (LogVariable* var : variables)
+			{
+				var->enable_history(capacity);
+			}
+			for (LogVariable* var : default_fetch_as)
+			{
+				var->enable_history(capacity);
+			}
+		}
+
+		/**
+		* Calls a function each time this block arrives, without allocating.
+		* May be called while logging.
+		* @param The function to call.
+		* @param The context passed to the function.
+		* @returns The slot of the subscriber, -1 if every slot is taken.
+		*/
+		int32_t subscribe(LogDataCallback callback, void* context)
+		{
+			int32_t result = -1;
+			std::lock_guard<std::mutex> guard(subscribeMutex);
+			uint32_t mask = subscribed.load(std::memory_order_relaxed) | retiring;
+			for (int32_t slot = 0; slot < MAX_SUBSCRIBERS && result < 0; slot++)
+			{
+				if ((mask & (1u << slot)) == 0)
+				{
+					subscribers[slot].callback = callback;
+					subscribers[slot].context = context;
+					subscribed.fetch_or(1u << slot);
+					result = slot;
+				}
+			}
+			return(result);
+		}
+
+		/**
+		* Stops calling a function.
+		* Returns once a call already started has finished,
+		* or at once when called from a subscriber of this block.
+		* @param The function given to subscribe.
+		* @param The context given to subscribe.
+		* @returns true if the subscriber was found.
+		*/
+		bool unsubscribe(LogDataCallback callback, void* context)
+		{
+			bool result = false;
+			int32_t found = -1;
+			{
+				std::lock_guard<std::mutex> guard(subscribeMutex);
+				uint32_t mask = subscribed.load(std::memory_order_relaxed);
+				for (int32_t slot = 0; slot < MAX_SUBSCRIBERS && !result; slot++)
+				{
+					if ((mask & (1u << slot)) != 0 &&
+						subscribers[slot].callback == callback &&
+						subscribers[slot].context == context)
+					{
+						subscribed.fetch_and(~(1u << slot));
+						retiring |= 1u << slot;
+						found = slot;
+						result = true;
+					}
+				}
+			}
+			if (result)
+			{
+				if (_dispatching() == this)
+				{
+					retiredInDispatch |= 1u << found;
+				}
+				else
+				{
+					_wait_dispatch();
+					std::lock_guard<std::mutex> guard(subscribeMutex);
+					retiring &= ~(1u << found);
+				}
+			}
+			return(result);
+		}
+
+		/**
+		* @returns The block whose subscribers the calling thread is running, NULL if none.
+		*/
+		static LogConfig*& _dispatching()
+		{
+			thread_local LogConfig* dispatching = NULL;
+			return(dispatching);
+		}
+
+		/**
+		* Waits until a dispatch that may have read a released slot has finished.
+		*/
+		void _wait_dispatch()
+		{
+			uint64_t sequence = dispatchSequence.load();
+			if ((sequence & 1) != 0)
+			{
+				while (dispatchSequence.load() == sequence)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		/**
+		* Compiles the decode plan of this block.
+		* Called when the block is added, once the types of the variables are known.
+		*/
+		void _compile_plan()
+		{
+			plan.compile(variables);
+			decoded.config = this;
+			decoded.timestamp = 0;
+			decoded.count = plan.shape != DECODE_NONE && plan.steps.size() <= LogData::MAX_VALUES ?
+				(uint32_t)plan.steps.size() : 0;
+		}
+
+		/**
+		* Passes the block just unpacked to each subscriber.
+		* @param The timestamp of the block.
+		*/
+		void _dispatch(uint32_t timestamp)
+		{
+			dispatchSequence.fetch_add(1);
+			uint32_t mask = subscribed.load();
+			if (mask != 0)
+			{
+				LogConfig* outer = _dispatching();
+				_dispatching() = this;
+				LogData local;
+				LogData* data = &decoded;
+				if (decoded.count == 0)
+				{
+					data = &local;
+					local.config = this;
+					local.timestamp = timestamp;
+					local.count = variables.size() < LogData::MAX_VALUES ? (uint32_t)variables.size() : LogData::MAX_VALUES;
+					for (uint32_t i = 0; i < local.count; i++)
+					{
+						uint32_t time = 0;
+						local.values[i] = variables[i]->fetchFloat(time);
+					}
+				}
+				for (int32_t slot = 0; slot < MAX_SUBSCRIBERS && mask != 0; slot++)
+				{
+					if ((mask & (1u << slot)) != 0)
+					{
+						mask &= ~(1u << slot);
+						LogSubscriber subscriber = subscribers[slot];
+						subscriber.callback(subscriber.context, *data);
+					}
+				}
+				_dispatching() = outer;
+				if (retiredInDispatch != 0)
+				{
+					std::lock_guard<std::mutex> guard(subscribeMutex);
+					retiring &= ~retiredInDispatch;
+					retiredInDispatch = 0;
+				}
+			}
+			dispatchSequence.fetch_add(1);
+		}
+
 		/**
 		* Sets if this LogConfig was added.
 		* @param true if it is added
@@ -473,14 +966,14 @@ public:
 		/**
 		* Packs the LogVariables into the packet
 		* @param The packet to setup
-		* @param The next LogVariable to add by index.
-		* @returns if the setup was successful
+		* @param The next LogVariable to add by index, set to the first one that did not fit.
+		* @returns true if every remaining LogVariable fit in the packet.
 		*/
 		bool _setup_log_elements(Packet& pk, int32_t& next_to_add)
 		{
 			bool result = true;
 			int32_t i = next_to_add;
-			for (; i < variables.size(); i++)
+			for (; (size_t)i < variables.size() && result; i++)
 			{
 				LogVariable& var = *variables[i];
 				if (!var.is_toc_variable())
@@ -492,7 +985,7 @@ public:
 						index += PackUtils::pack(pk.payload(), index, storage_fetch);
 						index += PackUtils::pack(pk.payload(), index, var.address);
 						pk.setPayloadSize(index);
-						next_to_add = i;
+						next_to_add = i + 1;
 					}
 					else
 					{
@@ -512,7 +1005,7 @@ public:
 							index += PackUtils::pack(pk.payload(), index, storage_fetch);
 							index += PackUtils::pack(pk.payload(), index, element_id);
 							pk.setPayloadSize(index);
-							next_to_add = i;
+							next_to_add = i + 1;
 						}
 						else
 						{
@@ -527,7 +1020,7 @@ public:
 							index += PackUtils::pack(pk.payload(), index, storage_fetch);
 							index += PackUtils::pack(pk.payload(), index, (uint8_t)(element_id & 0xff));
 							pk.setPayloadSize(index);
-							next_to_add = i;
+							next_to_add = i + 1;
 						}
 						else
 						{
@@ -541,6 +1034,9 @@ public:
 
 		/**
 		* Sends the LogConfig to the Crazyflie.
+		* The create command is retransmitted until it is answered, a create sent
+		* twice is answered with EEXIST. The append commands that follow it are
+		* sent once, a second append would add the variables to the block again.
 		*/
 		bool create()
 		{
@@ -552,20 +1048,7 @@ public:
 				bool is_done = false;
 				int32_t num_variables = 0;
 				int32_t _pending = 0;
-				for (size_t i = 0; i < log->blockListSize; i++)
-				{
-					LogConfig* config = log->blockList[i];
-					if (config != NULL)
-					{
-						if (config->pending || config->added || config->started)
-						{
-							_pending++;
-							num_variables += config->variables.size();
-
-						}
-					}
-					
-				}
+				log->_count_in_use(_pending, num_variables);
 				if ((_pending + 1) < MAX_BLOCKS)
 				{
 					if (num_variables + variables.size() < MAX_VARIABLES)
@@ -574,6 +1057,7 @@ public:
 						result = true;
 						_pending++;
 
+						std::vector<Packet> packets;
 						while (!is_done)
 						{
 							int32_t index = 0;
@@ -585,9 +1069,15 @@ public:
 							index += PackUtils::pack(data, index, id);
 							pk.setPayloadSize(index);
 							is_done = _setup_log_elements(pk, next_to_add);
-							log->portConnect->send_packet(pk, 0);
+							packets.push_back(pk);
 							command = _cmd_append_block();
 						}
+						log->portConnect->send_request(packets[0], PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8,
+							_request_done, NULL);
+						if (packets.size() > 1)
+						{
+							log->portConnect->send_packets(PacketSpan(&packets[1], packets.size() - 1));
+						}
 					}
 					else
 					{
@@ -610,14 +1100,14 @@ public:
 		bool start()
 		{
 			bool result = false;
+			hasTimestamp = false;
 			if (log != NULL)
 			{
 				if (log->portConnect != NULL)		// is connected
 				{
 					if (!added)
 					{
-						create();
-						result = true;
+						result = create();
 					}
 					else
 					{
@@ -630,7 +1120,8 @@ public:
 						index += PackUtils::pack(data, index, id);
 						index += PackUtils::pack(data, index, period);
 						pk.setPayloadSize(index);
-						log->portConnect->send_packet(pk, CMD_START_LOGGING);
+						log->portConnect->send_request(pk, PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8,
+							_request_done, NULL);
 						result = true;
 					}
 				}
@@ -659,11 +1150,11 @@ public:
 						Packet pk;
 						pk.setPort(LOGGING);
 						pk.setChannel(CHAN_SETTINGS);
-						uint8_t* data = pk.payload();
 						index += PackUtils::pack(pk.payload(), index, CMD_STOP_LOGGING);
 						index += PackUtils::pack(pk.payload(), index, id);
 						pk.setPayloadSize(index);
-						log->portConnect->send_packet(pk, CMD_STOP_LOGGING);
+						log->portConnect->send_request(pk, PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8,
+							_request_done, NULL);
 						result = true;
 					}
 				}
@@ -692,11 +1183,11 @@ public:
 						Packet pk;
 						pk.setPort(LOGGING);
 						pk.setChannel(CHAN_SETTINGS);
-						uint8_t* data = pk.payload();
 						index += PackUtils::pack(pk.payload(), index, CMD_DELETE_BLOCK);
 						index += PackUtils::pack(pk.payload(), index, id);
 						pk.setPayloadSize(index);
-						log->portConnect->send_packet(pk, CMD_DELETE_BLOCK);
+						log->portConnect->send_request(pk, PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8,
+							_request_done, NULL);
 						result = true;
 					}
 				}
@@ -704,18 +1195,93 @@ public:
 			return(result);
 		}
 
+		/**
+		* Counts a sample and estimates the samples lost before it
+		* from the gap to the previous firmware timestamp.
+		* @param The 24 bit firmware timestamp in milliseconds.
+		* @returns The samples lost before this one.
+		*/
+		uint32_t _count_sample(uint32_t timestamp)
+		{
+			uint32_t result = 0;
+			uint32_t periodMs = period > 0 ? (uint32_t)period * 10 : period_in_ms;
+			if (hasTimestamp && periodMs > 0)
+			{
+				uint32_t gap = (timestamp - lastTimestamp) & 0xffffff;
+				// a gap of more than half the 24 bit range is an older sample or a firmware restart.
+				if (gap < 0x800000)
+				{
+					uint32_t periods = (gap + periodMs / 2) / periodMs;
+					if (periods > 1)
+					{
+						result = periods - 1;
+					}
+				}
+			}
+			lastTimestamp = timestamp;
+			hasTimestamp = true;
+			samples++;
+			lostSamples += result;
+			return(result);
+		}
+
 		/**
 		* Unpacks and sets the data for each LogVariable
 		* @param The data to unpack
+		* @param The bytes of data.
 		* @param The timestamp for the data.
+		* @returns false if the data is shorter than the block, nothing is set.
 		*/
-		void unpack_log_data(uint8_t* logData, uint32_t timestamp)
+		bool unpack_log_data(uint8_t* logData, uint32_t length, uint32_t timestamp)
 		{
-			int32_t dataIndex = 0;
-			for (size_t i = 0; i < variables.size(); i++)
+			bool result = false;
+			if (decoded.count > 0)
+			{
+				if (length >= plan.length)
+				{
+					decoded.timestamp = timestamp;
+					plan.decode(logData, timestamp, decoded.values);
+					result = true;
+				}
+			}
+			else
+			{
+				result = _unpack_each(logData, length, timestamp);
+			}
+			if (!result)
 			{
-				dataIndex += variables[i]->set(logData + dataIndex, timestamp);
+				shortSamples++;
 			}
+			return(result);
+		}
+
+		/**
+		* Unpacks the data by setting each LogVariable in turn,
+		* used when there is no decode plan.
+		* @param The data to unpack
+		* @param The bytes of data.
+		* @param The timestamp for the data.
+		* @returns false if the data is shorter than the block, nothing is set.
+		*/
+		bool _unpack_each(uint8_t* logData, uint32_t length, uint32_t timestamp)
+		{
+			bool result = false;
+			uint32_t needed = 0;
+			size_t i = 0;
+			for (; i < variables.size() && variables[i]->fetch_as <= gMaxType; i++)
+			{
+				needed += types[variables[i]->fetch_as].size;
+			}
+			if (i == variables.size() && needed <= length)
+			{
+				int32_t dataIndex = 0;
+				for (i = 0; i < variables.size(); i++)
+				{
+					dataIndex += variables[i]->set(logData + dataIndex, timestamp);
+				}
+				result = true;
+			}
+			return(result);
 		}
 	};
 
@@ -727,6 +1293,8 @@ public:
 		const static uint8_t IDLE = 0;
 		const static uint8_t GET_TOC_INFO = 1;
 		const static uint8_t GET_TOC_ELEMENT = 2;
+		const static uint8_t WAIT_TOC_CACHE = 3;
+		const static uint8_t CHECK_TOC_INFO = 4;
 
 		cfLog* log = NULL;
 		LogToc* tocHolder = NULL;
@@ -768,6 +1336,31 @@ public:
 			_useV2 = protocolVersion >= 4;
 			log->tocfetcherCallbacks.push_back(this);
 			state = GET_TOC_INFO;
+			_request_toc_info();
+		}
+
+		/**
+		* Requests the TOC info to compare its crc with the TOC in memory,
+		* the result is passed to PortConnect::tocChecked.
+		* May be called again for each reconnect.
+		*/
+		void check()
+		{
+			_useV2 = protocolVersion >= 4;
+			if (std::find(log->tocfetcherCallbacks.begin(), log->tocfetcherCallbacks.end(), this) ==
+				log->tocfetcherCallbacks.end())
+			{
+				log->tocfetcherCallbacks.push_back(this);
+			}
+			state = CHECK_TOC_INFO;
+			_request_toc_info();
+		}
+
+		/**
+		* Sends the request for the number of items and crc of the TOC.
+		*/
+		void _request_toc_info()
+		{
 			{
 				std::array<uint8_t, gMaxBufferSize> buffer;
 				buffer[0] = 0xFF;
@@ -785,7 +1378,7 @@ public:
 				Packet pk(buffer.data(), index);
 				pk.setPort(port);
 				pk.setChannel(TOC_CHANNEL);
-				log->portConnect->send_packet(pk, expectedReply);
+				log->portConnect->send_request(pk, PendingRequests::MATCH_COMMAND, _request_done, NULL);
 			}
 		}
 
@@ -820,7 +1413,7 @@ public:
 			uint8_t channel = pk.channel();
 			if (channel == 0)
 			{
-				if (state == GET_TOC_INFO)
+				if (state == GET_TOC_INFO || state == CHECK_TOC_INFO)
 				{
 					if (_useV2)
 					{
@@ -838,40 +1431,25 @@ public:
 						index += PackUtils::unpack(buffer, index, _crc);
 						nbr_of_items = itemCount;
 					}
-					bool wasFound = false;
-					if (tocHolder != NULL)
+					if (state == CHECK_TOC_INFO)
+					{
+						state = IDLE;
+						log->portConnect->tocChecked(tocHolder != NULL &&
+							tocHolder->crc == _crc && tocHolder->groups.size() > 0);
+					}
+					else if (tocHolder != NULL)
 					{
-						if (tocHolder->crc == _crc)
+						if (tocHolder->crc == _crc && tocHolder->groups.size() > 0)
 						{
-							wasFound = true;
-							log->resetComplete = wasFound;
-							if (wasFound)
-							{
-								log->portConnect->logResetComplete();
-							}
+							_toc_done(false);
 						}
-						else if (tocHolder->tocExists(_crc))
+						else if (log->tocCache != NULL)
 						{
-							wasFound = readToc(_crc);
-							log->resetComplete = wasFound;
-							if (wasFound)
-							{
-								log->portConnect->logResetComplete();
-							}
+							_lookup_cache();
 						}
-					}
-					if (!wasFound)
-					{
-						state = GET_TOC_ELEMENT;
-						requested_index = 0;
-						if (nbr_of_items > 0)
+						else
 						{
-							messageOut << "Requesting ";
-							messageOut << nbr_of_items; 
-							messageOut << " items for the Log TOC\n\r ";
-
-							elementData.resize(nbr_of_items);
-							request_toc_element(requested_index);
+							_read_or_fetch();
 						}
 					}
 				}
@@ -902,8 +1480,7 @@ public:
 						{
 							messageOut << " Finished updating the Log TOC\n\r ";
 							tocHolder->write(_crc);
-							log->resetComplete = true;
-							log->portConnect->logResetComplete();
+							_toc_done(true);
 						}
 
 						if (requested_index < ((uint32_t)nbr_of_items - 1))
@@ -916,6 +1493,81 @@ public:
 			}
 		}
 
+		/**
+		* Reads the TOC from the file cache,
+		* or fetches it from the crazyflie.
+		*/
+		void _read_or_fetch()
+		{
+			bool wasFound = false;
+			if (tocHolder->tocExists(_crc))
+			{
+				wasFound = readToc(_crc);
+			}
+			if (wasFound)
+			{
+				_toc_done(true);
+			}
+			else
+			{
+				state = GET_TOC_ELEMENT;
+				requested_index = 0;
+				if (nbr_of_items > 0)
+				{
+					messageOut << "Requesting ";
+					messageOut << nbr_of_items;
+					messageOut << " items for the Log TOC\n\r ";
+
+					elementData.resize(nbr_of_items);
+					request_toc_element(requested_index);
+				}
+			}
+		}
+
+		/**
+		* Looks up the crc in the shared TocCache.
+		* Copies the TOC if it is there, waits if another drone
+		* is fetching it, or else reads or fetches it.
+		*/
+		void _lookup_cache()
+		{
+			int32_t found = log->tocCache->log.lookup(_crc, *tocHolder);
+			if (found == TocCacheTable<LogToc>::CACHE_HIT)
+			{
+				messageOut << "Log TOC was shared.\n\r";
+				log->tocShared = true;
+				log->cacheWaiter = NULL;
+				_toc_done(false);
+			}
+			else if (found == TocCacheTable<LogToc>::CACHE_WAIT)
+			{
+				state = WAIT_TOC_CACHE;
+				log->cacheWaiter = this;
+			}
+			else
+			{
+				log->cacheWaiter = NULL;
+				_read_or_fetch();
+			}
+		}
+
+		/**
+		* Finishes the log reset once the TOC is complete.
+		* @param True if the TOC should be shared with the TocCache.
+		*/
+		void _toc_done(bool share)
+		{
+			state = IDLE;
+			tocHolder->crc = _crc;
+			tocHolder->complete = true;
+			if (share && log->tocCache != NULL)
+			{
+				log->tocCache->log.store(_crc, *tocHolder);
+			}
+			log->resetComplete = true;
+			log->portConnect->logResetComplete();
+		}
+
 		/**
 		* Request a single toc element.
 		* @param The index of the element to fetch.
@@ -925,23 +1577,26 @@ public:
 			std::array<uint8_t, gMaxBufferSize> buffer;
 			buffer[0] = 0xFF;
 			uint8_t index = 1;
+			uint8_t match = PendingRequests::MATCH_COMMAND;
 			if (_useV2)
 			{
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)CMD_TOC_ITEM_V2);
 				index += PackUtils::pack(buffer.data(), index, elemDex);
 				expectedReply = CMD_TOC_ITEM_V2;
+				match |= PendingRequests::MATCH_IDENT16;
 			}
 			else
 			{
 				uint8_t _elemDex = elemDex & 0xff;
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)CMD_TOC_ELEMENT);
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)elemDex);
-				expectedReply = CMD_TOC_INFO;
+				expectedReply = CMD_TOC_ELEMENT;
+				match |= PendingRequests::MATCH_IDENT8;
 			}
 			Packet pk(buffer.data(), index);
 			pk.setPort(port);
 			pk.setChannel(TOC_CHANNEL);
-			log->portConnect->send_packet(pk, expectedReply);
+			log->portConnect->send_request(pk, match, _request_done, NULL);
 		}
 
 	};
@@ -956,6 +1611,10 @@ public:
 	std::atomic<LogConfig*> blockList[MAX_BLOCKS];
 	std::atomic<uint8_t> blockListSize = 0;
 	std::vector <TocFetcher*> tocfetcherCallbacks;
+	TocCache* tocCache = NULL;					/**< Shares TOCs with other drones when set. */
+	std::atomic<TocFetcher*> cacheWaiter = NULL;	/**< The fetch waiting for another drone to fetch its TOC. */
+	std::atomic<bool> tocShared = false;			/**< True if the TOC was copied from the TocCache. */
+	TocFetcher* tocChecker = NULL;					/**< Compares the TOC with the crazyflie after a reconnect. */
 	std::string linkSource;
 	uint8_t protocolVersion = 8;
 	bool useV2 = false;
@@ -977,6 +1636,7 @@ public:
 	*/
 	~cfLog()
 	{
+		clearBlockList();
 	}
 
 	/**
@@ -1024,12 +1684,57 @@ public:
 		}
 	}
 
+	/**
+	* Counts the blocks being created, added or started and their variables.
+	* @param The returned blocks.
+	* @param The returned variables.
+	*/
+	void _count_in_use(int32_t& blocks, int32_t& variables)
+	{
+		blocks = 0;
+		variables = 0;
+		uint8_t listSize = blockListSize;
+		for (int32_t i = 0; i < listSize; i++)
+		{
+			LogConfig* config = blockList[i];
+			if (config != NULL && (config->pending || config->added || config->started))
+			{
+				blocks++;
+				variables += (int32_t)config->variables.size();
+			}
+		}
+	}
+
+	/**
+	* @returns The blocks add_config and LogConfig::create still accept.
+	*/
+	int32_t free_blocks()
+	{
+		int32_t blocks = 0;
+		int32_t variables = 0;
+		_count_in_use(blocks, variables);
+		int32_t result = MAX_BLOCKS - 1 - blocks;
+		int32_t listed = MAX_BLOCKS - (int32_t)blockListSize;
+		return(listed < result ? listed : result);
+	}
+
+	/**
+	* @returns The variables LogConfig::create still accepts in new blocks.
+	*/
+	int32_t free_variables()
+	{
+		int32_t blocks = 0;
+		int32_t variables = 0;
+		_count_in_use(blocks, variables);
+		return(MAX_VARIABLES - 1 - variables);
+	}
+
 	/**
 	* Adds a LogConfig for logging
 	* Does not own the LogConfig, and will not delete.
 	* The LogConfig ptr must be valid for the duration of the connection.
 	* @param The LogConfig to add.
-	* @returns true if the LogConfig was added.
+	* @returns true if the LogConfig was added and its block sent to the crazyflie.
 	*/
 	bool add_config(LogConfig *config)
 	{
@@ -1044,7 +1749,7 @@ public:
 				LogVariable* var = config->default_fetch_as[i];
 				if (toc.get_element_by_complete_name(var->name, element))
 				{
-					var->fetch_as = (typeDex)element.ident.n;
+					var->fetch_as = (typeDex)element.get_id_from_cstring(element.ctype);
 					config->add_variable(var);
 				}
 				else
@@ -1067,18 +1772,29 @@ public:
 				}
 			}
 			if (config->valid &&
-				configSize < LogConfig::MAX_LEN &&
+				configSize <= LogConfig::MAX_LEN &&
+				blockListSize < MAX_BLOCKS &&
 				config->period > 0 && config->period < 0xff)
 			{
 				config->log = this;
+				config->_compile_plan();
 				int32_t id = blockListSize;
 				config->id = id;
 				config->useV2 = protocolVersion >= 4;
 				blockList[id] = config;
 				blockListSize++;
-				config->start();
-				result = true;
-				config->connected = true;
+				if (config->start())
+				{
+					result = true;
+					config->connected = true;
+				}
+				else
+				{
+					blockListSize--;
+					blockList[id] = NULL;
+					config->log = NULL;
+					config->id = LogConfig::NoID;
+				}
 			}
 		}
 		return(result);
@@ -1091,12 +1807,67 @@ public:
 	*/
 	void reset()
 	{
-		toc.groups.clear();
+		for (size_t i = 0; i < tocfetcherCallbacks.size(); i++)
+		{
+			tocfetcherCallbacks[i]->state = TocFetcher::IDLE;
+		}
+		toc.clear();
+		cacheWaiter = NULL;
+		tocShared = false;
 		useV2 = protocolVersion >= 4;
 		_send_reset_packet();
 		messageOut << "Resetting cfLog.\n\r";
 	}
 
+	/**
+	* Virtual PortClient call after a reconnect.
+	* Compares the crc of the TOC in memory with the crazyflie.
+	*/
+	void check_toc()
+	{
+		if (tocChecker == NULL)
+		{
+			tocChecker = new TocFetcher(this, LOGGING, &this->toc);
+		}
+		tocChecker->protocolVersion = protocolVersion;
+		tocChecker->check();
+	}
+
+	/**
+	* Virtual PortClient call after a reconnect found the same TOC.
+	* Keeps the TOC and the blockList, resets logging on the
+	* crazyflie and creates and starts each LogConfig again.
+	*/
+	void resume()
+	{
+		if (portConnect != NULL)
+		{
+			uint8_t listSize = blockListSize;
+			for (int32 i = 0; i < listSize; i++)
+			{
+				LogConfig* config = blockList[i];
+				if (config != NULL)
+				{
+					config->added = false;
+					config->started = false;
+					config->pending = 0;
+				}
+			}
+			_send_reset_packet();
+			for (int32 i = 0; i < listSize; i++)
+			{
+				LogConfig* config = blockList[i];
+				if (config != NULL && config->connected)
+				{
+					config->start();
+				}
+			}
+			messageOut << "Resumed ";
+			messageOut << (int32_t)listSize;
+			messageOut << " log blocks.\n\r";
+		}
+	}
+
 	/**
 	* Resets the Toc
 	* Disconnects the blockList
@@ -1104,7 +1875,9 @@ public:
 	*/
 	void refresh_toc()
 	{
-		toc.groups.clear();
+		toc.clear();
+		cacheWaiter = NULL;
+		tocShared = false;
 		useV2 = protocolVersion >= 4;
 		_send_reset_packet();
 	}
@@ -1122,7 +1895,20 @@ public:
 			pk.setChannel(CHAN_SETTINGS);
 			pk.payload()[0] = CMD_RESET_LOGGING;
 			pk.setPayloadSize(1);
-			portConnect->send_packet(pk, CMD_RESET_LOGGING);
+			portConnect->send_request(pk, PendingRequests::MATCH_COMMAND, _request_done, NULL);
+		}
+	}
+
+	/**
+	* Virtual PortClient call for each pass of the port thread or pump.
+	* Checks on a TOC that another drone is fetching.
+	*/
+	void service()
+	{
+		TocFetcher* waiter = cacheWaiter;
+		if (waiter != NULL)
+		{
+			waiter->_lookup_cache();
 		}
 	}
 
@@ -1152,7 +1938,26 @@ public:
 			pk.setChannel(CHAN_SETTINGS);
 			pk.payload()[0] = CMD_STOP_LOGGING;
 			pk.setPayloadSize(1);
-			portConnect->send_packet(pk, CMD_STOP_LOGGING);
+			portConnect->send_request(pk, PendingRequests::MATCH_COMMAND, _request_done, NULL);
+		}
+	}
+
+	/**
+	* Called when a log request completes.
+	* Reports requests that received no reply after every retry.
+	* @param Not used.
+	* @param The request status.
+	* @param The request that was sent when the request timed out.
+	*/
+	static void _request_done(void*, int32_t status, Packet& pk)
+	{
+		if (status == PendingRequests::REQUEST_TIMEOUT)
+		{
+			messageOut << "Log request timed out, channel ";
+			messageOut << (int32_t)pk.channel();
+			messageOut << " command ";
+			messageOut << (int32_t)pk.payload()[0];
+			messageOut << "\n\r";
 		}
 	}
 
@@ -1198,7 +2003,8 @@ public:
 										index += PackUtils::pack(buffer, index, id);
 										index += PackUtils::pack(buffer, index, block->period);
 										packet.setPayloadSize(index);
-										portConnect->send_packet(packet, CMD_START_LOGGING);
+										portConnect->send_request(packet, PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8,
+											_request_done, NULL);
 										block->added = true;
 										block->pending = false;
 									}
@@ -1218,6 +2024,14 @@ public:
 							messageOut << (int32_t)id; 
 							messageOut << "\n\r";
 						}
+						if ((command == CMD_APPEND_BLOCK || command == CMD_APPEND_BLOCK_V2) && errorStatus != 0)
+						{
+							if (blockExists)
+							{
+								block->err_no = errorStatus;
+							}
+							messageOut << "Append to block failed.\n\r";
+						}
 						if (command == CMD_START_LOGGING)
 						{
 							if (errorStatus == 0)
@@ -1272,8 +2086,8 @@ public:
 				else if (channel == CHAN_LOGDATA)
 				{
 					LogConfig* block;
-					uint8_t id = pk.payload()[0];
-					if (this->blockListSize > id)
+					uint8_t id = pk.payloadSize() > 0 ? pk.payload()[0] : LogConfig::NoID;
+					if (this->blockListSize > id && pk.payloadSize() >= 4)
 					{
 						block = this->blockList[id];
 						block->started = true;
@@ -1287,7 +2101,15 @@ public:
 						}
 						timestamp = timestamps[0] | timestamps[1] << 8 | timestamps[2] << 16;
 						buffer += index;
-						block->unpack_log_data(buffer, timestamp);
+						if (block->unpack_log_data(buffer, (uint32_t)pk.payloadSize() - 4, timestamp))
+						{
+							uint32_t lost = block->_count_sample(timestamp);
+							if (portConnect != NULL)
+							{
+								portConnect->linkMetrics.count_log_sample(lost);
+							}
+							block->_dispatch(timestamp);
+						}
 					}
 				}
 				else if (channel == TOC_CHANNEL)
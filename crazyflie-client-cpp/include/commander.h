@@ -54,8 +54,23 @@ struct Commander
         crtpTypeLand = 8,
     };
 
+    /**
+    * Mailbox slots, one for each type of setpoint.
+    */
+    enum SetpointSlot : int32_t
+    {
+        slotRPYT = 0,
+        slotVelocityWorld = 1,
+        slotZDistance = 2,
+        slotHover = 3,
+        slotPosition = 4,
+        slotFullState = 5,
+    };
+
     const static int32_t gMaxBufferSize = 32;
 	PortConnect* connection; 
+    bool useMailbox;            /**< true to keep only the newest setpoint of each type. */
+    TxMailbox mailbox;          /**< Latest-wins setpoint slots used in mailbox mode. */
 
     /**
     * Commander constructor
@@ -63,6 +78,7 @@ struct Commander
     Commander()
     {
         connection = NULL;
+        useMailbox = false;
     }
 
     /**
@@ -71,6 +87,7 @@ struct Commander
     */
 	Commander(PortConnect *portConnect)
 	{
+        useMailbox = false;
         init(portConnect);
 	}
 
@@ -79,6 +96,10 @@ struct Commander
     */
 	~Commander()
 	{
+        if (connection)
+        {
+            connection->detach_mailbox(&mailbox);
+        }
 		connection = NULL;  // the connection is not owned.
 	}
 
@@ -89,6 +110,79 @@ struct Commander
     void init(PortConnect * portConnect)
     {
         connection = portConnect;
+        if (connection && useMailbox)
+        {
+            connection->attach_mailbox(&mailbox);
+        }
+    }
+
+    /**
+    * Turns the setpoint mailbox on or off.
+    * In mailbox mode only the newest setpoint of each type is kept
+    * and is sent at the next chance, older unsent setpoints are
+    * counted in mailbox.superseded.
+    * @param true to use the mailbox.
+    */
+    void set_mailbox_mode(bool enable)
+    {
+        if (connection)
+        {
+            if (enable)
+            {
+                connection->attach_mailbox(&mailbox);
+            }
+            else
+            {
+                connection->detach_mailbox(&mailbox);
+            }
+        }
+        useMailbox = enable;
+    }
+
+    /**
+    * Limits the setpoints of this commander, the mailbox and the
+    * commander ports share the rate. Setpoints over the budget are
+    * sent when a token refills, in mailbox mode only the newest is kept.
+    * @param Setpoints per second, 0 for unlimited.
+    * @param Most setpoints sent at once after an idle time.
+    */
+    void set_budget(double ratePerSecond, double burst)
+    {
+        mailbox.budget.configure(ratePerSecond, burst);
+        if (connection)
+        {
+            connection->set_port_budget(this, COMMANDER, ratePerSecond, burst);
+            connection->set_port_budget(this, COMMANDER_GENERIC, ratePerSecond, burst);
+        }
+    }
+
+    /**
+    * Takes a packet to build a setpoint in, from the transmit pool when connected.
+    * @returns The handle of the packet.
+    */
+    PacketRef _new_packet()
+    {
+        return(connection ? connection->alloc_packet() : PacketPool::alloc_unpooled());
+    }
+
+    /**
+    * Sends a setpoint packet, posting it to its mailbox slot in mailbox mode.
+    * @param The setpoint packet.
+    * @param The mailbox slot for the type of setpoint.
+    */
+    void _send_setpoint(PacketRef& packet, SetpointSlot slot)
+    {
+        if (connection)
+        {
+            if (useMailbox)
+            {
+                connection->post_packet(mailbox, slot, *packet);
+            }
+            else
+            {
+                connection->send_packet(packet);
+            }
+        }
     }
 
     /**
@@ -114,19 +208,20 @@ struct Commander
     */
     void send_setpoint(float roll, float pitch, float yawrate, uint16_t thrust)
     {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, roll);
-        index += PackUtils::pack(buffer.data(), index, pitch);
-        index += PackUtils::pack(buffer.data(), index, yawrate);
-        index += PackUtils::pack(buffer.data(), index, thrust);
+        index += PackUtils::pack(buffer, index, roll);
+        index += PackUtils::pack(buffer, index, pitch);
+        index += PackUtils::pack(buffer, index, yawrate);
+        index += PackUtils::pack(buffer, index, thrust);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-        packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
-        packet.setPort((uint8_t)crtpPortCommander);
+        packet->setSize(index);
+        packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+        packet->setPort((uint8_t)crtpPortCommander);
 
-        connection->send_packet(packet);
+        _send_setpoint(packet, slotRPYT);
     }
 
 
@@ -139,15 +234,17 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeStop);
-            index += PackUtils::pack(buffer.data(), index, remain_valid_milliseconds);
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeStop);
+            index += PackUtils::pack(buffer, index, remain_valid_milliseconds);
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel(crtpChannelMetaCommand);
+            packet->setSize(index);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel(crtpChannelMetaCommand);
+            mailbox.discard();
             connection->send_packet(packet);
         }
     }
@@ -160,15 +257,17 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeStop);
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeStop);
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
-            connection->send_packet(packet);
+            packet->setSize(index);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+            mailbox.discard();
+            connection->send_packet(packet, TX_EMERGENCY);
         }
     }
 
@@ -183,20 +282,21 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeVelocityWorld);
-            index += PackUtils::pack(buffer.data(), index, vx);             // the x pos to set
-            index += PackUtils::pack(buffer.data(), index, vy);             // the y pos to set
-            index += PackUtils::pack(buffer.data(), index, vz);             // the z pos to set
-            index += PackUtils::pack(buffer.data(), index, yawrate);        // the yaw to set
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeVelocityWorld);
+            index += PackUtils::pack(buffer, index, vx);             // the x pos to set
+            index += PackUtils::pack(buffer, index, vy);             // the y pos to set
+            index += PackUtils::pack(buffer, index, vz);             // the z pos to set
+            index += PackUtils::pack(buffer, index, yawrate);        // the yaw to set
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+            packet->setSize(index);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
 
-            connection->send_packet(packet);
+            _send_setpoint(packet, slotVelocityWorld);
         }
     }
 
@@ -216,20 +316,21 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeZDistance);
-            index += PackUtils::pack(buffer.data(), index, roll);
-            index += PackUtils::pack(buffer.data(), index, pitch);
-            index += PackUtils::pack(buffer.data(), index, yawrate);
-            index += PackUtils::pack(buffer.data(), index, zdistance);
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeZDistance);
+            index += PackUtils::pack(buffer, index, roll);
+            index += PackUtils::pack(buffer, index, pitch);
+            index += PackUtils::pack(buffer, index, yawrate);
+            index += PackUtils::pack(buffer, index, zdistance);
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+            packet->setSize(index);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
 
-            connection->send_packet(packet);
+            _send_setpoint(packet, slotZDistance);
         }
     }
 
@@ -248,20 +349,21 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeHover);
-            index += PackUtils::pack(buffer.data(), index, vx);
-            index += PackUtils::pack(buffer.data(), index, vy);
-            index += PackUtils::pack(buffer.data(), index, yawrate);
-            index += PackUtils::pack(buffer.data(), index, zdistance);
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeHover);
+            index += PackUtils::pack(buffer, index, vx);
+            index += PackUtils::pack(buffer, index, vy);
+            index += PackUtils::pack(buffer, index, yawrate);
+            index += PackUtils::pack(buffer, index, zdistance);
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+            packet->setSize(index);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
 
-            connection->send_packet(packet);
+            _send_setpoint(packet, slotHover);
         }
     }
 
@@ -278,20 +380,21 @@ struct Commander
 	{
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypePosition);
-            index += PackUtils::pack(buffer.data(), index, x);             // the x pos to set
-            index += PackUtils::pack(buffer.data(), index, y);             // the y pos to set
-            index += PackUtils::pack(buffer.data(), index, z);             // the z pos to set
-            index += PackUtils::pack(buffer.data(), index, yaw);           // the yaw to set
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypePosition);
+            index += PackUtils::pack(buffer, index, x);             // the x pos to set
+            index += PackUtils::pack(buffer, index, y);             // the y pos to set
+            index += PackUtils::pack(buffer, index, z);             // the z pos to set
+            index += PackUtils::pack(buffer, index, yaw);           // the yaw to set
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setSize(index);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
 
-            connection->send_packet(packet);
+            _send_setpoint(packet, slotPosition);
         }
 	}
 
@@ -319,7 +422,8 @@ struct Commander
     {
         if (connection)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = _new_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
 
@@ -341,27 +445,27 @@ struct Commander
 
             uint32_t quat = PackUtils::quatcompress(orientation);
 
-            index += PackUtils::pack(buffer.data(), index, (uint8_t)crtpTypeFullState);
-            index += PackUtils::pack(buffer.data(), index, x);
-            index += PackUtils::pack(buffer.data(), index, y);
-            index += PackUtils::pack(buffer.data(), index, z);
-            index += PackUtils::pack(buffer.data(), index, vx);
-            index += PackUtils::pack(buffer.data(), index, vy);
-            index += PackUtils::pack(buffer.data(), index, vz);
-            index += PackUtils::pack(buffer.data(), index, ax);
-            index += PackUtils::pack(buffer.data(), index, ay);
-            index += PackUtils::pack(buffer.data(), index, az);
-            index += PackUtils::pack(buffer.data(), index, quat);
-            index += PackUtils::pack(buffer.data(), index, rr);
-            index += PackUtils::pack(buffer.data(), index, pr);
-            index += PackUtils::pack(buffer.data(), index, yr);
-
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setChannel(0);
-            packet.setPort((uint8_t)crtpPortCommanderGeneric);
-            packet.setChannel((uint8_t)SET_SETPOINT_CHANNEL);
-
-            connection->send_packet(packet);
+            index += PackUtils::pack(buffer, index, (uint8_t)crtpTypeFullState);
+            index += PackUtils::pack(buffer, index, x);
+            index += PackUtils::pack(buffer, index, y);
+            index += PackUtils::pack(buffer, index, z);
+            index += PackUtils::pack(buffer, index, vx);
+            index += PackUtils::pack(buffer, index, vy);
+            index += PackUtils::pack(buffer, index, vz);
+            index += PackUtils::pack(buffer, index, ax);
+            index += PackUtils::pack(buffer, index, ay);
+            index += PackUtils::pack(buffer, index, az);
+            index += PackUtils::pack(buffer, index, quat);
+            index += PackUtils::pack(buffer, index, rr);
+            index += PackUtils::pack(buffer, index, pr);
+            index += PackUtils::pack(buffer, index, yr);
+
+            packet->setSize(index);
+            packet->setChannel(0);
+            packet->setPort((uint8_t)crtpPortCommanderGeneric);
+            packet->setChannel((uint8_t)SET_SETPOINT_CHANNEL);
+
+            _send_setpoint(packet, slotFullState);
         }
     }
 };
@@ -26,6 +26,7 @@
 #pragma once
 
 #include "portconnect.h"
+#include "scancache.h"
 #include "platformservice.h"
 #include "cflog.h"
 #include "param.h"
@@ -33,6 +34,7 @@
 #include "stateestimate.h"
 #include "multiranger.h"
 #include "powermanagement.h"
+#include "logplanner.h"
 #include "commander.h"
 #include "highlevelcommander.h"
 
@@ -50,10 +52,23 @@ public:
 	cfLog *log;						/**< For registering LogConfigs for log variable output */
 	PlatformService* platform;		/**< For getting protocol, arming, crash recovery */
 	Param* param;					/**< For getting and setting parameters on the crazyflie */
+	PortPump* pump;					/**< When set, pumps the link instead of a port thread, such as a SwarmLink */
+	TocCache* tocCache;				/**< When set, shares log and param TOCs with other drones */
+	bool overlapTocFetch = false;	/**< Fetch the param TOC alongside the log TOC */
+	bool autoReconnect = false;		/**< Reopen the link after a packet timeout and resume logging and params */
+	LinkFactory linkFactory;		/**< When set, creates the link instead of a RadioLink, such as createReplayLink */
+	void* linkContext;				/**< Passed to the linkFactory */
+	TxBudgetSetting logBudget;		/**< Transmit budget of the log client, unlimited by default */
+	TxBudgetSetting paramBudget;	/**< Transmit budget of the param client, unlimited by default */
+	TxBudgetSetting setpointBudget;	/**< Transmit budget of the commander setpoints, unlimited by default */
+	PacketCapture* capture;			/**< When open, records every packet sent and received */
+	ThreadConfig threadConfig;		/**< Placement and scheduling of the library threads */
+	ScanCache scanCache;			/**< The uris found by earlier scans */
 
 	StateEstimate state_estimate;		/**< LogConfig for position and orientation */
 	MultiRanger multi_ranger;			/**< LogConfig distance ranging */
 	PowerManagement pm;					/**< LogConfig power managment */
+	LogPlanner logPlanner;				/**< Variables added here are packed into blocks on connect */
 	Param::ParamSetting servo_param;	/**< for getting and setting servo angle */
 	Commander commander;						/**< low-level commands for flying */
 	HighLevelCommander high_level_commander;	/**< high-level commands for flying */
@@ -77,6 +92,11 @@ public:
 		log = NULL;
 		platform = NULL;
 		param = NULL;
+		pump = NULL;
+		tocCache = NULL;
+		linkFactory = NULL;
+		linkContext = NULL;
+		capture = NULL;
 		servo_param.completeName = "servo.servoAngle";
 		setupComplete = false;
 		flowDeckPresent = false;
@@ -86,7 +106,7 @@ public:
 	/**
 	* Destructor
 	*/
-	~CrazyFlie()
+	virtual ~CrazyFlie()
 	{
 		disconnect();
 	}
@@ -94,12 +114,15 @@ public:
 	/**
 	* Scans for active crazyflie drones
 	* Sets the uri for each drone in the uris property.
+	* Uris found by an earlier scan are used until they are stale,
+	* then only they are checked before every channel is scanned again.
+	* @param true to scan every channel.
 	* @returns true if at least one was found
 	*/
-	bool scan()
+	bool scan(bool force = false)
 	{
 		bool result = false;
-		PortConnect::scan(uris);
+		scanCache.scan(uris, force);
 		foundConnections = uris.size() > 0;
 		result = uris.size() > 0;
 		if (!result)
@@ -156,6 +179,8 @@ public:
 
 	/**
 	* Connects to the supplied index in uris 
+	* Scans only when the scanCache has no fresh uris,
+	* use connect_uri to skip scanning entirely.
 	* @param The index to an entry in the uris list.
 	* @returns true if connected
 	*/
@@ -163,33 +188,9 @@ public:
 	{
 		bool result = false;
 		scan();
-		if (uris.size() > urlDex)
+		if (urlDex >= 0 && uris.size() > (size_t)urlDex)
 		{
-			if (isConnected())
-			{
-				portConnect->disconnect();
-			}
-			if (portConnect == NULL)
-			{
-				portConnect = new PortConnect();
-				portConnect->defaultDirectory = defaultDirectory;
-			}
-			if (platform == NULL)
-			{
-				platform = new PlatformService();
-			}
-			if (log == NULL)
-			{
-				log = new cfLog();
-				log->toc.defaultPath = defaultDirectory;
-			}
-			if (param == NULL)
-			{
-				param = new Param();
-				param->toc.defaultPath = defaultDirectory;
-			}
-			messageOut << "connecting...\n\r";
-			result = portConnect->connect(uris[urlDex], this, platform, log, param);
+			result = connect_uri(uris[urlDex]);
 		}
 		else
 		{
@@ -198,6 +199,67 @@ public:
 		return(result);
 	}
 
+	/**
+	* Connects to a uri without scanning,
+	* for uris found by an earlier scan.
+	* @param The uri of the drone.
+	* @returns true if connected
+	*/
+	bool connect_uri(std::string uri)
+	{
+		_prepare_connect();
+		messageOut << "connecting...\n\r";
+		return(portConnect->connect(uri, this, platform, log, param));
+	}
+
+	/**
+	* Disconnects the current session and creates
+	* the PortConnect and clients for a new one.
+	*/
+	void _prepare_connect()
+	{
+		if (isConnected())
+		{
+			portConnect->disconnect();
+		}
+		if (portConnect == NULL)
+		{
+			portConnect = new PortConnect();
+			portConnect->defaultDirectory = defaultDirectory;
+		}
+		portConnect->pump = pump;
+		portConnect->overlapTocFetch = overlapTocFetch;
+		portConnect->autoReconnect = autoReconnect;
+		portConnect->linkFactory = linkFactory;
+		portConnect->linkContext = linkContext;
+		portConnect->capture = capture;
+		portConnect->threadConfig = threadConfig;
+		if (platform == NULL)
+		{
+			platform = new PlatformService();
+		}
+		if (log == NULL)
+		{
+			log = new cfLog();
+			log->toc.defaultPath = defaultDirectory;
+		}
+		log->tocCache = tocCache;
+		if (param == NULL)
+		{
+			param = new Param();
+			param->toc.defaultPath = defaultDirectory;
+		}
+		param->tocCache = tocCache;
+		if (logBudget.ratePerSecond > 0)
+		{
+			portConnect->set_client_budget(log, logBudget.ratePerSecond, logBudget.burst);
+		}
+		if (paramBudget.ratePerSecond > 0)
+		{
+			portConnect->set_client_budget(param, paramBudget.ratePerSecond, paramBudget.burst);
+		}
+	}
+
 	/**
 	* Checks for the existance of the Flow2 deck
 	* @returns true if there is a Flow2 deck.
@@ -286,6 +348,10 @@ public:
 		}
 		messageOut << "connecting powerManagement.\n\r";
 		pm.connect(log);
+		if (logPlanner.requests.size() > 0)
+		{
+			logPlanner.connect(log);
+		}
 
 		if (hasServoDeck())
 		{
@@ -308,6 +374,10 @@ public:
 		}
 		commander.init(portConnect);
 		high_level_commander.init(portConnect);
+		if (setpointBudget.ratePerSecond > 0)
+		{
+			commander.set_budget(setpointBudget.ratePerSecond, setpointBudget.burst);
+		}
 		setupComplete = true;
 	}
 
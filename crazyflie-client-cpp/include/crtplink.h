@@ -0,0 +1,300 @@
+/*
+* Header-only implementation of the CRTP link interface for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "Connection.h"
+#include <string>
+#include <vector>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+/**
+* A run of packets in caller owned storage, handed over without a copy.
+*/
+struct PacketSpan
+{
+	Packet* packets;			/**< The first packet. */
+	size_t count;				/**< The number of packets. */
+
+	/**
+	* Constructor
+	* @param The first packet.
+	* @param The number of packets.
+	*/
+	PacketSpan(Packet* _packets, size_t _count)
+	{
+		packets = _packets;
+		count = _count;
+	}
+
+	/**
+	* Constructor
+	* @param The packets of a vector.
+	*/
+	PacketSpan(std::vector<Packet>& _packets)
+	{
+		packets = _packets.data();
+		count = _packets.size();
+	}
+
+	/**
+	* @returns The number of packets.
+	*/
+	size_t size() const
+	{
+		return(count);
+	}
+
+	/**
+	* @returns The first packet.
+	*/
+	Packet* begin() const
+	{
+		return(packets);
+	}
+
+	/**
+	* @returns One past the last packet.
+	*/
+	Packet* end() const
+	{
+		return(packets + count);
+	}
+
+	/**
+	* @param The index of a packet.
+	* @returns The packet.
+	*/
+	Packet& operator[](size_t index) const
+	{
+		return(packets[index]);
+	}
+};
+
+/**
+* Provides a base class for the transport under a PortConnect.
+* send() is called from the transmit thread, receive() from the
+* port thread or pump, so the two may run at the same time.
+*/
+class CrtpLink
+{
+public:
+
+	/**
+	* Destructor
+	*/
+	virtual ~CrtpLink() {}
+
+	/**
+	* Sends a packet to the crazyflie.
+	* @param The packet to send.
+	*/
+	virtual void send(const Packet& pk) = 0;
+
+	/**
+	* Receives the next packet from the crazyflie.
+	* @param The longest wait in milliseconds, Connection::TimeoutNone to poll.
+	* @returns The packet, with a size of 0 if none arrived.
+	*/
+	virtual Packet receive(uint32_t timeoutMs) = 0;
+
+	/**
+	* Receives every packet that is waiting, up to the number of packets given.
+	* Waits only for the first packet, then takes the rest without waiting.
+	* @param The packets to fill, in order, such as slots of a PacketPool.
+	* @param The number of packets to fill.
+	* @param The longest wait for the first packet in milliseconds.
+	* @returns The number of packets received.
+	*/
+	virtual size_t receive_batch(Packet** packets, size_t maxPackets, uint32_t timeoutMs)
+	{
+		size_t count = 0;
+		while (count < maxPackets)
+		{
+			*packets[count] = receive(count == 0 ? timeoutMs : Connection::TimeoutNone);
+			if (packets[count]->size() == 0)
+			{
+				break;
+			}
+			count++;
+		}
+		return(count);
+	}
+
+	/**
+	* Closes the link, receive() returns no more packets.
+	*/
+	virtual void close() = 0;
+
+	/**
+	* @returns The uri the link was opened with.
+	*/
+	virtual std::string uri() = 0;
+
+	/**
+	* Reads the radio statistics of the link.
+	* @param The returned statistics.
+	* @returns false if the link keeps none.
+	*/
+	virtual bool statistics(Connection::Statistics&)
+	{
+		return(false);
+	}
+};
+
+/**
+* Creates the CrtpLink for a uri.
+* @param The context given with the factory.
+* @param The uri to open.
+* @returns The new link, owned by the caller, or NULL if it could not be opened.
+*/
+typedef CrtpLink* (*LinkFactory)(void* context, const std::string& uri);
+
+/**
+* Reads the dongle of a uri, the first field after the scheme,
+* such as 0 for radio://0/80/2M/E7E7E7E7E7.
+* @param The uri.
+* @returns The dongle index, or -1 for any dongle or none.
+*/
+inline int32_t uriDongle(const std::string& uri)
+{
+	int32_t result = -1;
+	size_t start = uri.find("://");
+	if (start != std::string::npos)
+	{
+		start += 3;
+		size_t end = start;
+		int32_t index = 0;
+		while (end < uri.size() && uri[end] >= '0' && uri[end] <= '9')
+		{
+			index = index * 10 + (uri[end] - '0');
+			end++;
+		}
+		if (end > start && (end == uri.size() || uri[end] == '/'))
+		{
+			result = index;
+		}
+	}
+	return(result);
+}
+
+/**
+* Replaces the dongle of a uri.
+* @param The uri, with a dongle index or * as the first field after the scheme.
+* @param The new dongle index.
+* @returns The uri on the new dongle, or the uri unchanged if it has no scheme.
+*/
+inline std::string uriWithDongle(const std::string& uri, int32_t dongle)
+{
+	std::string result = uri;
+	size_t start = uri.find("://");
+	if (start != std::string::npos)
+	{
+		start += 3;
+		size_t end = uri.find('/', start);
+		if (end == std::string::npos)
+		{
+			end = uri.size();
+		}
+		result = uri.substr(0, start) + std::to_string(dongle) + uri.substr(end);
+	}
+	return(result);
+}
+
+/**
+* A CrtpLink on a crazyflie-link-cpp Connection,
+* the Crazyradio or USB.
+*/
+class RadioLink : public CrtpLink
+{
+public:
+	bitcraze::crazyflieLinkCpp::Connection connection;	/**< The radio or USB connection. */
+
+	/**
+	* Constructor
+	* @param The uri to open.
+	*/
+	RadioLink(const std::string& uri) : connection(uri)
+	{
+	}
+
+	/**
+	* Virtual CrtpLink call, queues the packet on the connection.
+	* @param The packet to send.
+	*/
+	void send(const Packet& pk)
+	{
+		connection.send(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, receives from the connection.
+	* @param The longest wait in milliseconds.
+	* @returns The packet, with a size of 0 if none arrived.
+	*/
+	Packet receive(uint32_t timeoutMs)
+	{
+		return(connection.receive(timeoutMs));
+	}
+
+	/**
+	* Virtual CrtpLink call, closes the connection.
+	*/
+	void close()
+	{
+		connection.close();
+	}
+
+	/**
+	* @returns The uri of the connection.
+	*/
+	std::string uri()
+	{
+		return(connection.uri());
+	}
+
+	/**
+	* Virtual CrtpLink call, reads the statistics of the connection.
+	* @param The returned statistics.
+	* @returns true
+	*/
+	bool statistics(Connection::Statistics& stats)
+	{
+		stats = connection.statistics();
+		return(true);
+	}
+};
+
+/**
+* The default LinkFactory, opens a RadioLink.
+* @param Not used.
+* @param The uri to open.
+* @returns The new RadioLink.
+*/
+inline CrtpLink* createRadioLink(void*, const std::string& uri)
+{
+	return(new RadioLink(uri));
+}
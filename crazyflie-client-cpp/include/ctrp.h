@@ -28,6 +28,8 @@ const static uint8_t PORT_ALL = 0xFF;
 const static uint8_t TOC_CHANNEL = 0;
 const static uint8_t APP_CHANNEL = 2;
 const static uint8_t MISC_CHANNEL = 3;
+const static uint8_t CHANNEL_COUNT = 4;
+const static uint8_t CHANNEL_ALL = 0xFF;
 
 const static int32_t gMaxBufferSize = 32;
 
@@ -128,17 +128,18 @@ struct HighLevelCommander
 
         useCurentYaw = true;
 
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcTakeOff_2);
-        index += PackUtils::pack(buffer.data(), index, group_mask);
-        index += PackUtils::pack(buffer.data(), index, absolute_height_m);
-        index += PackUtils::pack(buffer.data(), index, targetYaw);
-        index += PackUtils::pack(buffer.data(), index, useCurentYaw);
-        index += PackUtils::pack(buffer.data(), index, duration_s);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcTakeOff_2);
+        index += PackUtils::pack(buffer, index, group_mask);
+        index += PackUtils::pack(buffer, index, absolute_height_m);
+        index += PackUtils::pack(buffer, index, targetYaw);
+        index += PackUtils::pack(buffer, index, useCurentYaw);
+        index += PackUtils::pack(buffer, index, duration_s);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
+        packet->setSize(index);
 
         _send_packet(packet);
     }
@@ -161,17 +162,18 @@ struct HighLevelCommander
         float yaw = 0.0f;
         bool useCurentYaw = true;
   
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcLand2);
-        index += PackUtils::pack(buffer.data(), index, group_mask);
-        index += PackUtils::pack(buffer.data(), index, absolute_height_m);
-        index += PackUtils::pack(buffer.data(), index, yaw);
-        index += PackUtils::pack(buffer.data(), index, useCurentYaw);
-        index += PackUtils::pack(buffer.data(), index, duration_s);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcLand2);
+        index += PackUtils::pack(buffer, index, group_mask);
+        index += PackUtils::pack(buffer, index, absolute_height_m);
+        index += PackUtils::pack(buffer, index, yaw);
+        index += PackUtils::pack(buffer, index, useCurentYaw);
+        index += PackUtils::pack(buffer, index, duration_s);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
+        packet->setSize(index);
 
         _send_packet(packet);
     }
@@ -184,14 +186,15 @@ struct HighLevelCommander
     void stop(
         uint8_t group_mask = gAllGroups)
     {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcStop);
-        index += PackUtils::pack(buffer.data(), index, group_mask);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcStop);
+        index += PackUtils::pack(buffer, index, group_mask);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-        _send_packet(packet);
+        packet->setSize(index);
+        _send_packet(packet, TX_EMERGENCY);
     }
 
     /**
@@ -208,19 +211,20 @@ struct HighLevelCommander
     void go_to(float x, float y, float z, float yaw, float duration_s, bool relative = false,
         uint8_t group_mask = gAllGroups)
     {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcGoTo);
-        index += PackUtils::pack(buffer.data(), index, group_mask);
-        index += PackUtils::pack(buffer.data(), index, relative);
-        index += PackUtils::pack(buffer.data(), index, x);
-        index += PackUtils::pack(buffer.data(), index, y);
-        index += PackUtils::pack(buffer.data(), index, z);
-        index += PackUtils::pack(buffer.data(), index, yaw);
-        index += PackUtils::pack(buffer.data(), index, duration_s);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcGoTo);
+        index += PackUtils::pack(buffer, index, group_mask);
+        index += PackUtils::pack(buffer, index, relative);
+        index += PackUtils::pack(buffer, index, x);
+        index += PackUtils::pack(buffer, index, y);
+        index += PackUtils::pack(buffer, index, z);
+        index += PackUtils::pack(buffer, index, yaw);
+        index += PackUtils::pack(buffer, index, duration_s);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
+        packet->setSize(index);
 
         _send_packet(packet);
     }
@@ -243,17 +247,18 @@ struct HighLevelCommander
         bool reversed = false, 
         uint8_t group_mask = gAllGroups)
     {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcStartTrajectory);
-        index += PackUtils::pack(buffer.data(), index, group_mask);
-        index += PackUtils::pack(buffer.data(), index, relative);
-        index += PackUtils::pack(buffer.data(), index, reversed);
-        index += PackUtils::pack(buffer.data(), index, trajectory_id);
-        index += PackUtils::pack(buffer.data(), index, time_scale);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcStartTrajectory);
+        index += PackUtils::pack(buffer, index, group_mask);
+        index += PackUtils::pack(buffer, index, relative);
+        index += PackUtils::pack(buffer, index, reversed);
+        index += PackUtils::pack(buffer, index, trajectory_id);
+        index += PackUtils::pack(buffer, index, time_scale);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
+        packet->setSize(index);
 
         _send_packet(packet);
     }
@@ -268,17 +273,18 @@ struct HighLevelCommander
     */
     void define_trajectory(uint8_t trajectory_id, uint32_t offset, uint8_t n_pieces, uint8_t type = tTypePoly4d)
     {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+        PacketRef packet = _new_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
 
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)hlcDefineTrajectory);
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)trajectory_id);
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)gTrajectoryLocationMem);
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)type);
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)offset);
-        index += PackUtils::pack(buffer.data(), index, (uint8_t)n_pieces);
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
+        index += PackUtils::pack(buffer, index, (uint8_t)hlcDefineTrajectory);
+        index += PackUtils::pack(buffer, index, (uint8_t)trajectory_id);
+        index += PackUtils::pack(buffer, index, (uint8_t)gTrajectoryLocationMem);
+        index += PackUtils::pack(buffer, index, (uint8_t)type);
+        index += PackUtils::pack(buffer, index, (uint8_t)offset);
+        index += PackUtils::pack(buffer, index, (uint8_t)n_pieces);
+        packet->setSize(index);
 
         _send_packet(packet);
     }
@@ -287,13 +293,23 @@ struct HighLevelCommander
     /**
     * Send a packet with the port set to crtpPortCommanderHL
     * @param The packet to send.
+    * @param The transmit priority class.
     */
-    void _send_packet(bitcraze::crazyflieLinkCpp::Packet& packet)
+    void _send_packet(PacketRef& packet, TxClass txClass = TX_SETPOINT)
     {
         if (connection != NULL)
         {
-            packet.setPort((uint8_t)crtpPortCommanderHL);
-            connection->send_packet(packet);
+            packet->setPort((uint8_t)crtpPortCommanderHL);
+            connection->send_packet(packet, txClass);
         }
     }
+
+    /**
+    * Takes a packet to build a command in, from the transmit pool when connected.
+    * @returns The handle of the packet.
+    */
+    PacketRef _new_packet()
+    {
+        return(connection != NULL ? connection->alloc_packet() : PacketPool::alloc_unpooled());
+    }
 };
\ No newline at end of file
@@ -0,0 +1,468 @@
+/*
+* Header-only implementation of link quality and latency metrics for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "Connection.h"
+#include "ctrp.h"
+#include "portdispatch.h"
+#include "messageout.h"
+#include <atomic>
+#include <stdint.h>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+/**
+* A lock-free histogram of round trip times.
+* Bucket i holds times below 2^i microseconds, the last bucket
+* holds everything longer. Recorded from any thread, read from any thread.
+*/
+struct LatencyHistogram
+{
+	const static int32_t BUCKETS = 24;						/**< Number of buckets, the last is about 4 seconds and longer. */
+
+	std::atomic<uint64_t> counts[BUCKETS];					/**< Round trips in each bucket. */
+	std::atomic<uint64_t> count = 0;						/**< Round trips recorded. */
+	std::atomic<int64_t> totalNs = 0;						/**< Total of the recorded round trips. */
+	std::atomic<int64_t> maxNs = 0;							/**< Longest recorded round trip. */
+
+	/**
+	* Constructor
+	*/
+	LatencyHistogram()
+	{
+		clear();
+	}
+
+	/**
+	* Clears the histogram.
+	*/
+	void clear()
+	{
+		for (int32_t i = 0; i < BUCKETS; i++)
+		{
+			counts[i] = 0;
+		}
+		count = 0;
+		totalNs = 0;
+		maxNs = 0;
+	}
+
+	/**
+	* Records one round trip.
+	* @param The round trip in nanoseconds.
+	*/
+	void record(int64_t ns)
+	{
+		uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+		int32_t bucket = 0;
+		while (us > 0 && bucket < BUCKETS - 1)
+		{
+			us >>= 1;
+			bucket++;
+		}
+		counts[bucket].fetch_add(1, std::memory_order_relaxed);
+		totalNs.fetch_add(ns, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		updateAtomicMax(maxNs, ns);
+	}
+
+	/**
+	* The upper limit of a bucket.
+	* @param The bucket.
+	* @returns The limit in milliseconds.
+	*/
+	static double bucketLimitMs(int32_t bucket)
+	{
+		return((double)((uint64_t)1 << bucket) * 1.0e-3);
+	}
+
+	/**
+	* Finds the bucket holding a percentile of the recorded round trips.
+	* @param The percentile from 0 to 100.
+	* @returns The upper limit of the bucket in milliseconds, 0 if none were recorded.
+	*/
+	double percentileMs(double percentile)
+	{
+		double result = 0;
+		uint64_t snapshot[BUCKETS];
+		uint64_t total = 0;
+		for (int32_t i = 0; i < BUCKETS; i++)
+		{
+			snapshot[i] = counts[i].load(std::memory_order_relaxed);
+			total += snapshot[i];
+		}
+		if (total > 0)
+		{
+			uint64_t target = (uint64_t)((double)total * percentile * 0.01 + 0.5);
+			if (target < 1)
+			{
+				target = 1;
+			}
+			uint64_t seen = 0;
+			for (int32_t i = 0; i < BUCKETS; i++)
+			{
+				seen += snapshot[i];
+				if (seen >= target)
+				{
+					result = bucketLimitMs(i);
+					break;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* The average recorded round trip.
+	* @returns The average in milliseconds.
+	*/
+	double averageMs()
+	{
+		uint64_t _count = count;
+		return(_count > 0 ? (double)totalNs / (double)_count * 1.0e-6 : 0.0);
+	}
+};
+
+/**
+* Packet counts and rates of one port and channel.
+*/
+struct LinkChannelMetrics
+{
+	std::atomic<uint64_t> rxPackets = 0;		/**< Packets received. */
+	std::atomic<uint64_t> txPackets = 0;		/**< Packets handed to the link. */
+	std::atomic<uint64_t> rxBytes = 0;			/**< Payload bytes received. */
+	std::atomic<uint64_t> txBytes = 0;			/**< Payload bytes handed to the link. */
+	std::atomic<double> rxPerSecond = 0;		/**< Packets received in the last measurement. */
+	std::atomic<double> txPerSecond = 0;		/**< Packets sent in the last measurement. */
+	uint64_t _lastRxPackets = 0;				/**< rxPackets at the last measurement, used by the port thread. */
+	uint64_t _lastTxPackets = 0;				/**< txPackets at the last measurement, used by the port thread. */
+};
+
+/**
+* A copy of the link metrics for a dashboard,
+* filled by PortConnect::sample_link_metrics.
+*/
+struct LinkSample
+{
+	double rxPerSecond = 0;				/**< Packets received per second. */
+	double txPerSecond = 0;				/**< Packets sent per second. */
+	double ackRatio = 0;				/**< Acknowledged share of the packets the radio sent, 1 when unknown. */
+	double requestP50Ms = 0;			/**< Median request round trip. */
+	double requestP99Ms = 0;			/**< 99th percentile request round trip. */
+	double paramReadP50Ms = 0;			/**< Median param read round trip. */
+	double paramReadP99Ms = 0;			/**< 99th percentile param read round trip. */
+	double tocP50Ms = 0;				/**< Median TOC request round trip. */
+	double tocP99Ms = 0;				/**< 99th percentile TOC request round trip. */
+	uint64_t logSamples = 0;			/**< Log block samples received. */
+	uint64_t logSamplesLost = 0;		/**< Log block samples missing from the timestamps. */
+	double logLossRatio = 0;			/**< Share of the expected log samples that were lost. */
+	uint32_t txQueueDepth = 0;			/**< Packets waiting in the transmit queue. */
+	uint32_t txMaxQueueDepth = 0;		/**< Largest transmit queue seen in any class. */
+	uint32_t pendingRequests = 0;		/**< Requests waiting for a reply. */
+};
+
+/**
+* Link quality and latency metrics of a PortConnect.
+* Every field is atomic so a dashboard may read them from any thread
+* without a lock. Packets are counted by the port and transmit threads,
+* round trips by the client workers, and the rates and the radio
+* statistics are measured once a second by the port thread.
+*/
+struct LinkMetrics
+{
+	const static uint8_t PARAM_READ_CHANNEL = 1;				/**< PARAM channel for reads. */
+
+	LinkChannelMetrics channels[PORT_COUNT][CHANNEL_COUNT];	/**< Counts and rates by port and channel. */
+	std::atomic<double> rxPerSecond = 0;		/**< Packets received per second. */
+	std::atomic<double> txPerSecond = 0;		/**< Packets sent per second. */
+
+	LatencyHistogram requestRoundTrip;			/**< Queue to reply time of every tracked request. */
+	LatencyHistogram paramReadRoundTrip;		/**< Queue to reply time of param reads. */
+	LatencyHistogram tocRoundTrip;				/**< Queue to reply time of log and param TOC requests. */
+
+	std::atomic<uint64_t> linkSent = 0;			/**< Packets the radio sent on the current link. */
+	std::atomic<uint64_t> linkAcks = 0;			/**< Acknowledgements the radio received on the current link. */
+	std::atomic<uint64_t> linkPings = 0;		/**< Empty packets the radio sent to poll the crazyflie. */
+	std::atomic<uint64_t> linkReceived = 0;		/**< Packets the radio received on the current link. */
+	std::atomic<double> ackRatio = 1;			/**< Acknowledged share of the packets sent in the last measurement. */
+	std::atomic<bool> hasLinkStats = false;		/**< The link reports radio statistics. */
+
+	std::atomic<uint64_t> logSamples = 0;		/**< Log block samples received. */
+	std::atomic<uint64_t> logSamplesLost = 0;	/**< Log block samples missing from the timestamps. */
+	std::atomic<int64_t> measuredNs = 0;		/**< Time of the last measurement. */
+
+	int64_t _measureStartNs = 0;				/**< Start of the current measurement, used by the port thread. */
+	uint64_t _lastLinkSent = 0;					/**< linkSent at the last measurement. */
+	uint64_t _lastLinkAcks = 0;					/**< linkAcks at the last measurement. */
+
+	/**
+	* Clears the metrics for a new session.
+	* @param The start of the first measurement.
+	*/
+	void clear(int64_t nowNs)
+	{
+		for (uint8_t port = 0; port < PORT_COUNT; port++)
+		{
+			for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+			{
+				LinkChannelMetrics& metrics = channels[port][channel];
+				metrics.rxPackets = 0;
+				metrics.txPackets = 0;
+				metrics.rxBytes = 0;
+				metrics.txBytes = 0;
+				metrics.rxPerSecond = 0;
+				metrics.txPerSecond = 0;
+				metrics._lastRxPackets = 0;
+				metrics._lastTxPackets = 0;
+			}
+		}
+		rxPerSecond = 0;
+		txPerSecond = 0;
+		requestRoundTrip.clear();
+		paramReadRoundTrip.clear();
+		tocRoundTrip.clear();
+		linkSent = 0;
+		linkAcks = 0;
+		linkPings = 0;
+		linkReceived = 0;
+		ackRatio = 1;
+		hasLinkStats = false;
+		logSamples = 0;
+		logSamplesLost = 0;
+		measuredNs = nowNs;
+		_measureStartNs = nowNs;
+		_lastLinkSent = 0;
+		_lastLinkAcks = 0;
+	}
+
+	/**
+	* Counts a received packet.
+	* @param The packet.
+	*/
+	void count_rx(const Packet& pk)
+	{
+		LinkChannelMetrics& metrics = channels[pk.port() & (PORT_COUNT - 1)][pk.channel() & (CHANNEL_COUNT - 1)];
+		metrics.rxPackets.fetch_add(1, std::memory_order_relaxed);
+		metrics.rxBytes.fetch_add(pk.payloadSize(), std::memory_order_relaxed);
+	}
+
+	/**
+	* Counts a packet handed to the link.
+	* @param The packet.
+	*/
+	void count_tx(const Packet& pk)
+	{
+		LinkChannelMetrics& metrics = channels[pk.port() & (PORT_COUNT - 1)][pk.channel() & (CHANNEL_COUNT - 1)];
+		metrics.txPackets.fetch_add(1, std::memory_order_relaxed);
+		metrics.txBytes.fetch_add(pk.payloadSize(), std::memory_order_relaxed);
+	}
+
+	/**
+	* Records the round trip of a completed request.
+	* @param The port of the reply.
+	* @param The channel of the reply.
+	* @param The time from queueing the request to its reply.
+	*/
+	void record_round_trip(uint8_t port, uint8_t channel, int64_t roundTripNs)
+	{
+		requestRoundTrip.record(roundTripNs);
+		if (channel == TOC_CHANNEL && (port == LOGGING || port == PARAM))
+		{
+			tocRoundTrip.record(roundTripNs);
+		}
+		else if (port == PARAM && channel == PARAM_READ_CHANNEL)
+		{
+			paramReadRoundTrip.record(roundTripNs);
+		}
+	}
+
+	/**
+	* Counts a received log block sample.
+	* @param The samples missing before it.
+	*/
+	void count_log_sample(uint32_t lost)
+	{
+		logSamples.fetch_add(1, std::memory_order_relaxed);
+		if (lost > 0)
+		{
+			logSamplesLost.fetch_add(lost, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	* The share of the expected log samples that were lost.
+	* @returns The ratio from 0 to 1.
+	*/
+	double logLossRatio()
+	{
+		uint64_t lost = logSamplesLost;
+		uint64_t expected = logSamples + lost;
+		return(expected > 0 ? (double)lost / (double)expected : 0.0);
+	}
+
+	/**
+	* Measures the rates and the ack ratio, called once a second by the port thread.
+	* @param The current time.
+	* @param The radio statistics of the link.
+	* @param false if the link has no radio statistics.
+	*/
+	void measure(int64_t nowNs, const Connection::Statistics& stats, bool hasStats)
+	{
+		double elapsed = (double)(nowNs - _measureStartNs) * 1.0e-9;
+		if (elapsed > 0)
+		{
+			uint64_t rxTotal = 0;
+			uint64_t txTotal = 0;
+			for (uint8_t port = 0; port < PORT_COUNT; port++)
+			{
+				for (uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+				{
+					LinkChannelMetrics& metrics = channels[port][channel];
+					uint64_t rx = metrics.rxPackets;
+					uint64_t tx = metrics.txPackets;
+					metrics.rxPerSecond = (double)(rx - metrics._lastRxPackets) / elapsed;
+					metrics.txPerSecond = (double)(tx - metrics._lastTxPackets) / elapsed;
+					rxTotal += rx - metrics._lastRxPackets;
+					txTotal += tx - metrics._lastTxPackets;
+					metrics._lastRxPackets = rx;
+					metrics._lastTxPackets = tx;
+				}
+			}
+			rxPerSecond = (double)rxTotal / elapsed;
+			txPerSecond = (double)txTotal / elapsed;
+		}
+		hasLinkStats = hasStats;
+		if (hasStats)
+		{
+			uint64_t sent = stats.sent_count.load();
+			uint64_t acks = stats.ack_count.load();
+			if (sent < _lastLinkSent || acks < _lastLinkAcks)
+			{
+				// the link was reopened and its counts started over.
+				_lastLinkSent = 0;
+				_lastLinkAcks = 0;
+			}
+			if (sent > _lastLinkSent)
+			{
+				double ratio = (double)(acks - _lastLinkAcks) / (double)(sent - _lastLinkSent);
+				ackRatio = ratio < 1.0 ? ratio : 1.0;
+			}
+			_lastLinkSent = sent;
+			_lastLinkAcks = acks;
+			linkSent = sent;
+			linkAcks = acks;
+			linkPings = stats.sent_ping_count.load();
+			linkReceived = stats.receive_count.load();
+		}
+		_measureStartNs = nowNs;
+		measuredNs = nowNs;
+	}
+
+	/**
+	* Copies the rates, ratios and round trip percentiles.
+	* @param The sample to fill, the queue depths are left to the caller.
+	*/
+	void sample(LinkSample& sample)
+	{
+		sample.rxPerSecond = rxPerSecond;
+		sample.txPerSecond = txPerSecond;
+		sample.ackRatio = ackRatio;
+		sample.requestP50Ms = requestRoundTrip.percentileMs(50);
+		sample.requestP99Ms = requestRoundTrip.percentileMs(99);
+		sample.paramReadP50Ms = paramReadRoundTrip.percentileMs(50);
+		sample.paramReadP99Ms = paramReadRoundTrip.percentileMs(99);
+		sample.tocP50Ms = tocRoundTrip.percentileMs(50);
+		sample.tocP99Ms = tocRoundTrip.percentileMs(99);
+		sample.logSamples = logSamples;
+		sample.logSamplesLost = logSamplesLost;
+		sample.logLossRatio = logLossRatio();
+	}
+};
+
+/**
+* How late the library threads wake from their timed waits.
+* A wait that runs to its deadline records the time from the
+* deadline to when the thread runs again, in log2 microsecond buckets.
+*/
+struct ThreadMetrics
+{
+	LatencyHistogram portWake;		/**< Lateness of the port thread after a receive wait with no packet. */
+	LatencyHistogram transmitWake;	/**< Lateness of the transmit thread after waiting for a budget token. */
+	LatencyHistogram paramWake;		/**< Lateness of the param queue thread after an idle wait. */
+
+	/**
+	* Clears the histograms.
+	*/
+	void clear()
+	{
+		portWake.clear();
+		transmitWake.clear();
+		paramWake.clear();
+	}
+
+	/**
+	* Records the lateness of a wake.
+	* @param The histogram of the thread.
+	* @param steady_clock time in nanoseconds the wait was to end.
+	*/
+	static void record_wake(LatencyHistogram& histogram, int64_t deadlineNs)
+	{
+		int64_t lateNs = steadyNowNs() - deadlineNs;
+		if (lateNs >= 0)
+		{
+			histogram.record(lateNs);
+		}
+	}
+
+	/**
+	* Writes one histogram to messageOut.
+	* @param The name of the thread.
+	* @param The histogram.
+	*/
+	static void report(const char* name, LatencyHistogram& histogram)
+	{
+		messageOut << name;
+		messageOut << " wakes ";
+		messageOut << (uint64_t)histogram.count;
+		messageOut << " late p50 ";
+		messageOut << histogram.percentileMs(50);
+		messageOut << " p99 ";
+		messageOut << histogram.percentileMs(99);
+		messageOut << " max ";
+		messageOut << (double)histogram.maxNs * 1.0e-6;
+		messageOut << " ms\n\r";
+	}
+
+	/**
+	* Writes every histogram to messageOut.
+	*/
+	void report()
+	{
+		report("port", portWake);
+		report("transmit", transmitWake);
+		report("param", paramWake);
+	}
+};
@@ -0,0 +1,145 @@
+/*
+* Header-only sample history of a log variable for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+/**
+* A sample of a log variable.
+*/
+struct LogSample
+{
+	uint32_t timestamp = 0;		/**< The crazyflie time of the sample in milliseconds. */
+	float value = 0;			/**< The value of the sample. */
+};
+
+/**
+* The last samples of a log variable, written by the log worker
+* and drained by one consumer thread, without locks.
+* The writer never waits, when the consumer falls more than a
+* capacity behind the oldest samples are overwritten and counted as lost.
+* Each sample is the packed value and timestamp of LogVariable::_value.
+*/
+struct LogHistory
+{
+	std::vector<std::atomic<uint64_t>> samples;		/**< The ring storage. */
+	uint64_t mask;									/**< capacity - 1, the capacity is a power of two. */
+	alignas(64) std::atomic<uint64_t> claimed = 0;	/**< Samples the writer has started, written before the slot. */
+	std::atomic<uint64_t> tail = 0;					/**< Samples the writer has finished, written after the slot. */
+	alignas(64) std::atomic<uint64_t> head = 0;		/**< The next sample to drain, written by the consumer. */
+	std::atomic<uint64_t> lost = 0;					/**< Samples overwritten before they were drained. */
+
+	/**
+	* Constructor
+	* @param The number of samples kept, rounded up to a power of two.
+	*/
+	LogHistory(uint32_t capacity)
+	{
+		uint64_t size = 1;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		samples = std::vector<std::atomic<uint64_t>>(size);
+		mask = size - 1;
+	}
+
+	/**
+	* @returns The number of samples kept.
+	*/
+	uint64_t capacity() const
+	{
+		return(mask + 1);
+	}
+
+	/**
+	* Adds a sample, called only from the writer thread.
+	* @param The packed value and timestamp.
+	*/
+	void push(uint64_t sample)
+	{
+		uint64_t _tail = tail.load(std::memory_order_relaxed);
+		claimed.store(_tail + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		samples[_tail & mask].store(sample, std::memory_order_relaxed);
+		tail.store(_tail + 1, std::memory_order_release);
+	}
+
+	/**
+	* The number of samples waiting to be drained.
+	* @returns The samples, at most the capacity.
+	*/
+	uint64_t size()
+	{
+		uint64_t waiting = tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+		return(waiting < capacity() ? waiting : capacity());
+	}
+
+	/**
+	* Copies the waiting samples, oldest first, called only from the consumer thread.
+	* @param The buffer for the samples.
+	* @param The size of the buffer.
+	* @returns The number of samples copied.
+	*/
+	size_t drain(uint64_t* buffer, size_t maxSamples)
+	{
+		uint64_t _head = head.load(std::memory_order_relaxed);
+		uint64_t _tail = tail.load(std::memory_order_acquire);
+		if (_tail - _head > capacity())
+		{
+			lost.fetch_add(_tail - _head - capacity(), std::memory_order_relaxed);
+			_head = _tail - capacity();
+		}
+		size_t count = (size_t)(_tail - _head) < maxSamples ? (size_t)(_tail - _head) : maxSamples;
+		for (size_t i = 0; i < count; i++)
+		{
+			buffer[i] = samples[(_head + i) & mask].load(std::memory_order_relaxed);
+		}
+		// a sample is good unless the writer reused its slot while it was copied.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t _claimed = claimed.load(std::memory_order_relaxed);
+		uint64_t first = _claimed > capacity() ? _claimed - capacity() : 0;
+		size_t skip = 0;
+		if (first > _head)
+		{
+			skip = (size_t)(first - _head) < count ? (size_t)(first - _head) : count;
+			for (size_t i = skip; i < count; i++)
+			{
+				buffer[i - skip] = buffer[i];
+			}
+			lost.fetch_add(skip, std::memory_order_relaxed);
+		}
+		head.store(_head + count, std::memory_order_release);
+		return(count - skip);
+	}
+
+	/**
+	* Discards the waiting samples, called only from the consumer thread.
+	*/
+	void clear()
+	{
+		head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+	}
+};
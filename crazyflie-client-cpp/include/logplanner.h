@@ -0,0 +1,448 @@
+/*
+* Header-only packing of log variables into log blocks for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "cflog.h"
+#include "messageout.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+/**
+* A log variable requested from a LogPlanner.
+*/
+struct LogRequest
+{
+	std::string name;						/**< The complete name, such as stabilizer.roll. */
+	uint32_t periodMs = 100;				/**< The longest time between samples in milliseconds. */
+	typeDex fetch_as = tdNone;				/**< The type to fetch, tdNone for the type in the TOC. */
+	cfLog::LogVariable* variable = NULL;	/**< Holds the value, owned by the planner. */
+	bool planned = false;					/**< The variable is in a block of the last plan. */
+	float minimum = 0;						/**< The smallest value expected, with maximum to narrow the type. */
+	float maximum = 0;						/**< The largest value expected, equal to minimum to keep the type. */
+	float tolerance = 0;					/**< The largest error allowed in the value. */
+};
+
+/**
+* The radio use of the blocks of a plan.
+*/
+struct LogPlanStats
+{
+	int32_t blocks = 0;					/**< Blocks planned. */
+	int32_t variables = 0;				/**< Variables in the blocks. */
+	int32_t bytes = 0;					/**< Bytes of values in the blocks. */
+	double packetsPerSecond = 0;		/**< Log data packets sent each second. */
+	double samplesPerSecond = 0;		/**< Variable samples carried each second. */
+
+	/**
+	* @returns Samples carried by each log data packet.
+	*/
+	double samples_per_packet() const
+	{
+		return(packetsPerSecond > 0 ? samplesPerSecond / packetsPerSecond : 0);
+	}
+};
+
+/**
+* Packs requested log variables into the fewest log blocks for each period,
+* using the sizes of their types in the TOC, so callers do not have to
+* split them by hand to fit LogConfig::MAX_LEN, cfLog::MAX_BLOCKS and
+* cfLog::MAX_VARIABLES. Values are read by name, whichever block carries them.
+* Add the variables before connecting, the planner must outlive the connection.
+*/
+class LogPlanner
+{
+public:
+	std::vector<LogRequest> requests;				/**< The requested variables, in the order added. */
+	std::map<std::string, size_t> byName;			/**< The request of each name. */
+	std::vector<cfLog::LogConfig*> configs;			/**< The blocks of the last plan, owned by the planner. */
+
+	/**
+	* Destructor
+	*/
+	~LogPlanner()
+	{
+		_clear_configs();
+		for (LogRequest& request : requests)
+		{
+			delete request.variable;
+			request.variable = NULL;
+		}
+	}
+
+	/**
+	* Requests a variable, a variable requested twice is logged at the shorter period.
+	* @param The complete name, such as stabilizer.roll.
+	* @param The longest time between samples in milliseconds, 10 to 2540.
+	* @param The type to fetch, tdNone for the type in the TOC.
+	*/
+	void add(const std::string& name, uint32_t periodMs, typeDex fetch_as = tdNone)
+	{
+		auto found = byName.find(name);
+		if (found != byName.end())
+		{
+			LogRequest& request = requests[found->second];
+			request.periodMs = periodMs < request.periodMs ? periodMs : request.periodMs;
+			if (fetch_as != tdNone)
+			{
+				request.fetch_as = fetch_as;
+			}
+		}
+		else
+		{
+			LogRequest request;
+			request.name = name;
+			request.periodMs = periodMs;
+			request.fetch_as = fetch_as;
+			request.variable = new cfLog::LogVariable();
+			request.variable->name = name;
+			request.variable->fetch_as = fetch_as;
+			byName[name] = requests.size();
+			requests.push_back(request);
+		}
+	}
+
+	/**
+	* Requests a variable with the range and error it needs, so the planner
+	* fetches it as the narrowest type that meets them.
+	* @param The complete name, such as stabilizer.roll.
+	* @param The longest time between samples in milliseconds, 10 to 2540.
+	* @param The smallest value expected.
+	* @param The largest value expected.
+	* @param The largest error allowed in the value.
+	*/
+	void add_range(const std::string& name, uint32_t periodMs, float minimum, float maximum, float tolerance)
+	{
+		bool added = byName.find(name) == byName.end();
+		add(name, periodMs);
+		LogRequest& request = requests[byName[name]];
+		if (added || request.maximum <= request.minimum)
+		{
+			request.minimum = minimum;
+			request.maximum = maximum;
+			request.tolerance = tolerance;
+		}
+		else
+		{
+			request.minimum = minimum < request.minimum ? minimum : request.minimum;
+			request.maximum = maximum > request.maximum ? maximum : request.maximum;
+			request.tolerance = tolerance < request.tolerance ? tolerance : request.tolerance;
+		}
+	}
+
+	/**
+	* Chooses the narrowest type to fetch a variable as.
+	* The firmware converts a float to an integer type by dropping the fraction,
+	* so an integer type is a fixed point with a step of 1 and needs a tolerance of 1.
+	* A float16 keeps 11 bits, an error of up to 1/1024 of the largest magnitude.
+	* @param The type in the TOC.
+	* @param The smallest value expected.
+	* @param The largest value expected, equal to minimum to keep the TOC type.
+	* @param The largest error allowed in the value.
+	* @returns The type to fetch as.
+	*/
+	static typeDex narrowest(typeDex tocType, float minimum, float maximum, float tolerance)
+	{
+		typeDex result = tocType;
+		bool isFloat = tocType == tdFloat32 || tocType == tdFloat16;
+		if (tocType <= gMaxType && maximum > minimum)
+		{
+			static const typeDex candidates[] = { tdUint8, tdInt8, tdFloat16, tdUint16, tdInt16 };
+			static const float lowest[] = { 0.0f, -128.0f, -65504.0f, 0.0f, -32768.0f };
+			static const float highest[] = { 255.0f, 127.0f, 65504.0f, 65535.0f, 32767.0f };
+			float magnitude = fabsf(minimum) > fabsf(maximum) ? fabsf(minimum) : fabsf(maximum);
+			for (int32_t i = 0; i < 5; i++)
+			{
+				typeDex candidate = candidates[i];
+				bool fits = minimum >= lowest[i] && maximum <= highest[i] &&
+					types[candidate].size < types[result].size;
+				if (candidate == tdFloat16)
+				{
+					fits = fits && isFloat && magnitude * (1.0f / 1024.0f) <= tolerance;
+				}
+				else if (isFloat)
+				{
+					fits = fits && tolerance >= 1.0f;
+				}
+				if (fits)
+				{
+					result = candidate;
+					break;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Packs the requested variables into blocks for a log with a complete TOC.
+	* Each period is packed on its own, largest types first, into the first
+	* block with room. Shorter periods are given blocks first.
+	* @param The log the blocks are planned for.
+	* @returns true if every variable was placed.
+	*/
+	bool plan(cfLog* log)
+	{
+		bool result = true;
+		_clear_configs();
+		std::map<uint8_t, std::vector<size_t>> periods;
+		for (size_t i = 0; i < requests.size(); i++)
+		{
+			LogRequest& request = requests[i];
+			request.planned = false;
+			typeDex type = request.fetch_as;
+			LogTocElement element;
+			if (!log->toc.get_element_by_complete_name(request.name, element))
+			{
+				messageOut << "Log variable not in the TOC ";
+				messageOut << request.name;
+				messageOut << "\n\r";
+				result = false;
+				continue;
+			}
+			if (type == tdNone)
+			{
+				type = narrowest((typeDex)element.get_id_from_cstring(element.ctype),
+					request.minimum, request.maximum, request.tolerance);
+			}
+			if (type > gMaxType)
+			{
+				result = false;
+				continue;
+			}
+			request.variable->fetch_as = type;
+			periods[_period(request.periodMs)].push_back(i);
+		}
+
+		int32_t freeBlocks = log->free_blocks();
+		int32_t freeVariables = log->free_variables();
+		bool fits = true;
+		for (auto& period : periods)
+		{
+			std::vector<size_t>& members = period.second;
+			std::stable_sort(members.begin(), members.end(), [this](size_t a, size_t b) {
+				return(_size(a) > _size(b));
+				});
+			std::vector<int32_t> used;
+			size_t first = configs.size();
+			for (size_t index : members)
+			{
+				int32_t size = _size(index);
+				size_t bin = 0;
+				while (bin < used.size() && used[bin] + size > cfLog::LogConfig::MAX_LEN)
+				{
+					bin++;
+				}
+				if (bin == used.size())
+				{
+					if (freeBlocks <= 0 || freeVariables <= 0)
+					{
+						fits = false;
+						continue;
+					}
+					freeBlocks--;
+					cfLog::LogConfig* config = new cfLog::LogConfig("plan" + std::to_string(configs.size()),
+						(uint32_t)period.first * 10);
+					configs.push_back(config);
+					used.push_back(0);
+				}
+				else if (freeVariables <= 0)
+				{
+					fits = false;
+					continue;
+				}
+				freeVariables--;
+				used[bin] += size;
+				configs[first + bin]->add_variable(requests[index].variable);
+				requests[index].planned = true;
+			}
+		}
+		if (!fits)
+		{
+			messageOut << "Not every log variable fits in the free log blocks.\n\r";
+		}
+		return(result && fits);
+	}
+
+	/**
+	* Plans the blocks and adds them to a log, called once its TOC is complete.
+	* Blocks still added to a log are kept, so a second call does not add them twice.
+	* A deleted log clears its blocks, so the next log is planned again.
+	* @param The log.
+	* @returns true if every variable is being logged.
+	*/
+	bool connect(cfLog* log)
+	{
+		bool result = log != NULL;
+		bool attached = false;
+		for (cfLog::LogConfig* config : configs)
+		{
+			attached = attached || config->log != NULL;
+		}
+		if (result && !attached && requests.size() > 0)
+		{
+			result = plan(log);
+			for (cfLog::LogConfig* config : configs)
+			{
+				if (!log->add_config(config))
+				{
+					messageOut << "Log block not added ";
+					messageOut << config->name;
+					messageOut << "\n\r";
+					for (cfLog::LogVariable* var : config->variables)
+					{
+						requests[byName[var->name]].planned = false;
+					}
+					result = false;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Finds the variable of a name, it stays valid for the life of the planner.
+	* @param The complete name.
+	* @returns The variable, NULL if it was not requested.
+	*/
+	cfLog::LogVariable* find(const std::string& name)
+	{
+		cfLog::LogVariable* result = NULL;
+		auto found = byName.find(name);
+		if (found != byName.end())
+		{
+			result = requests[found->second].variable;
+		}
+		return(result);
+	}
+
+	/**
+	* Fetches the last value of a variable by name.
+	* @param The complete name.
+	* @param The returned value.
+	* @param The returned crazyflie time of the value in milliseconds.
+	* @returns true if the variable is in a block of the last plan.
+	*/
+	bool fetch(const std::string& name, float& value, uint32_t& timestamp)
+	{
+		bool result = false;
+		auto found = byName.find(name);
+		if (found != byName.end() && requests[found->second].planned)
+		{
+			value = requests[found->second].variable->fetchFloat(timestamp);
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Measures the radio use of the last plan.
+	* @returns The blocks, bytes and rates of the plan.
+	*/
+	LogPlanStats stats()
+	{
+		LogPlanStats result;
+		for (cfLog::LogConfig* config : configs)
+		{
+			double perSecond = config->period_in_ms > 0 ? 1000.0 / (double)config->period_in_ms : 0;
+			result.blocks++;
+			result.variables += (int32_t)config->variables.size();
+			result.packetsPerSecond += perSecond;
+			result.samplesPerSecond += perSecond * (double)config->variables.size();
+			for (cfLog::LogVariable* var : config->variables)
+			{
+				result.bytes += types[var->fetch_as].size;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Writes the blocks of the last plan to messageOut.
+	*/
+	void report()
+	{
+		for (cfLog::LogConfig* config : configs)
+		{
+			int32_t bytes = 0;
+			for (cfLog::LogVariable* var : config->variables)
+			{
+				bytes += types[var->fetch_as].size;
+			}
+			messageOut << config->name;
+			messageOut << " period ";
+			messageOut << config->period_in_ms;
+			messageOut << " ms variables ";
+			messageOut << (int32_t)config->variables.size();
+			messageOut << " bytes ";
+			messageOut << bytes;
+			messageOut << " of ";
+			messageOut << (int32_t)cfLog::LogConfig::MAX_LEN;
+			messageOut << "\n\r";
+		}
+		LogPlanStats planStats = stats();
+		messageOut << "log plan samples/s ";
+		messageOut << planStats.samplesPerSecond;
+		messageOut << " packets/s ";
+		messageOut << planStats.packetsPerSecond;
+		messageOut << " samples/packet ";
+		messageOut << planStats.samples_per_packet();
+		messageOut << "\n\r";
+	}
+
+	/**
+	* Converts a period to the 10 millisecond units of a block.
+	* @param The period in milliseconds.
+	* @returns The period in units, from 1 to 254, the longest add_config accepts.
+	*/
+	static uint8_t _period(uint32_t periodMs)
+	{
+		uint32_t units = periodMs / 10;
+		units = units < 1 ? 1 : units;
+		return((uint8_t)(units > 254 ? 254 : units));
+	}
+
+	/**
+	* @param The index of a request with a type.
+	* @returns The bytes of its value in a block.
+	*/
+	int32_t _size(size_t index)
+	{
+		return(types[requests[index].variable->fetch_as].size);
+	}
+
+	/**
+	* Deletes the blocks of the last plan.
+	*/
+	void _clear_configs()
+	{
+		for (cfLog::LogConfig* config : configs)
+		{
+			delete config;
+		}
+		configs.clear();
+	}
+};
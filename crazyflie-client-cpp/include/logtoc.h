@@ -499,7 +499,7 @@ struct LogToc		//Container for LogTocElements
 			sprintf_s(filename, "%08lX_toc.json", crc);
 			std::filesystem::path tocPath = folderPath;
 			tocPath /= filename;
-			fullPath = tocPath.u8string();
+			fullPath = tocPath.string();
 		}
 		return(result);
 	}
@@ -0,0 +1,302 @@
+/*
+* Header-only implementation of a packet pool for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "Connection.h"
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+struct PacketPool;
+
+/**
+* A packet in a PacketPool, one cache line each
+* so slots used on different threads never share a line.
+*/
+struct alignas(64) PooledPacket
+{
+	Packet pk;								/**< The packet. */
+	std::atomic<int32_t> refs = 0;			/**< The PacketRefs holding the slot. */
+	std::atomic<uint32_t> next = 0;			/**< The next free slot plus one, 0 at the end of the free list. */
+	PacketPool* pool = NULL;				/**< The pool that owns the slot, NULL for a slot from the heap. */
+};
+
+/**
+* Returns a slot to its pool, or deletes a slot from the heap.
+* @param The slot no PacketRef holds any more.
+*/
+inline void releasePooledPacket(PooledPacket* slot);
+
+/**
+* A reference counted handle to a pooled packet.
+* Copies share the packet, the slot returns to its
+* pool when the last handle is released.
+*/
+struct PacketRef
+{
+	PooledPacket* slot;			/**< The held slot, NULL when empty. */
+
+	/**
+	* Constructor, an empty handle.
+	*/
+	PacketRef()
+	{
+		slot = NULL;
+	}
+
+	/**
+	* Constructor, takes over a slot with one reference.
+	* @param The slot.
+	*/
+	explicit PacketRef(PooledPacket* _slot)
+	{
+		slot = _slot;
+	}
+
+	/**
+	* Copy constructor, shares the packet.
+	* @param The handle to share.
+	*/
+	PacketRef(const PacketRef& other)
+	{
+		slot = other.slot;
+		if (slot != NULL)
+		{
+			slot->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	* Move constructor, takes over the packet.
+	* @param The handle to empty.
+	*/
+	PacketRef(PacketRef&& other) noexcept
+	{
+		slot = other.slot;
+		other.slot = NULL;
+	}
+
+	/**
+	* Destructor
+	*/
+	~PacketRef()
+	{
+		release();
+	}
+
+	/**
+	* Shares the packet of another handle.
+	* @param The handle to share.
+	* @returns This handle.
+	*/
+	PacketRef& operator=(const PacketRef& other)
+	{
+		if (slot != other.slot)
+		{
+			if (other.slot != NULL)
+			{
+				other.slot->refs.fetch_add(1, std::memory_order_relaxed);
+			}
+			release();
+			slot = other.slot;
+		}
+		return(*this);
+	}
+
+	/**
+	* Takes over the packet of another handle.
+	* @param The handle to empty.
+	* @returns This handle.
+	*/
+	PacketRef& operator=(PacketRef&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			slot = other.slot;
+			other.slot = NULL;
+		}
+		return(*this);
+	}
+
+	/**
+	* Lets go of the packet, the slot is freed with the last handle.
+	*/
+	void release()
+	{
+		if (slot != NULL)
+		{
+			if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				releasePooledPacket(slot);
+			}
+			slot = NULL;
+		}
+	}
+
+	/**
+	* @returns The packet, or NULL for an empty handle.
+	*/
+	Packet* get() const
+	{
+		return(slot != NULL ? &slot->pk : NULL);
+	}
+
+	/**
+	* @returns The packet of a handle that is not empty.
+	*/
+	Packet& operator*() const
+	{
+		return(slot->pk);
+	}
+
+	/**
+	* @returns The packet of a handle that is not empty.
+	*/
+	Packet* operator->() const
+	{
+		return(&slot->pk);
+	}
+
+	/**
+	* @returns true if the handle holds a packet.
+	*/
+	explicit operator bool() const
+	{
+		return(slot != NULL);
+	}
+};
+
+/**
+* A preallocated pool of packets shared through PacketRefs.
+* Free slots are kept on a lock-free list, so packets may be taken
+* and returned on any thread. When every slot is in use a packet
+* is taken from the heap instead, so a caller never goes without.
+*/
+struct PacketPool
+{
+	const static uint32_t DEFAULT_SIZE = 512;		/**< Slots in a pool by default. */
+
+	std::vector<PooledPacket> slots;				/**< The slots, never resized once the pool is in use. */
+	std::atomic<uint64_t> freeHead = 0;				/**< The first free slot plus one in the low word, a change count in the high word. */
+	std::atomic<uint32_t> inUse = 0;				/**< Slots held by PacketRefs. */
+	std::atomic<uint32_t> maxInUse = 0;				/**< Most slots seen in use at once. */
+	std::atomic<uint64_t> taken = 0;				/**< Packets taken from the pool. */
+	std::atomic<uint64_t> overflows = 0;			/**< Packets taken from the heap because the pool was empty. */
+
+	/**
+	* Constructor
+	* @param The number of slots.
+	*/
+	PacketPool(uint32_t size = DEFAULT_SIZE) : slots(size)
+	{
+		for (uint32_t i = 0; i < size; i++)
+		{
+			slots[i].pool = this;
+			slots[i].next.store(i + 2 <= size ? i + 2 : 0, std::memory_order_relaxed);
+		}
+		freeHead = size > 0 ? 1 : 0;
+	}
+
+	/**
+	* Takes a packet, from the heap if the pool is empty.
+	* The packet keeps what it held when it was last released.
+	* @returns The handle of the packet.
+	*/
+	PacketRef alloc()
+	{
+		PooledPacket* slot = NULL;
+		uint64_t head = freeHead.load(std::memory_order_acquire);
+		while ((head & 0xFFFFFFFF) != 0)
+		{
+			PooledPacket* first = &slots[(head & 0xFFFFFFFF) - 1];
+			uint64_t next = (head & 0xFFFFFFFF00000000ULL) + 0x100000000ULL + first->next.load(std::memory_order_relaxed);
+			if (freeHead.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				slot = first;
+				break;
+			}
+		}
+		if (slot != NULL)
+		{
+			taken.fetch_add(1, std::memory_order_relaxed);
+			uint32_t used = inUse.fetch_add(1, std::memory_order_relaxed) + 1;
+			uint32_t most = maxInUse.load(std::memory_order_relaxed);
+			while (used > most && !maxInUse.compare_exchange_weak(most, used, std::memory_order_relaxed))
+			{
+			}
+		}
+		else
+		{
+			overflows.fetch_add(1, std::memory_order_relaxed);
+			slot = new PooledPacket();
+		}
+		slot->refs.store(1, std::memory_order_relaxed);
+		return(PacketRef(slot));
+	}
+
+	/**
+	* Takes a packet from the heap, for a sender without a pool.
+	* @returns The handle of the packet.
+	*/
+	static PacketRef alloc_unpooled()
+	{
+		PooledPacket* slot = new PooledPacket();
+		slot->refs.store(1, std::memory_order_relaxed);
+		return(PacketRef(slot));
+	}
+
+	/**
+	* Returns a slot to the free list, called when its last handle is released.
+	* @param The slot.
+	*/
+	void free(PooledPacket* slot)
+	{
+		uint32_t index = (uint32_t)(slot - slots.data()) + 1;
+		uint64_t head = freeHead.load(std::memory_order_acquire);
+		while (true)
+		{
+			slot->next.store((uint32_t)(head & 0xFFFFFFFF), std::memory_order_relaxed);
+			uint64_t next = (head & 0xFFFFFFFF00000000ULL) + 0x100000000ULL + index;
+			if (freeHead.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				break;
+			}
+		}
+		inUse.fetch_sub(1, std::memory_order_relaxed);
+	}
+};
+
+inline void releasePooledPacket(PooledPacket* slot)
+{
+	if (slot->pool != NULL)
+	{
+		slot->pool->free(slot);
+	}
+	else
+	{
+		delete slot;
+	}
+}
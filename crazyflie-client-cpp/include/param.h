@@ -27,6 +27,7 @@
 #include"portconnect.h"
 #include "pttype.h"
 #include "paramtoc.h"
+#include "toccache.h"
 #include "packutils.h"
 
 #include <vector>
@@ -35,6 +36,8 @@
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <errno.h>
 #include "messageout.h"
 
@@ -71,9 +74,11 @@ public:
 	*/
 	struct TocFetcher
 	{
-		//const static uint8_t IDLE = 0;
+		const static uint8_t IDLE = 0;
 		const static uint8_t GET_TOC_INFO = 1;
 		const static uint8_t GET_TOC_ELEMENT = 2;
+		const static uint8_t WAIT_TOC_CACHE = 3;
+		const static uint8_t CHECK_TOC_INFO = 4;
 
 		Param* param = NULL;
 		ParamToc* tocHolder = NULL;
@@ -115,6 +120,31 @@ public:
 			_useV2 = protocolVersion >= 4;
 			param->tocfetcherCallbacks.push_back(this);
 			state = GET_TOC_INFO;
+			_request_toc_info();
+		}
+
+		/**
+		* Requests the TOC info to compare its crc with the TOC in memory,
+		* the result is passed to PortConnect::tocChecked.
+		* May be called again for each reconnect.
+		*/
+		void check()
+		{
+			_useV2 = protocolVersion >= 4;
+			if (std::find(param->tocfetcherCallbacks.begin(), param->tocfetcherCallbacks.end(), this) ==
+				param->tocfetcherCallbacks.end())
+			{
+				param->tocfetcherCallbacks.push_back(this);
+			}
+			state = CHECK_TOC_INFO;
+			_request_toc_info();
+		}
+
+		/**
+		* Sends the request for the number of items and crc of the TOC.
+		*/
+		void _request_toc_info()
+		{
 			{
 				std::array<uint8_t, gMaxBufferSize> buffer;
 				buffer[0] = 0xFF;
@@ -132,7 +162,7 @@ public:
 				Packet pk(buffer.data(), index);
 				pk.setPort(port);
 				pk.setChannel(TOC_CHANNEL);
-				param->portConnect->send_packet(pk, expectedReply);
+				param->portConnect->send_request(pk, PendingRequests::MATCH_COMMAND, _request_done, param);
 			}
 		}
 
@@ -167,7 +197,7 @@ public:
 			uint8_t channel = pk.channel();
 			if (channel == 0)
 			{
-				if (state == GET_TOC_INFO)
+				if (state == GET_TOC_INFO || state == CHECK_TOC_INFO)
 				{
 					if (_useV2)
 					{
@@ -185,32 +215,25 @@ public:
 						index += PackUtils::unpack(buffer, index, _crc);
 						nbr_of_items = itemCount;
 					}
-					bool wasFound = false;
-					if (tocHolder != NULL)
+					if (state == CHECK_TOC_INFO)
 					{
-						if (tocHolder->crc == _crc)
+						state = IDLE;
+						param->portConnect->tocChecked(tocHolder != NULL &&
+							tocHolder->crc == _crc && tocHolder->groups.size() > 0);
+					}
+					else if (tocHolder != NULL)
+					{
+						if (tocHolder->crc == _crc && tocHolder->groups.size() > 0)
 						{
-							wasFound = true;
-							param->toc_complete();
+							_toc_done(false);
 						}
-						else if (tocHolder->tocExists(_crc))
+						else if (param->tocCache != NULL)
 						{
-							wasFound = readToc(_crc);
-							param->toc_complete();
+							_lookup_cache();
 						}
-					}
-					if (!wasFound)
-					{
-						state = GET_TOC_ELEMENT;
-						requested_index = 0;
-						if (nbr_of_items > 0)
+						else
 						{
-							messageOut << "Requesting ";
-							messageOut << nbr_of_items;
-							messageOut << " items for the Param TOC\n\r ";
-
-							elementData.resize(nbr_of_items);
-							request_toc_element(requested_index);
+							_read_or_fetch();
 						}
 					}
 				}
@@ -239,9 +262,9 @@ public:
 
 						if (ident == nbr_of_items - 1)
 						{
-							messageOut << " Finished updating the Log TOC\n\r ";
+							messageOut << " Finished updating the Param TOC\n\r ";
 							tocHolder->write(_crc);
-							param->toc_complete();
+							_toc_done(true);
 						}
 
 						if (requested_index < ((uint32_t)nbr_of_items - 1))
@@ -254,6 +277,80 @@ public:
 			}
 		}
 
+		/**
+		* Reads the TOC from the file cache,
+		* or fetches it from the crazyflie.
+		*/
+		void _read_or_fetch()
+		{
+			bool wasFound = false;
+			if (tocHolder->tocExists(_crc))
+			{
+				wasFound = readToc(_crc);
+			}
+			if (wasFound)
+			{
+				_toc_done(true);
+			}
+			else
+			{
+				state = GET_TOC_ELEMENT;
+				requested_index = 0;
+				if (nbr_of_items > 0)
+				{
+					messageOut << "Requesting ";
+					messageOut << nbr_of_items;
+					messageOut << " items for the Param TOC\n\r ";
+
+					elementData.resize(nbr_of_items);
+					request_toc_element(requested_index);
+				}
+			}
+		}
+
+		/**
+		* Looks up the crc in the shared TocCache.
+		* Copies the TOC if it is there, waits if another drone
+		* is fetching it, or else reads or fetches it.
+		*/
+		void _lookup_cache()
+		{
+			int32_t found = param->tocCache->param.lookup(_crc, *tocHolder);
+			if (found == TocCacheTable<ParamToc>::CACHE_HIT)
+			{
+				messageOut << "Param TOC was shared.\n\r";
+				param->tocShared = true;
+				param->cacheWaiter = NULL;
+				_toc_done(false);
+			}
+			else if (found == TocCacheTable<ParamToc>::CACHE_WAIT)
+			{
+				state = WAIT_TOC_CACHE;
+				param->cacheWaiter = this;
+			}
+			else
+			{
+				param->cacheWaiter = NULL;
+				_read_or_fetch();
+			}
+		}
+
+		/**
+		* Finishes the TOC and starts the extended type requests.
+		* @param True if the TOC should be shared with the TocCache.
+		*/
+		void _toc_done(bool share)
+		{
+			state = IDLE;
+			tocHolder->crc = _crc;
+			tocHolder->complete = true;
+			if (share && param->tocCache != NULL)
+			{
+				param->tocCache->param.store(_crc, *tocHolder);
+			}
+			param->toc_complete();
+		}
+
 		/**
 		* Request a single toc element.
 		* @param The index of the element to fetch.
@@ -263,23 +360,26 @@ public:
 			std::array<uint8_t, gMaxBufferSize> buffer;
 			buffer[0] = 0xFF;
 			uint8_t index = 1;
+			uint8_t match = PendingRequests::MATCH_COMMAND;
 			if (_useV2)
 			{
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)CMD_TOC_ITEM_V2);
 				index += PackUtils::pack(buffer.data(), index, elemDex);
 				expectedReply = CMD_TOC_ITEM_V2;
+				match |= PendingRequests::MATCH_IDENT16;
 			}
 			else
 			{
 				uint8_t _elemDex = elemDex & 0xff;
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)CMD_TOC_ELEMENT);
 				index += PackUtils::pack(buffer.data(), index, (uint8_t)elemDex);
-				expectedReply = CMD_TOC_INFO;
+				expectedReply = CMD_TOC_ELEMENT;
+				match |= PendingRequests::MATCH_IDENT8;
 			}
 			Packet pk(buffer.data(), index);
 			pk.setPort(port);
 			pk.setChannel(TOC_CHANNEL);
-			param->portConnect->send_packet(pk, expectedReply);
+			param->portConnect->send_request(pk, match, _request_done, param);
 		}
 	};
 
@@ -305,6 +405,7 @@ public:
 		std::atomic<uint16_t> _ctype;	/**< The c language type index for this param */
 		std::atomic<uint16_t> _csize;	/**< The packed size of this param */
 		std::atomic<uint16_t> _state;	/**< The request state of this param value */
+		std::atomic<bool> _written;		/**< Set by the client, written again when a session resumes */
 
 		/**
 		* Constructor
@@ -316,6 +417,7 @@ public:
 			_ctype = 0;
 			_csize = 0;
 			_state = PENDING | REQUEST_NONE;
+			_written = false;
 
 		}
 		/**
@@ -330,6 +432,7 @@ public:
 		ParamValue(uint16_t state)
 		{
 			_state = state;
+			_written = false;
 		}
 
 		/**
@@ -605,15 +708,26 @@ public:
 	const static uint8_t ALL_PARAMS_REQUESTED = 1;
 	const static uint8_t ALL_PARAMS_DONE = 2;
 
+	const static uint32_t queueWaitMs = 10;		/**< Longest wait of the queue thread without a wake */
+
 	ParamToc toc;	/**< The current table of contents */
 	
 	std::vector <TocFetcher*> tocfetcherCallbacks;		/**< The active TocFetchers */
+	TocCache* tocCache = NULL;							/**< Shares TOCs with other drones when set. */
+	std::atomic<TocFetcher*> cacheWaiter = NULL;		/**< The fetch waiting for another drone to fetch its TOC. */
+	std::atomic<bool> tocShared = false;				/**< True if the TOC was copied from the TocCache. */
+	TocFetcher* tocChecker = NULL;						/**< Compares the TOC with the crazyflie after a reconnect. */
+	std::vector <ParamSetting*> registeredSettings;		/**< Registered ParamSettings, registered again for a new TOC */
+	std::mutex registeredMutex;							/**< the mutex to guard the registeredSettings */
 	std::vector <ParamValue*> values;					/**< list of ParamValue pointers ordered by identifier */
 	std::queue <uint32_t> updateQueue;					/**< The queue of the identifiers being updated */
 	std::queue <uint32_t> extendedTypeQueue;			/**< The queue of extended types being updated */
 	std::mutex updateQueueMutex;						/**< the mutex to guard thread locking for the updateQueue */
 	std::mutex extendedTypeQueueMutex;					/**< the mutex to guard thread locking for the extendedTypeQueue */
 	std::thread queueThread;							/**< The thread for handling the queues */
+	std::mutex queueWakeMutex;							/**< the mutex for the queueCondition */
+	std::condition_variable queueCondition;				/**< Wakes the queue thread for a reply, new work or a stop */
+	bool queueWake = false;								/**< Set with the queueWakeMutex held when the queue thread is woken */
 	
 	std::atomic <int32_t> idCount = 0;						/**< The total number of parameters in the TOC */
 	std::atomic<bool> running = false;						/**< The Param is connected and handling requests */
@@ -662,8 +776,15 @@ public:
 	{
 		if (running)
 		{
-			running = false;
-			queueThread.join();
+			{
+				std::lock_guard<std::mutex> guard(queueWakeMutex);
+				running = false;
+			}
+			queueCondition.notify_one();
+			if (queueThread.joinable())
+			{
+				queueThread.join();
+			}
 		}
 		for (size_t i = 0; i < tocfetcherCallbacks.size(); i++)
 		{
@@ -684,6 +805,8 @@ public:
 
 		values.clear();
 		tocfetcherCallbacks.clear();
+		tocChecker = NULL;
+		cacheWaiter = NULL;
 		toc.clear();
 		resetComplete = false;
 		protocolVersion = 0xff;
@@ -713,7 +836,10 @@ public:
 			protocolVersion = portConnect->platform->get_version();
 			useV2 = protocolVersion >= 4;
 			running = true;
-			queueThread = std::thread(queueThreadFunc, this);
+			if (portConnect->pump == NULL)
+			{
+				queueThread = std::thread(queueThreadFunc, this);
+			}
 		}
 	}
 
@@ -747,7 +873,67 @@ public:
 				}
 			}
 		}
+		_register_settings();
 		resetComplete = done;
+		_wake_queues();
+		if (done && portConnect != NULL)
+		{
+			portConnect->_advance_stages();
+		}
+	}
+
+	/**
+	* Virtual PortClient call after a reconnect.
+	* Compares the crc of the TOC in memory with the crazyflie.
+	*/
+	void check_toc()
+	{
+		if (tocChecker == NULL)
+		{
+			tocChecker = new TocFetcher(this, PARAM, &this->toc);
+		}
+		tocChecker->protocolVersion = protocolVersion;
+		tocChecker->check();
+	}
+
+	/**
+	* Virtual PortClient call after a reconnect found the same TOC.
+	* Keeps the TOC, the values and the registered ParamSettings.
+	* Writes again each value set by the client, in case the
+	* crazyflie restarted, and reads each registered setting.
+	*/
+	void resume()
+	{
+		int32_t written = 0;
+		{
+			std::lock_guard<std::mutex> guard(updateQueueMutex);
+			for (size_t i = 0; i < values.size(); i++)
+			{
+				ParamValue* value = values[i];
+				if (value != NULL && value->_written)
+				{
+					value->_state = ParamValue::PENDING | ParamValue::REQUEST_WRITE;
+					updateQueue.push((uint32_t)i);
+					written++;
+				}
+			}
+		}
+		_wake_queues();
+		{
+			std::lock_guard<std::mutex> guard(registeredMutex);
+			for (size_t i = 0; i < registeredSettings.size(); i++)
+			{
+				ParamSetting* setting = registeredSettings[i];
+				if (setting->is_registered && setting->ident < values.size() &&
+					!(values[setting->ident] != NULL && values[setting->ident]->_written))
+				{
+					request_param_update(setting->completeName);
+				}
+			}
+		}
+		messageOut << "Resumed ";
+		messageOut << written;
+		messageOut << " param writes.\n\r";
 	}
 
 	/**
@@ -755,7 +941,9 @@ public:
 	*/
 	void reset()
 	{
-		toc.groups.clear();
+		toc.clear();
+		cacheWaiter = NULL;
+		tocShared = false;
 		TocFetcher* tocFetcher =
 			new TocFetcher(this, PARAM, &this->toc);
 		messageOut << "Resetting Param.\n\r";
@@ -804,7 +992,7 @@ public:
 			if (values.size() > 0)
 			{
 				idCount = toc.get_id_count();
-				if (values.size() == idCount)
+				if (values.size() == (size_t)idCount)
 				{
 					result = true;
 					for (size_t i = 0; i < values.size(); i++)
@@ -924,15 +1112,61 @@ public:
 					std::lock_guard<std::mutex> guard(updateQueueMutex);
 					updateQueue.push(ident);
 				}
+				_wake_queues();
 			}
 		}
 	}
 
 	/**
 	* Registers a ParamSetting for read and write using its identiier.
+	* The setting is registered again whenever a new TOC completes,
+	* so it must persist until it is unregistered or the Param is deleted.
 	* @param The ParamSetting to register.
+	* @returns true if its value was read.
 	*/
 	bool registerParamSetting(ParamSetting &setting)
+	{
+		{
+			std::lock_guard<std::mutex> guard(registeredMutex);
+			if (std::find(registeredSettings.begin(), registeredSettings.end(), &setting) ==
+				registeredSettings.end())
+			{
+				registeredSettings.push_back(&setting);
+			}
+		}
+		return(_register_setting(setting));
+	}
+
+	/**
+	* Stops registering a ParamSetting again for a new TOC.
+	* @param The ParamSetting to unregister.
+	*/
+	void unregisterParamSetting(ParamSetting &setting)
+	{
+		std::lock_guard<std::mutex> guard(registeredMutex);
+		registeredSettings.erase(std::remove(registeredSettings.begin(), registeredSettings.end(), &setting),
+			registeredSettings.end());
+		setting.is_registered = false;
+	}
+
+	/**
+	* Registers each registered ParamSetting again with the current TOC.
+	*/
+	void _register_settings()
+	{
+		std::lock_guard<std::mutex> guard(registeredMutex);
+		for (size_t i = 0; i < registeredSettings.size(); i++)
+		{
+			_register_setting(*registeredSettings[i]);
+		}
+	}
+
+	/**
+	* Finds the identifier and type of a ParamSetting in the TOC.
+	* @param The ParamSetting to register.
+	* @returns true if its value was read.
+	*/
+	bool _register_setting(ParamSetting &setting)
 	{
 		bool result = NULL;
 		setting.ident = NO_IDENT;
@@ -1047,7 +1281,7 @@ public:
 					paramValue->_ctype = _cType;
 					paramValue->_csize = ParamTocElement::get_size_from_id(_cType);
 					paramValue->_state = ParamValue::PENDING | ParamValue::REQUEST_WRITE;
-					values[ident]->setValue(value);
+					paramValue->setValue(value);
 					values[ident] = paramValue;
 				}
 				else
@@ -1055,11 +1289,150 @@ public:
 					values[ident]->setValue(value);
 					values[ident]->_state = ParamValue::PENDING | ParamValue::REQUEST_WRITE;
 				}
+				values[ident]->_written = true;
 				{
 					std::lock_guard<std::mutex> guard(updateQueueMutex);
 					updateQueue.push(ident);
 					result = true;
 				}
+				_wake_queues();
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* The reply layout of param reads and writes.
+	* @returns The PendingRequests::MATCH_* flags.
+	*/
+	uint8_t reply_match()
+	{
+		return(useV2 ? PendingRequests::MATCH_IDENT16 : PendingRequests::MATCH_IDENT8);
+	}
+
+	/**
+	* Builds a read or write request for a param.
+	* @param The returned request.
+	* @param READ_CHANNEL or WRITE_CHANNEL.
+	* @param The identifier of the param.
+	* @param The value to write, NULL for a read.
+	*/
+	void _pack_request(Packet& pk, uint8_t channel, uint16_t var_id, ParamValue* value)
+	{
+		pk.setPort(PARAM);
+		pk.setChannel(channel);
+		int32 index = 0;
+		uint8_t* buffer = pk.payload();
+		if (useV2)
+		{
+			index += PackUtils::pack(buffer, index, var_id);
+		}
+		else
+		{
+			index += PackUtils::pack(buffer, index, (uint8_t)var_id);
+		}
+		if (value != NULL)
+		{
+			uint8_t csize = value->_csize;
+			uint64_t dataClump = value->_value;
+			uint8_t* data = (uint8_t*)&dataClump;
+			for (uint8_t i = 0; i < csize; i++)
+			{
+				buffer[index] = data[i];
+				index++;
+			}
+		}
+		pk.setPayloadSize(index);
+	}
+
+	/**
+	* Builds a request to read a param, for a caller that sends it
+	* and tracks its reply, such as the coroutine api.
+	* The Param still stores the value when the reply arrives.
+	* @param The complete name (group.name) of the param.
+	* @param The returned identifier of the param.
+	* @param The returned request.
+	* @returns false if the param is not in the TOC.
+	*/
+	bool read_request(std::string& completeName, uint16_t& ident, Packet& pk)
+	{
+		bool result = false;
+		ParamTocElement& element = toc.get_element_by_complete_name(completeName);
+		ident = element.ident;
+		if (ident != NO_IDENT)
+		{
+			_pack_request(pk, READ_CHANNEL, ident, NULL);
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Builds a request to write a param, for a caller that sends it
+	* and tracks its reply, such as the coroutine api.
+	* The value is stored as the current value of the param
+	* and written again when a session resumes.
+	* @param The complete name (group.name) of the param.
+	* @param The value to write.
+	* @param The returned request.
+	* @returns false if the param is not in the TOC.
+	*/
+	bool write_request(std::string& completeName, double value, Packet& pk)
+	{
+		bool result = false;
+		ParamTocElement& element = toc.get_element_by_complete_name(completeName);
+		uint16_t ident = element.ident;
+		if (ident != NO_IDENT)
+		{
+			ParamValue packed(ParamValue::SET | ParamValue::REQUEST_NONE);
+			uint8_t ctype = ParamTocElement::get_id_from_cstring(element.ctype);
+			packed._ctype = ctype;
+			packed._csize = ParamTocElement::get_size_from_id(ctype);
+			packed.setValue(value);
+			_pack_request(pk, WRITE_CHANNEL, ident, &packed);
+			{
+				std::lock_guard<std::mutex> guard(updateQueueMutex);
+				if (ident < values.size())
+				{
+					if (values[ident] == NULL)
+					{
+						ParamValue* paramValue = new ParamValue(ParamValue::SET | ParamValue::REQUEST_NONE);
+						paramValue->_ctype = ctype;
+						paramValue->_csize = (uint16_t)packed._csize;
+						values[ident] = paramValue;
+					}
+					values[ident]->_value = (uint64_t)packed._value;
+					values[ident]->_written = true;
+				}
+			}
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Reads the value carried by the reply to a read request.
+	* @param The identifier of the param.
+	* @param The reply.
+	* @param The returned value as a float64.
+	* @returns false if the reply is too short for the param.
+	*/
+	bool read_reply(uint16_t ident, Packet& reply, double& value)
+	{
+		bool result = false;
+		ParamTocElement& element = toc.get_element_by_id(ident);
+		if (element.ident != NO_IDENT)
+		{
+			ParamValue packed(ParamValue::SET | ParamValue::REQUEST_NONE);
+			uint8_t ctype = ParamTocElement::get_id_from_cstring(element.ctype);
+			packed._ctype = ctype;
+			packed._csize = ParamTocElement::get_size_from_id(ctype);
+			uint8_t valueIndex = (useV2 ? 2 : 1) + 1;
+			if (reply.channel() == READ_CHANNEL && reply.payloadSize() >= valueIndex + packed._csize)
+			{
+				packed.set(reply.payload() + valueIndex);
+				value = packed.getValue();
+				result = true;
 			}
 		}
 		return(result);
@@ -1099,143 +1472,227 @@ public:
 						}
 					}
 				}
+				_wake_queues();
 			}
 		}
 	}
 
 	/**
-	* Handles both the update and the extended queues.
+	* Called when a param request completes.
+	* A request without a reply after every retry releases
+	* its queue so the following requests are sent.
 	* @param The owner Param.
+	* @param The request status.
+	* @param The request that was sent when the request timed out.
 	*/
-	static void queueThreadFunc(void* data)
+	static void _request_done(void* context, int32_t status, Packet& pk)
+	{
+		Param* param = (Param*)context;
+		if (param != NULL && status == PendingRequests::REQUEST_TIMEOUT)
+		{
+			uint8_t channel = pk.channel();
+			uint8_t* data = pk.payload();
+			if (channel == READ_CHANNEL || channel == WRITE_CHANNEL)
+			{
+				uint16_t var_id = 0;
+				if (param->useV2)
+				{
+					PackUtils::unpack(data, 0, var_id);
+				}
+				else
+				{
+					var_id = data[0];
+				}
+				if (var_id < param->values.size() && param->values[var_id] != NULL)
+				{
+					param->values[var_id]->_state = ParamValue::SET | ParamValue::REQUEST_NONE;
+				}
+				messageOut << "Param request timed out: ";
+				messageOut << (int32_t)var_id;
+				messageOut << "\n\r";
+			}
+			else if (channel == MISC_CHANNEL)
+			{
+				if (param->extendedState == EXTENDED_REQUEST)
+				{
+					param->extendedState = EXTENDED_SET;
+				}
+				messageOut << "Param extended type request timed out.\n\r";
+			}
+			else
+			{
+				messageOut << "Param TOC request timed out.\n\r";
+			}
+			param->_wake_queues();
+		}
+	}
+
+	/**
+	* Wakes the queue thread to send the next request.
+	*/
+	void _wake_queues()
 	{
-		Param* param = (Param*)data;
-		if (param != NULL)
 		{
-			bool useV2 = param->useV2;
+			std::lock_guard<std::mutex> guard(queueWakeMutex);
+			queueWake = true;
+		}
+		queueCondition.notify_one();
+	}
 
-			while (param->running)
+	/**
+	* Virtual PortClient call for each pass of the port thread or pump.
+	* Checks on a TOC that another drone is fetching,
+	* and handles the queues when pumped.
+	*/
+	void service()
+	{
+		TocFetcher* waiter = cacheWaiter;
+		if (waiter != NULL)
+		{
+			waiter->_lookup_cache();
+		}
+		if (running && portConnect != NULL && portConnect->pump != NULL)
+		{
+			_service_queues();
+		}
+	}
+
+	/**
+	* Sends the next request of the extended or update queue
+	* once the previous request has been answered.
+	* @returns true if a finished entry was removed and the next may be handled at once.
+	*/
+	bool _service_queues()
+	{
+		bool result = false;
+		bool hasExtendedQueue = false;
+		bool extendedComplete = false;
+		{
+			std::lock_guard<std::mutex> guard(extendedTypeQueueMutex);
+			size_t queueSize = extendedTypeQueue.size();
+			if (queueSize > 0)
 			{
-				bool hasExtendedQueue = false;
+				hasExtendedQueue = true;
+				uint16_t var_id = extendedTypeQueue.front();
+				if (var_id == extendedRequestIdent)
 				{
-					std::lock_guard<std::mutex> guard(param->extendedTypeQueueMutex);
-					size_t queueSize = param->extendedTypeQueue.size();
-					if (queueSize > 0)
+					if (extendedState == EXTENDED_SET)
 					{
-						hasExtendedQueue = true;
-						uint16_t var_id = param->extendedTypeQueue.front();
-						if (var_id == param->extendedRequestIdent)
+						extendedTypeQueue.pop();
+						result = true;
+						extendedState = EXTENDED_PENDING;
+						extendedRequestIdent = NO_IDENT;
+						if (extendedTypeQueue.size() == 0)
 						{
-							if (param->extendedState == EXTENDED_SET)
-							{
-								param->extendedTypeQueue.pop();
-								param->extendedState = EXTENDED_PENDING;
-								param->extendedRequestIdent = NO_IDENT;
-								if (param->extendedTypeQueue.size() == 0)
-								{
-									param->resetComplete = true;
-									messageOut << "ExParam update complete.\n\r";
-								}
-							}
-						}
-						else
-						{
-							if (param->extendedRequestIdent == NO_IDENT)
-							{
-								Packet pk;
-								pk.setPort(PARAM);
-								pk.setChannel(MISC_CHANNEL);
-								int32 index = 0;
-								uint8_t* buffer = pk.payload();
-								index += PackUtils::pack(buffer, index, (uint8_t)MISC_GET_EXTENDED_TYPE);
-								index += PackUtils::pack(buffer, index, var_id);
-								pk.setPayloadSize(index);
-								param->portConnect->send_packet(pk, MISC_GET_EXTENDED_TYPE);
-								param->extendedRequestIdent = var_id;
-								param->extendedState = EXTENDED_REQUEST;
-								//messageOut << "ExParamRequest: ";
-								//messageOut << (int32_t)var_id;
-								//messageOut << "\n\r";
-							}
+							resetComplete = true;
+							extendedComplete = true;
+							messageOut << "ExParam update complete.\n\r";
 						}
 					}
 				}
-				if (!hasExtendedQueue)
+				else
 				{
-					std::lock_guard<std::mutex> guard(param->updateQueueMutex);
-					size_t queueSize = param->updateQueue.size();
-					if (queueSize > 0)
+					if (extendedRequestIdent == NO_IDENT)
 					{
-						uint16_t var_id = param->updateQueue.front();
-						if (var_id < param->values.size())
+						Packet pk;
+						pk.setPort(PARAM);
+						pk.setChannel(MISC_CHANNEL);
+						int32 index = 0;
+						uint8_t* buffer = pk.payload();
+						index += PackUtils::pack(buffer, index, (uint8_t)MISC_GET_EXTENDED_TYPE);
+						index += PackUtils::pack(buffer, index, var_id);
+						pk.setPayloadSize(index);
+						extendedRequestIdent = var_id;
+						extendedState = EXTENDED_REQUEST;
+						portConnect->send_request(pk, PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT16,
+							_request_done, this);
+						//messageOut << "ExParamRequest: ";
+						//messageOut << (int32_t)var_id;
+						//messageOut << "\n\r";
+					}
+				}
+			}
+		}
+		if (extendedComplete)
+		{
+			portConnect->_advance_stages();
+		}
+		if (!hasExtendedQueue)
+		{
+			std::lock_guard<std::mutex> guard(updateQueueMutex);
+			size_t queueSize = updateQueue.size();
+			if (queueSize > 0)
+			{
+				uint16_t var_id = updateQueue.front();
+				if (var_id < values.size())
+				{
+					if (values[var_id] != NULL)
+					{
+						if (values[var_id]->_state == 
+							(ParamValue::PENDING | ParamValue::REQUEST_READ))
 						{
-							if (param->values[var_id] != NULL)
-							{
-								if (param->values[var_id]->_state == 
-									(ParamValue::PENDING | ParamValue::REQUEST_READ))
-								{
-									Packet pk; 
-									pk.setPort(PARAM);
-									pk.setChannel(READ_CHANNEL); 
-									int32 index = 0;
-									uint8_t* buffer = pk.payload();
-									if (useV2)
-									{
-										index += PackUtils::pack(buffer, index, var_id); 
-									}
-									else
-									{
-										index += PackUtils::pack(buffer, index, (uint8_t)var_id);
-									}
-									pk.setPayloadSize(index);
-									param->portConnect->send_packet(pk, READ_CHANNEL);
-									param->values[var_id]->_state = (ParamValue::REQUESTED | ParamValue::REQUEST_READ);
-								}
-								else if (param->values[var_id]->_state ==
-									(ParamValue::PENDING | ParamValue::REQUEST_WRITE))
-								{
-									Packet pk;
-									pk.setPort(PARAM);
-									pk.setChannel(WRITE_CHANNEL);
-									int32 index = 0;
-									uint8_t* buffer = pk.payload();
-									if (useV2)
-									{
-										index += PackUtils::pack(buffer, index, var_id);
-									}
-									else
-									{
-										index += PackUtils::pack(buffer, index, (uint8_t)var_id);
-									}
-									uint8_t csize = param->values[var_id]->_csize;
-									uint64_t dataClump = param->values[var_id]->_value;
-									uint8_t* data = (uint8_t*)&dataClump;
-									for (uint8_t i = 0; i < csize; i++)
-									{
-										buffer[index] = data[i];
-										index++;
-									}
-									pk.setPayloadSize(index);
-									param->portConnect->send_packet(pk, WRITE_CHANNEL);
-									param->values[var_id]->_state = (ParamValue::REQUESTED | ParamValue::REQUEST_WRITE);
-								}
-								else if (param->values[var_id]->_state == (ParamValue::SET | ParamValue::REQUEST_NONE))
-								{
-									param->updateQueue.pop();
-								}
-							}
-							else
-							{
-								param->updateQueue.pop();
-							}
+							Packet pk;
+							_pack_request(pk, READ_CHANNEL, var_id, NULL);
+							values[var_id]->_state = (ParamValue::REQUESTED | ParamValue::REQUEST_READ);
+							portConnect->send_request(pk, reply_match(), _request_done, this);
 						}
-						else
+						else if (values[var_id]->_state ==
+							(ParamValue::PENDING | ParamValue::REQUEST_WRITE))
 						{
-							param->updateQueue.pop();
+							Packet pk;
+							_pack_request(pk, WRITE_CHANNEL, var_id, values[var_id]);
+							values[var_id]->_state = (ParamValue::REQUESTED | ParamValue::REQUEST_WRITE);
+							portConnect->send_request(pk, reply_match(), _request_done, this);
 						}
+						else if (values[var_id]->_state == (ParamValue::SET | ParamValue::REQUEST_NONE))
+						{
+							updateQueue.pop();
+							result = true;
+						}
+					}
+					else
+					{
+						updateQueue.pop();
+						result = true;
+					}
+				}
+				else
+				{
+					updateQueue.pop();
+					result = true;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Handles both the update and the extended queues.
+	* @param The owner Param.
+	*/
+	static void queueThreadFunc(void* data)
+	{
+		Param* param = (Param*)data;
+		if (param != NULL)
+		{
+			PortConnect* portConnect = param->portConnect;
+			portConnect->threadConfig.param.apply("cf-param");
+			while (param->running)
+			{
+				if (!param->_service_queues())
+				{
+					// wait for a reply, new work or a stop.
+					std::unique_lock<std::mutex> lock(param->queueWakeMutex);
+					int64_t deadlineNs = steadyNowNs() + (int64_t)queueWaitMs * 1000000;
+					bool woken = param->queueCondition.wait_for(lock, std::chrono::milliseconds(queueWaitMs), [param] {
+						return(!param->running || param->queueWake);
+						});
+					if (!woken)
+					{
+						ThreadMetrics::record_wake(portConnect->threadMetrics.paramWake, deadlineNs);
 					}
+					param->queueWake = false;
 				}
-				std::this_thread::sleep_for(std::chrono::microseconds(1000));
 			}
 		}
 	}
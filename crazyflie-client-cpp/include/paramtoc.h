@@ -94,6 +94,24 @@ struct ParamTocElement
 		persistent = a.persistent;
 	}
 
+	/**
+	* Assignment
+	* @param the ParamTocElement to copy.
+	* @returns this element.
+	*/
+	ParamTocElement& operator=(const ParamTocElement& a)
+	{
+		ident = a.ident;
+		group = a.group;
+		name = a.name;
+		ctype = a.ctype;
+		pytype = a.pytype;
+		access = a.access;
+		extended = a.extended;
+		persistent = a.persistent;
+		return(*this);
+	}
+
 	/**
 	* Construct from data
 	* @param the identifier for the element.
@@ -587,7 +605,7 @@ struct ParamToc		//Container for ParamTocElements
 			sprintf_s(filename, "%08lX_toc.json", crc);
 			std::filesystem::path tocPath = folderPath;
 			tocPath /= filename;
-			fullPath = tocPath.u8string();
+			fullPath = tocPath.string();
 		}
 		return(result);
 	}
@@ -0,0 +1,567 @@
+/*
+* Header-only implementation of the pending request table for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "Connection.h"
+#include "ctrp.h"
+#include "portdispatch.h"
+#include "txqueue.h"
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+/**
+* Called when a pending request completes.
+* @param The context given with the request.
+* @param The request status, PendingRequests::REQUEST_DONE, REQUEST_TIMEOUT or REQUEST_CANCELLED.
+* @param The reply when done, otherwise the request that was sent.
+*/
+typedef void (*PendingCallback)(void* context, int32_t status, Packet& pk);
+
+/**
+* A request waiting for its reply.
+*/
+struct PendingRequest
+{
+	Packet pk;							/**< The request, kept for retransmits. */
+	PendingCallback callback = NULL;	/**< Called when the request completes, may be NULL. */
+	void* context = NULL;				/**< Passed to the callback. */
+	int64_t sentNs = 0;					/**< Time the request was first queued. */
+	int64_t deadlineNs = 0;				/**< Time the request is retransmitted or times out. */
+	uint32_t timeoutMs = 0;				/**< Time to wait for each reply. */
+	int32_t retries = 0;				/**< Retransmits left. */
+	uint16_t ident = 0;					/**< The identifier the reply must carry. */
+	uint8_t port = 0;					/**< The port the reply must arrive on. */
+	uint8_t channel = 0;				/**< The channel the reply must arrive on. */
+	uint8_t command = 0;				/**< The command the reply must carry. */
+	uint8_t match = 0;					/**< The reply layout, PendingRequests::MATCH_* flags. */
+	TxClass txClass = TX_AUTO;			/**< The priority class for retransmits. */
+	bool active = false;				/**< true while the request waits for a reply. */
+};
+
+/**
+* Correlates requests with their replies by port, channel,
+* command and identifier.
+* Requests are retransmitted when no reply arrives before their
+* deadline and complete with a timeout when the retries run out.
+* Replies are still handed to the port clients, the table only
+* observes them.
+*/
+struct PendingRequests : public ReplyObserver
+{
+	const static int32_t MAX_PENDING = 64;					/**< Most requests that can wait at once. */
+	const static uint32_t DEFAULT_TIMEOUT_MS = 100;			/**< Default time to wait for a reply. */
+	const static int32_t DEFAULT_RETRIES = 5;				/**< Default number of retransmits. */
+	const static int64_t RETRY_FULL_NS = 1000000;			/**< Delay before a retransmit the full transmit queue turned away is tried again. */
+
+	/**
+	* Reply layout flags.
+	* The reply starts with the same command and identifier bytes as the request.
+	*/
+	const static uint8_t MATCH_PORT_CHANNEL = 0;			/**< Any reply on the port and channel. */
+	const static uint8_t MATCH_COMMAND = 1;					/**< The first payload byte is the command. */
+	const static uint8_t MATCH_IDENT8 = 2;					/**< A one byte identifier follows the command. */
+	const static uint8_t MATCH_IDENT16 = 4;					/**< A two byte identifier follows the command. */
+
+	/**
+	* Request status
+	*/
+	const static int32_t REQUEST_DONE = 0;					/**< The reply arrived. */
+	const static int32_t REQUEST_TIMEOUT = 1;				/**< No reply arrived after every retry. */
+	const static int32_t REQUEST_CANCELLED = 2;				/**< The request was replaced or the link closed. */
+
+	PendingRequest requests[MAX_PENDING];					/**< The request table. */
+	std::mutex requestMutex;								/**< Guards the request table. */
+	std::atomic<int32_t> activeCount = 0;					/**< Requests waiting for a reply. */
+	std::atomic<int64_t> nextDeadlineNs = INT64_MAX;		/**< The earliest deadline in the table. */
+
+	std::atomic<uint64_t> added = 0;						/**< Requests added. */
+	std::atomic<uint64_t> completed = 0;					/**< Requests that received a reply. */
+	std::atomic<uint64_t> retransmits = 0;					/**< Requests sent again after a deadline. */
+	std::atomic<uint64_t> timeouts = 0;						/**< Requests that ran out of retries. */
+	std::atomic<uint64_t> cancelled = 0;					/**< Requests replaced or cancelled. */
+	std::atomic<uint64_t> overflows = 0;					/**< Requests sent untracked because the table was full. */
+	std::atomic<int64_t> lastRoundTripNs = 0;				/**< Time from queueing to reply for the last request. */
+	std::atomic<int64_t> maxRoundTripNs = 0;				/**< Longest time from queueing to reply. */
+	LinkMetrics* metrics = NULL;							/**< Records each round trip when not NULL. */
+	std::recursive_mutex* callbackMutex = NULL;			/**< Held while a callback runs on the port thread, may be NULL. */
+
+	/**
+	* Reads the command and identifier of a request or reply.
+	* @param The packet.
+	* @param The MATCH_* flags for the layout.
+	* @param The returned command.
+	* @param The returned identifier.
+	* @returns false if the packet is too short for the layout.
+	*/
+	static bool keyOf(Packet& pk, uint8_t match, uint8_t& command, uint16_t& ident)
+	{
+		bool result = true;
+		const uint8_t* data = pk.payload();
+		size_t size = pk.payloadSize();
+		size_t index = 0;
+		command = 0;
+		ident = 0;
+		if (match & MATCH_COMMAND)
+		{
+			if (size > index)
+			{
+				command = data[index];
+				index++;
+			}
+			else
+			{
+				result = false;
+			}
+		}
+		if (match & MATCH_IDENT16)
+		{
+			if (size >= index + 2)
+			{
+				ident = (uint16_t)(data[index] | (data[index + 1] << 8));
+			}
+			else
+			{
+				result = false;
+			}
+		}
+		else if (match & MATCH_IDENT8)
+		{
+			if (size > index)
+			{
+				ident = data[index];
+			}
+			else
+			{
+				result = false;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Recomputes the earliest deadline, called with the request mutex held.
+	*/
+	void _updateNextDeadline()
+	{
+		int64_t nextNs = INT64_MAX;
+		for (int32_t i = 0; i < MAX_PENDING; i++)
+		{
+			if (requests[i].active && requests[i].deadlineNs < nextNs)
+			{
+				nextNs = requests[i].deadlineNs;
+			}
+		}
+		nextDeadlineNs = nextNs;
+	}
+
+	/**
+	* Adds a request to the table.
+	* A request with the same key replaces the one waiting,
+	* which completes as cancelled.
+	* @param The request packet.
+	* @param The MATCH_* flags for the reply layout.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @param Called when the request completes, may be NULL.
+	* @param Passed to the callback.
+	* @param The priority class for retransmits.
+	* @returns false if the table is full and the request is not tracked.
+	*/
+	bool add(Packet& pk, uint8_t match, uint32_t timeoutMs, int32_t retries,
+		PendingCallback callback, void* context, TxClass txClass)
+	{
+		bool result = false;
+		PendingRequest replaced;
+		{
+			std::lock_guard<std::mutex> guard(requestMutex);
+			result = _insert(pk, match, timeoutMs, retries, callback, context, txClass, replaced);
+		}
+		if (replaced.callback != NULL)
+		{
+			replaced.callback(replaced.context, REQUEST_CANCELLED, replaced.pk);
+		}
+		return(result);
+	}
+
+	/**
+	* Adds a run of requests that share a reply layout and callback,
+	* taking the table lock once.
+	* @param The request packets.
+	* @param The MATCH_* flags for the reply layout.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @param Called when each request completes, may be NULL.
+	* @param Passed to the callback.
+	* @param The priority class for retransmits.
+	* @returns The number of requests that are tracked.
+	*/
+	int32_t add_batch(PacketSpan packets, uint8_t match, uint32_t timeoutMs, int32_t retries,
+		PendingCallback callback, void* context, TxClass txClass)
+	{
+		int32_t result = 0;
+		std::vector<PendingRequest> replaced;
+		{
+			std::lock_guard<std::mutex> guard(requestMutex);
+			PendingRequest _replaced;
+			for (size_t i = 0; i < packets.size(); i++)
+			{
+				_replaced.callback = NULL;
+				if (_insert(packets[i], match, timeoutMs, retries, callback, context, txClass, _replaced))
+				{
+					result++;
+				}
+				if (_replaced.callback != NULL)
+				{
+					replaced.push_back(_replaced);
+				}
+			}
+		}
+		for (size_t i = 0; i < replaced.size(); i++)
+		{
+			replaced[i].callback(replaced[i].context, REQUEST_CANCELLED, replaced[i].pk);
+		}
+		return(result);
+	}
+
+	/**
+	* Stores a request in a free slot, or in the slot of the request it replaces.
+	* Called with requestMutex held.
+	* @param The request packet.
+	* @param The MATCH_* flags for the reply layout.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @param Called when the request completes, may be NULL.
+	* @param Passed to the callback.
+	* @param The priority class for retransmits.
+	* @param Returns the replaced request, its callback is left NULL if none was replaced.
+	* @returns false if the table is full and the request is not tracked.
+	*/
+	bool _insert(Packet& pk, uint8_t match, uint32_t timeoutMs, int32_t retries,
+		PendingCallback callback, void* context, TxClass txClass, PendingRequest& replaced)
+	{
+		bool result = false;
+		uint8_t command = 0;
+		uint16_t ident = 0;
+		if (keyOf(pk, match, command, ident))
+		{
+			int32_t slot = -1;
+			for (int32_t i = 0; i < MAX_PENDING; i++)
+			{
+				PendingRequest& request = requests[i];
+				if (request.active)
+				{
+					if (request.port == pk.port() && request.channel == pk.channel() &&
+						request.match == match && request.command == command && request.ident == ident)
+					{
+						replaced = request;
+						cancelled++;
+						activeCount--;
+						slot = i;
+						break;
+					}
+				}
+				else if (slot < 0)
+				{
+					slot = i;
+				}
+			}
+			if (slot >= 0)
+			{
+				int64_t nowNs = steadyNowNs();
+				PendingRequest& request = requests[slot];
+				request.pk = pk;
+				request.callback = callback;
+				request.context = context;
+				request.sentNs = nowNs;
+				request.deadlineNs = nowNs + (int64_t)timeoutMs * 1000000;
+				request.timeoutMs = timeoutMs;
+				request.retries = retries;
+				request.ident = ident;
+				request.port = pk.port();
+				request.channel = pk.channel();
+				request.command = command;
+				request.match = match;
+				request.txClass = txClass;
+				request.active = true;
+				activeCount++;
+				added++;
+				if (request.deadlineNs < nextDeadlineNs)
+				{
+					nextDeadlineNs = request.deadlineNs;
+				}
+				result = true;
+			}
+			else
+			{
+				overflows++;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Completes the request a reply answers.
+	* Called on the port thread as the reply arrives,
+	* before it is queued for the port clients.
+	* @param The reply.
+	* @returns true if a request was completed.
+	*/
+	bool complete(Packet& pk)
+	{
+		bool result = false;
+		if (activeCount > 0)
+		{
+			PendingCallback callback = NULL;
+			void* context = NULL;
+			{
+				std::lock_guard<std::mutex> guard(requestMutex);
+				uint8_t port = pk.port();
+				uint8_t channel = pk.channel();
+				for (int32_t i = 0; i < MAX_PENDING; i++)
+				{
+					PendingRequest& request = requests[i];
+					if (request.active && request.port == port && request.channel == channel)
+					{
+						uint8_t command = 0;
+						uint16_t ident = 0;
+						if (keyOf(pk, request.match, command, ident) &&
+							command == request.command && ident == request.ident)
+						{
+							int64_t roundTripNs = steadyNowNs() - request.sentNs;
+							lastRoundTripNs = roundTripNs;
+							updateAtomicMax(maxRoundTripNs, roundTripNs);
+							if (metrics != NULL)
+							{
+								metrics->record_round_trip(port, channel, roundTripNs);
+							}
+							callback = request.callback;
+							context = request.context;
+							request.active = false;
+							activeCount--;
+							completed++;
+							result = true;
+							break;
+						}
+					}
+				}
+			}
+			_call(callback, context, REQUEST_DONE, pk);
+		}
+		return(result);
+	}
+
+	/**
+	* Calls the callback of a completed request with the callbackMutex held,
+	* so it does not run at the same time as the clients.
+	* @param The callback, may be NULL.
+	* @param Passed to the callback.
+	* @param The request status.
+	* @param The reply or the request.
+	*/
+	void _call(PendingCallback callback, void* context, int32_t status, Packet& pk)
+	{
+		if (callback != NULL)
+		{
+			if (callbackMutex != NULL)
+			{
+				std::lock_guard<std::recursive_mutex> guard(*callbackMutex);
+				callback(context, status, pk);
+			}
+			else
+			{
+				callback(context, status, pk);
+			}
+		}
+	}
+
+	/**
+	* Virtual ReplyObserver call for each handled packet.
+	* @param The received packet.
+	* @returns true if a request was completed.
+	*/
+	bool observe_reply(Packet& pk)
+	{
+		return(complete(pk));
+	}
+
+	/**
+	* Gives back the retries of retransmits the transmit queue turned away,
+	* the next service pass sends them again.
+	* A slot reused by a new request in the meantime is left alone.
+	* @param The retransmitted packets.
+	* @param The table index of each request.
+	* @param The number of requests to defer.
+	*/
+	void _defer(Packet* resend, int32_t* resendIndex, int32_t count)
+	{
+		std::lock_guard<std::mutex> guard(requestMutex);
+		int64_t retryNs = steadyNowNs() + RETRY_FULL_NS;
+		for (int32_t i = 0; i < count; i++)
+		{
+			PendingRequest& request = requests[resendIndex[i]];
+			if (request.active && request.pk.size() == resend[i].size() &&
+				std::memcmp(request.pk.raw(), resend[i].raw(), request.pk.size()) == 0)
+			{
+				request.retries++;
+				request.deadlineNs = retryNs;
+				retransmits--;
+			}
+		}
+		_updateNextDeadline();
+	}
+
+	/**
+	* Retransmits requests past their deadline and
+	* times out requests without retries left.
+	* Called from the port thread, which never waits on the transmit queue.
+	* @param The queue to retransmit on.
+	* @returns The number of requests retransmitted or timed out.
+	*/
+	int32_t service(TxQueue& txQueue)
+	{
+		int32_t result = 0;
+		if (activeCount > 0 && steadyNowNs() >= nextDeadlineNs)
+		{
+			Packet resend[MAX_PENDING];
+			TxClass resendClass[MAX_PENDING];
+			int32_t resendIndex[MAX_PENDING];
+			int32_t resendCount = 0;
+			Packet expired[MAX_PENDING];
+			PendingCallback expiredCallback[MAX_PENDING];
+			void* expiredContext[MAX_PENDING];
+			int32_t expiredCount = 0;
+			{
+				std::lock_guard<std::mutex> guard(requestMutex);
+				int64_t nowNs = steadyNowNs();
+				for (int32_t i = 0; i < MAX_PENDING; i++)
+				{
+					PendingRequest& request = requests[i];
+					if (request.active && nowNs >= request.deadlineNs)
+					{
+						if (request.retries > 0)
+						{
+							request.retries--;
+							request.deadlineNs = nowNs + (int64_t)request.timeoutMs * 1000000;
+							resend[resendCount] = request.pk;
+							resendClass[resendCount] = request.txClass;
+							resendIndex[resendCount] = i;
+							resendCount++;
+							retransmits++;
+						}
+						else
+						{
+							expired[expiredCount] = request.pk;
+							expiredCallback[expiredCount] = request.callback;
+							expiredContext[expiredCount] = request.context;
+							expiredCount++;
+							request.active = false;
+							activeCount--;
+							timeouts++;
+						}
+					}
+				}
+				_updateNextDeadline();
+			}
+			int32_t deferred = 0;
+			for (int32_t i = 0; i < resendCount; i++)
+			{
+				if (!txQueue.try_enqueue(resend[i], resendClass[i]) && txQueue.running)
+				{
+					if (deferred != i)
+					{
+						resend[deferred] = resend[i];
+						resendIndex[deferred] = resendIndex[i];
+					}
+					deferred++;
+				}
+			}
+			if (deferred > 0)
+			{
+				_defer(resend, resendIndex, deferred);
+			}
+			for (int32_t i = 0; i < expiredCount; i++)
+			{
+				_call(expiredCallback[i], expiredContext[i], REQUEST_TIMEOUT, expired[i]);
+			}
+			result = resendCount + expiredCount;
+		}
+		return(result);
+	}
+
+	/**
+	* Cancels every waiting request.
+	*/
+	void cancel_all()
+	{
+		Packet pending[MAX_PENDING];
+		PendingCallback pendingCallback[MAX_PENDING];
+		void* pendingContext[MAX_PENDING];
+		int32_t count = 0;
+		{
+			std::lock_guard<std::mutex> guard(requestMutex);
+			for (int32_t i = 0; i < MAX_PENDING; i++)
+			{
+				PendingRequest& request = requests[i];
+				if (request.active)
+				{
+					pending[count] = request.pk;
+					pendingCallback[count] = request.callback;
+					pendingContext[count] = request.context;
+					count++;
+					request.active = false;
+					cancelled++;
+				}
+			}
+			activeCount = 0;
+			nextDeadlineNs = INT64_MAX;
+		}
+		for (int32_t i = 0; i < count; i++)
+		{
+			_call(pendingCallback[i], pendingContext[i], REQUEST_CANCELLED, pending[i]);
+		}
+	}
+
+	/**
+	* The time until the earliest deadline.
+	* @param The longest time to return.
+	* @returns The time in milliseconds, at least 1.
+	*/
+	uint32_t waitMs(uint32_t maxMs)
+	{
+		uint32_t result = maxMs;
+		if (activeCount > 0)
+		{
+			int64_t untilNs = nextDeadlineNs - steadyNowNs();
+			if (untilNs < (int64_t)maxMs * 1000000)
+			{
+				result = (untilNs > 1000000) ? (uint32_t)(untilNs / 1000000) : 1;
+			}
+		}
+		return(result);
+	}
+};
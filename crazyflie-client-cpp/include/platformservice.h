@@ -64,7 +64,7 @@ public:
 
  
     std::string linkSource;                     /**< The name of the link source */
-    uint8_t protocolVersion = NO_PROTOCOL;      /**< The protocol version  */
+    std::atomic<uint8_t> protocolVersion = NO_PROTOCOL; /**< The protocol version, set by the port thread  */
 
     /**
     * Constructor
@@ -83,6 +83,16 @@ public:
         return(protocolVersion);
     }
 
+    /**
+    * Virtual PortClient call to forget the link source and protocol
+    * version, so they are requested again on a reopened link.
+    */
+    void reset()
+    {
+        linkSource.clear();
+        protocolVersion = NO_PROTOCOL;
+    }
+
     /**
     * Sends a version request to the current connection.
     * This is a virtual function used by the PortConnect.
@@ -101,7 +111,7 @@ public:
 
             packet.setPort(LINKCTRL);
             packet.setChannel(PlatformService::LINKSERVICE_SOURCE);
-            portConnect->send_packet(packet);
+            portConnect->send_request(packet, PendingRequests::MATCH_PORT_CHANNEL);
         }
     }
 
@@ -114,15 +124,16 @@ public:
     {
         if (portConnect)
         {
-            std::array<uint8_t, gMaxBufferSize> buffer;
+            PacketRef packet = portConnect->alloc_packet();
+            uint8_t* buffer = packet->raw();
             buffer[0] = 0xFF;
             uint8_t index = 1;
-            index += PackUtils::pack(buffer.data(), index, PLATFORM_REQUEST_ARMING);
-            index += PackUtils::pack(buffer.data(), index, doArm);
+            index += PackUtils::pack(buffer, index, PLATFORM_REQUEST_ARMING);
+            index += PackUtils::pack(buffer, index, doArm);
 
-            bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-            packet.setPort(PLATFORM);
-            packet.setChannel(PLATFORM_COMMAND);
+            packet->setSize(index);
+            packet->setPort(PLATFORM);
+            packet->setChannel(PLATFORM_COMMAND);
 
             portConnect->send_packet(packet);
         }
@@ -137,24 +148,25 @@ public:
     {
         if (portConnect)
         {
-            portConnect->send_packet(recoveryCommand(), PLATFORM_REQUEST_CRASH_RECOVERY);
+            portConnect->send_packet(recoveryCommand(portConnect));
         }
     }
 
     /**
-    * Constructs an recoveryCommand packet
-    * @param true, if arming
+    * Constructs an recoveryCommand packet in the transmit pool
+    * @param The connection the packet is sent on.
     * @returns The packet data in packet form
     */
-    static bitcraze::crazyflieLinkCpp::Packet& recoveryCommand() {
-        std::array<uint8_t, gMaxBufferSize> buffer;
+    static PacketRef recoveryCommand(PortConnect* connection) {
+        PacketRef packet = connection->alloc_packet();
+        uint8_t* buffer = packet->raw();
         buffer[0] = 0xFF;
         uint8_t index = 1;
-        index += PackUtils::pack(buffer.data(), index, PLATFORM_REQUEST_CRASH_RECOVERY);
+        index += PackUtils::pack(buffer, index, PLATFORM_REQUEST_CRASH_RECOVERY);
 
-        bitcraze::crazyflieLinkCpp::Packet packet(buffer.data(), index);
-        packet.setPort(PLATFORM);
-        packet.setChannel(PLATFORM_COMMAND);
+        packet->setSize(index);
+        packet->setPort(PLATFORM);
+        packet->setChannel(PLATFORM_COMMAND);
         return packet;
     }
 
@@ -195,7 +207,7 @@ public:
 
                             packet.setPort(PLATFORM);
                             packet.setChannel(VERSION_COMMAND);
-                            portConnect->send_packet(packet);
+                            portConnect->send_request(packet, PendingRequests::MATCH_COMMAND);
                         }
                         else
                         {
@@ -212,6 +224,7 @@ public:
                     if (pk.payload()[0] == VERSION_GET_PROTOCOL)
                     {
                         protocolVersion = pk.payload()[1];
+                        portConnect->notify_lifecycle();
                     }
                 }
             }
@@ -0,0 +1,210 @@
+/*
+* Header-only implementation of the port owner and client interfaces for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "Connection.h"
+#include "packetpool.h"
+#include <atomic>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+struct PortConnect; 
+
+/**
+* Provides a base class for ownership of a PortConnect.
+*/
+class PortOwner
+{
+public:
+
+	PortConnect* portConnect;				/**< The owned PortConnect. */
+	std::atomic<bool> connected = false;	/**< true if connected to the PortConnect. */
+
+	/**
+	* Constructor
+	*/
+	PortOwner()
+	{
+		portConnect = NULL;
+		connected = false;
+	}
+
+	/**
+	* Destructor
+	*/
+	virtual ~PortOwner() {}
+	
+	/**
+	* Called when the log has finished reseting
+	*/
+	virtual void logResetComplete()
+	{
+
+	}
+
+	/**
+	* Called when the param has finished reseting
+	*/
+	virtual void paramResetComplete()
+	{
+
+	}
+
+
+};
+
+/**
+* Provides a base class for client of a PortConnect.
+*/
+class PortClient
+{
+public:
+
+	PortConnect* portConnect;					/**< The PortConnect service. */
+	std::atomic<bool> connected = false;		/**< true if connected to the PortConnect. */
+	std::atomic<bool> resetComplete = false;	/**< true if the reset is complete. */
+
+	/**
+	* Constructor
+	*/
+	PortClient()
+	{
+		portConnect = NULL;
+		connected = false;
+		resetComplete = false;
+	}
+
+	/**
+	* Destructor
+	*/
+	virtual ~PortClient() {}
+
+	/**
+	* Called when a port packet arrives.
+	*/
+	virtual void _new_packet_cb(Packet& pk) {}
+
+	/**
+	* Called with a run of port packets in the order they arrived.
+	* Hands each packet to _new_packet_cb unless a client
+	* handles the whole run at once. A client may keep a copy
+	* of a PacketRef to hold on to a packet without copying it.
+	* @param The packets, shared with the other clients of the port.
+	* @param The number of packets.
+	*/
+	virtual void _new_packets_cb(PacketRef* packets, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			_new_packet_cb(*packets[i]);
+		}
+	}
+
+	/**
+	* Called when the conenction stops.
+	*/
+	virtual void stop() {}
+
+	/**
+	* Called to set a new connection.
+	*/
+	virtual void setConnection(PortConnect* _portConnect)
+	{
+		portConnect = _portConnect;
+		connected = true;
+	}
+
+	/**
+	* Called to request a version for the connection
+	*/
+	virtual void _request_version() {}
+
+	/**
+	* Called to fetch the requested version
+	*/
+	virtual uint8_t get_version() { return(0); }
+
+	/**
+	* Called to reset this client.
+	*/
+	virtual void reset() {};
+
+	/**
+	* Called to completely update this client.
+	*/
+	virtual void update_all() {};
+
+	/**
+	* Called after a reconnect to compare the TOC in memory
+	* with the TOC of the crazyflie.
+	*/
+	virtual void check_toc() {};
+
+	/**
+	* Called after a reconnect found the same TOC,
+	* to restore this client on the crazyflie without a reset.
+	*/
+	virtual void resume() {};
+
+	/**
+	* Called by PortConnect on each pass of its port thread, or of the
+	* SwarmLink pump when the connection is pumped, after the received
+	* packets are queued for the workers.
+	* Called with the dispatcher handlerMutex held, so it never runs
+	* alongside the handlers of the clients of the session.
+	* Polls for work that no packet announces, such as a TOC another
+	* drone is fetching, and sends requests a pumped client has queued.
+	*/
+	virtual void service() {};
+
+};
+
+/**
+* Provides a base class for pumping a PortConnect from
+* threads it does not own, such as a SwarmLink reactor.
+*/
+class PortPump
+{
+public:
+
+	/**
+	* Destructor
+	*/
+	virtual ~PortPump() {}
+
+	/**
+	* Called when a PortConnect opens a link, starts pumping it.
+	* @param The PortConnect to pump.
+	*/
+	virtual void attach(PortConnect* portConnect) = 0;
+
+	/**
+	* Called before a PortConnect closes its link.
+	* Stops pumping it, when this returns the PortConnect is not in use.
+	* @param The PortConnect to stop pumping.
+	*/
+	virtual void detach(PortConnect* portConnect) = 0;
+};
@@ -28,126 +28,104 @@
 #include "Connection.h"
 #include "packutils.h"
 #include "ctrp.h"
+#include "portclient.h"
+#include "crtplink.h"
+#include "capture.h"
+#include "udplink.h"
+#include "portdispatch.h"
+#include "txqueue.h"
+#include "pendingrequests.h"
+#include "linkmetrics.h"
 #include <thread>
 #include <atomic>
 #include <vector>
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <exception>
 
 using namespace bitcraze::crazyflieLinkCpp;
 
-struct PortConnect; 
-
 /**
-* Provides a base class for ownership of a PortConnect.
+* steady_clock times in nanoseconds of each stage of a session bring-up,
+* zero until the stage is reached.
+* Stages are stamped by the threads that reach them.
 */
-class PortOwner
+struct BringUpTimeline
 {
-public:
-
-	PortConnect* portConnect;				/**< The owned PortConnect. */
-	std::atomic<bool> connected = false;	/**< true if connected to the PortConnect. */
+	std::atomic<int64_t> openNs = 0;			/**< The link was opened. */
+	std::atomic<int64_t> versionNs = 0;			/**< The protocol version arrived and the clients were started. */
+	std::atomic<int64_t> logTocNs = 0;			/**< The log TOC is complete. */
+	std::atomic<int64_t> paramTocNs = 0;		/**< The param TOC and extended types are complete. */
+	std::atomic<int64_t> paramValuesNs = 0;		/**< Every param value has been read, the session is ready. */
 
 	/**
-	* Constructor
+	* Clears the stages for a new session.
+	* @param The time the link was opened.
 	*/
-	PortOwner()
+	void clear(int64_t nowNs)
 	{
-		portConnect = NULL;
-		connected = false;
+		versionNs = 0;
+		logTocNs = 0;
+		paramTocNs = 0;
+		paramValuesNs = 0;
+		openNs = nowNs;
 	}
 
 	/**
-	* Destructor
-	*/
-	~PortOwner() {}
-	
-	/**
-	* Called when the log has finished reseting
+	* @param The stage time.
+	* @returns Milliseconds from opening the link to the stage, or -1 if not reached.
 	*/
-	virtual void logResetComplete()
+	double since_open_ms(int64_t stageNs)
 	{
-
+		return(stageNs != 0 ? (double)(stageNs - openNs) * 1.0e-6 : -1.0);
 	}
-
-	/**
-	* Called when the param has finished reseting
-	*/
-	virtual void paramResetComplete()
-	{
-
-	}
-
-
 };
 
 /**
-* Provides a base class for client of a PortConnect.
+* Counts and times of the automatic reconnects of a PortConnect.
 */
-class PortClient
+struct ReconnectMetrics
 {
-public:
-
-	PortConnect* portConnect;					/**< The PortConnect service. */
-	std::atomic<bool> connected = false;		/**< true if connected to the PortConnect. */
-	std::atomic<bool> resetComplete = false;	/**< true if the reset is complete. */
+	std::atomic<uint32_t> timeouts = 0;			/**< Packet timeouts that started a reconnect. */
+	std::atomic<uint32_t> attempts = 0;			/**< Times the link was reopened. */
+	std::atomic<uint32_t> resumed = 0;			/**< Reconnects that kept the TOCs, log blocks and params. */
+	std::atomic<uint32_t> resets = 0;			/**< Reconnects that found a changed TOC and reset the clients. */
+	std::atomic<uint32_t> failures = 0;			/**< Reconnects that gave up. */
+	std::atomic<int64_t> lastRecoverNs = 0;		/**< Time from the timeout to the restored session, last reconnect. */
+	std::atomic<int64_t> maxRecoverNs = 0;		/**< Longest time to recover. */
+	std::atomic<int64_t> totalRecoverNs = 0;	/**< Total time to recover. */
 
 	/**
-	* Constructor
+	* Records the time to recover of a reconnect.
+	* @param The time from the timeout to the restored session.
 	*/
-	PortClient()
+	void recovered(int64_t recoverNs)
 	{
-		portConnect = NULL;
-		connected = false;
-		resetComplete = false;
+		lastRecoverNs = recoverNs;
+		totalRecoverNs += recoverNs;
+		updateAtomicMax(maxRecoverNs, recoverNs);
 	}
 
 	/**
-	* Destructor
-	*/
-	~PortClient() {}
-
-	/**
-	* Called when a port packet arrives.
-	*/
-	virtual void _new_packet_cb(Packet& pk) {}
-
-	/**
-	* Called when the conenction stops.
+	* The average time to recover.
+	* @returns The average in milliseconds.
 	*/
-	virtual void stop() {}
-
-	/**
-	* Called to set a new connection.
-	*/
-	virtual void setConnection(PortConnect* _portConnect)
+	double averageRecoverMs()
 	{
-		portConnect = _portConnect;
-		connected = true;
+		uint32_t count = resumed + resets;
+		return(count > 0 ? (double)totalRecoverNs * 1.0e-6 / (double)count : 0.0);
 	}
-
-	/**
-	* Called to request a version for the connection
-	*/
-	virtual void _request_version() {}
-
-	/**
-	* Called to fetch the requested version
-	*/
-	virtual uint8_t get_version() { return(0); }
-
-	/**
-	* Called to reset this client.
-	*/
-	virtual void reset() {};
-
-	/**
-	* Called to completely update this client.
-	*/
-	virtual void update_all() {};
-
 };
 
+/**
+* Called when the lifecycle of a PortConnect changes, the protocol
+* version arrives or the log TOC completes.
+* Called with the lifecycleMutex held, it must not block.
+* @param The context given with the callback.
+*/
+typedef void (*LifecycleCallback)(void* context);
+
 /**
 * Provides a connection to crazyflie ports for
 * PortClients.
@@ -155,20 +133,80 @@ public:
 struct PortConnect
 {
 	const static int32_t packetTimoutSec = 3;					/**< number of seconds with no packets for timeout. */
-	bitcraze::crazyflieLinkCpp::Connection* cfConnection;		/**< The connection to the crazyflie. */
+	const static uint32_t receiveWaitMs = 10;					/**< Longest wait for a packet before the port thread checks its state. */
+	const static uint32_t RX_BATCH_SIZE = 32;					/**< Most packets received in one wakeup of the port thread. */
+	const static uint32_t reconnectMinMs = 100;					/**< First wait between reconnect attempts. */
+	const static uint32_t reconnectMaxMs = 5000;				/**< Longest wait between reconnect attempts. */
+	const static uint32_t reconnectStageMs = 1000;				/**< Longest wait for the version or the TOC check of an attempt. */
+
+	const static uint8_t RECONNECT_IDLE = 0;		/**< Not reconnecting. */
+	const static uint8_t RECONNECT_PROBE = 1;		/**< Asking for the version on the quiet link before reopening it. */
+	const static uint8_t RECONNECT_WAIT = 2;		/**< Waiting before the next attempt. */
+	const static uint8_t RECONNECT_VERSION = 3;		/**< The link was reopened, waiting for the protocol version. */
+	const static uint8_t RECONNECT_CHECK = 4;		/**< Comparing the log and param TOCs with the crazyflie. */
+	const static uint8_t RECONNECT_FAILED = 5;		/**< Gave up after reconnectAttempts. */
+
+	const static uint8_t LINK_CLOSED = 0;			/**< No session is open. */
+	const static uint8_t LINK_OPENING = 1;			/**< The link is open, waiting for the protocol version. */
+	const static uint8_t LINK_CONNECTED = 2;		/**< The clients are fetching their TOCs and values. */
+	const static uint8_t LINK_READY = 3;			/**< Every param value was read. */
+	const static uint8_t LINK_CLOSING = 4;			/**< disconnect() is shutting the session down. */
+
+	CrtpLink* cfConnection;										/**< The link to the crazyflie, NULL while a reconnect fails to open it. */
+	std::string linkUri;										/**< The uri of the session, used to reopen the link. */
+	LinkFactory linkFactory;									/**< Creates the link for a uri, a UdpLink or RadioLink by scheme when NULL. */
+	void* linkContext;											/**< Passed to the linkFactory. */
+	PacketCapture* capture;										/**< Records every packet of the session when open. */
 	std::string defaultDirectory;								/**< The defualt directory for caching TOCs */
 	std::thread portThread;										/**< Thread for async handling of packets */
-	std::atomic<double> packetsPerSecond = 0;					/**< Metric found for packets per second. */
 	std::atomic<bool> running = false;							/**< true while thread is running. */
 	std::atomic<bool> _isConnected = false;						/**< true while connected. */
 	std::atomic<bool> timedOut = false;							/**< Set true during packet timeout */
-	
-	std::mutex sendMutex;					/**< Mutex for protecting sending a packet from multiple threads. */
+
+	TxQueue txQueue;						/**< Prioritized queue of packets sent from a single transmit thread. */
 
 	PortOwner* owner;						/**< The owner of the PortConnect. */
 	PortClient* log;						/**< TThe client which handles LOG port packets. */
 	PortClient* platform;					/**< TThe client which handles PLATFORM and LINKCTRL port packets. */
 	PortClient* param;						/**< TThe client which handles PARAM port packets. */
+	PacketPool rxPool;						/**< The received packets, shared by the port thread, the workers and the clients. */
+	PortDispatcher dispatcher;				/**< Routes packets by port and channel to a worker thread for each client. */
+	PendingRequests pendingRequests;		/**< Requests waiting for their replies. */
+	LinkMetrics linkMetrics;				/**< Link quality and latency, readable from any thread. */
+	ThreadConfig threadConfig;				/**< Placement and scheduling of the threads, set before connecting. */
+	ThreadMetrics threadMetrics;			/**< How late the threads wake from their timed waits. */
+	PortPump* pump;							/**< Pumps the link from outside when set, no threads are started. */
+	BringUpTimeline timeline;				/**< When each stage of the current session was reached. */
+	bool overlapTocFetch = false;			/**< Fetch the param TOC alongside the log TOC instead of after it. */
+	bool autoReconnect = false;				/**< Reopen the link after a packet timeout and resume the session. */
+	int32_t reconnectAttempts = 0;			/**< Most attempts of a reconnect, 0 to keep trying. */
+	ReconnectMetrics reconnectMetrics;		/**< Counts and times of the reconnects. */
+	std::atomic<uint8_t> reconnectState = RECONNECT_IDLE;	/**< The RECONNECT_* state. */
+	std::atomic<int32_t> tocChecksPending = 0;				/**< Clients still checking their TOC. */
+	std::atomic<bool> tocChanged = false;					/**< A client found a changed TOC. */
+	std::mutex reopenMutex;					/**< Held while the link is reopened or closed. */
+	std::atomic<uint8_t> lifecycle = LINK_CLOSED;	/**< The LINK_* state of the session. */
+	std::mutex lifecycleMutex;						/**< The mutex for the lifecycleCondition. */
+	std::condition_variable lifecycleCondition;		/**< Signalled when the lifecycle changes or the version arrives. */
+	LifecycleCallback lifecycleCallback = NULL;		/**< Called with the lifecycleCondition, guarded by the lifecycleMutex. */
+	void* lifecycleContext = NULL;					/**< Passed to the lifecycleCallback. */
+
+	bool needsParamReset = true;				/**< The param reset waits for the log reset. */
+	bool needsParamUpdate = true;				/**< The param update waits for the param reset. */
+	std::atomic<bool> advancing = false;		/**< A thread is advancing the bring-up stages. */
+	std::atomic<bool> stagesPending = false;	/**< A stage may be ready to advance. */
+	int32_t packetCount = 0;					/**< Packets received since the last rate measurement. */
+	PacketRef rxBatch[RX_BATCH_SIZE];			/**< Slots of the rxPool for the packets of one wakeup, used only by the port thread or the pump. */
+	Packet* rxSlots[RX_BATCH_SIZE];				/**< The packets of the rxBatch slots, filled by the link. */
+	std::atomic<uint64_t> rxBatches = 0;		/**< Wakeups that received packets. */
+	std::atomic<uint32_t> maxRxBatch = 0;		/**< Most packets received in one wakeup. */
+	int32_t noPacketCount = 0;					/**< Seconds in a row with almost no packets. */
+	bool sendTimedOut = true;					/**< Report the next packet timeout. */
+	int64_t rateStartNs = 0;					/**< Start of the current rate measurement. */
+	int64_t reconnectStartNs = 0;				/**< Time the packet timeout started the reconnect. */
+	int64_t reconnectNextNs = 0;				/**< Time of the next reconnect attempt or stage deadline. */
+	uint32_t reconnectWaitMs = 0;				/**< The current wait between attempts. */
+	int32_t reconnectTries = 0;					/**< Attempts of the current reconnect. */
 
 	/**
 	* Constructor
@@ -176,10 +214,22 @@ struct PortConnect
 	PortConnect()
 	{
 		cfConnection = NULL;
+		linkFactory = NULL;
+		linkContext = NULL;
+		capture = NULL;
+		owner = NULL;
 		log = NULL;
 		platform = NULL;
-		packetsPerSecond = 0;
+		param = NULL;
+		pump = NULL;
 		timedOut = false;
+		dispatcher.observer = &pendingRequests;
+		pendingRequests.metrics = &linkMetrics;
+		pendingRequests.callbackMutex = &dispatcher.handlerMutex;
+		txQueue.metrics = &linkMetrics;
+		txQueue.threadSettings = &threadConfig.transmit;
+		txQueue.wakeJitter = &threadMetrics.transmitWake;
+		dispatcher.threadSettings = &threadConfig.worker;
 	}
 
 	/**
@@ -195,7 +245,10 @@ struct PortConnect
 	*/
 	void logResetComplete()
 	{
+		timeline.logTocNs = steadyNowNs();
 		owner->logResetComplete();
+		notify_lifecycle();
+		_advance_stages();
 	}
 
 	/**
@@ -204,6 +257,86 @@ struct PortConnect
 	void paramResetComplete()
 	{
 		owner->paramResetComplete();
+		timeline.paramValuesNs = steadyNowNs();
+		_set_lifecycle(LINK_READY);
+	}
+
+	/**
+	* Sets the lifecycle state and wakes every waiting thread.
+	* @param The LINK_* state.
+	*/
+	void _set_lifecycle(uint8_t state)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lifecycleMutex);
+			lifecycle = state;
+			_call_lifecycle();
+		}
+		lifecycleCondition.notify_all();
+	}
+
+	/**
+	* Wakes the threads waiting on the lifecycle,
+	* called by the platform when the protocol version arrives.
+	*/
+	void notify_lifecycle()
+	{
+		{
+			// taking the lock orders the version with a waiter about to check it.
+			std::lock_guard<std::mutex> guard(lifecycleMutex);
+			_call_lifecycle();
+		}
+		lifecycleCondition.notify_all();
+	}
+
+	/**
+	* Sets the callback for lifecycle changes, replacing any earlier one.
+	* Once it returns the earlier callback is no longer running.
+	* @param The callback, NULL to remove it.
+	* @param Passed to the callback.
+	*/
+	void set_lifecycle_callback(LifecycleCallback callback, void* context)
+	{
+		std::lock_guard<std::mutex> guard(lifecycleMutex);
+		lifecycleCallback = callback;
+		lifecycleContext = context;
+	}
+
+	/**
+	* Calls the lifecycleCallback, with the lifecycleMutex held.
+	*/
+	void _call_lifecycle()
+	{
+		if (lifecycleCallback != NULL)
+		{
+			lifecycleCallback(lifecycleContext);
+		}
+	}
+
+	/**
+	* Waits for the protocol version of a session opened with open().
+	* @param The longest wait in milliseconds.
+	* @returns true if the version arrived.
+	*/
+	bool wait_version(uint32_t timeoutMs)
+	{
+		std::unique_lock<std::mutex> lock(lifecycleMutex);
+		return(lifecycleCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {
+			return(version_ready() || lifecycle == LINK_CLOSING || lifecycle == LINK_CLOSED);
+			}) && version_ready());
+	}
+
+	/**
+	* Waits until every param value of the session was read.
+	* @param The longest wait in milliseconds.
+	* @returns true if the session is ready.
+	*/
+	bool wait_ready(uint32_t timeoutMs)
+	{
+		std::unique_lock<std::mutex> lock(lifecycleMutex);
+		return(lifecycleCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {
+			return(lifecycle == LINK_READY || lifecycle == LINK_CLOSING || lifecycle == LINK_CLOSED);
+			}) && lifecycle == LINK_READY);
 	}
 
 	/**
@@ -211,89 +344,264 @@ struct PortConnect
 	*/
 	void disconnect()
 	{
-		if (cfConnection != NULL)
+		if (lifecycle != LINK_CLOSED)
+		{
+			_set_lifecycle(LINK_CLOSING);
+		}
+		if (pump != NULL && running)
 		{
-			if (_isConnected)
+			pump->detach(this);
+		}
+		pendingRequests.cancel_all();
+		if (_isConnected)
+		{
+			std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+			if (log != NULL)
 			{
-				if (log != NULL)
-				{
-					log->stop();
-				}
-				if (param != NULL)
-				{
-					param->stop();
-				}
-				
+				log->stop();
+			}
+			if (param != NULL)
+			{
+				param->stop();
 			}
 		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		txQueue.flush(50);
+		txQueue.stop();
 
-		if (cfConnection != NULL)
 		{
-			cfConnection->close();
+			std::lock_guard<std::mutex> guard(reopenMutex);
+			if (cfConnection != NULL)
+			{
+				cfConnection->close();
+			}
 			_isConnected = false;
 		}
 		if (running)
 		{
 			running = false;
-			portThread.join();
+			if (portThread.joinable())
+			{
+				portThread.join();
+			}
 		}
+		dispatcher.clear();
+		pendingRequests.cancel_all();
 		if (cfConnection != NULL)
 		{
 			delete cfConnection;
 			cfConnection = NULL;
 		}
+		if (lifecycle != LINK_CLOSED)
+		{
+			_set_lifecycle(LINK_CLOSED);
+		}
 	}
 
 	/**
 	* Connect a new session.
+	* Waits up to 100 ms for the protocol version.
 	*/
 	bool connect(std::string uri, PortOwner* _owner, PortClient*_platform, PortClient*_log, PortClient *_param)
 	{
-		const static double minBandwidth = 0.001;
+		bool result = false;
+		if (open(uri, _owner, _platform, _log, _param))
+		{
+			if (wait_version(100))
+			{
+				result = complete_connect();
+			}
+		}
+		return(result);
+	}
 
+	/**
+	* Opens the link for a new session and requests the protocol version.
+	* Returns without waiting, complete_connect() finishes the
+	* session once version_ready() is true.
+	* With a pump set, no threads are started and the pump
+	* calls pump_once() for this session.
+	* @returns true if the link was opened.
+	*/
+	bool open(std::string uri, PortOwner* _owner, PortClient* _platform, PortClient* _log, PortClient* _param)
+	{
 		bool result = false;
 
-		{
-			platform = _platform;
-			log = _log;
-			param = _param;
-			owner = _owner;
+		platform = _platform;
+		log = _log;
+		param = _param;
+		owner = _owner;
+
+		platform->setConnection(this);
 
-			platform->setConnection(this);
+		if (uri.size() > 0)
+		{
+			dispatcher.clear();
+			add_client(platform, LINKCTRL);
+			add_client(platform, PLATFORM);
+			add_client(log, LOGGING);
+			add_client(param, PARAM);
+			_reset_port_state();
+			linkMetrics.clear(rateStartNs);
+			_set_lifecycle(LINK_OPENING);
 
-			if (uri.size() > 0)
+			linkUri = uri;
+			cfConnection = _create_link(uri);
+			if (cfConnection != NULL)
 			{
-				cfConnection = new bitcraze::crazyflieLinkCpp::Connection(uri);
-				std::this_thread::sleep_for(std::chrono::microseconds(1000));
 				running = true;
-				portThread = std::thread(portThreadFunc, this);
+				if (pump != NULL)
 				{
-					int32_t iter = 100;
-					{
-						running = true;
+					txQueue.start(cfConnection, false);
+					pump->attach(this);
+				}
+				else
+				{
+					dispatcher.start();
+					txQueue.start(cfConnection);
+					portThread = std::thread(portThreadFunc, this);
+				}
 
-						platform->_request_version();
-						while (platform->get_version() == NO_PROTOCOL && iter)
-						{
-							std::this_thread::sleep_for(std::chrono::milliseconds(1));
-							iter--;
-						}
-					}
-					if (iter > 0)
-					{
-						_isConnected = true;
-						log->setConnection(this);
-						log->reset();
-						param->setConnection(this);
-						result = true;
-					}
+				{
+					std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+					platform->_request_version();
 				}
+				result = true;
+			}
+			else
+			{
+				_set_lifecycle(LINK_CLOSED);
 			}
 		}
 		return(result);
 	}
 
+	/**
+	* Checks if the protocol version has arrived.
+	* @returns true if the platform knows the protocol version.
+	*/
+	bool version_ready()
+	{
+		return(platform != NULL && platform->get_version() != NO_PROTOCOL);
+	}
+
+	/**
+	* Copies the link metrics and the current queue depths without a lock,
+	* may be called from any thread.
+	* @param The sample to fill.
+	*/
+	void sample_link_metrics(LinkSample& sample)
+	{
+		linkMetrics.sample(sample);
+		sample.txQueueDepth = 0;
+		sample.txMaxQueueDepth = 0;
+		for (int32_t i = 0; i < TX_CLASS_COUNT; i++)
+		{
+			uint32_t maxDepth = txQueue.stats[i].maxQueueDepth;
+			sample.txQueueDepth += txQueue.stats[i].queueDepth;
+			if (maxDepth > sample.txMaxQueueDepth)
+			{
+				sample.txMaxQueueDepth = maxDepth;
+			}
+		}
+		sample.pendingRequests = (uint32_t)pendingRequests.activeCount;
+	}
+
+	/**
+	* Finishes connecting a session opened with open().
+	* Starts the log and param clients.
+	* @returns true if connected.
+	*/
+	bool complete_connect()
+	{
+		bool result = false;
+		if (cfConnection != NULL && version_ready())
+		{
+			std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+			timeline.versionNs = steadyNowNs();
+			log->setConnection(this);
+			param->setConnection(this);
+			_isConnected = true;
+			_set_lifecycle(LINK_CONNECTED);
+			log->reset();
+			_advance_stages();
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Registers a client for the packets of a port and channel.
+	* Any number of clients may share a port and channel.
+	* Routes are cleared when the session disconnects.
+	* @param The client to handle the packets.
+	* @param The port to route.
+	* @param The channel to route, or CHANNEL_ALL for every channel of the port.
+	* @returns true if the client was registered.
+	*/
+	bool add_client(PortClient* client, uint8_t port, uint8_t channel = CHANNEL_ALL)
+	{
+		bool result = dispatcher.add_client(client, port, channel);
+		int32_t budget = txQueue.find_budget(client);
+		if (result && budget != TxQueue::NO_BUDGET)
+		{
+			txQueue.assign_budget(port, budget);
+		}
+		return(result);
+	}
+
+	/**
+	* Limits the packets sent on the ports of a client with one shared budget.
+	* Packets over the budget are deferred, never dropped.
+	* The budget stays set for later sessions.
+	* @param The client.
+	* @param Packets per second, 0 for unlimited.
+	* @param Most packets sent at once after an idle time.
+	* @returns false if every budget is in use.
+	*/
+	bool set_client_budget(PortClient* client, double ratePerSecond, double burst)
+	{
+		int32_t budget = txQueue.set_budget(client, ratePerSecond, burst);
+		if (budget != TxQueue::NO_BUDGET)
+		{
+			for (uint8_t port = 0; port < PORT_COUNT; port++)
+			{
+				if (dispatcher.routes_client(client, port))
+				{
+					txQueue.assign_budget(port, budget);
+				}
+			}
+		}
+		return(budget != TxQueue::NO_BUDGET);
+	}
+
+	/**
+	* Limits the packets sent on a port, ports set with the same owner
+	* share one budget. Used for the setpoint streams.
+	* @param The client or stream that owns the budget.
+	* @param The port to limit.
+	* @param Packets per second, 0 for unlimited.
+	* @param Most packets sent at once after an idle time.
+	* @returns false if every budget is in use.
+	*/
+	bool set_port_budget(void* owner, uint8_t port, double ratePerSecond, double burst)
+	{
+		int32_t budget = txQueue.set_budget(owner, ratePerSecond, burst);
+		if (budget != TxQueue::NO_BUDGET)
+		{
+			txQueue.assign_budget(port, budget);
+		}
+		return(budget != TxQueue::NO_BUDGET);
+	}
+
+	/**
+	* Stops routing packets to a client.
+	* @param The client to remove.
+	*/
+	void remove_client(PortClient* client)
+	{
+		dispatcher.remove_client(client);
+	}
+
 	/**
 	* Scan for active crazyflie uris
 	*/
@@ -304,16 +612,20 @@ struct PortConnect
 	}
 
 	/**
-	* Send a packet to the crazyflie
+	* Queue a packet to send to the crazyflie.
+	* May be called from any thread, the packet is sent from the
+	* transmit thread in order of its priority class.
+	* Replies are not tracked, use send_request for a request that expects one.
+	* @param The packet to send.
+	* @param The priority class, or TX_AUTO to classify by port and channel.
 	*/
-	void send_packet(bitcraze::crazyflieLinkCpp::Packet& packet, uint8_t expectedReply = 0)
+	void send_packet(bitcraze::crazyflieLinkCpp::Packet& packet, TxClass txClass = TX_AUTO)
 	{
 		if (cfConnection != NULL)
 		{
 			if (packet.size() > 0)
 			{
-				std::lock_guard<std::mutex> guard(sendMutex);  // can be called from multiple threads
-				cfConnection->send(packet);
+				txQueue.enqueue(packet, txClass);
 			}
 			else
 			{
@@ -323,112 +635,642 @@ struct PortConnect
 	}
 
 	/**
-	* Check for packets from cfConnection,
-	* send to the proper port client.
-	* Measure packets per second and set timeout if needed.
+	* Takes an empty packet from the transmit pool,
+	* a sender builds the packet in place and queues it with send_packet.
+	* @returns The handle of the packet.
 	*/
-	static void portThreadFunc(void* data)
+	PacketRef alloc_packet()
 	{
-		bool needsParamReset = true;
-		bool needsParamUpdate = true;
-		PortConnect* portConnect = (PortConnect*)data;
-		if (portConnect->cfConnection != NULL)
+		return(txQueue.pool.alloc());
+	}
+
+	/**
+	* Queue a packet built in a slot of the transmit pool,
+	* the packet is sent without being copied.
+	* May be called from any thread.
+	* @param The packet to send.
+	* @param The priority class, or TX_AUTO to classify by port and channel.
+	*/
+	void send_packet(const PacketRef& packet, TxClass txClass = TX_AUTO)
+	{
+		if (cfConnection != NULL && packet && packet->size() > 0)
 		{
-			int32_t packetCount = 0;
-			int32_t noPacketCount = 0;
-			double elapsedTime = 0;
-			bool sendTimedOut = true;
+			txQueue.enqueue(packet, txClass);
+		}
+	}
 
-			auto lastTime = std::chrono::steady_clock::now();
-			std::chrono::duration<double> diff = lastTime - lastTime;
-		
+	/**
+	* Queue a sequence of packets to send in order, such as the
+	* blocks of an upload. May be called from any thread,
+	* the transmit thread is woken once for the whole sequence.
+	* @param The packets to send.
+	* @param The priority class, or TX_AUTO to classify by port and channel.
+	* @returns The number of packets queued.
+	*/
+	int32_t send_packets(PacketSpan packets, TxClass txClass = TX_AUTO)
+	{
+		int32_t result = 0;
+		if (cfConnection != NULL && packets.size() > 0)
+		{
+			result = txQueue.enqueue_batch(packets, txClass);
+		}
+		return(result);
+	}
 
-			while (portConnect->running)
+	/**
+	* Queue a request and track its reply.
+	* The request is sent again if no reply arrives within the timeout,
+	* and the callback is called on the port thread as the reply arrives,
+	* before the port clients handle it, or when the retries run out.
+	* @param The request to send.
+	* @param The reply layout, PendingRequests::MATCH_* flags.
+	* @param Called when the request completes, may be NULL.
+	* @param Passed to the callback.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @param The priority class, or TX_AUTO to classify by port and channel.
+	* @returns true if the request was queued and is tracked.
+	*/
+	bool send_request(bitcraze::crazyflieLinkCpp::Packet& packet, uint8_t match,
+		PendingCallback callback = NULL, void* context = NULL,
+		uint32_t timeoutMs = PendingRequests::DEFAULT_TIMEOUT_MS,
+		int32_t retries = PendingRequests::DEFAULT_RETRIES,
+		TxClass txClass = TX_AUTO)
+	{
+		bool result = false;
+		if (cfConnection != NULL && packet.size() > 0)
+		{
+			if (txClass >= TX_CLASS_COUNT)
 			{
-				Packet pk;
-				pk = portConnect->cfConnection->receive(1);
-				if (pk.size() > 0)
-				{
-					uint8_t port = pk.port();
-					uint8_t channel = pk.channel();
+				txClass = TxQueue::classify(packet);
+			}
+			result = pendingRequests.add(packet, match, timeoutMs, retries, callback, context, txClass);
+			txQueue.enqueue(packet, txClass);
+		}
+		return(result);
+	}
+
+	/**
+	* Queue a sequence of requests in order and track their replies,
+	* such as the reads of several params.
+	* Each request must have its own reply key and be safe to send twice.
+	* Every request shares the reply layout, callback and retries,
+	* the request table is locked once and the transmit thread
+	* is woken once for the whole sequence.
+	* @param The requests to send, each must have a payload.
+	* @param The reply layout, PendingRequests::MATCH_* flags.
+	* @param Called as each request completes, may be NULL.
+	* @param Passed to the callback.
+	* @param The time to wait for each reply in milliseconds.
+	* @param The number of retransmits.
+	* @param The priority class, or TX_AUTO to classify by port and channel.
+	* @returns true if every request was queued and is tracked.
+	*/
+	bool send_requests(PacketSpan packets, uint8_t match,
+		PendingCallback callback = NULL, void* context = NULL,
+		uint32_t timeoutMs = PendingRequests::DEFAULT_TIMEOUT_MS,
+		int32_t retries = PendingRequests::DEFAULT_RETRIES,
+		TxClass txClass = TX_AUTO)
+	{
+		bool result = false;
+		if (cfConnection != NULL && packets.size() > 0)
+		{
+			if (txClass >= TX_CLASS_COUNT)
+			{
+				txClass = TxQueue::classify(packets[0]);
+			}
+			int32_t tracked = pendingRequests.add_batch(packets, match, timeoutMs, retries, callback, context, txClass);
+			int32_t queued = txQueue.enqueue_batch(packets, txClass);
+			result = (tracked == (int32_t)packets.size() && queued == tracked);
+		}
+		return(result);
+	}
 
-					if (port == LOGGING)
+	/**
+	* Attach a latest-wins mailbox to the transmit queue.
+	* @param The mailbox to attach.
+	* @returns true if the mailbox is attached.
+	*/
+	bool attach_mailbox(TxMailbox* mailbox)
+	{
+		return(txQueue.attach_mailbox(mailbox));
+	}
+
+	/**
+	* Detach a mailbox from the transmit queue.
+	* @param The mailbox to detach.
+	*/
+	void detach_mailbox(TxMailbox* mailbox)
+	{
+		txQueue.detach_mailbox(mailbox);
+	}
+
+	/**
+	* Post a packet to a slot of an attached mailbox.
+	* Replaces any packet of the slot that has not been sent,
+	* only the newest packet is sent at setpoint priority.
+	* @param The attached mailbox.
+	* @param The slot in the mailbox.
+	* @param The packet to send.
+	* @returns true if the packet was posted.
+	*/
+	bool post_packet(TxMailbox& mailbox, int32_t slot, bitcraze::crazyflieLinkCpp::Packet& packet)
+	{
+		bool result = false;
+		if (cfConnection != NULL && packet.size() > 0)
+		{
+			result = txQueue.post(mailbox, slot, packet);
+		}
+		return(result);
+	}
+
+	/**
+	* Creates the link for a session, recorded when the capture is open.
+	* @param The uri to open.
+	* @returns The new link, or NULL if it could not be opened.
+	*/
+	CrtpLink* _create_link(const std::string& uri)
+	{
+		CrtpLink* link = NULL;
+		if (linkFactory != NULL)
+		{
+			link = linkFactory(linkContext, uri);
+		}
+		else if (uri.compare(0, 6, "udp://") == 0)
+		{
+			link = createUdpLink(NULL, uri);
+		}
+		else
+		{
+			link = createRadioLink(NULL, uri);
+		}
+		if (link != NULL && capture != NULL && capture->isOpen())
+		{
+			link = new CaptureLink(link, capture);
+		}
+		return(link);
+	}
+
+	/**
+	* Clears the port state for a new session.
+	*/
+	void _reset_port_state()
+	{
+		needsParamReset = true;
+		needsParamUpdate = true;
+		packetCount = 0;
+		noPacketCount = 0;
+		sendTimedOut = true;
+		rateStartNs = steadyNowNs();
+		timedOut = false;
+		reconnectState = RECONNECT_IDLE;
+		timeline.clear(rateStartNs);
+	}
+
+	/**
+	* Routes the packets of one wakeup to their clients,
+	* each client worker is woken once for the batch.
+	* The clients share the pooled packets, they are not copied.
+	* @param The received packets.
+	* @param The number of packets.
+	*/
+	void _handle_packets(PacketRef* packets, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			linkMetrics.count_rx(*packets[i]);
+		}
+		dispatcher.dispatch_batch(packets, count);
+		packetCount += (int32_t)count;
+		rxBatches++;
+		updateAtomicMax(maxRxBatch, (uint32_t)count);
+	}
+
+	/**
+	* Receives every waiting packet straight into slots of the rxPool and routes them.
+	* Slots left unfilled are kept for the next wakeup.
+	* @param The longest wait for the first packet in milliseconds.
+	* @param The most packets to receive.
+	* @returns The number of packets received.
+	*/
+	size_t _receive_batch(uint32_t timeoutMs, size_t maxPackets = RX_BATCH_SIZE)
+	{
+		maxPackets = maxPackets < RX_BATCH_SIZE ? maxPackets : RX_BATCH_SIZE;
+		for (size_t i = 0; i < maxPackets; i++)
+		{
+			if (!rxBatch[i])
+			{
+				rxBatch[i] = rxPool.alloc();
+				rxSlots[i] = rxBatch[i].get();
+			}
+		}
+		size_t count = 0;
+		if (cfConnection != NULL)
+		{
+			count = cfConnection->receive_batch(rxSlots, maxPackets, timeoutMs);
+		}
+		else if (timeoutMs > 0)
+		{
+			// the link failed to reopen, wait out the receive timeout until the next attempt.
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+		}
+		if (count > 0)
+		{
+			_handle_packets(rxBatch, count);
+			for (size_t i = 0; i < count; i++)
+			{
+				rxBatch[i].release();
+			}
+		}
+		return(count);
+	}
+
+	/**
+	* Starts the param reset once the log is ready, and the param update
+	* once the param TOC is complete. Called from the port thread and by
+	* the clients as they finish, so a stage starts without waiting for
+	* the next pass of the port thread. A call made while another thread,
+	* or the same thread, is advancing is handled by that thread.
+	*/
+	void _advance_stages()
+	{
+		stagesPending = true;
+		bool expected = false;
+		while (advancing.compare_exchange_strong(expected, true))
+		{
+			while (stagesPending.exchange(false))
+			{
+				if (log != NULL && param != NULL)
+				{
+					std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+					if (needsParamReset)
 					{
-						if (portConnect->log != NULL)
+						if (log->resetComplete || (overlapTocFetch && _isConnected))
 						{
-							portConnect->log->_new_packet_cb(pk);
+							needsParamReset = false;
+							param->reset();
 						}
 					}
-					else if (port == PARAM)
+					if (!needsParamReset && needsParamUpdate)
 					{
-						if (portConnect->log != NULL)
+						if (param->resetComplete)
 						{
-							portConnect->param->_new_packet_cb(pk);
+							timeline.paramTocNs = steadyNowNs();
+							needsParamUpdate = false;
+							param->update_all();
 						}
 					}
-					else if (port == LINKCTRL || port == PLATFORM)
-					{
-						portConnect->platform->_new_packet_cb(pk);
-					}
+				}
+			}
+			advancing = false;
+			if (!stagesPending)
+			{
+				break;
+			}
+			expected = false;
+		}
+	}
 
-					if (portConnect->log != NULL && portConnect->param != NULL)
-					{
-						if (needsParamReset)
-						{
-							if (portConnect->log->resetComplete)
-							{
-								needsParamReset = false;
-								portConnect->param->reset();
-							}
-						}
-						else if (needsParamUpdate)
-						{
-							if (portConnect->param->resetComplete)
-							{
-								needsParamUpdate = false;
-								portConnect->param->update_all();
-							}
-						}
-					}
-					packetCount++;
-					
+	/**
+	* Services the clients, retransmits late requests, starts the param
+	* reset and update once the log is ready, and measures the link metrics.
+	* The clients are called with the handlerMutex held, as their workers call them.
+	*/
+	void _service()
+	{
+		{
+			std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+			if (platform != NULL)
+			{
+				platform->service();
+			}
+			if (log != NULL)
+			{
+				log->service();
+			}
+			if (param != NULL)
+			{
+				param->service();
+			}
+		}
+		if (reconnectState != RECONNECT_WAIT)
+		{
+			pendingRequests.service(txQueue);
+		}
+
+		_advance_stages();
+		int64_t nowNs = steadyNowNs();
+		double elapsedTime = (double)(nowNs - rateStartNs) * 1.0e-9;
+
+		if (elapsedTime >= 1.0)
+		{
+			rateStartNs = nowNs;
+
+			Connection::Statistics stats;
+			bool hasStats = cfConnection != NULL && cfConnection->statistics(stats);
+			linkMetrics.measure(nowNs, stats, hasStats);
+
+			if (packetCount < 2)
+			{
+				noPacketCount++;
+			}
+			else
+			{
+				noPacketCount = 0;
+			}
+			packetCount = 0;
+			if (noPacketCount >= packetTimoutSec)
+			{
+				timedOut = true;
+				if (sendTimedOut)
+				{
+					messageOut << "packets timed out\n\r";
+					sendTimedOut = false;
+				}
+				if (autoReconnect && _isConnected && reconnectState == RECONNECT_IDLE)
+				{
+					std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+					reconnectMetrics.timeouts++;
+					reconnectState = RECONNECT_PROBE;
+					reconnectStartNs = nowNs;
+					reconnectNextNs = nowNs + (int64_t)reconnectStageMs * 1000000;
+					reconnectWaitMs = reconnectMinMs;
+					reconnectTries = 0;
+					platform->reset();
+					platform->_request_version();
 				}
-				auto thisTime = std::chrono::steady_clock::now();
-				diff = thisTime - lastTime;
-				elapsedTime = diff.count();
+			}
+			else
+			{
+				timedOut = false;
+			}
+		}
+		if (reconnectState != RECONNECT_IDLE)
+		{
+			_service_reconnect(nowNs);
+		}
+	}
 
-				if (elapsedTime >= 1.0)
+	/**
+	* Runs the reconnect after a packet timeout.
+	* A link that answers a version request was only quiet and is kept.
+	* Otherwise reopens the link with a growing wait between attempts, waits for
+	* the protocol version, and has the log and param compare their TOCs
+	* with the crazyflie. With the same TOCs the log blocks and params are
+	* restored in place, otherwise the clients are reset as on connect.
+	* Before they are restored, the workers finish the packets of the old link.
+	* Called without the handlerMutex held, the clients are called with it held.
+	* @param The current steady_clock time.
+	*/
+	void _service_reconnect(int64_t nowNs)
+	{
+		uint8_t state = reconnectState;
+		int32_t checksPending = tocChecksPending;
+		if (state == RECONNECT_CHECK && checksPending <= 0 && !tocChanged)
+		{
+			dispatcher.flush(reconnectStageMs);
+		}
+		std::lock_guard<std::recursive_mutex> guard(dispatcher.handlerMutex);
+		if (state == RECONNECT_PROBE)
+		{
+			if (version_ready())
+			{
+				reconnectState = RECONNECT_IDLE;
+				noPacketCount = 0;
+				sendTimedOut = true;
+				timedOut = false;
+			}
+			else if (nowNs >= reconnectNextNs)
+			{
+				reconnectState = RECONNECT_WAIT;
+				reconnectNextNs = nowNs;
+			}
+		}
+		else if (state == RECONNECT_WAIT)
+		{
+			if (nowNs >= reconnectNextNs)
+			{
+				if (reconnectAttempts > 0 && reconnectTries >= reconnectAttempts)
+				{
+					reconnectMetrics.failures++;
+					reconnectState = RECONNECT_FAILED;
+					messageOut << "reconnect failed\n\r";
+				}
+				else if (_reopen_link())
 				{
-					lastTime = thisTime;
+					reconnectTries++;
+					reconnectState = RECONNECT_VERSION;
+					reconnectNextNs = nowNs + (int64_t)reconnectStageMs * 1000000;
+				}
+				else
+				{
+					reconnectTries++;
+					_retry_reconnect(nowNs);
+				}
+			}
+		}
+		else if (state == RECONNECT_VERSION)
+		{
+			if (version_ready())
+			{
+				if (timeline.paramValuesNs != 0 && log != NULL && param != NULL)
+				{
+					tocChanged = false;
+					tocChecksPending = 2;
+					reconnectState = RECONNECT_CHECK;
+					reconnectNextNs = nowNs + (int64_t)reconnectStageMs * 1000000;
+					log->check_toc();
+					param->check_toc();
+				}
+				else
+				{
+					_restart_clients(nowNs);
+				}
+			}
+			else if (nowNs >= reconnectNextNs)
+			{
+				_retry_reconnect(nowNs);
+			}
+		}
+		else if (state == RECONNECT_CHECK)
+		{
+			if (checksPending <= 0)
+			{
+				if (tocChanged)
+				{
+					_restart_clients(nowNs);
+				}
+				else
+				{
+					log->resume();
+					param->resume();
+					reconnectMetrics.resumed++;
+					_reconnected(nowNs);
+				}
+			}
+			else if (nowNs >= reconnectNextNs)
+			{
+				_retry_reconnect(nowNs);
+			}
+		}
+	}
 
-					portConnect->packetsPerSecond = (double)packetCount / elapsedTime; 
-					elapsedTime = 0;
+	/**
+	* Waits longer before the next reconnect attempt.
+	* @param The current steady_clock time.
+	*/
+	void _retry_reconnect(int64_t nowNs)
+	{
+		reconnectState = RECONNECT_WAIT;
+		reconnectNextNs = nowNs + (int64_t)reconnectWaitMs * 1000000;
+		reconnectWaitMs = reconnectWaitMs * 2 < reconnectMaxMs ? reconnectWaitMs * 2 : reconnectMaxMs;
+	}
 
-					if (packetCount < 2)
-					{
-						noPacketCount++;
-					}
-					else
-					{
-						noPacketCount = 0;
-					}
-					packetCount = 0;
-					if (noPacketCount >= packetTimoutSec)
-					{
-						portConnect->timedOut = true;
-						if (sendTimedOut)
-						{
-							messageOut << "packets timed out\n\r";
-							sendTimedOut = false;
-						}
-						
-					}
-					else
-					{
-						portConnect->timedOut = false;
-					}
+	/**
+	* Closes the link and opens it again on the same uri,
+	* then requests the protocol version.
+	* Queued packets are held while the link is replaced.
+	* If the link fails to open, cfConnection stays NULL
+	* until the next attempt.
+	* @returns true if the link was reopened.
+	*/
+	bool _reopen_link()
+	{
+		bool result = false;
+		std::lock_guard<std::mutex> guard(reopenMutex);
+		if (_isConnected && linkUri.size() > 0)
+		{
+			CrtpLink* previous = cfConnection;
+			txQueue.set_link(NULL);
+			cfConnection = NULL;
+			if (previous != NULL)
+			{
+				previous->close();
+				delete previous;
+			}
+
+			reconnectMetrics.attempts++;
+			try
+			{
+				cfConnection = _create_link(linkUri);
+			}
+			catch (std::exception& error)
+			{
+				messageOut << "reconnect could not open the link: ";
+				messageOut << error.what();
+				messageOut << "\n\r";
+			}
+			if (cfConnection != NULL)
+			{
+				txQueue.set_link(cfConnection);
+				platform->reset();
+				platform->_request_version();
+				result = true;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Called by the log and param when their TOC check is done.
+	* @param true if the TOC in memory matches the crazyflie.
+	*/
+	void tocChecked(bool matches)
+	{
+		if (!matches)
+		{
+			tocChanged = true;
+		}
+		tocChecksPending--;
+	}
+
+	/**
+	* Resets the clients after a reconnect as on connect,
+	* for a changed TOC or a session that was not yet ready.
+	* @param The current steady_clock time.
+	*/
+	void _restart_clients(int64_t nowNs)
+	{
+		messageOut << "TOC changed, resetting the session.\n\r";
+		reconnectMetrics.resets++;
+		_reconnected(nowNs);
+		_reset_port_state();
+		_set_lifecycle(LINK_CONNECTED);
+		timeline.versionNs = steadyNowNs();
+		log->setConnection(this);
+		param->setConnection(this);
+		log->reset();
+	}
+
+	/**
+	* Ends a reconnect and records its time to recover.
+	* @param The current steady_clock time.
+	*/
+	void _reconnected(int64_t nowNs)
+	{
+		int64_t recoverNs = nowNs - reconnectStartNs;
+		reconnectMetrics.recovered(recoverNs);
+		reconnectState = RECONNECT_IDLE;
+		noPacketCount = 0;
+		sendTimedOut = true;
+		timedOut = false;
+		messageOut << "reconnected in ";
+		messageOut << (double)recoverNs * 1.0e-6;
+		messageOut << " ms\n\r";
+	}
+
+	/**
+	* Runs one pass of a pumped session without waiting.
+	* Receives up to maxPackets packets, hands them to the clients,
+	* services the clients and sends the queued packets.
+	* Called only from the pump that is attached.
+	* @param The most packets to receive in this pass.
+	* @returns The number of packets received and sent.
+	*/
+	int32_t pump_once(int32_t maxPackets)
+	{
+		int32_t result = 0;
+		if (running)
+		{
+			while (cfConnection != NULL && result < maxPackets)
+			{
+				size_t count = _receive_batch(bitcraze::crazyflieLinkCpp::Connection::TimeoutNone,
+					(size_t)(maxPackets - result));
+				if (count == 0)
+				{
+					break;
+				}
+				result += (int32_t)count;
+			}
+			dispatcher.drain();
+			_service();
+			result += txQueue.drain();
+		}
+		return(result);
+	}
+
+	/**
+	* Check for packets from cfConnection, take every packet
+	* waiting in one pass and queue them for the workers of their port clients.
+	* Retransmit requests whose replies are late.
+	* Measure packets per second and set timeout if needed.
+	*/
+	static void portThreadFunc(void* data)
+	{
+		PortConnect* portConnect = (PortConnect*)data;
+		if (portConnect->cfConnection != NULL)
+		{
+			portConnect->threadConfig.port.apply("cf-port");
+			while (portConnect->running)
+			{
+				uint32_t waitMs = portConnect->pendingRequests.waitMs(receiveWaitMs);
+				int64_t deadlineNs = steadyNowNs() + (int64_t)waitMs * 1000000;
+				if (portConnect->_receive_batch(waitMs) == 0)
+				{
+					ThreadMetrics::record_wake(portConnect->threadMetrics.portWake, deadlineNs);
 				}
+				portConnect->_service();
 			}
 		}
 	}
-};
\ No newline at end of file
+};
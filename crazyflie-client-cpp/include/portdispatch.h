@@ -0,0 +1,972 @@
+/*
+* Header-only implementation of the port packet dispatcher for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "portclient.h"
+#include "ctrp.h"
+#include "threadconfig.h"
+#include <thread>
+#include <atomic>
+#include <array>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+/**
+* The current steady clock time.
+* @returns The time in nanoseconds.
+*/
+inline int64_t steadyNowNs()
+{
+	return(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+* Stores a value in an atomic maximum if it is larger.
+* @param The maximum to update
+* @param The new value
+*/
+template <class T>
+inline void updateAtomicMax(std::atomic<T>& maximum, T value)
+{
+	T current = maximum.load(std::memory_order_relaxed);
+	while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+	{
+	}
+}
+
+/**
+* Lock-free ring with a single producer and a single consumer.
+* SIZE must be a power of two.
+*/
+template <class T, uint32_t SIZE>
+struct SpscRing
+{
+	static_assert((SIZE & (SIZE - 1)) == 0, "SpscRing size must be a power of two");
+
+	std::array<T, SIZE> items;						/**< The ring storage. */
+	alignas(64) std::atomic<uint32_t> head = 0;		/**< Next item to pop, written by the consumer. */
+	alignas(64) std::atomic<uint32_t> tail = 0;		/**< Next item to push, written by the producer. */
+
+	/**
+	* Pushes an item, called only from the producer thread.
+	* @param The item to push, moved into the ring.
+	* @returns false if the ring is full.
+	*/
+	bool push(T item)
+	{
+		bool result = false;
+		uint32_t _tail = tail.load(std::memory_order_relaxed);
+		if (_tail - head.load(std::memory_order_acquire) < SIZE)
+		{
+			items[_tail & (SIZE - 1)] = std::move(item);
+			tail.store(_tail + 1, std::memory_order_release);
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Pops an item, called only from the consumer thread.
+	* @param The returned item.
+	* @returns false if the ring is empty.
+	*/
+	bool pop(T& item)
+	{
+		bool result = false;
+		uint32_t _head = head.load(std::memory_order_relaxed);
+		if (_head != tail.load(std::memory_order_acquire))
+		{
+			item = std::move(items[_head & (SIZE - 1)]);
+			head.store(_head + 1, std::memory_order_release);
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* The number of items in the ring.
+	* @returns The number of items waiting to be popped.
+	*/
+	uint32_t size()
+	{
+		return(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+	}
+
+	/**
+	* Checks if the ring is empty.
+	* @returns true if there is nothing to pop.
+	*/
+	bool empty()
+	{
+		return(size() == 0);
+	}
+
+	/**
+	* Discards all items, only safe when neither thread is running.
+	*/
+	void clear()
+	{
+		T item;
+		while (pop(item))
+		{
+		}
+		head = 0;
+		tail = 0;
+	}
+};
+
+/**
+* A received packet and the time it was queued.
+*/
+struct QueuedPacket
+{
+	PacketRef pk;					/**< The received packet, shared with the other workers of its port. */
+	int64_t queuedNs = 0;			/**< steady_clock time in nanoseconds when the packet was queued. */
+};
+
+/**
+* Observes each received packet before the clients handle it.
+*/
+class ReplyObserver
+{
+public:
+
+	/**
+	* Destructor
+	*/
+	virtual ~ReplyObserver() {}
+
+	/**
+	* Called once with each received packet, on the port thread
+	* before the packet is queued for the clients.
+	* @param The received packet.
+	* @returns true if the packet answered a request.
+	*/
+	virtual bool observe_reply(Packet& pk) = 0;
+};
+
+/**
+* Consumes the packets for one PortClient on its own thread.
+* The port thread is the only producer for the ring,
+* the worker thread is the only consumer.
+* The client is called with the handlerMutex held, so it never runs
+* at the same time as the other clients of the session or the port thread.
+*/
+struct PortWorker
+{
+	const static uint32_t RING_SIZE = 256;			/**< Number of packets that may wait for the client. */
+	const static uint32_t BATCH_SIZE = 32;			/**< Most packets handed to the client in one call. */
+
+	PortClient* client;								/**< The client that handles the packets. */
+	const ThreadSettings* threadSettings;			/**< Applied to the worker thread when it starts, may be NULL. */
+	std::recursive_mutex* handlerMutex;			/**< Held while the client handles packets, may be NULL. */
+	SpscRing<QueuedPacket, RING_SIZE> ring;			/**< The packets waiting for the client. */
+	PacketRef batch[BATCH_SIZE];					/**< The packets being handed to the client, used only by the consumer. */
+	std::thread workerThread;						/**< Thread calling the client. */
+	std::atomic<bool> running = false;				/**< true while the worker thread is running. */
+	std::atomic<bool> removed = false;				/**< Set when the client is removed, no more packets are handed to it. */
+	std::atomic<bool> sleeping = false;				/**< true while the worker waits for packets. */
+	std::mutex wakeMutex;							/**< Mutex for the wake condition. */
+	std::condition_variable wakeCondition;			/**< Signalled when packets are queued or the worker stops. */
+
+	std::atomic<uint32_t> queueDepth = 0;			/**< Packets waiting in the ring. */
+	std::atomic<uint32_t> maxQueueDepth = 0;		/**< Largest number of packets seen waiting in the ring. */
+	std::atomic<uint64_t> received = 0;				/**< Packets queued for the client. */
+	std::atomic<uint64_t> handled = 0;				/**< Packets handled by the client. */
+	std::atomic<uint64_t> batches = 0;				/**< Calls to the client. */
+	std::atomic<uint64_t> dropped = 0;				/**< Packets dropped because the ring was full. */
+	std::atomic<int64_t> lastHandlerNs = 0;			/**< Time spent in the last call to the client. */
+	std::atomic<int64_t> maxHandlerNs = 0;			/**< Longest time spent in a call to the client. */
+	std::atomic<int64_t> totalHandlerNs = 0;		/**< Total time spent in calls to the client. */
+	std::atomic<int64_t> lastQueueWaitNs = 0;		/**< Time the last packet waited in the ring. */
+	std::atomic<int64_t> maxQueueWaitNs = 0;		/**< Longest time a packet waited in the ring. */
+
+	/**
+	* Constructor
+	* @param The client for the packets.
+	* @param Applied to the worker thread when it starts, may be NULL.
+	* @param Held while the client handles packets, may be NULL.
+	*/
+	PortWorker(PortClient* _client, const ThreadSettings* _threadSettings = NULL,
+		std::recursive_mutex* _handlerMutex = NULL)
+	{
+		client = _client;
+		threadSettings = _threadSettings;
+		handlerMutex = _handlerMutex;
+	}
+
+	/**
+	* Destructor
+	*/
+	~PortWorker()
+	{
+		stop();
+	}
+
+	/**
+	* Starts the worker thread.
+	*/
+	void start()
+	{
+		if (!running)
+		{
+			if (workerThread.joinable())
+			{
+				workerThread.join();
+			}
+			running = true;
+			workerThread = std::thread(workerThreadFunc, this);
+		}
+	}
+
+	/**
+	* Stops and joins the worker thread.
+	* Packets still in the ring are discarded.
+	* Called from the worker thread itself, the thread only
+	* stops and is joined by a later call from another thread.
+	*/
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(wakeMutex);
+			running = false;
+		}
+		wakeCondition.notify_one();
+		if (workerThread.joinable() && workerThread.get_id() != std::this_thread::get_id())
+		{
+			workerThread.join();
+		}
+		if (!workerThread.joinable())
+		{
+			ring.clear();
+			queueDepth = 0;
+		}
+	}
+
+	/**
+	* Queues a packet for the client, called from the port thread.
+	* The worker shares the packet, it is not copied.
+	* @param The packet to queue.
+	* @param false to leave the worker asleep until wake() is called,
+	* so a batch of packets wakes it once.
+	* @returns false if the packet was dropped.
+	*/
+	bool post(const PacketRef& pk, bool notify = true)
+	{
+		QueuedPacket queued;
+		queued.pk = pk;
+		queued.queuedNs = steadyNowNs();
+		bool result = ring.push(std::move(queued));
+		if (result)
+		{
+			received++;
+			uint32_t depth = ring.size();
+			queueDepth = depth;
+			updateAtomicMax(maxQueueDepth, depth);
+			if (notify)
+			{
+				wake();
+			}
+		}
+		else
+		{
+			dropped++;
+		}
+		return(result);
+	}
+
+	/**
+	* Wakes the worker thread if it waits for packets.
+	*/
+	void wake()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping)
+		{
+			std::lock_guard<std::mutex> guard(wakeMutex);
+			wakeCondition.notify_one();
+		}
+	}
+
+	/**
+	* Hands every queued packet to the client,
+	* up to BATCH_SIZE packets in each call.
+	* @param true when called from the worker thread.
+	* @returns The number of packets handled.
+	*/
+	int32_t drain(bool onWorker = false)
+	{
+		int32_t count = 0;
+		QueuedPacket queued;
+		while (!removed)
+		{
+			uint32_t size = 0;
+			int64_t startNs = steadyNowNs();
+			int64_t maxWaitNs = 0;
+			while (size < BATCH_SIZE && ring.pop(queued))
+			{
+				batch[size] = std::move(queued.pk);
+				int64_t waitNs = startNs - queued.queuedNs;
+				maxWaitNs = waitNs > maxWaitNs ? waitNs : maxWaitNs;
+				size++;
+			}
+			if (size == 0)
+			{
+				break;
+			}
+			std::unique_lock<std::recursive_mutex> lock;
+			bool locked = _lock_handler(lock, onWorker);
+			if (locked)
+			{
+				client->_new_packets_cb(batch, size);
+				if (lock.owns_lock())
+				{
+					lock.unlock();
+				}
+			}
+			int64_t handlerNs = steadyNowNs() - startNs;
+			for (uint32_t i = 0; i < size; i++)
+			{
+				batch[i].release();
+			}
+			if (!locked)
+			{
+				break;
+			}
+
+			lastQueueWaitNs = maxWaitNs;
+			updateAtomicMax(maxQueueWaitNs, maxWaitNs);
+			lastHandlerNs = handlerNs;
+			updateAtomicMax(maxHandlerNs, handlerNs);
+			totalHandlerNs += handlerNs;
+			handled += size;
+			batches++;
+			count += size;
+		}
+		queueDepth = ring.size();
+		return(count);
+	}
+
+	/**
+	* Takes the handlerMutex for a call to the client.
+	* Gives up once the worker is removed or stopped, so a thread
+	* holding the mutex can stop the worker without a deadlock.
+	* @param The lock to take.
+	* @param true when called from the worker thread.
+	* @returns false if the worker gave up, the packets are not handled.
+	*/
+	bool _lock_handler(std::unique_lock<std::recursive_mutex>& lock, bool onWorker)
+	{
+		bool result = true;
+		if (handlerMutex != NULL)
+		{
+			lock = std::unique_lock<std::recursive_mutex>(*handlerMutex, std::defer_lock);
+			for (int32_t tries = 0; !lock.try_lock(); tries++)
+			{
+				if (removed || (onWorker && !running))
+				{
+					result = false;
+					break;
+				}
+				if (tries < 64)
+				{
+					std::this_thread::yield();
+				}
+				else
+				{
+					std::this_thread::sleep_for(std::chrono::microseconds(200));
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* The average time spent in a call to the client.
+	* @returns The average in nanoseconds.
+	*/
+	int64_t averageHandlerNs()
+	{
+		uint64_t count = handled;
+		return(count > 0 ? totalHandlerNs / (int64_t)count : 0);
+	}
+
+	/**
+	* Waits for packets and hands them to the client
+	* until the worker is stopped.
+	* @param The owner PortWorker.
+	*/
+	static void workerThreadFunc(void* data)
+	{
+		PortWorker* worker = (PortWorker*)data;
+		if (worker->threadSettings != NULL)
+		{
+			worker->threadSettings->apply("cf-worker");
+		}
+		while (worker->running)
+		{
+			worker->drain(true);
+
+			std::unique_lock<std::mutex> lock(worker->wakeMutex);
+			worker->sleeping = true;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			worker->wakeCondition.wait(lock, [worker] {
+				return(!worker->running || !worker->ring.empty());
+				});
+			worker->sleeping = false;
+		}
+	}
+};
+
+/**
+* The workers registered for one port and channel.
+* A list is never changed once it is published, a new list replaces it,
+* so the port thread reads a consistent list without taking a lock.
+*/
+struct RouteList
+{
+	const static int32_t MAX_CLIENTS = 8;				/**< Most clients that can share a port and channel. */
+
+	int32_t count = 0;									/**< The number of registered workers. */
+	PortWorker* workers[MAX_CLIENTS] = {};				/**< The registered workers. */
+
+	/**
+	* Checks if a worker is registered.
+	* @param The worker to find.
+	* @returns true if the worker is registered.
+	*/
+	bool contains(PortWorker* worker) const
+	{
+		bool result = false;
+		for (int32_t i = 0; i < count; i++)
+		{
+			if (workers[i] == worker)
+			{
+				result = true;
+				break;
+			}
+		}
+		return(result);
+	}
+};
+
+/**
+* The published RouteList of one port and channel.
+*/
+struct PortRoute
+{
+	const static int32_t MAX_CLIENTS = RouteList::MAX_CLIENTS;	/**< Most clients that can share a port and channel. */
+
+	std::atomic<const RouteList*> list = NULL;			/**< The current workers, NULL for none. */
+
+	/**
+	* Checks if a worker is registered.
+	* @param The worker to find.
+	* @returns true if the worker is registered.
+	*/
+	bool contains(PortWorker* worker)
+	{
+		const RouteList* _list = list.load();
+		return(_list != NULL && _list->contains(worker));
+	}
+};
+
+/**
+* Routes packets from the port thread to the PortWorkers
+* of every client registered for the packet's port and channel.
+* Lookup is a direct index into a PORT_COUNT x CHANNEL_COUNT table.
+*/
+struct PortDispatcher
+{
+	std::vector<PortWorker*> workers;					/**< One worker for each client. */
+	std::vector<PortWorker*> removedWorkers;			/**< Stopped workers of removed clients, deleted by clear(). */
+	PortRoute routes[PORT_COUNT][CHANNEL_COUNT];		/**< The workers for each port and channel. */
+	std::vector<const RouteList*> retiredLists;			/**< Replaced lists, the port thread may still read them until clear(). */
+	std::mutex routeMutex;								/**< Guards registration, never taken by the port thread. */
+	std::recursive_mutex handlerMutex;				/**< Held while a client of the session runs, on its worker or any other thread. */
+	std::atomic<uint64_t> dispatchSequence = 0;			/**< Odd while the port thread dispatches. */
+	std::atomic<std::thread::id> dispatchThread;		/**< The thread inside dispatch() or dispatch_batch(), none outside. */
+	std::atomic<bool> running = false;					/**< true while the workers are started. */
+	std::atomic<uint64_t> unrouted = 0;					/**< Packets for a port and channel without a client. */
+	ReplyObserver* observer;							/**< Observes each packet before it is queued, may be NULL. */
+	const ThreadSettings* threadSettings;				/**< Applied to each worker thread, may be NULL. */
+
+	const static int32_t MAX_POSTED = 16;				/**< Most workers woken at the end of a batch. */
+	PortWorker* posted[MAX_POSTED];						/**< Workers posted a packet in this dispatch, used only by the port thread. */
+	int32_t postedCount = 0;							/**< The number of posted workers. */
+	bool batching = false;								/**< true while dispatch_batch queues its packets. */
+
+	/**
+	* Constructor
+	*/
+	PortDispatcher()
+	{
+		observer = NULL;
+		threadSettings = NULL;
+		dispatchThread = std::thread::id();
+	}
+
+	/**
+	* Destructor
+	*/
+	~PortDispatcher()
+	{
+		clear();
+	}
+
+	/**
+	* Finds the worker for a client.
+	* @param The client to find.
+	* @returns The worker or NULL if the client has none.
+	*/
+	PortWorker* findWorker(PortClient* client)
+	{
+		PortWorker* result = NULL;
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			if (workers[i]->client == client)
+			{
+				result = workers[i];
+				break;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Registers a client for a port and channel.
+	* May be called while packets are being dispatched.
+	* @param The client to handle the packets.
+	* @param The port to route.
+	* @param The channel to route, or CHANNEL_ALL for every channel of the port.
+	* @returns true if the client was registered.
+	*/
+	bool add_client(PortClient* client, uint8_t port, uint8_t channel = CHANNEL_ALL)
+	{
+		bool result = false;
+		if (client != NULL && port < PORT_COUNT && (channel < CHANNEL_COUNT || channel == CHANNEL_ALL))
+		{
+			std::lock_guard<std::mutex> guard(routeMutex);
+			PortWorker* worker = findWorker(client);
+			if (worker == NULL)
+			{
+				worker = new PortWorker(client, threadSettings, &handlerMutex);
+				workers.push_back(worker);
+				if (running)
+				{
+					worker->start();
+				}
+			}
+			result = true;
+			uint8_t first = (channel == CHANNEL_ALL) ? 0 : channel;
+			uint8_t last = (channel == CHANNEL_ALL) ? CHANNEL_COUNT - 1 : channel;
+			for (uint8_t chan = first; chan <= last; chan++)
+			{
+				PortRoute& route = routes[port][chan];
+				const RouteList* current = route.list.load();
+				if (current == NULL || !current->contains(worker))
+				{
+					if (current == NULL || current->count < RouteList::MAX_CLIENTS)
+					{
+						RouteList* next = current != NULL ? new RouteList(*current) : new RouteList();
+						next->workers[next->count++] = worker;
+						_publish(route, next);
+					}
+					else
+					{
+						result = false;
+					}
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Removes every route to a client and stops its worker.
+	* Once this returns the client is handed no more packets,
+	* unless it is called from the client's own worker thread,
+	* which then only finishes the packet it is handling.
+	* The worker is deleted by clear().
+	* The routes are replaced with the routeMutex held, the wait for the
+	* dispatch and the worker thread is done after it is released,
+	* so the client may register or remove clients as it stops.
+	* @param The client to remove.
+	*/
+	void remove_client(PortClient* client)
+	{
+		PortWorker* worker = NULL;
+		{
+			std::lock_guard<std::mutex> guard(routeMutex);
+			worker = findWorker(client);
+			if (worker != NULL)
+			{
+				_unroute(worker);
+				worker->removed = true;
+				workers.erase(std::find(workers.begin(), workers.end(), worker));
+			}
+		}
+		if (worker != NULL)
+		{
+			_wait_dispatch();
+			worker->stop();
+			std::lock_guard<std::mutex> guard(routeMutex);
+			removedWorkers.push_back(worker);
+		}
+	}
+
+	/**
+	* Replaces every list that holds a worker with a list without it.
+	* Called with the routeMutex held.
+	* @param The worker to remove.
+	*/
+	void _unroute(PortWorker* worker)
+	{
+		for (int32_t port = 0; port < PORT_COUNT; port++)
+		{
+			for (int32_t chan = 0; chan < CHANNEL_COUNT; chan++)
+			{
+				PortRoute& route = routes[port][chan];
+				const RouteList* current = route.list.load();
+				if (current != NULL && current->contains(worker))
+				{
+					RouteList* next = new RouteList();
+					for (int32_t i = 0; i < current->count; i++)
+					{
+						if (current->workers[i] != worker)
+						{
+							next->workers[next->count++] = current->workers[i];
+						}
+					}
+					_publish(route, next);
+				}
+			}
+		}
+	}
+
+	/**
+	* Checks if a client is routed on any channel of a port.
+	* @param The client.
+	* @param The port.
+	* @returns true if the client handles packets of the port.
+	*/
+	bool routes_client(PortClient* client, uint8_t port)
+	{
+		bool result = false;
+		std::lock_guard<std::mutex> guard(routeMutex);
+		PortWorker* worker = findWorker(client);
+		if (worker != NULL && port < PORT_COUNT)
+		{
+			for (int32_t chan = 0; chan < CHANNEL_COUNT && !result; chan++)
+			{
+				result = routes[port][chan].contains(worker);
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Starts every worker thread.
+	*/
+	void start()
+	{
+		std::lock_guard<std::mutex> guard(routeMutex);
+		running = true;
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i]->start();
+		}
+	}
+
+	/**
+	* Stops every worker thread.
+	*/
+	void stop()
+	{
+		std::lock_guard<std::mutex> guard(routeMutex);
+		running = false;
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i]->stop();
+		}
+	}
+
+	/**
+	* Stops and removes all workers and routes.
+	*/
+	void clear()
+	{
+		stop();
+		std::lock_guard<std::mutex> guard(routeMutex);
+		for (int32_t port = 0; port < PORT_COUNT; port++)
+		{
+			for (int32_t chan = 0; chan < CHANNEL_COUNT; chan++)
+			{
+				_publish(routes[port][chan], NULL);
+			}
+		}
+		_wait_dispatch();
+		for (const RouteList* list : retiredLists)
+		{
+			delete list;
+		}
+		retiredLists.clear();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			delete workers[i];
+		}
+		workers.clear();
+		for (size_t i = 0; i < removedWorkers.size(); i++)
+		{
+			delete removedWorkers[i];
+		}
+		removedWorkers.clear();
+	}
+
+	/**
+	* Replaces the list of a route, the old list is kept until clear().
+	* Called with the routeMutex held.
+	* @param The route.
+	* @param The new list, NULL for none.
+	*/
+	void _publish(PortRoute& route, const RouteList* next)
+	{
+		const RouteList* current = route.list.exchange(next);
+		if (current != NULL)
+		{
+			retiredLists.push_back(current);
+		}
+	}
+
+	/**
+	* Waits until a dispatch that may have read a replaced list has finished.
+	* Returns at once on the dispatching thread itself.
+	*/
+	void _wait_dispatch()
+	{
+		uint64_t sequence = dispatchSequence.load();
+		if ((sequence & 1) != 0 && dispatchThread.load() != std::this_thread::get_id())
+		{
+			while (dispatchSequence.load() == sequence)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	/**
+	* Hands the queued packets to the clients on the calling thread.
+	* Used when the workers are not started and the
+	* PortConnect is pumped from outside.
+	* @returns The number of packets handled.
+	*/
+	int32_t drain()
+	{
+		int32_t result = 0;
+		std::vector<PortWorker*> current;
+		{
+			std::lock_guard<std::mutex> guard(routeMutex);
+			current = workers;
+		}
+		// a removed worker is kept until clear(), its drain() returns at once.
+		for (size_t i = 0; i < current.size(); i++)
+		{
+			result += current[i]->drain();
+		}
+		return(result);
+	}
+
+	/**
+	* Waits until every worker has handled the packets queued for it
+	* before the call, such as the packets of a link that was replaced.
+	* Drains the workers on the calling thread when they are not started.
+	* Called without the handlerMutex held, the workers take it to handle packets.
+	* @param The longest wait in milliseconds.
+	* @returns true if every packet queued before the call was handled.
+	*/
+	bool flush(uint32_t timeoutMs)
+	{
+		bool result = true;
+		if (!running)
+		{
+			drain();
+		}
+		else
+		{
+			std::vector<PortWorker*> current;
+			{
+				std::lock_guard<std::mutex> guard(routeMutex);
+				current = workers;
+			}
+			std::vector<uint64_t> queued(current.size());
+			for (size_t i = 0; i < current.size(); i++)
+			{
+				queued[i] = current[i]->received;
+			}
+			int64_t deadlineNs = steadyNowNs() + (int64_t)timeoutMs * 1000000;
+			for (size_t i = 0; i < current.size() && result; i++)
+			{
+				PortWorker* worker = current[i];
+				// a stopped or removed worker hands no more packets to its client.
+				while (worker->handled < queued[i] && worker->running && !worker->removed)
+				{
+					if (steadyNowNs() >= deadlineNs)
+					{
+						result = false;
+						break;
+					}
+					worker->wake();
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Queues a packet for every worker registered for its port and channel.
+	* The workers share the packet, it is not copied.
+	* Called only from the port thread.
+	* @param The packet to route.
+	* @returns The number of workers the packet was queued for.
+	*/
+	int32_t dispatch(const PacketRef& pk)
+	{
+		bool outer = !batching;
+		if (outer)
+		{
+			_begin_dispatch();
+		}
+		int32_t result = 0;
+		if (observer != NULL)
+		{
+			observer->observe_reply(*pk);
+		}
+		const RouteList* list = routes[pk->port()][pk->channel()].list.load();
+		int32_t _count = list != NULL ? list->count : 0;
+		for (int32_t i = 0; i < _count; i++)
+		{
+			PortWorker* worker = list->workers[i];
+			if (worker->post(pk, false))
+			{
+				result++;
+				_wake_later(worker);
+			}
+		}
+		if (_count == 0)
+		{
+			unrouted++;
+		}
+		if (outer)
+		{
+			_end_dispatch();
+			_wake_posted();
+		}
+		return(result);
+	}
+
+	/**
+	* Marks the port thread as dispatching, so a client being
+	* removed waits until it no longer reads the old routes.
+	*/
+	void _begin_dispatch()
+	{
+		dispatchThread = std::this_thread::get_id();
+		dispatchSequence.fetch_add(1);
+	}
+
+	/**
+	* Marks the end of a dispatch.
+	*/
+	void _end_dispatch()
+	{
+		dispatchSequence.fetch_add(1);
+		dispatchThread = std::thread::id();
+	}
+
+	/**
+	* Queues a batch of packets for their workers and wakes
+	* each worker once, after all of its packets are queued.
+	* Called only from the port thread.
+	* @param The packets to route, in the order they arrived.
+	* @param The number of packets.
+	* @returns The number of packets queued for a worker.
+	*/
+	int32_t dispatch_batch(PacketRef* packets, size_t count)
+	{
+		int32_t result = 0;
+		_begin_dispatch();
+		batching = true;
+		for (size_t i = 0; i < count; i++)
+		{
+			result += dispatch(packets[i]);
+		}
+		batching = false;
+		_end_dispatch();
+		_wake_posted();
+		return(result);
+	}
+
+	/**
+	* Notes a worker to wake at the end of the dispatch,
+	* wakes it now if too many workers wait.
+	* @param The worker that was posted a packet.
+	*/
+	void _wake_later(PortWorker* worker)
+	{
+		bool found = false;
+		for (int32_t i = 0; i < postedCount && !found; i++)
+		{
+			found = (posted[i] == worker);
+		}
+		if (!found)
+		{
+			if (postedCount < MAX_POSTED)
+			{
+				posted[postedCount++] = worker;
+			}
+			else
+			{
+				worker->wake();
+			}
+		}
+	}
+
+	/**
+	* Wakes every worker posted a packet since the last wake.
+	*/
+	void _wake_posted()
+	{
+		for (int32_t i = 0; i < postedCount; i++)
+		{
+			posted[i]->wake();
+		}
+		postedCount = 0;
+	}
+};
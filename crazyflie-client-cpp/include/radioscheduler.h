@@ -0,0 +1,278 @@
+/*
+* Header-only scheduling of drones across Crazyradio dongles
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "crtplink.h"
+#include "linkmetrics.h"
+#include "messageout.h"
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+/**
+* One Crazyradio dongle and the drones scheduled on it.
+*/
+struct RadioDongle
+{
+	int32_t index = 0;				/**< The dongle index used in the uris. */
+	double budget = 0;				/**< Packets the dongle carries each second. */
+	double load = 0;				/**< Packets each second of the drones on the dongle. */
+	int32_t drones = 0;				/**< Drones on the dongle. */
+
+	/**
+	* @returns The share of the budget in use.
+	*/
+	double usage() const
+	{
+		return(budget > 0 ? load / budget : 1.0);
+	}
+};
+
+/**
+* One drone of a RadioScheduler.
+*/
+struct RadioDrone
+{
+	std::string uri;				/**< The uri as given, its dongle is replaced. */
+	int32_t dongle = -1;			/**< The slot in the dongles of the drone, -1 until assigned. */
+	double rate = 0;				/**< Observed packets each second, the expected rate until observed. */
+	bool observed = false;			/**< The rate was measured on the link. */
+};
+
+/**
+* A drone moved by a rebalance.
+*/
+struct RadioMove
+{
+	size_t drone = 0;				/**< The index of the drone. */
+	int32_t from = 0;				/**< The dongle index it leaves. */
+	int32_t to = 0;					/**< The dongle index it joins. */
+	std::string uri;				/**< The uri on the new dongle. */
+};
+
+/**
+* Spreads the drones of a swarm across several Crazyradio dongles,
+* so they do not share the airtime of a single radio.
+* Drones are placed on the least used dongle, then moved off any dongle
+* whose observed packet rate nears its budget. Not thread safe, called
+* from the thread that connects the swarm.
+*/
+class RadioScheduler
+{
+public:
+	const static int32_t DEFAULT_BUDGET = 1000;			/**< Packets a dongle carries each second by default. */
+	const static int32_t DEFAULT_DRONE_RATE = 100;		/**< Packets each second assumed for a drone not yet observed. */
+
+	std::vector<RadioDongle> dongles;					/**< The dongles, in the order they were added. */
+	std::vector<RadioDrone> drones;						/**< The drones of the last assign. */
+	double expectedRate = DEFAULT_DRONE_RATE;			/**< Packets each second assumed for a drone not yet observed. */
+	double saturation = 0.9;							/**< Share of the budget at which a dongle is saturated. */
+
+	/**
+	* Adds a dongle.
+	* @param The dongle index used in the uris.
+	* @param Packets the dongle carries each second.
+	*/
+	void add_dongle(int32_t index, double budget = DEFAULT_BUDGET)
+	{
+		RadioDongle dongle;
+		dongle.index = index;
+		dongle.budget = budget;
+		dongles.push_back(dongle);
+	}
+
+	/**
+	* Places each drone on the least used dongle.
+	* @param The uris of the drones, the first field after the scheme is the dongle.
+	* @returns The uris on their scheduled dongles, unchanged if no dongle was added.
+	*/
+	std::vector<std::string> assign(const std::vector<std::string>& uris)
+	{
+		std::vector<std::string> result;
+		drones.clear();
+		for (RadioDongle& dongle : dongles)
+		{
+			dongle.load = 0;
+			dongle.drones = 0;
+		}
+		for (const std::string& uri : uris)
+		{
+			RadioDrone drone;
+			drone.uri = uri;
+			drone.rate = expectedRate;
+			drone.dongle = _least_used(-1, drone.rate);
+			if (drone.dongle >= 0)
+			{
+				RadioDongle& dongle = dongles[drone.dongle];
+				dongle.load += drone.rate;
+				dongle.drones++;
+				result.push_back(uriWithDongle(uri, dongle.index));
+			}
+			else
+			{
+				result.push_back(uri);
+			}
+			drones.push_back(drone);
+		}
+		return(result);
+	}
+
+	/**
+	* Sets the observed packet rate of a drone.
+	* @param The index of the drone.
+	* @param Packets each second sent and received.
+	*/
+	void observe(size_t drone, double packetsPerSecond)
+	{
+		if (drone < drones.size())
+		{
+			RadioDrone& record = drones[drone];
+			if (record.dongle >= 0)
+			{
+				dongles[record.dongle].load += packetsPerSecond - record.rate;
+			}
+			record.rate = packetsPerSecond;
+			record.observed = true;
+		}
+	}
+
+	/**
+	* Sets the observed packet rate of a drone from its link metrics.
+	* @param The index of the drone.
+	* @param The metrics of its link, measured once a second.
+	*/
+	void observe(size_t drone, LinkMetrics& metrics)
+	{
+		observe(drone, metrics.rxPerSecond + metrics.txPerSecond);
+	}
+
+	/**
+	* Moves drones off each saturated dongle, largest rate first,
+	* onto the least used dongle that stays below saturation.
+	* The caller reconnects each moved drone on its new uri.
+	* @returns The drones moved.
+	*/
+	std::vector<RadioMove> rebalance()
+	{
+		std::vector<RadioMove> result;
+		for (int32_t slot = 0; slot < (int32_t)dongles.size(); slot++)
+		{
+			RadioDongle& from = dongles[slot];
+			while (from.usage() >= saturation)
+			{
+				int32_t target = _least_used(slot, 0);
+				if (target < 0)
+				{
+					break;
+				}
+				RadioDongle& to = dongles[target];
+				int32_t best = -1;
+				for (size_t i = 0; i < drones.size(); i++)
+				{
+					RadioDrone& drone = drones[i];
+					if (drone.dongle == slot && to.load + drone.rate < to.budget * saturation &&
+						(best < 0 || drone.rate > drones[best].rate))
+					{
+						best = (int32_t)i;
+					}
+				}
+				if (best < 0)
+				{
+					break;
+				}
+				RadioDrone& drone = drones[best];
+				from.load -= drone.rate;
+				from.drones--;
+				to.load += drone.rate;
+				to.drones++;
+				drone.dongle = target;
+
+				RadioMove move;
+				move.drone = (size_t)best;
+				move.from = from.index;
+				move.to = to.index;
+				move.uri = uriWithDongle(drone.uri, to.index);
+				result.push_back(move);
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* @param The index of a drone.
+	* @returns The uri of the drone on its scheduled dongle.
+	*/
+	std::string uri(size_t drone)
+	{
+		std::string result;
+		if (drone < drones.size())
+		{
+			RadioDrone& record = drones[drone];
+			result = record.dongle >= 0 ? uriWithDongle(record.uri, dongles[record.dongle].index) : record.uri;
+		}
+		return(result);
+	}
+
+	/**
+	* Writes the load of each dongle to messageOut.
+	*/
+	void report()
+	{
+		for (RadioDongle& dongle : dongles)
+		{
+			messageOut << "dongle ";
+			messageOut << dongle.index;
+			messageOut << " drones ";
+			messageOut << dongle.drones;
+			messageOut << " load ";
+			messageOut << dongle.load;
+			messageOut << " of ";
+			messageOut << dongle.budget;
+			messageOut << " packets/s\n\r";
+		}
+	}
+
+	/**
+	* Finds the dongle with the smallest share of its budget in use
+	* once a drone is added.
+	* @param A slot to skip, or -1.
+	* @param The packet rate of the drone.
+	* @returns The slot of the dongle, -1 if there is none.
+	*/
+	int32_t _least_used(int32_t skip, double rate)
+	{
+		int32_t result = -1;
+		double lowest = 0;
+		for (int32_t slot = 0; slot < (int32_t)dongles.size(); slot++)
+		{
+			RadioDongle& dongle = dongles[slot];
+			double usage = dongle.budget > 0 ? (dongle.load + rate) / dongle.budget : 1.0e9;
+			if (slot != skip && (result < 0 || usage < lowest))
+			{
+				result = slot;
+				lowest = usage;
+			}
+		}
+		return(result);
+	}
+};
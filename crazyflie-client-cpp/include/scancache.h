@@ -0,0 +1,316 @@
+/*
+* Header-only cache of scanned crazyflie uris
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "Connection.h"
+#include "portdispatch.h"
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+/**
+* Scans every channel of the radio for one address.
+* @param The address.
+* @returns The uris that answered.
+*/
+typedef std::vector<std::string>(*ScanFunction)(uint64_t address);
+
+/**
+* Scans only the given uris.
+* @param The uris to check.
+* @returns The uris that answered.
+*/
+typedef std::vector<std::string>(*ScanSelectedFunction)(const std::vector<std::string>& uris);
+
+/**
+* A uri found by a scan.
+*/
+struct ScanEntry
+{
+	std::string uri;			/**< The uri of the drone. */
+	int64_t foundNs = 0;		/**< steady_clock time the drone last answered. */
+};
+
+/**
+* Remembers the uris found by a scan, so a connect does not rescan
+* every channel. Fresh uris are used as they are, stale uris are checked
+* with a scan of only those uris, and every channel is scanned only when
+* none of them answers. A full scan of several addresses runs in parallel.
+*/
+class ScanCache
+{
+public:
+	const static int32_t DEFAULT_TTL_MS = 30000;			/**< Time a found uri is used without checking it again. */
+	const static uint64_t DEFAULT_ADDRESS = 0xE7E7E7E7E7;	/**< The address of a crazyflie as shipped. */
+	const static int32_t DEFAULT_SCAN_THREADS = 4;			/**< Addresses scanned at a time by default. */
+
+	int32_t ttlMs = DEFAULT_TTL_MS;							/**< Time a found uri is used without checking it again. */
+	int32_t scanThreads = DEFAULT_SCAN_THREADS;				/**< Addresses scanned at a time in a full scan. */
+	std::vector<uint64_t> addresses;						/**< The addresses of a full scan, the default address when empty. */
+	std::vector<ScanEntry> entries;							/**< The found uris, in the order they were found. */
+	std::mutex cacheMutex;									/**< Held while the entries are used. */
+	ScanFunction scanFunction;								/**< Scans all channels for one address. */
+	ScanSelectedFunction scanSelectedFunction;				/**< Scans only the given uris. */
+
+	std::atomic<uint64_t> hits = 0;							/**< Scans answered from fresh uris. */
+	std::atomic<uint64_t> verifies = 0;						/**< Scans answered by checking stale uris. */
+	std::atomic<uint64_t> fullScans = 0;					/**< Scans of every channel. */
+
+	/**
+	* Constructor
+	*/
+	ScanCache()
+	{
+		scanFunction = bitcraze::crazyflieLinkCpp::Connection::scan;
+		scanSelectedFunction = bitcraze::crazyflieLinkCpp::Connection::scan_selected;
+	}
+
+	/**
+	* Finds the drones, from the cache when it can.
+	* @param The returned uris.
+	* @param true to scan every channel even if uris are cached.
+	* @returns true if at least one was found.
+	*/
+	bool scan(std::vector<std::string>& uris, bool force = false)
+	{
+		uris.clear();
+		if (!force)
+		{
+			std::vector<std::string> stale;
+			_cached(steadyNowNs(), uris, stale);
+			if (uris.size() > 0 && stale.size() == 0)
+			{
+				hits++;
+			}
+			else if (stale.size() > 0)
+			{
+				std::vector<std::string> found = scanSelectedFunction(stale);
+				verifies++;
+				_found(found, stale);
+				uris.insert(uris.end(), found.begin(), found.end());
+			}
+		}
+		if (uris.size() == 0)
+		{
+			uris = scan_addresses(addresses.size() > 0 ? addresses : std::vector<uint64_t>(1, DEFAULT_ADDRESS));
+			fullScans++;
+			int64_t nowNs = steadyNowNs();
+			std::lock_guard<std::mutex> guard(cacheMutex);
+			entries.clear();
+			for (const std::string& uri : uris)
+			{
+				ScanEntry entry;
+				entry.uri = uri;
+				entry.foundNs = nowNs;
+				entries.push_back(entry);
+			}
+		}
+		return(uris.size() > 0);
+	}
+
+	/**
+	* Checks that one uri still answers, without scanning other channels.
+	* A fresh uri is not checked again.
+	* @param The uri.
+	* @returns true if the drone answered.
+	*/
+	bool verify(const std::string& uri)
+	{
+		bool result = false;
+		{
+			std::lock_guard<std::mutex> guard(cacheMutex);
+			ScanEntry* entry = _find(uri);
+			result = entry != NULL && steadyNowNs() - entry->foundNs < (int64_t)ttlMs * 1000000;
+		}
+		if (result)
+		{
+			hits++;
+		}
+		else
+		{
+			std::vector<std::string> check(1, uri);
+			std::vector<std::string> found = scanSelectedFunction(check);
+			verifies++;
+			_found(found, check);
+			result = found.size() > 0;
+		}
+		return(result);
+	}
+
+	/**
+	* Scans every channel for several addresses, a number of addresses at a time.
+	* @param The addresses.
+	* @returns The uris that answered, sorted.
+	*/
+	std::vector<std::string> scan_addresses(const std::vector<uint64_t>& scanAddresses)
+	{
+		std::vector<std::string> result;
+		std::mutex resultMutex;
+		std::atomic<size_t> next = 0;
+		size_t threadCount = scanThreads > 1 ? (size_t)scanThreads : 1;
+		threadCount = threadCount < scanAddresses.size() ? threadCount : scanAddresses.size();
+		auto scanNext = [&]() {
+			size_t index = next++;
+			while (index < scanAddresses.size())
+			{
+				std::vector<std::string> found = scanFunction(scanAddresses[index]);
+				{
+					std::lock_guard<std::mutex> guard(resultMutex);
+					result.insert(result.end(), found.begin(), found.end());
+				}
+				index = next++;
+			}
+		};
+		if (threadCount <= 1)
+		{
+			scanNext();
+		}
+		else
+		{
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < threadCount; i++)
+			{
+				threads.push_back(std::thread(scanNext));
+			}
+			for (std::thread& thread : threads)
+			{
+				thread.join();
+			}
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return(result);
+	}
+
+	/**
+	* Makes a run of addresses for a fleet, such as E7E7E7E701 to E7E7E7E70A.
+	* @param The first address.
+	* @param The number of addresses.
+	* @returns The addresses.
+	*/
+	static std::vector<uint64_t> address_range(uint64_t first, int32_t count)
+	{
+		std::vector<uint64_t> result;
+		for (int32_t i = 0; i < count; i++)
+		{
+			result.push_back(first + (uint64_t)i);
+		}
+		return(result);
+	}
+
+	/**
+	* Adds a uri known without a scan, such as one given by the user.
+	* @param The uri.
+	*/
+	void add(const std::string& uri)
+	{
+		std::vector<std::string> found(1, uri);
+		_found(found, std::vector<std::string>());
+	}
+
+	/**
+	* Forgets every uri, the next scan checks every channel.
+	*/
+	void clear()
+	{
+		std::lock_guard<std::mutex> guard(cacheMutex);
+		entries.clear();
+	}
+
+	/**
+	* Splits the cached uris into fresh and stale.
+	* @param The current time.
+	* @param The returned fresh uris.
+	* @param The returned stale uris.
+	*/
+	void _cached(int64_t nowNs, std::vector<std::string>& fresh, std::vector<std::string>& stale)
+	{
+		std::lock_guard<std::mutex> guard(cacheMutex);
+		for (ScanEntry& entry : entries)
+		{
+			if (nowNs - entry.foundNs < (int64_t)ttlMs * 1000000)
+			{
+				fresh.push_back(entry.uri);
+			}
+			else
+			{
+				stale.push_back(entry.uri);
+			}
+		}
+	}
+
+	/**
+	* Refreshes the uris that answered and forgets the checked uris that did not.
+	* @param The uris that answered.
+	* @param The uris that were checked.
+	*/
+	void _found(const std::vector<std::string>& found, const std::vector<std::string>& checked)
+	{
+		int64_t nowNs = steadyNowNs();
+		std::lock_guard<std::mutex> guard(cacheMutex);
+		for (const std::string& uri : checked)
+		{
+			if (std::find(found.begin(), found.end(), uri) == found.end())
+			{
+				entries.erase(std::remove_if(entries.begin(), entries.end(), [&uri](const ScanEntry& entry) {
+					return(entry.uri == uri);
+					}), entries.end());
+			}
+		}
+		for (const std::string& uri : found)
+		{
+			ScanEntry* entry = _find(uri);
+			if (entry == NULL)
+			{
+				entries.push_back(ScanEntry());
+				entry = &entries.back();
+				entry->uri = uri;
+			}
+			entry->foundNs = nowNs;
+		}
+	}
+
+	/**
+	* Finds the entry of a uri.
+	* Called with the cacheMutex held.
+	* @param The uri.
+	* @returns The entry, or NULL.
+	*/
+	ScanEntry* _find(const std::string& uri)
+	{
+		ScanEntry* result = NULL;
+		for (ScanEntry& entry : entries)
+		{
+			if (entry.uri == uri)
+			{
+				result = &entry;
+				break;
+			}
+		}
+		return(result);
+	}
+};
@@ -0,0 +1,1005 @@
+/*
+* Header-only implementation of a simulated crazyflie link
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "crtplink.h"
+#include "ctrp.h"
+#include "lttype.h"
+#include "pttype.h"
+#include "logtoc.h"
+#include "PackUtils.h"
+#include "portdispatch.h"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+
+/**
+* A variable in the simulated log TOC.
+*/
+struct SimLogVariable
+{
+	std::string group;		/**< The group name. */
+	std::string name;		/**< The variable name. */
+	uint8_t type;			/**< The typeDex of the variable. */
+};
+
+/**
+* A parameter in the simulated param TOC.
+*/
+struct SimParam
+{
+	std::string group;			/**< The group name. */
+	std::string name;			/**< The parameter name. */
+	uint8_t type;				/**< The ptTypeDex of the parameter. */
+	bool readOnly = false;		/**< Writes are refused. */
+	bool persistent = false;	/**< Reported as EXTENDED_PERSISTENT. */
+	uint64_t value = 0;			/**< The raw little-endian value. */
+};
+
+/**
+* A log block created on the simulated crazyflie.
+*/
+struct SimLogBlock
+{
+	bool used = false;					/**< The block has been created. */
+	bool started = false;				/**< Log data is being sent. */
+	int64_t periodNs = 0;				/**< Time between log data packets. */
+	int64_t nextNs = 0;					/**< Time the next log data packet is due. */
+	std::vector<uint16_t> idents;		/**< The TOC identifiers of the variables. */
+	std::vector<uint8_t> fetchTypes;	/**< The typeDex each variable is sent as. */
+};
+
+/**
+* A simulated Crazyradio dongle, which carries a limited number of
+* packets each second for every link opened on it.
+* A packet beyond the budget waits for its airtime, so the links
+* of a saturated dongle slow down as they would on the radio.
+*/
+struct SimRadio
+{
+	double packetsPerSecond;				/**< Packets the dongle carries each second, 0 for no limit. */
+	double burst;							/**< Most packets carried at once after an idle time. */
+	double tokens;							/**< Packets that may be carried now, below 0 when packets wait. */
+	int64_t refillNs;						/**< Time the tokens were last refilled. */
+	std::mutex radioMutex;					/**< Held while the tokens are used. */
+	std::atomic<uint64_t> carried = 0;		/**< Packets carried. */
+	std::atomic<uint64_t> delayed = 0;		/**< Packets that waited for airtime. */
+	std::atomic<int64_t> delayNs = 0;		/**< Total time packets waited for airtime. */
+
+	/**
+	* Constructor
+	* @param Packets the dongle carries each second, 0 for no limit.
+	*/
+	SimRadio(double _packetsPerSecond)
+	{
+		set_budget(_packetsPerSecond);
+	}
+
+	/**
+	* Sets the packets the dongle carries each second.
+	* @param Packets each second, 0 for no limit.
+	*/
+	void set_budget(double _packetsPerSecond)
+	{
+		std::lock_guard<std::mutex> guard(radioMutex);
+		packetsPerSecond = _packetsPerSecond;
+		burst = packetsPerSecond * 0.01 > 1 ? packetsPerSecond * 0.01 : 1;
+		tokens = burst;
+		refillNs = steadyNowNs();
+	}
+
+	/**
+	* Takes the airtime of packets, waiting until the dongle has carried them.
+	* Called without the lock of a link held.
+	* @param The number of packets.
+	*/
+	void carry(size_t count = 1)
+	{
+		int64_t waitNs = 0;
+		{
+			std::lock_guard<std::mutex> guard(radioMutex);
+			if (packetsPerSecond > 0)
+			{
+				int64_t nowNs = steadyNowNs();
+				tokens += (double)(nowNs - refillNs) * 1.0e-9 * packetsPerSecond;
+				tokens = tokens < burst ? tokens : burst;
+				refillNs = nowNs;
+				tokens -= (double)count;
+				if (tokens < 0)
+				{
+					waitNs = (int64_t)(-tokens / packetsPerSecond * 1.0e9);
+				}
+			}
+		}
+		carried += count;
+		if (waitNs > 0)
+		{
+			delayed += count;
+			delayNs += waitNs;
+			std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+		}
+	}
+};
+
+/**
+* A set of simulated Crazyradio dongles, found by the dongle of a uri.
+*/
+struct SimRadios
+{
+	std::vector<SimRadio*> radios;		/**< The dongles by index. */
+
+	/**
+	* Constructor
+	* @param The number of dongles.
+	* @param Packets each dongle carries each second.
+	*/
+	SimRadios(int32_t count, double packetsPerSecond)
+	{
+		for (int32_t i = 0; i < count; i++)
+		{
+			radios.push_back(new SimRadio(packetsPerSecond));
+		}
+	}
+
+	/**
+	* Destructor
+	*/
+	~SimRadios()
+	{
+		for (SimRadio* radio : radios)
+		{
+			delete radio;
+		}
+		radios.clear();
+	}
+
+	/**
+	* Finds the dongle of a uri, such as sim://1/3 for drone 3 on dongle 1.
+	* @param The uri.
+	* @returns The dongle, or NULL if the uri names none of them.
+	*/
+	SimRadio* find(const std::string& uri)
+	{
+		SimRadio* result = NULL;
+		int32_t index = uriDongle(uri);
+		if (index >= 0 && index < (int32_t)radios.size())
+		{
+			result = radios[index];
+		}
+		return(result);
+	}
+};
+
+/**
+* The sizes of a simulated crazyflie.
+*/
+struct SimSettings
+{
+	uint8_t protocolVersion = 6;	/**< The protocol version, below 4 uses the v1 TOC commands. */
+	int32_t extraLogVariables = 0;	/**< Generated log variables added to the standard ones. */
+	int32_t extraParams = 0;		/**< Generated parameters added to the standard ones. */
+	SimRadios* radios = NULL;		/**< When set, each link shares the airtime of the dongle in its uri. */
+};
+
+/**
+* A CrtpLink that answers as a crazyflie, for testing and load
+* testing without a Crazyradio.
+* Implements the LINKCTRL source and PLATFORM version handshake,
+* the log TOC, blocks and periodic log data, and the param TOC,
+* read, write and extended types, using the v1 or v2 TOC commands.
+* Commander setpoints are counted and dropped.
+* Replies are queued by send() and returned by receive(),
+* log data is made in receive() when a started block is due.
+* With SimSettings radios, packets beyond the budget of the dongle wait for airtime.
+*/
+class SimLink : public CrtpLink
+{
+public:
+	const static uint8_t MAX_BLOCKS = 16;				/**< Log blocks the firmware holds. */
+	const static uint8_t LOG_DATA_MAX = 26;				/**< Log data bytes in one packet. */
+	const static uint8_t LINKSERVICE_SOURCE = 1;		/**< LINKCTRL channel for the link source. */
+	const static uint8_t VERSION_COMMAND = 1;			/**< PLATFORM channel for the versions. */
+	const static uint8_t LOG_SETTINGS_CHANNEL = 1;		/**< LOGGING channel for the block settings. */
+	const static uint8_t LOG_DATA_CHANNEL = 2;			/**< LOGGING channel for the log data. */
+	const static uint8_t PARAM_READ_CHANNEL = 1;		/**< PARAM channel for reads. */
+	const static uint8_t PARAM_WRITE_CHANNEL = 2;		/**< PARAM channel for writes. */
+	const static uint8_t MISC_GET_EXTENDED_TYPE = 2;	/**< PARAM misc command for the extended type. */
+
+	// log settings commands, as sent by cfLog.
+	const static uint8_t CMD_CREATE_BLOCK = 0;
+	const static uint8_t CMD_APPEND_BLOCK = 1;
+	const static uint8_t CMD_DELETE_BLOCK = 2;
+	const static uint8_t CMD_START_LOGGING = 3;
+	const static uint8_t CMD_STOP_LOGGING = 4;
+	const static uint8_t CMD_RESET_LOGGING = 5;
+	const static uint8_t CMD_CREATE_BLOCK_V2 = 6;
+	const static uint8_t CMD_APPEND_BLOCK_V2 = 7;
+
+	uint8_t protocolVersion;					/**< The protocol version reported. */
+	std::vector<SimLogVariable> logToc;			/**< The log TOC by identifier. */
+	std::vector<SimParam> paramToc;				/**< The param TOC by identifier. */
+	uint32_t logCrc;							/**< crc of the log TOC. */
+	uint32_t paramCrc;							/**< crc of the param TOC. */
+	SimLogBlock blocks[MAX_BLOCKS];				/**< The log blocks. */
+	std::string linkUri;						/**< The uri the link was opened with. */
+	SimRadio* radio;							/**< The dongle whose budget the link shares, NULL for no limit. */
+
+	std::mutex simMutex;						/**< Held while the simulated state or reply queue is used. */
+	std::condition_variable replyCondition;		/**< Signalled when a reply is queued. */
+	std::deque<Packet> replies;					/**< Packets waiting for receive(). */
+	std::atomic<bool> closed = false;			/**< True once closed. */
+	int64_t startNs;							/**< steady_clock time the link was opened. */
+
+	std::atomic<uint64_t> received = 0;			/**< Packets sent to the simulated crazyflie. */
+	std::atomic<uint64_t> sent = 0;				/**< Packets returned by receive(). */
+	std::atomic<uint64_t> logPackets = 0;		/**< Log data packets made. */
+	std::atomic<uint64_t> setpoints = 0;		/**< Commander packets received. */
+	std::atomic<uint64_t> paramWrites = 0;		/**< Param writes accepted. */
+
+	/**
+	* Constructor
+	* @param The uri the link was opened with.
+	* @param The sizes of the simulated crazyflie.
+	*/
+	SimLink(const std::string& uri = "sim://0", const SimSettings& settings = SimSettings())
+	{
+		linkUri = uri;
+		protocolVersion = settings.protocolVersion;
+		radio = settings.radios != NULL ? settings.radios->find(uri) : NULL;
+		startNs = steadyNowNs();
+		add_standard_toc();
+		add_generated_toc(settings.extraLogVariables, settings.extraParams);
+	}
+
+	/**
+	* Adds the log variables and params the CrazyFlie class uses.
+	*/
+	void add_standard_toc()
+	{
+		static const char* stateNames[] = { "x", "y", "z", "vx", "vy", "vz", "ax", "ay", "az", "roll", "pitch", "yaw" };
+		for (const char* name : stateNames)
+		{
+			add_log_variable("stateEstimate", name, tdFloat32);
+		}
+		static const char* rangeNames[] = { "front", "back", "up", "left", "right", "zrange" };
+		for (const char* name : rangeNames)
+		{
+			add_log_variable("range", name, tdUint16);
+		}
+		add_log_variable("pm", "vbat", tdFloat32);
+		add_log_variable("pm", "batteryLevel", tdUint8);
+		add_log_variable("pm", "state", tdInt8);
+
+		add_param("deck", "bcFlow2", ptUint8, 1, true);
+		add_param("deck", "bcMultiranger", ptUint8, 1, true);
+		add_param("deck", "bcLighthouse4", ptUint8, 0, true);
+		add_param("deck", "bcServo", ptUint8, 0, true);
+		add_param("commander", "enHighLevel", ptUint8, 1);
+		add_param("stabilizer", "estimator", ptUint8, 2);
+		add_param("stabilizer", "controller", ptUint8, 1);
+		float mass = 0.027f;
+		uint32_t massBits = 0;
+		memcpy(&massBits, &mass, sizeof(massBits));
+		add_param("pid_rate", "mass", ptFloat32, massBits, false, true);
+	}
+
+	/**
+	* Adds generated entries to make the TOCs as large as needed.
+	* @param The number of log variables to add.
+	* @param The number of params to add.
+	*/
+	void add_generated_toc(int32_t logCount, int32_t paramCount)
+	{
+		static const uint8_t logTypes[] = { tdFloat32, tdUint16, tdInt32, tdUint8 };
+		static const uint8_t paramTypes[] = { ptFloat32, ptUint16, ptInt32, ptUint8 };
+		char name[16];
+		for (int32_t i = 0; i < logCount; i++)
+		{
+			snprintf(name, sizeof(name), "v%d", (int)i);
+			add_log_variable("sim", name, logTypes[i % 4]);
+		}
+		for (int32_t i = 0; i < paramCount; i++)
+		{
+			snprintf(name, sizeof(name), "p%d", (int)i);
+			add_param("simp", name, paramTypes[i % 4], (uint64_t)i, false, (i % 8) == 0);
+		}
+	}
+
+	/**
+	* Adds a log variable to the TOC.
+	* @param The group name.
+	* @param The variable name.
+	* @param The typeDex of the variable.
+	*/
+	void add_log_variable(const std::string& group, const std::string& name, uint8_t type)
+	{
+		std::lock_guard<std::mutex> guard(simMutex);
+		SimLogVariable variable;
+		variable.group = group;
+		variable.name = name;
+		variable.type = type;
+		logToc.push_back(variable);
+		logCrc = _toc_crc(true);
+	}
+
+	/**
+	* Adds a parameter to the TOC.
+	* @param The group name.
+	* @param The parameter name.
+	* @param The ptTypeDex of the parameter.
+	* @param The raw value.
+	* @param True if the parameter is read only.
+	* @param True if the parameter is persistent.
+	*/
+	void add_param(const std::string& group, const std::string& name, uint8_t type,
+		uint64_t value, bool readOnly = false, bool persistent = false)
+	{
+		std::lock_guard<std::mutex> guard(simMutex);
+		SimParam param;
+		param.group = group;
+		param.name = name;
+		param.type = type;
+		param.value = value;
+		param.readOnly = readOnly;
+		param.persistent = persistent;
+		paramToc.push_back(param);
+		paramCrc = _toc_crc(false);
+	}
+
+	/**
+	* Hashes the names and types of a TOC, so a changed TOC has a new crc.
+	* Called with the simMutex held.
+	* @param True for the log TOC, false for the param TOC.
+	* @returns The crc.
+	*/
+	uint32_t _toc_crc(bool isLog)
+	{
+		uint32_t hash = 2166136261u;
+		size_t count = isLog ? logToc.size() : paramToc.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			const std::string& group = isLog ? logToc[i].group : paramToc[i].group;
+			const std::string& name = isLog ? logToc[i].name : paramToc[i].name;
+			uint8_t type = isLog ? logToc[i].type : paramToc[i].type;
+			for (char c : group)
+			{
+				hash = (hash ^ (uint8_t)c) * 16777619u;
+			}
+			for (char c : name)
+			{
+				hash = (hash ^ (uint8_t)c) * 16777619u;
+			}
+			hash = (hash ^ type) * 16777619u;
+		}
+		return(hash ^ (isLog ? 0x4c4f4700u : 0x50415200u));
+	}
+
+	/**
+	* Virtual CrtpLink call, handles a packet on the simulated crazyflie.
+	* @param The packet to handle.
+	*/
+	void send(const Packet& pk)
+	{
+		received++;
+		if (radio != NULL)
+		{
+			radio->carry();
+		}
+		if (pk.size() > 0 && !closed)
+		{
+			std::lock_guard<std::mutex> guard(simMutex);
+			uint8_t port = pk.port();
+			if (port == LINKCTRL)
+			{
+				_handle_linkctrl(pk);
+			}
+			else if (port == PLATFORM)
+			{
+				_handle_platform(pk);
+			}
+			else if (port == LOGGING)
+			{
+				_handle_logging(pk);
+			}
+			else if (port == PARAM)
+			{
+				_handle_param(pk);
+			}
+			else if (port == crtpPortCommander || port == crtpPortCommanderGeneric || port == crtpPortCommanderHL)
+			{
+				setpoints++;
+			}
+		}
+	}
+
+	/**
+	* Virtual CrtpLink call, returns the next reply or due log data.
+	* @param The longest wait in milliseconds.
+	* @returns The packet, with a size of 0 if none is ready.
+	*/
+	Packet receive(uint32_t timeoutMs)
+	{
+		Packet pk;
+		std::unique_lock<std::mutex> lock(simMutex);
+		_make_log_data();
+		if (replies.empty() && timeoutMs > 0 && !closed)
+		{
+			int64_t waitNs = (int64_t)timeoutMs * 1000000;
+			int64_t nextLogNs = _next_log_due();
+			if (nextLogNs > 0)
+			{
+				int64_t untilLogNs = nextLogNs - steadyNowNs();
+				waitNs = untilLogNs < waitNs ? untilLogNs : waitNs;
+			}
+			if (waitNs > 0)
+			{
+				replyCondition.wait_for(lock, std::chrono::nanoseconds(waitNs));
+			}
+			_make_log_data();
+		}
+		if (!replies.empty())
+		{
+			pk = replies.front();
+			replies.pop_front();
+			sent++;
+		}
+		lock.unlock();
+		if (radio != NULL && pk.size() > 0)
+		{
+			radio->carry();
+		}
+		return(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, returns every ready reply and due log data
+	* that fits in the batch, taking the lock once.
+	* @param The packets to fill.
+	* @param The number of packets to fill.
+	* @param The longest wait for the first packet in milliseconds.
+	* @returns The number of packets received.
+	*/
+	size_t receive_batch(Packet** packets, size_t maxPackets, uint32_t timeoutMs)
+	{
+		size_t count = 0;
+		if (maxPackets > 0)
+		{
+			*packets[0] = receive(timeoutMs);
+			if (packets[0]->size() > 0)
+			{
+				count++;
+				{
+					std::lock_guard<std::mutex> guard(simMutex);
+					_make_log_data();
+					while (count < maxPackets && !replies.empty())
+					{
+						*packets[count] = replies.front();
+						replies.pop_front();
+						sent++;
+						count++;
+					}
+				}
+				if (radio != NULL && count > 1)
+				{
+					radio->carry(count - 1);
+				}
+			}
+		}
+		return(count);
+	}
+
+	/**
+	* Virtual CrtpLink call, stops the simulated crazyflie.
+	*/
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> guard(simMutex);
+			closed = true;
+			replies.clear();
+		}
+		replyCondition.notify_all();
+	}
+
+	/**
+	* @returns The uri the link was opened with.
+	*/
+	std::string uri()
+	{
+		return(linkUri);
+	}
+
+	/**
+	* Virtual CrtpLink call, the simulated radio acknowledges every packet.
+	* @param The returned statistics.
+	* @returns true
+	*/
+	bool statistics(Connection::Statistics& stats)
+	{
+		stats.sent_count = (size_t)received;
+		stats.ack_count = (size_t)received;
+		stats.receive_count = (size_t)sent;
+		return(true);
+	}
+
+	/**
+	* Queues a reply. Called with the simMutex held.
+	* @param The port of the reply.
+	* @param The channel of the reply.
+	* @param The payload.
+	* @param The payload size.
+	*/
+	void _reply(uint8_t port, uint8_t channel, const uint8_t* payload, size_t size)
+	{
+		Packet pk;
+		pk.setPort(port);
+		pk.setChannel(channel);
+		if (size > CRTP_MAXSIZE - 1)
+		{
+			size = CRTP_MAXSIZE - 1;
+		}
+		memcpy(pk.payload(), payload, size);
+		pk.setPayloadSize(size);
+		replies.push_back(pk);
+		replyCondition.notify_one();
+	}
+
+	/**
+	* Answers the link source request.
+	* @param The request.
+	*/
+	void _handle_linkctrl(const Packet& pk)
+	{
+		if (pk.channel() == LINKSERVICE_SOURCE)
+		{
+			static const char platformName[] = "Bitcraze Crazyflie";
+			_reply(LINKCTRL, pk.channel(), (const uint8_t*)platformName, sizeof(platformName));
+		}
+		else if (pk.channel() == 0)
+		{
+			_reply(LINKCTRL, 0, pk.payload(), pk.payloadSize());
+		}
+	}
+
+	/**
+	* Answers the protocol and firmware version requests.
+	* @param The request.
+	*/
+	void _handle_platform(const Packet& pk)
+	{
+		if (pk.channel() == VERSION_COMMAND && pk.payloadSize() > 0)
+		{
+			uint8_t payload[2];
+			payload[0] = pk.payload()[0];
+			payload[1] = payload[0] == 0 ? protocolVersion : 0;
+			_reply(PLATFORM, pk.channel(), payload, 2);
+		}
+	}
+
+	/**
+	* Copies "group\0name\0" after a TOC element header.
+	* @param The payload to fill.
+	* @param The index of the names in the payload.
+	* @param The group name.
+	* @param The element name.
+	* @returns The payload size.
+	*/
+	size_t _pack_names(uint8_t* payload, size_t index, const std::string& group, const std::string& name)
+	{
+		size_t room = CRTP_MAXSIZE - 1 - index;
+		size_t groupSize = group.size() + 1 < room ? group.size() + 1 : room;
+		memcpy(payload + index, group.c_str(), groupSize);
+		index += groupSize;
+		room -= groupSize;
+		size_t nameSize = name.size() + 1 < room ? name.size() + 1 : room;
+		memcpy(payload + index, name.c_str(), nameSize);
+		index += nameSize;
+		payload[CRTP_MAXSIZE - 2] = 0;
+		return(index);
+	}
+
+	/**
+	* Answers a TOC info or element request.
+	* @param The request.
+	* @param The port of the TOC.
+	* @param The number of elements.
+	* @param The crc of the TOC.
+	* @returns The identifier of a requested element, or NO_IDENT.
+	*/
+	uint16_t _handle_toc(const Packet& pk, uint8_t port, size_t count, uint32_t crc)
+	{
+		uint16_t result = NO_IDENT;
+		uint8_t command = pk.payload()[0];
+		uint8_t payload[CRTP_MAXSIZE];
+		int32_t index = 0;
+		if (command == CMD_TOC_INFO || command == CMD_TOC_INFO_V2)
+		{
+			index += PackUtils::pack(payload, index, command);
+			if (command == CMD_TOC_INFO_V2)
+			{
+				index += PackUtils::pack(payload, index, (uint16_t)count);
+			}
+			else
+			{
+				index += PackUtils::pack(payload, index, (uint8_t)(count < 0xff ? count : 0xff));
+			}
+			index += PackUtils::pack(payload, index, crc);
+			index += PackUtils::pack(payload, index, (uint8_t)MAX_BLOCKS);
+			index += PackUtils::pack(payload, index, (uint8_t)128);
+			_reply(port, TOC_CHANNEL, payload, index);
+		}
+		else if (command == CMD_TOC_ITEM_V2 && pk.payloadSize() >= 3)
+		{
+			result = pk.payload()[1] | (pk.payload()[2] << 8);
+		}
+		else if (command == CMD_TOC_ELEMENT && pk.payloadSize() >= 2)
+		{
+			result = pk.payload()[1];
+		}
+		return(result < count ? result : NO_IDENT);
+	}
+
+	/**
+	* Answers an element request of the log or param TOC.
+	* @param The request command.
+	* @param The port of the TOC.
+	* @param The element identifier.
+	* @param The type byte.
+	* @param The group name.
+	* @param The element name.
+	*/
+	void _reply_toc_element(uint8_t command, uint8_t port, uint16_t ident, uint8_t type,
+		const std::string& group, const std::string& name)
+	{
+		uint8_t payload[CRTP_MAXSIZE];
+		int32_t index = 0;
+		index += PackUtils::pack(payload, index, command);
+		if (command == CMD_TOC_ITEM_V2)
+		{
+			index += PackUtils::pack(payload, index, ident);
+		}
+		else
+		{
+			index += PackUtils::pack(payload, index, (uint8_t)ident);
+		}
+		index += PackUtils::pack(payload, index, type);
+		size_t size = _pack_names(payload, index, group, name);
+		_reply(port, TOC_CHANNEL, payload, size);
+	}
+
+	/**
+	* Handles the log TOC and the log block settings.
+	* @param The request.
+	*/
+	void _handle_logging(const Packet& pk)
+	{
+		if (pk.payloadSize() == 0)
+		{
+			return;
+		}
+		uint8_t channel = pk.channel();
+		uint8_t command = pk.payload()[0];
+		if (channel == TOC_CHANNEL)
+		{
+			uint16_t ident = _handle_toc(pk, LOGGING, logToc.size(), logCrc);
+			if (ident != NO_IDENT)
+			{
+				SimLogVariable& variable = logToc[ident];
+				_reply_toc_element(command, LOGGING, ident, variable.type, variable.group, variable.name);
+			}
+		}
+		else if (channel == LOG_SETTINGS_CHANNEL)
+		{
+			uint8_t id = pk.payloadSize() > 1 ? pk.payload()[1] : 0;
+			uint8_t status = 0;
+			if (command == CMD_RESET_LOGGING)
+			{
+				for (int32_t i = 0; i < MAX_BLOCKS; i++)
+				{
+					blocks[i] = SimLogBlock();
+				}
+				id = 0;
+			}
+			else if (id >= MAX_BLOCKS)
+			{
+				status = ENOENT;
+			}
+			else if (command == CMD_CREATE_BLOCK || command == CMD_CREATE_BLOCK_V2)
+			{
+				if (blocks[id].used)
+				{
+					status = EEXIST;
+				}
+				else
+				{
+					blocks[id] = SimLogBlock();
+					blocks[id].used = true;
+					status = _append_variables(blocks[id], pk, command == CMD_CREATE_BLOCK_V2);
+				}
+			}
+			else if (command == CMD_APPEND_BLOCK || command == CMD_APPEND_BLOCK_V2)
+			{
+				status = blocks[id].used ? _append_variables(blocks[id], pk, command == CMD_APPEND_BLOCK_V2) : ENOENT;
+			}
+			else if (command == CMD_DELETE_BLOCK)
+			{
+				status = blocks[id].used ? 0 : ENOENT;
+				blocks[id] = SimLogBlock();
+			}
+			else if (command == CMD_START_LOGGING)
+			{
+				if (blocks[id].used && pk.payloadSize() > 2)
+				{
+					uint8_t period = pk.payload()[2];
+					blocks[id].periodNs = (int64_t)(period > 0 ? period : 1) * 10000000;
+					blocks[id].nextNs = steadyNowNs() + blocks[id].periodNs;
+					blocks[id].started = true;
+				}
+				else
+				{
+					status = ENOENT;
+				}
+			}
+			else if (command == CMD_STOP_LOGGING)
+			{
+				status = blocks[id].used ? 0 : ENOENT;
+				blocks[id].started = false;
+			}
+			uint8_t payload[3] = { command, id, status };
+			_reply(LOGGING, channel, payload, 3);
+		}
+	}
+
+	/**
+	* Adds the variables of a create or append request to a block.
+	* @param The block.
+	* @param The request.
+	* @param True for 16 bit identifiers.
+	* @returns 0, or an errno when a variable is not in the TOC or the block is full.
+	*/
+	uint8_t _append_variables(SimLogBlock& block, const Packet& pk, bool useV2)
+	{
+		uint8_t result = 0;
+		size_t index = 2;
+		size_t size = pk.payloadSize();
+		int32_t blockSize = 0;
+		for (size_t i = 0; i < block.fetchTypes.size(); i++)
+		{
+			blockSize += LogTocElement::get_size_from_id(block.fetchTypes[i]);
+		}
+		while (index + (useV2 ? 3 : 2) <= size && result == 0)
+		{
+			uint8_t fetchType = pk.payload()[index] & 0x0f;
+			uint16_t ident = pk.payload()[index + 1];
+			if (useV2)
+			{
+				ident |= pk.payload()[index + 2] << 8;
+			}
+			index += useV2 ? 3 : 2;
+			blockSize += LogTocElement::get_size_from_id(fetchType);
+			if (ident >= logToc.size() || fetchType >= gTypesSize)
+			{
+				result = ENOENT;
+			}
+			else if (blockSize > LOG_DATA_MAX)
+			{
+				result = E2BIG;
+			}
+			else
+			{
+				block.idents.push_back(ident);
+				block.fetchTypes.push_back(fetchType);
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* @returns The time the next started block is due, or 0 if none is started.
+	*/
+	int64_t _next_log_due()
+	{
+		int64_t result = 0;
+		for (int32_t i = 0; i < MAX_BLOCKS; i++)
+		{
+			if (blocks[i].started && (result == 0 || blocks[i].nextNs < result))
+			{
+				result = blocks[i].nextNs;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Queues a log data packet for each started block that is due.
+	* Called with the simMutex held.
+	*/
+	void _make_log_data()
+	{
+		int64_t nowNs = steadyNowNs();
+		for (int32_t i = 0; i < MAX_BLOCKS; i++)
+		{
+			SimLogBlock& block = blocks[i];
+			if (block.started && nowNs >= block.nextNs)
+			{
+				block.nextNs += block.periodNs;
+				if (block.nextNs < nowNs)
+				{
+					block.nextNs = nowNs + block.periodNs;
+				}
+				uint32_t timestamp = (uint32_t)((nowNs - startNs) / 1000000);
+				uint8_t payload[CRTP_MAXSIZE];
+				int32_t index = 0;
+				payload[index++] = (uint8_t)i;
+				payload[index++] = timestamp & 0xff;
+				payload[index++] = (timestamp >> 8) & 0xff;
+				payload[index++] = (timestamp >> 16) & 0xff;
+				double seconds = (double)(nowNs - startNs) * 1.0e-9;
+				for (size_t j = 0; j < block.idents.size(); j++)
+				{
+					index += _pack_log_value(payload + index, block.fetchTypes[j],
+						sin(seconds + block.idents[j]) * 100.0);
+				}
+				_reply(LOGGING, LOG_DATA_CHANNEL, payload, index);
+				logPackets++;
+			}
+		}
+	}
+
+	/**
+	* Packs a simulated log value as a typeDex.
+	* @param The buffer to pack into.
+	* @param The typeDex to pack as.
+	* @param The value.
+	* @returns The bytes packed.
+	*/
+	int32_t _pack_log_value(uint8_t* buffer, uint8_t type, double value)
+	{
+		int32_t result = LogTocElement::get_size_from_id(type);
+		if (type == tdFloat32)
+		{
+			float floatValue = (float)value;
+			memcpy(buffer, &floatValue, 4);
+		}
+		else if (type == tdFloat16)
+		{
+			PackUtils::packFloat16(buffer, 0, (float)value);
+		}
+		else
+		{
+			int32_t intValue = (int32_t)value;
+			if (type == tdUint8 || type == tdUint16 || type == tdUint32)
+			{
+				intValue = intValue < 0 ? -intValue : intValue;
+			}
+			memcpy(buffer, &intValue, result);
+		}
+		return(result);
+	}
+
+	/**
+	* Handles the param TOC, reads, writes and extended types.
+	* @param The request.
+	*/
+	void _handle_param(const Packet& pk)
+	{
+		if (pk.payloadSize() == 0)
+		{
+			return;
+		}
+		uint8_t channel = pk.channel();
+		bool useV2 = protocolVersion >= 4;
+		size_t identSize = useV2 ? 2 : 1;
+		if (channel == TOC_CHANNEL)
+		{
+			uint8_t command = pk.payload()[0];
+			uint16_t ident = _handle_toc(pk, PARAM, paramToc.size(), paramCrc);
+			if (ident != NO_IDENT)
+			{
+				SimParam& param = paramToc[ident];
+				uint8_t metadata = param.type;
+				if (param.persistent)
+				{
+					metadata |= 0x10;
+				}
+				if (param.readOnly)
+				{
+					metadata |= 0x40;
+				}
+				_reply_toc_element(command, PARAM, ident, metadata, param.group, param.name);
+			}
+		}
+		else if (channel == PARAM_READ_CHANNEL || channel == PARAM_WRITE_CHANNEL)
+		{
+			uint16_t ident = pk.payload()[0];
+			if (useV2 && pk.payloadSize() > 1)
+			{
+				ident |= pk.payload()[1] << 8;
+			}
+			if (ident < paramToc.size())
+			{
+				SimParam& param = paramToc[ident];
+				uint8_t size = ptTypes[param.type].size;
+				uint8_t payload[CRTP_MAXSIZE];
+				memcpy(payload, pk.payload(), identSize);
+				size_t index = identSize;
+				if (channel == PARAM_WRITE_CHANNEL)
+				{
+					if (!param.readOnly && pk.payloadSize() >= identSize + size)
+					{
+						param.value = 0;
+						memcpy(&param.value, pk.payload() + identSize, size);
+						paramWrites++;
+					}
+				}
+				else
+				{
+					payload[index++] = 0;
+				}
+				memcpy(payload + index, &param.value, size);
+				_reply(PARAM, channel, payload, index + size);
+			}
+		}
+		else if (channel == MISC_CHANNEL && pk.payloadSize() >= 3)
+		{
+			// misc commands carry a uint16_t identifier in both protocols.
+			uint8_t command = pk.payload()[0];
+			uint16_t ident = pk.payload()[1] | (pk.payload()[2] << 8);
+			if (command == MISC_GET_EXTENDED_TYPE && ident < paramToc.size())
+			{
+				uint8_t payload[4];
+				memcpy(payload, pk.payload(), 3);
+				payload[3] = paramToc[ident].persistent ? EXTENDED_PERSISTENT : 0;
+				_reply(PARAM, MISC_CHANNEL, payload, 4);
+			}
+		}
+	}
+};
+
+/**
+* A LinkFactory that opens a SimLink.
+* @param SimSettings, or NULL for the standard TOCs.
+* @param The uri, kept as the uri of the link.
+* @returns The new SimLink.
+*/
+inline CrtpLink* createSimLink(void* context, const std::string& uri)
+{
+	SimSettings settings;
+	if (context != NULL)
+	{
+		settings = *(SimSettings*)context;
+	}
+	return(new SimLink(uri, settings));
+}
@@ -0,0 +1,308 @@
+/*
+* Header-only implementation of fleet bring-up for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "crazyflie.h"
+#include "toccache.h"
+#include "radioscheduler.h"
+#include "messageout.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+
+/**
+* The bring-up of one drone, times in milliseconds from the start
+* of connectAll, -1 for a stage that was not reached.
+*/
+struct SwarmBringUp
+{
+	std::string uri;				/**< The uri of the drone. */
+	bool connected = false;			/**< The link opened and the protocol version arrived. */
+	bool ready = false;				/**< Every param value was read and the drone was set up. */
+	bool logTocShared = false;		/**< The log TOC was copied from another drone. */
+	bool paramTocShared = false;	/**< The param TOC was copied from another drone. */
+	double startMs = -1;			/**< Waited for a free bring-up slot. */
+	double versionMs = -1;			/**< Protocol version. */
+	double logTocMs = -1;			/**< Log TOC complete. */
+	double paramTocMs = -1;			/**< Param TOC and extended types complete. */
+	double readyMs = -1;			/**< Param values read, ready to fly. */
+};
+
+/**
+* Connects a fleet of CrazyFlies.
+* Scans once for the whole fleet, brings up several drones at a time,
+* fetches each distinct log and param TOC once through a shared TocCache,
+* and fetches the param TOC alongside the log TOC.
+*/
+class Swarm
+{
+public:
+	const static int32_t DEFAULT_PARALLEL = 4;				/**< Drones brought up at a time by default. */
+	const static int32_t DEFAULT_READY_TIMEOUT_MS = 20000;	/**< Longest wait for a drone to be ready. */
+
+	std::vector<CrazyFlie*> drones;			/**< One CrazyFlie for each uri. */
+	std::vector<SwarmBringUp> bringUp;		/**< The bring-up of each drone of the last connectAll. */
+	std::vector<std::string> uris;			/**< The uris of the fleet. */
+	std::string defaultDirectory;			/**< The directory for the cached TOCs. */
+	TocCache tocCache;						/**< TOCs shared by every drone. */
+	ScanCache scanCache;					/**< The uris found by earlier scans, set its addresses to scan a fleet in parallel. */
+	ThreadConfig threadConfig;				/**< Placement and scheduling of the threads of every drone and the bring-up. */
+	PortPump* pump;							/**< Set on each drone when not NULL, such as a SwarmLink. */
+	RadioScheduler* scheduler;				/**< When set, spreads the drones across its radio dongles. */
+	LinkFactory linkFactory;				/**< Set on each drone when not NULL, such as createSimLink. */
+	void* linkContext;						/**< Passed to the linkFactory. */
+	std::atomic<int32_t> nextDrone = 0;		/**< The next drone for a bring-up thread. */
+	int64_t startNs = 0;					/**< Start of the last connectAll. */
+
+	/**
+	* Constructor
+	*/
+	Swarm()
+	{
+		pump = NULL;
+		scheduler = NULL;
+		linkFactory = NULL;
+		linkContext = NULL;
+	}
+
+	/**
+	* Destructor
+	*/
+	~Swarm()
+	{
+		disconnectAll();
+		for (CrazyFlie* drone : drones)
+		{
+			delete drone;
+		}
+		drones.clear();
+	}
+
+	/**
+	* Scans once for every active drone.
+	* @param true to scan every channel even if uris are cached.
+	* @returns true if at least one was found.
+	*/
+	bool scan(bool force = false)
+	{
+		bool result = scanCache.scan(uris, force);
+		if (!result)
+		{
+			messageOut << "scan failed\n\r";
+		}
+		return(result);
+	}
+
+	/**
+	* Connects every drone of the fleet and waits until each is ready.
+	* @param The uris to connect, or empty to scan for them.
+	* @param The most drones brought up at a time.
+	* @param The longest wait for each drone in milliseconds.
+	* @returns The number of drones that are ready.
+	*/
+	int32_t connectAll(std::vector<std::string> _uris = std::vector<std::string>(),
+		int32_t maxParallel = DEFAULT_PARALLEL,
+		int32_t timeoutMs = DEFAULT_READY_TIMEOUT_MS)
+	{
+		int32_t result = 0;
+		if (_uris.size() > 0)
+		{
+			uris = _uris;
+		}
+		else
+		{
+			scan();
+		}
+		if (scheduler != NULL)
+		{
+			uris = scheduler->assign(uris);
+		}
+		while (drones.size() < uris.size())
+		{
+			CrazyFlie* drone = new CrazyFlie();
+			drone->defaultDirectory = defaultDirectory;
+			drones.push_back(drone);
+		}
+		bringUp.clear();
+		bringUp.resize(uris.size());
+		for (size_t i = 0; i < uris.size(); i++)
+		{
+			CrazyFlie* drone = drones[i];
+			drone->uris = uris;
+			drone->tocCache = &tocCache;
+			drone->pump = pump;
+			drone->linkFactory = linkFactory;
+			drone->linkContext = linkContext;
+			drone->overlapTocFetch = true;
+			drone->threadConfig = threadConfig;
+			bringUp[i].uri = uris[i];
+		}
+
+		startNs = steadyNowNs();
+		nextDrone = 0;
+		int32_t threadCount = (int32_t)uris.size();
+		if (maxParallel > 0 && threadCount > maxParallel)
+		{
+			threadCount = maxParallel;
+		}
+		std::vector<std::thread> threads;
+		for (int32_t i = 0; i < threadCount; i++)
+		{
+			threads.push_back(std::thread(bringUpThreadFunc, this, timeoutMs));
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		for (SwarmBringUp& drone : bringUp)
+		{
+			if (drone.ready)
+			{
+				result++;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Measures the packet rate of each drone and moves drones off
+	* saturated dongles, reconnecting each moved drone on its new dongle.
+	* @param The longest wait for each moved drone in milliseconds.
+	* @returns The number of drones moved.
+	*/
+	int32_t rebalance(int32_t timeoutMs = DEFAULT_READY_TIMEOUT_MS)
+	{
+		int32_t result = 0;
+		if (scheduler != NULL)
+		{
+			for (size_t i = 0; i < drones.size(); i++)
+			{
+				// a drone is observed once its link was measured after it was ready.
+				PortConnect* portConnect = drones[i]->portConnect;
+				if (drones[i]->isConnected() && portConnect->timeline.paramValuesNs != 0 &&
+					portConnect->linkMetrics.measuredNs > portConnect->timeline.paramValuesNs)
+				{
+					scheduler->observe(i, portConnect->linkMetrics);
+				}
+			}
+			std::vector<RadioMove> moves = scheduler->rebalance();
+			for (RadioMove& move : moves)
+			{
+				CrazyFlie* drone = drones[move.drone];
+				drone->disconnect();
+				uris[move.drone] = move.uri;
+				bringUp[move.drone] = SwarmBringUp();
+				bringUp[move.drone].uri = move.uri;
+				_bring_up(move.drone, timeoutMs);
+				result++;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Disconnects every drone.
+	*/
+	void disconnectAll()
+	{
+		for (CrazyFlie* drone : drones)
+		{
+			drone->disconnect();
+		}
+	}
+
+	/**
+	* Writes the bring-up of each drone to messageOut.
+	*/
+	void report()
+	{
+		for (SwarmBringUp& drone : bringUp)
+		{
+			messageOut << drone.uri;
+			messageOut << (drone.ready ? " ready" : " not ready");
+			messageOut << " start " << drone.startMs;
+			messageOut << " version " << drone.versionMs;
+			messageOut << " logToc " << drone.logTocMs << (drone.logTocShared ? " shared" : "");
+			messageOut << " paramToc " << drone.paramTocMs << (drone.paramTocShared ? " shared" : "");
+			messageOut << " ready " << drone.readyMs;
+			messageOut << " ms\n\r";
+		}
+		messageOut << "TOC cache hits " << (tocCache.log.hits + tocCache.param.hits);
+		messageOut << " fetches " << (tocCache.log.fetches + tocCache.param.fetches);
+		messageOut << "\n\r";
+	}
+
+	/**
+	* @param A steady_clock time, or zero.
+	* @returns Milliseconds since the start of connectAll, or -1 for zero.
+	*/
+	double _since_start_ms(int64_t stageNs)
+	{
+		return(stageNs != 0 ? (double)(stageNs - startNs) * 1.0e-6 : -1.0);
+	}
+
+	/**
+	* Connects one drone and waits until it is ready.
+	* @param The index of the drone.
+	* @param The longest wait in milliseconds.
+	*/
+	void _bring_up(size_t index, int32_t timeoutMs)
+	{
+		CrazyFlie* drone = drones[index];
+		SwarmBringUp& record = bringUp[index];
+		record.startMs = _since_start_ms(steadyNowNs());
+		record.connected = drone->connect_uri(uris[index]);
+		if (record.connected)
+		{
+			BringUpTimeline& timeline = drone->portConnect->timeline;
+			drone->portConnect->wait_ready(timeoutMs);
+			record.ready = timeline.paramValuesNs != 0;
+			record.versionMs = _since_start_ms(timeline.versionNs);
+			record.logTocMs = _since_start_ms(timeline.logTocNs);
+			record.paramTocMs = _since_start_ms(timeline.paramTocNs);
+			record.readyMs = _since_start_ms(timeline.paramValuesNs);
+			record.logTocShared = drone->log->tocShared;
+			record.paramTocShared = drone->param->tocShared;
+		}
+	}
+
+	/**
+	* Brings up drones until every drone has been started.
+	* @param The owner Swarm.
+	* @param The longest wait for each drone in milliseconds.
+	*/
+	static void bringUpThreadFunc(Swarm* swarm, int32_t timeoutMs)
+	{
+		swarm->threadConfig.swarm.apply("cf-swarm");
+		size_t index = (size_t)swarm->nextDrone++;
+		while (index < swarm->drones.size() && index < swarm->uris.size())
+		{
+			swarm->_bring_up(index, timeoutMs);
+			index = (size_t)swarm->nextDrone++;
+		}
+	}
+};
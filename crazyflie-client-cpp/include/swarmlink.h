@@ -0,0 +1,337 @@
+/*
+* Header-only implementation of a multi-drone link reactor for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "portclient.h"
+#include "portconnect.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+
+/**
+* One pumped drone and its per-turn statistics.
+*/
+struct SwarmDrone
+{
+	PortConnect* portConnect = NULL;	/**< The pumped session. */
+	uint64_t packets = 0;				/**< Packets received and sent in all turns. */
+	uint64_t turns = 0;					/**< Turns given to this drone. */
+	int64_t maxTurnNs = 0;				/**< Longest turn in nanoseconds. */
+	int64_t totalTurnNs = 0;			/**< Sum of all turns in nanoseconds. */
+
+	/**
+	* @returns The average turn in nanoseconds.
+	*/
+	int64_t averageTurnNs()
+	{
+		return(turns > 0 ? totalTurnNs / (int64_t)turns : 0);
+	}
+};
+
+/**
+* One reactor thread and the drones it pumps.
+*/
+struct SwarmReactor
+{
+	std::thread thread;							/**< The reactor thread. */
+	std::mutex droneMutex;						/**< Held for each pass and while drones are added or removed. */
+	std::condition_variable idleCondition;		/**< Waited on when a pass does no work, signalled on attach and stop. */
+	std::vector<SwarmDrone*> drones;			/**< Drones pumped by this reactor. */
+	std::atomic<bool> running = false;			/**< The reactor thread is running. */
+	size_t nextStart = 0;						/**< Drone that goes first in the next pass. */
+	uint64_t passes = 0;						/**< Passes made over the drones. */
+	uint64_t idlePasses = 0;					/**< Passes that did no work. */
+};
+
+/**
+* Pumps the links of many CrazyFlie sessions from a small fixed pool
+* of reactor threads, instead of a port, queue, worker and transmit
+* thread for each drone.
+* Set CrazyFlie::pump to a SwarmLink before connect(), the session is
+* attached when the link opens and detached when it closes.
+* Each pass gives every drone of a reactor one turn of up to
+* maxPacketsPerTurn packets, starting with a different drone each pass
+* so no drone is always served last.
+* Client callbacks run on the reactor thread, they must not block
+* and must not disconnect their own session.
+*/
+class SwarmLink : public PortPump
+{
+public:
+	static const int32_t DEFAULT_REACTORS = 2;				/**< Reactor threads started by default. */
+	static const int32_t DEFAULT_PACKETS_PER_TURN = 8;		/**< Packets received per drone per turn by default. */
+	static const int32_t IDLE_WAIT_US = 1000;				/**< Wait after a pass that did no work. */
+
+	int32_t maxPacketsPerTurn = DEFAULT_PACKETS_PER_TURN;	/**< Most packets received per drone per turn. */
+	std::vector<SwarmReactor*> reactors;					/**< The reactor pool. */
+	std::mutex poolMutex;									/**< Held while the pool is started, stopped or assigned. */
+	ThreadSettings threadSettings;							/**< Applied to each reactor thread, set before start(). */
+
+	/**
+	* Constructor
+	*/
+	SwarmLink()
+	{
+	}
+
+	/**
+	* Destructor
+	*/
+	~SwarmLink()
+	{
+		stop();
+	}
+
+	/**
+	* Starts the reactor pool.
+	* @param The number of reactor threads.
+	* @returns true if the pool was started.
+	*/
+	bool start(int32_t reactorCount = DEFAULT_REACTORS)
+	{
+		std::lock_guard<std::mutex> guard(poolMutex);
+		return(_start(reactorCount));
+	}
+
+	/**
+	* Starts the reactor pool.
+	* Called with the poolMutex held.
+	* @param The number of reactor threads.
+	* @returns true if the pool was started.
+	*/
+	bool _start(int32_t reactorCount)
+	{
+		bool result = false;
+		if (reactors.size() == 0 && reactorCount > 0)
+		{
+			for (int32_t i = 0; i < reactorCount; i++)
+			{
+				SwarmReactor* reactor = new SwarmReactor();
+				reactor->running = true;
+				reactor->thread = std::thread(reactorThreadFunc, this, reactor);
+				reactors.push_back(reactor);
+			}
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Stops and joins the reactor pool.
+	* Sessions still attached are no longer pumped.
+	*/
+	void stop()
+	{
+		std::lock_guard<std::mutex> guard(poolMutex);
+		for (SwarmReactor* reactor : reactors)
+		{
+			{
+				std::lock_guard<std::mutex> droneGuard(reactor->droneMutex);
+				reactor->running = false;
+			}
+			reactor->idleCondition.notify_one();
+			if (reactor->thread.joinable())
+			{
+				reactor->thread.join();
+			}
+			for (SwarmDrone* drone : reactor->drones)
+			{
+				delete drone;
+			}
+			delete reactor;
+		}
+		reactors.clear();
+	}
+
+	/**
+	* PortPump call when a session opens its link.
+	* Adds the session to the reactor with the fewest drones,
+	* starting the pool if needed.
+	* @param The PortConnect to pump.
+	*/
+	void attach(PortConnect* portConnect)
+	{
+		if (portConnect != NULL)
+		{
+			std::lock_guard<std::mutex> guard(poolMutex);
+			if (reactors.size() == 0)
+			{
+				_start(DEFAULT_REACTORS);
+			}
+			SwarmReactor* least = NULL;
+			size_t leastCount = 0;
+			for (SwarmReactor* reactor : reactors)
+			{
+				std::lock_guard<std::mutex> droneGuard(reactor->droneMutex);
+				if (least == NULL || reactor->drones.size() < leastCount)
+				{
+					least = reactor;
+					leastCount = reactor->drones.size();
+				}
+			}
+			if (least != NULL)
+			{
+				SwarmDrone* drone = new SwarmDrone();
+				drone->portConnect = portConnect;
+				{
+					std::lock_guard<std::mutex> droneGuard(least->droneMutex);
+					least->drones.push_back(drone);
+				}
+				least->idleCondition.notify_one();
+			}
+		}
+	}
+
+	/**
+	* PortPump call before a session closes its link.
+	* Waits for the current pass to finish, after this returns
+	* the session is no longer pumped.
+	* Must not be called from a reactor thread.
+	* @param The PortConnect to stop pumping.
+	*/
+	void detach(PortConnect* portConnect)
+	{
+		std::lock_guard<std::mutex> guard(poolMutex);
+		for (SwarmReactor* reactor : reactors)
+		{
+			std::lock_guard<std::mutex> droneGuard(reactor->droneMutex);
+			for (size_t i = 0; i < reactor->drones.size(); i++)
+			{
+				if (reactor->drones[i]->portConnect == portConnect)
+				{
+					delete reactor->drones[i];
+					reactor->drones.erase(reactor->drones.begin() + i);
+					break;
+				}
+			}
+		}
+	}
+
+	/**
+	* Copies the turn statistics of a pumped session.
+	* @param The pumped PortConnect.
+	* @param Receives the statistics.
+	* @returns true if the session is attached.
+	*/
+	bool drone_stats(PortConnect* portConnect, SwarmDrone& stats)
+	{
+		bool result = false;
+		std::lock_guard<std::mutex> guard(poolMutex);
+		for (SwarmReactor* reactor : reactors)
+		{
+			std::lock_guard<std::mutex> droneGuard(reactor->droneMutex);
+			for (SwarmDrone* drone : reactor->drones)
+			{
+				if (drone->portConnect == portConnect)
+				{
+					stats = *drone;
+					result = true;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* @returns The number of attached sessions.
+	*/
+	size_t drone_count()
+	{
+		size_t result = 0;
+		std::lock_guard<std::mutex> guard(poolMutex);
+		for (SwarmReactor* reactor : reactors)
+		{
+			std::lock_guard<std::mutex> droneGuard(reactor->droneMutex);
+			result += reactor->drones.size();
+		}
+		return(result);
+	}
+
+	/**
+	* Gives each drone of a reactor one turn.
+	* Called with the reactor droneMutex held.
+	* @param The reactor.
+	* @returns The number of packets received and sent.
+	*/
+	int32_t _pass(SwarmReactor* reactor)
+	{
+		int32_t result = 0;
+		size_t count = reactor->drones.size();
+		if (count > 0)
+		{
+			size_t first = reactor->nextStart % count;
+			for (size_t i = 0; i < count; i++)
+			{
+				SwarmDrone* drone = reactor->drones[(first + i) % count];
+				int64_t startNs = steadyNowNs();
+				int32_t packets = drone->portConnect->pump_once(maxPacketsPerTurn);
+				int64_t turnNs = steadyNowNs() - startNs;
+				drone->packets += packets;
+				drone->turns++;
+				drone->totalTurnNs += turnNs;
+				if (turnNs > drone->maxTurnNs)
+				{
+					drone->maxTurnNs = turnNs;
+				}
+				result += packets;
+			}
+			reactor->nextStart = first + 1;
+		}
+		reactor->passes++;
+		if (result == 0)
+		{
+			reactor->idlePasses++;
+		}
+		return(result);
+	}
+
+	/**
+	* Pumps the drones of one reactor until it is stopped.
+	* @param The owner SwarmLink.
+	* @param The reactor.
+	*/
+	static void reactorThreadFunc(SwarmLink* swarm, SwarmReactor* reactor)
+	{
+		swarm->threadSettings.apply("cf-reactor");
+		std::unique_lock<std::mutex> lock(reactor->droneMutex);
+		while (reactor->running)
+		{
+			if (swarm->_pass(reactor) == 0 && reactor->running)
+			{
+				reactor->idleCondition.wait_for(lock, std::chrono::microseconds(IDLE_WAIT_US));
+			}
+			else
+			{
+				lock.unlock();
+				std::this_thread::yield();
+				lock.lock();
+			}
+		}
+	}
+};
@@ -0,0 +1,159 @@
+/*
+* Header-only thread placement and scheduling for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "messageout.h"
+#include <string>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+* The scheduling of a thread.
+*/
+enum ThreadPolicy : uint8_t
+{
+	THREAD_DEFAULT = 0,		/**< Left as the operating system starts it. */
+	THREAD_NICE = 1,		/**< Time shared with a nice value from -20 to 19, a higher priority on Windows for a negative value. */
+	THREAD_FIFO = 2,		/**< Real-time first in first out with a priority from 1 to 99, time critical on Windows. */
+};
+
+/**
+* Where and how one kind of library thread runs.
+*/
+struct ThreadSettings
+{
+	uint64_t affinityMask = 0;				/**< The cores the thread may run on, bit 0 for core 0, 0 for any core. */
+	ThreadPolicy policy = THREAD_DEFAULT;	/**< The scheduling of the thread. */
+	int32_t priority = 0;					/**< The nice value or the real-time priority, by policy. */
+	std::string name;						/**< The name shown by debuggers and tools, empty for the library name. */
+
+	/**
+	* Places and schedules the calling thread.
+	* A setting the process may not change, such as a real-time priority
+	* without the rights for it, is reported and the thread runs on.
+	* @param The name of the thread when none is set, at most 15 characters on Linux.
+	* @returns true if every setting was applied.
+	*/
+	bool apply(const char* defaultName) const
+	{
+		bool result = true;
+		std::string threadName = name.empty() ? std::string(defaultName) : name;
+#if defined(_WIN32)
+		HANDLE thread = GetCurrentThread();
+		std::wstring wideName(threadName.begin(), threadName.end());
+		SetThreadDescription(thread, wideName.c_str());
+		if (affinityMask != 0)
+		{
+			result = SetThreadAffinityMask(thread, (DWORD_PTR)affinityMask) != 0 && result;
+		}
+		if (policy == THREAD_FIFO)
+		{
+			result = SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL) != 0 && result;
+		}
+		else if (policy == THREAD_NICE)
+		{
+			int32_t level = THREAD_PRIORITY_NORMAL;
+			if (priority <= -10)
+			{
+				level = THREAD_PRIORITY_HIGHEST;
+			}
+			else if (priority < 0)
+			{
+				level = THREAD_PRIORITY_ABOVE_NORMAL;
+			}
+			else if (priority >= 10)
+			{
+				level = THREAD_PRIORITY_LOWEST;
+			}
+			else if (priority > 0)
+			{
+				level = THREAD_PRIORITY_BELOW_NORMAL;
+			}
+			result = SetThreadPriority(thread, level) != 0 && result;
+		}
+#elif defined(__linux__)
+		pthread_t thread = pthread_self();
+		pthread_setname_np(thread, threadName.substr(0, 15).c_str());
+		if (affinityMask != 0)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			for (int32_t core = 0; core < 64 && core < CPU_SETSIZE; core++)
+			{
+				if ((affinityMask >> core) & 1)
+				{
+					CPU_SET(core, &cpus);
+				}
+			}
+			result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus) == 0 && result;
+		}
+		if (policy == THREAD_FIFO)
+		{
+			sched_param param;
+			param.sched_priority = priority;
+			result = pthread_setschedparam(thread, SCHED_FIFO, &param) == 0 && result;
+		}
+		else if (policy == THREAD_NICE)
+		{
+			result = setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), priority) == 0 && result;
+		}
+#else
+		result = (affinityMask == 0 && policy == THREAD_DEFAULT);
+#endif
+		if (!result)
+		{
+			messageOut << "Could not apply every thread setting to ";
+			messageOut << threadName;
+			messageOut << "\n\r";
+		}
+		return(result);
+	}
+};
+
+/**
+* The settings of every kind of thread the library starts.
+* Set on a CrazyFlie or Swarm before connecting.
+*/
+struct ThreadConfig
+{
+	ThreadSettings port;		/**< The port thread, which receives and routes packets. */
+	ThreadSettings transmit;	/**< The transmit thread, which sends setpoints and requests. */
+	ThreadSettings param;		/**< The param queue thread. */
+	ThreadSettings worker;		/**< The worker thread of each port client. */
+	ThreadSettings swarm;		/**< The swarm bring-up threads. */
+};
@@ -0,0 +1,187 @@
+/*
+* Header-only implementation of a shared TOC cache for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+* The usb libray may be found here...
+* https://github.com/libusb/libusb
+*
+*/
+
+
+#pragma once
+#include "logtoc.h"
+#include "paramtoc.h"
+#include "portdispatch.h"
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+/**
+* In-memory TOCs of one kind, keyed by crc and shared by every drone
+* that uses the table.
+* The first drone to ask for a crc fetches it, drones asking while
+* that fetch is in flight wait for it instead of fetching the same TOC.
+* A fetch that is not stored within FETCH_LEASE_MS is handed to the
+* next drone that asks, so a lost drone does not stall the others.
+*/
+template <class TocType>
+struct TocCacheTable
+{
+	const static int32_t CACHE_HIT = 0;			/**< The TOC was copied from the table. */
+	const static int32_t CACHE_FETCH = 1;		/**< The caller must fetch the TOC and store it. */
+	const static int32_t CACHE_WAIT = 2;		/**< Another drone is fetching the TOC, ask again later. */
+	const static int32_t FETCH_LEASE_MS = 5000;	/**< Time a drone may take to fetch a claimed TOC. */
+
+	/**
+	* One TOC in the table.
+	*/
+	struct Entry
+	{
+		uint32_t crc = 0;			/**< The crc of the TOC. */
+		TocType toc;				/**< The TOC, valid when ready. */
+		bool ready = false;			/**< True once the TOC has been stored. */
+		int64_t claimNs = 0;		/**< steady_clock time the current fetch was claimed. */
+	};
+
+	std::mutex mutex;						/**< Held while the table is used. */
+	std::vector<Entry*> entries;			/**< The TOCs by crc. */
+	std::atomic<uint64_t> hits = 0;			/**< Lookups answered from the table. */
+	std::atomic<uint64_t> fetches = 0;		/**< Fetches handed out. */
+	std::atomic<uint64_t> waits = 0;		/**< Lookups told to wait for a fetch in flight. */
+
+	/**
+	* Destructor
+	*/
+	~TocCacheTable()
+	{
+		clear();
+	}
+
+	/**
+	* Removes every TOC from the table.
+	*/
+	void clear()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		for (Entry* entry : entries)
+		{
+			delete entry;
+		}
+		entries.clear();
+	}
+
+	/**
+	* Finds the entry for a crc.
+	* Called with the mutex held.
+	* @param The crc to find.
+	* @returns The entry or NULL.
+	*/
+	Entry* _find(uint32_t crc)
+	{
+		Entry* result = NULL;
+		for (Entry* entry : entries)
+		{
+			if (entry->crc == crc)
+			{
+				result = entry;
+				break;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Looks up a TOC, claiming its fetch if no drone is fetching it.
+	* @param The crc of the TOC.
+	* @param Receives a copy of the TOC on CACHE_HIT.
+	* @returns CACHE_HIT, CACHE_FETCH or CACHE_WAIT.
+	*/
+	int32_t lookup(uint32_t crc, TocType& toc)
+	{
+		int32_t result = CACHE_FETCH;
+		int64_t nowNs = steadyNowNs();
+		std::lock_guard<std::mutex> guard(mutex);
+		Entry* entry = _find(crc);
+		if (entry == NULL)
+		{
+			entry = new Entry();
+			entry->crc = crc;
+			entry->claimNs = nowNs;
+			entries.push_back(entry);
+		}
+		else if (entry->ready)
+		{
+			std::string defaultPath = toc.defaultPath;
+			toc = entry->toc;
+			toc.defaultPath = defaultPath;
+			result = CACHE_HIT;
+		}
+		else if (nowNs - entry->claimNs < (int64_t)FETCH_LEASE_MS * 1000000)
+		{
+			result = CACHE_WAIT;
+		}
+		else
+		{
+			entry->claimNs = nowNs;
+		}
+		if (result == CACHE_HIT)
+		{
+			hits++;
+		}
+		else if (result == CACHE_WAIT)
+		{
+			waits++;
+		}
+		else
+		{
+			fetches++;
+		}
+		return(result);
+	}
+
+	/**
+	* Stores a fetched TOC and releases the drones waiting for it.
+	* @param The crc of the TOC.
+	* @param The complete TOC.
+	*/
+	void store(uint32_t crc, TocType& toc)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		Entry* entry = _find(crc);
+		if (entry == NULL)
+		{
+			entry = new Entry();
+			entry->crc = crc;
+			entries.push_back(entry);
+		}
+		entry->toc = toc;
+		entry->ready = true;
+	}
+};
+
+/**
+* The log and param TOCs shared by a fleet of drones.
+* Set CrazyFlie::tocCache to share it, each distinct crc is
+* then fetched once for the whole fleet.
+*/
+struct TocCache
+{
+	TocCacheTable<LogToc> log;			/**< Log TOCs by crc. */
+	TocCacheTable<ParamToc> param;		/**< Param TOCs by crc. */
+};
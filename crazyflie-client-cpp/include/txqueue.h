@@ -0,0 +1,1348 @@
+/*
+* Header-only implementation of the prioritized transmit queue for crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "Connection.h"
+#include "crtplink.h"
+#include "ctrp.h"
+#include "portdispatch.h"
+#include "linkmetrics.h"
+#include "packetpool.h"
+#include "messageout.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+using namespace bitcraze::crazyflieLinkCpp;
+
+/**
+* Transmit priority classes, highest priority first.
+*/
+enum TxClass : uint8_t
+{
+	TX_EMERGENCY = 0,		/**< Emergency stop, always sent first. */
+	TX_SETPOINT = 1,		/**< Commander and high level commander setpoints. */
+	TX_LOG_CONTROL = 2,		/**< Log block control, link and platform requests. */
+	TX_PARAM = 3,			/**< Param reads and writes. */
+	TX_TOC = 4,				/**< TOC fetches and bulk memory transfers. */
+	TX_CLASS_COUNT = 5,
+	TX_AUTO = 0xff			/**< Choose the class from the packet port and channel. */
+};
+
+/**
+* Lock-free bounded queue with many producers and a single consumer.
+* Each cell carries a sequence number that tells producers and
+* the consumer whose turn it is to use the cell.
+* SIZE must be a power of two.
+*/
+template <class T, uint32_t SIZE>
+struct MpscQueue
+{
+	static_assert((SIZE & (SIZE - 1)) == 0, "MpscQueue size must be a power of two");
+
+	/**
+	* A queue cell.
+	*/
+	struct Cell
+	{
+		std::atomic<uint32_t> sequence;		/**< The position this cell is ready for. */
+		T data;								/**< The queued item. */
+	};
+
+	Cell cells[SIZE];								/**< The queue storage. */
+	alignas(64) std::atomic<uint32_t> enqueuePos;	/**< Next position for a producer. */
+	alignas(64) std::atomic<uint32_t> dequeuePos;	/**< Next position for the consumer. */
+
+	/**
+	* Constructor
+	*/
+	MpscQueue()
+	{
+		clear();
+	}
+
+	/**
+	* Discards all items, only safe when no thread is using the queue.
+	*/
+	void clear()
+	{
+		for (uint32_t i = 0; i < SIZE; i++)
+		{
+			cells[i].sequence = i;
+			cells[i].data = T();
+		}
+		enqueuePos = 0;
+		dequeuePos = 0;
+	}
+
+	/**
+	* Pushes an item, may be called from any thread.
+	* @param The item to push, moved into the queue.
+	* @returns false if the queue is full.
+	*/
+	bool push(T item)
+	{
+		bool result = false;
+		uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell& cell = cells[pos & (SIZE - 1)];
+			uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+			int32_t diff = (int32_t)(seq - pos);
+			if (diff == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.data = std::move(item);
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					result = true;
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				break;		// full
+			}
+			else
+			{
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Pops an item, called only from the consumer thread.
+	* @param The returned item.
+	* @returns false if the queue is empty.
+	*/
+	bool pop(T& item)
+	{
+		bool result = false;
+		uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+		Cell& cell = cells[pos & (SIZE - 1)];
+		uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+		if (seq == pos + 1)
+		{
+			item = std::move(cell.data);
+			dequeuePos.store(pos + 1, std::memory_order_relaxed);
+			cell.sequence.store(pos + SIZE, std::memory_order_release);
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* The approximate number of items in the queue.
+	* @returns The number of items claimed by producers and not yet popped.
+	*/
+	uint32_t size()
+	{
+		return(enqueuePos.load(std::memory_order_acquire) - dequeuePos.load(std::memory_order_acquire));
+	}
+};
+
+/**
+* A packet waiting to be sent.
+*/
+struct TxEntry
+{
+	PacketRef pk;					/**< The packet to send, a slot of the TxQueue pool. */
+	int64_t queuedNs = 0;			/**< steady_clock time in nanoseconds when the packet was queued. */
+};
+
+/**
+* A packet posted to a mailbox slot.
+*/
+struct TxPosted
+{
+	Packet pk;						/**< The packet to send. */
+	int64_t queuedNs = 0;			/**< steady_clock time in nanoseconds when the packet was posted. */
+};
+
+/**
+* Metrics for one transmit priority class.
+*/
+struct TxClassStats
+{
+	std::atomic<uint32_t> queueDepth = 0;		/**< Packets waiting to be sent. */
+	std::atomic<uint32_t> maxQueueDepth = 0;	/**< Largest number of packets seen waiting. */
+	std::atomic<uint64_t> enqueued = 0;			/**< Packets queued. */
+	std::atomic<uint64_t> sent = 0;				/**< Packets handed to the link. */
+	std::atomic<uint64_t> fullWaits = 0;		/**< Times a sender waited because the queue was full. */
+	std::atomic<uint64_t> fullRejects = 0;		/**< Packets try_enqueue turned away because the queue was full. */
+	std::atomic<int64_t> lastWaitNs = 0;		/**< Time the last packet waited in the queue. */
+	std::atomic<int64_t> maxWaitNs = 0;			/**< Longest time a packet waited in the queue. */
+	std::atomic<int64_t> totalWaitNs = 0;		/**< Total time packets waited in the queue. */
+
+	/**
+	* The average time a packet waited in the queue.
+	* @returns The average in nanoseconds.
+	*/
+	int64_t averageWaitNs()
+	{
+		uint64_t count = sent;
+		return(count > 0 ? totalWaitNs / (int64_t)count : 0);
+	}
+
+	/**
+	* Clears the maximums so a new measurement can start.
+	*/
+	void resetMax()
+	{
+		maxQueueDepth = 0;
+		maxWaitNs = 0;
+	}
+};
+
+/**
+* A token bucket budget for the packets of one client or stream.
+* Tokens refill at ratePerSecond up to burst and each packet sent
+* takes one. A packet without a token is deferred until one refills,
+* never dropped. A rate of 0 is unlimited.
+* Configured from any thread, spent only by the transmit thread.
+*/
+struct TxBudget
+{
+	std::atomic<double> ratePerSecond = 0;		/**< Packets per second, 0 for unlimited. */
+	std::atomic<double> burst = 1;				/**< Most packets sent at once after an idle time. */
+	std::atomic<void*> owner;					/**< The client or stream using the budget, NULL when free. */
+	std::atomic<uint64_t> sent = 0;				/**< Packets sent within the budget. */
+	std::atomic<uint64_t> deferred = 0;			/**< Times a packet waited for a token. */
+	std::atomic<int64_t> lastDeferNs = 0;		/**< Time the last deferred packet waited for its token. */
+	std::atomic<int64_t> maxDeferNs = 0;		/**< Longest time a packet waited for its token. */
+	std::atomic<double> tokensLeft = 0;			/**< Tokens left after the last packet. */
+	std::atomic<int64_t> startNs = 0;			/**< Time the budget was configured. */
+	double tokens = 0;							/**< Tokens available, used by the transmit thread. */
+	int64_t refillNs = 0;						/**< Time tokens were last added, 0 to start with a full bucket. */
+	int64_t deferStartNs = 0;					/**< Time the waiting packet was first deferred, 0 if none waits. */
+
+	/**
+	* Constructor
+	*/
+	TxBudget()
+	{
+		owner = NULL;
+	}
+
+	/**
+	* Sets the rate and burst of the budget.
+	* @param Packets per second, 0 for unlimited.
+	* @param Most packets sent at once, at least 1.
+	*/
+	void configure(double _ratePerSecond, double _burst)
+	{
+		burst = _burst < 1.0 ? 1.0 : _burst;
+		ratePerSecond = _ratePerSecond > 0 ? _ratePerSecond : 0.0;
+		startNs = steadyNowNs();
+	}
+
+	/**
+	* Takes a token for a packet, called from the transmit thread.
+	* @param The current steady_clock time.
+	* @returns 0 if the packet may be sent, otherwise the nanoseconds until a token refills.
+	*/
+	int64_t take(int64_t nowNs)
+	{
+		int64_t result = 0;
+		double rate = ratePerSecond;
+		if (rate > 0)
+		{
+			double _burst = burst;
+			if (refillNs == 0)
+			{
+				tokens = _burst;
+			}
+			else
+			{
+				tokens += (double)(nowNs - refillNs) * 1.0e-9 * rate;
+				if (tokens > _burst)
+				{
+					tokens = _burst;
+				}
+			}
+			refillNs = nowNs;
+			if (tokens >= 1.0)
+			{
+				tokens -= 1.0;
+			}
+			else
+			{
+				result = (int64_t)((1.0 - tokens) / rate * 1.0e9) + 1;
+			}
+			tokensLeft = tokens;
+		}
+		if (result == 0)
+		{
+			sent++;
+			if (deferStartNs != 0)
+			{
+				int64_t deferNs = nowNs - deferStartNs;
+				lastDeferNs = deferNs;
+				updateAtomicMax(maxDeferNs, deferNs);
+				deferStartNs = 0;
+			}
+		}
+		else if (deferStartNs == 0)
+		{
+			deferred++;
+			deferStartNs = nowNs;
+		}
+		return(result);
+	}
+
+	/**
+	* The packets sent per second since the budget was configured.
+	* @returns The average rate.
+	*/
+	double usedPerSecond()
+	{
+		double seconds = (double)(steadyNowNs() - startNs) * 1.0e-9;
+		return(seconds > 0 ? (double)sent / seconds : 0.0);
+	}
+};
+
+/**
+* The rate and burst of a TxBudget, as set by an owner before connecting.
+*/
+struct TxBudgetSetting
+{
+	double ratePerSecond = 0;		/**< Packets per second, 0 for unlimited. */
+	double burst = 8;				/**< Most packets sent at once after an idle time. */
+};
+
+/**
+* A latest-wins mailbox slot for one stream of packets.
+* Uses a triple buffer, so posting and taking never block
+* each other. Only one thread may post to a slot.
+*/
+struct TxMailboxSlot
+{
+	const static uint8_t FRESH = 0x4;		/**< Set in middle when it holds an unsent packet. */
+
+	TxPosted entries[3];					/**< The three buffers. */
+	std::atomic<uint8_t> middle = 2;		/**< The shared buffer index and the FRESH bit. */
+	uint8_t back = 0;						/**< The buffer owned by the posting thread. */
+	uint8_t front = 1;						/**< The buffer owned by the transmit thread. */
+
+	/**
+	* Replaces the packet waiting in this slot.
+	* @param The packet to post.
+	* @returns true if an unsent packet was replaced.
+	*/
+	bool post(Packet& pk)
+	{
+		entries[back].pk = pk;
+		entries[back].queuedNs = steadyNowNs();
+		uint8_t previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+		back = previous & 0x3;
+		return((previous & FRESH) != 0);
+	}
+
+	/**
+	* Checks if the slot holds an unsent packet.
+	* @returns true if a packet is waiting.
+	*/
+	bool pending()
+	{
+		return((middle.load(std::memory_order_acquire) & FRESH) != 0);
+	}
+
+	/**
+	* Discards an unsent packet, called only from the posting thread.
+	* A packet the transmit thread has already taken is still sent.
+	* @returns true if a packet was discarded.
+	*/
+	bool discard()
+	{
+		uint8_t previous = middle.fetch_and((uint8_t)~FRESH, std::memory_order_acq_rel);
+		return((previous & FRESH) != 0);
+	}
+
+	/**
+	* Takes the waiting packet, called only from the transmit thread.
+	* The packet is left in its buffer, which is not reused before the next take.
+	* @param The returned entry.
+	* @returns false if no packet was waiting.
+	*/
+	bool take(TxPosted*& entry)
+	{
+		bool result = false;
+		if (pending())
+		{
+			uint8_t previous = middle.exchange(front, std::memory_order_acq_rel);
+			front = previous & 0x3;
+			entry = &entries[front];
+			result = true;
+		}
+		return(result);
+	}
+};
+
+/**
+* A set of latest-wins slots, one for each type of setpoint.
+* Posting a packet replaces any packet of the same slot that has
+* not been sent yet, the transmit thread sends the newest one
+* at its next chance at setpoint priority.
+*/
+struct TxMailbox
+{
+	const static int32_t MAX_SLOTS = 8;			/**< Number of slots in a mailbox. */
+
+	TxMailboxSlot slots[MAX_SLOTS];				/**< The slots. */
+	std::atomic<uint64_t> posted = 0;			/**< Packets posted. */
+	std::atomic<uint64_t> superseded = 0;		/**< Packets replaced before they were sent. */
+	std::atomic<uint64_t> sent = 0;				/**< Packets handed to the link. */
+	std::atomic<uint64_t> discarded = 0;		/**< Packets discarded before they were sent. */
+	std::atomic<int64_t> lastWaitNs = 0;		/**< Time the last sent packet waited in its slot. */
+	std::atomic<int64_t> maxWaitNs = 0;			/**< Longest time a sent packet waited in its slot. */
+	TxBudget budget;							/**< Limits the setpoints sent from the mailbox. */
+
+	/**
+	* Posts a packet to a slot.
+	* @param The slot index.
+	* @param The packet.
+	* @returns true if the packet was posted.
+	*/
+	bool post(int32_t slot, Packet& pk)
+	{
+		bool result = false;
+		if (slot >= 0 && slot < MAX_SLOTS)
+		{
+			posted++;
+			if (slots[slot].post(pk))
+			{
+				superseded++;
+			}
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Checks if any slot holds an unsent packet.
+	* @returns true if a packet is waiting.
+	*/
+	bool pending()
+	{
+		bool result = false;
+		for (int32_t i = 0; i < MAX_SLOTS; i++)
+		{
+			if (slots[i].pending())
+			{
+				result = true;
+				break;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Discards every unsent packet, called from the posting thread.
+	* @returns The number of packets discarded.
+	*/
+	int32_t discard()
+	{
+		int32_t result = 0;
+		for (int32_t i = 0; i < MAX_SLOTS; i++)
+		{
+			if (slots[i].discard())
+			{
+				result++;
+			}
+		}
+		discarded += result;
+		return(result);
+	}
+
+	/**
+	* Takes the first waiting packet.
+	* @param The returned entry, valid until the next take of its slot.
+	* @returns false if no packet was waiting.
+	*/
+	bool take(TxPosted*& entry)
+	{
+		bool result = false;
+		for (int32_t i = 0; i < MAX_SLOTS; i++)
+		{
+			if (slots[i].take(entry))
+			{
+				result = true;
+				break;
+			}
+		}
+		return(result);
+	}
+};
+
+/**
+* The packets of one TxBudget and priority class waiting for a token,
+* in the order they were queued. Used only by the transmit thread.
+*/
+struct TxDeferred
+{
+	const static uint32_t SIZE = 32;		/**< Most packets that may wait for one budget and class. */
+
+	TxEntry entries[SIZE];					/**< The waiting packets. */
+	uint32_t head = 0;						/**< Index of the oldest packet. */
+	uint32_t count = 0;						/**< Number of waiting packets. */
+
+	/**
+	* Adds a packet behind the others.
+	* @param The packet, moved into the ring.
+	* @returns false if the ring is full.
+	*/
+	bool push(TxEntry& entry)
+	{
+		bool result = false;
+		if (count < SIZE)
+		{
+			entries[(head + count) % SIZE] = std::move(entry);
+			count++;
+			result = true;
+		}
+		return(result);
+	}
+
+	/**
+	* Takes the oldest packet.
+	* @param The returned entry.
+	*/
+	void pop(TxEntry& entry)
+	{
+		entry = std::move(entries[head]);
+		head = (head + 1) % SIZE;
+		count--;
+	}
+
+	/**
+	* Discards every waiting packet.
+	*/
+	void clear()
+	{
+		while (count > 0)
+		{
+			entries[head].pk.release();
+			head = (head + 1) % SIZE;
+			count--;
+		}
+		head = 0;
+	}
+};
+
+/**
+* Queues packets from any thread and sends them from
+* a single transmit thread, highest priority class first.
+* A port may be given a TxBudget, packets of a port over its budget
+* wait in a TxDeferred ring for the budget and class while the
+* packets of other budgets, and the other classes, are sent.
+* Emergency packets are never limited.
+*/
+struct TxQueue
+{
+	const static uint32_t QUEUE_SIZE = 512;				/**< Packets that may wait in each class. */
+	const static int32_t MAX_MAILBOXES = 4;				/**< Number of mailboxes that may be attached. */
+	const static int32_t MAX_BUDGETS = 8;				/**< Number of budgets that may be set. */
+	const static int8_t NO_BUDGET = -1;					/**< A port without a budget. */
+	const static uint32_t POOL_SIZE = 256;				/**< Packets in the pool before packets are taken from the heap. */
+
+	PacketPool pool;									/**< The packets waiting to be sent, senders may build packets in place. */
+	MpscQueue<TxEntry, QUEUE_SIZE> queues[TX_CLASS_COUNT];	/**< One queue for each priority class. */
+	TxClassStats stats[TX_CLASS_COUNT];					/**< Metrics for each priority class. */
+	std::atomic<CrtpLink*> link;						/**< The link packets are sent on. */
+	std::mutex linkMutex;								/**< Held while packets are sent on the link. */
+	std::thread txThread;								/**< Thread sending the packets. */
+	std::atomic<bool> running = false;					/**< true while the transmit thread runs. */
+	std::atomic<bool> sleeping = false;					/**< true while the transmit thread waits for packets. */
+	std::mutex wakeMutex;								/**< Mutex for the wake condition. */
+	std::condition_variable wakeCondition;				/**< Signalled when packets are queued or the thread stops. */
+	std::condition_variable idleCondition;				/**< Signalled when every queue is empty. */
+	std::atomic<TxMailbox*> mailboxes[MAX_MAILBOXES];	/**< Attached latest-wins mailboxes. */
+	std::mutex mailboxMutex;							/**< Held while a mailbox is being read or detached. */
+	LinkMetrics* metrics;								/**< Counts each packet handed to the link when not NULL. */
+	TxBudget budgets[MAX_BUDGETS];						/**< Budgets shared by the ports of a client or stream. */
+	std::atomic<int8_t> portBudgets[PORT_COUNT];		/**< The budget of each port, or NO_BUDGET. */
+	TxDeferred deferred[MAX_BUDGETS][TX_CLASS_COUNT];	/**< The packets of each budget and class waiting for a token. */
+	std::atomic<uint32_t> deferredCount = 0;			/**< Packets waiting in the deferred rings. */
+	TxEntry held[TX_CLASS_COUNT];						/**< The head packet of each class, held while the deferred ring of its budget is full. */
+	std::atomic<bool> holding[TX_CLASS_COUNT];			/**< true while held holds a packet. */
+	std::atomic<int64_t> deferUntilNs = 0;				/**< Time the next deferred packet has a token, 0 if none waits. */
+	std::atomic<uint32_t> wakeCount = 0;				/**< Counts calls to wake() so the thread sees packets queued while it drained. */
+	const ThreadSettings* threadSettings;				/**< Applied to the transmit thread when it starts, may be NULL. */
+	LatencyHistogram* wakeJitter;						/**< Records how late the thread wakes for a budget token when not NULL. */
+
+	/**
+	* Constructor
+	*/
+	TxQueue() : pool(POOL_SIZE)
+	{
+		link = NULL;
+		metrics = NULL;
+		threadSettings = NULL;
+		wakeJitter = NULL;
+		for (int32_t i = 0; i < MAX_MAILBOXES; i++)
+		{
+			mailboxes[i] = NULL;
+		}
+		for (int32_t i = 0; i < PORT_COUNT; i++)
+		{
+			portBudgets[i] = NO_BUDGET;
+		}
+		for (int32_t i = 0; i < TX_CLASS_COUNT; i++)
+		{
+			holding[i] = false;
+		}
+	}
+
+	/**
+	* Destructor
+	*/
+	~TxQueue()
+	{
+		stop();
+	}
+
+	/**
+	* Chooses the priority class of a packet from its port and channel.
+	* @param The packet to classify.
+	* @returns The priority class.
+	*/
+	static TxClass classify(Packet& pk)
+	{
+		TxClass result = TX_LOG_CONTROL;
+		uint8_t port = pk.port();
+		uint8_t channel = pk.channel();
+		switch (port)
+		{
+		case COMMANDER:
+		case COMMANDER_GENERIC:
+		case SETPOINT_HL:
+		case LOCALIZATION:
+			result = TX_SETPOINT;
+			break;
+		case LOGGING:
+			result = (channel == TOC_CHANNEL) ? TX_TOC : TX_LOG_CONTROL;
+			break;
+		case PARAM:
+			result = (channel == TOC_CHANNEL) ? TX_TOC : TX_PARAM;
+			break;
+		case MEM:
+			result = TX_TOC;
+			break;
+		default:
+			result = TX_LOG_CONTROL;
+			break;
+		}
+		return(result);
+	}
+
+	/**
+	* Starts the transmit thread.
+	* Without a thread, the owner sends the packets by calling drain().
+	* @param The connection to send on.
+	* @param true to start the transmit thread.
+	*/
+	void start(CrtpLink* _link, bool startThread = true)
+	{
+		if (!running)
+		{
+			link = _link;
+			running = true;
+			if (startThread)
+			{
+				txThread = std::thread(txThreadFunc, this);
+			}
+		}
+	}
+
+	/**
+	* Stops and joins the transmit thread.
+	* Packets still queued are discarded.
+	*/
+	void stop()
+	{
+		if (running)
+		{
+			{
+				std::lock_guard<std::mutex> guard(wakeMutex);
+				running = false;
+			}
+			wakeCondition.notify_one();
+			if (txThread.joinable())
+			{
+				txThread.join();
+			}
+		}
+		for (int32_t i = 0; i < TX_CLASS_COUNT; i++)
+		{
+			queues[i].clear();
+			stats[i].queueDepth = 0;
+			holding[i] = false;
+			held[i].pk.release();
+		}
+		for (int32_t i = 0; i < MAX_BUDGETS; i++)
+		{
+			for (int32_t j = 0; j < TX_CLASS_COUNT; j++)
+			{
+				deferred[i][j].clear();
+			}
+		}
+		deferredCount = 0;
+		deferUntilNs = 0;
+		link = NULL;
+	}
+
+	/**
+	* Sets the budget of a client or stream, may be called from any thread.
+	* @param The client or stream, ports given the same owner share one budget.
+	* @param Packets per second, 0 for unlimited.
+	* @param Most packets sent at once after an idle time.
+	* @returns The index of the budget, or NO_BUDGET if every budget is in use.
+	*/
+	int32_t set_budget(void* owner, double ratePerSecond, double burst)
+	{
+		int32_t result = find_budget(owner);
+		for (int32_t i = 0; i < MAX_BUDGETS && result == NO_BUDGET; i++)
+		{
+			void* expected = NULL;
+			if (budgets[i].owner.compare_exchange_strong(expected, owner))
+			{
+				result = i;
+			}
+		}
+		if (result != NO_BUDGET)
+		{
+			budgets[result].configure(ratePerSecond, burst);
+		}
+		return(result);
+	}
+
+	/**
+	* Finds the budget of a client or stream.
+	* @param The client or stream.
+	* @returns The index of the budget, or NO_BUDGET.
+	*/
+	int32_t find_budget(void* owner)
+	{
+		int32_t result = NO_BUDGET;
+		for (int32_t i = 0; i < MAX_BUDGETS && owner != NULL; i++)
+		{
+			if (budgets[i].owner == owner)
+			{
+				result = i;
+				break;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Limits the packets of a port by a budget.
+	* @param The port.
+	* @param The index of the budget, or NO_BUDGET to remove the limit.
+	*/
+	void assign_budget(uint8_t port, int32_t index)
+	{
+		if (port < PORT_COUNT && index >= NO_BUDGET && index < MAX_BUDGETS)
+		{
+			portBudgets[port] = (int8_t)index;
+			wake();
+		}
+	}
+
+	/**
+	* Finds the budget limiting a packet.
+	* @param The packet.
+	* @returns The budget, or NULL if the port is unlimited.
+	*/
+	TxBudget* budgetOf(const Packet& pk)
+	{
+		int8_t index = portBudgets[pk.port() & (PORT_COUNT - 1)];
+		return(index != NO_BUDGET ? &budgets[index] : NULL);
+	}
+
+	/**
+	* Writes the use of each budget to messageOut.
+	*/
+	void report_budgets()
+	{
+		for (int32_t i = 0; i < MAX_BUDGETS; i++)
+		{
+			TxBudget& budget = budgets[i];
+			if (budget.owner != NULL)
+			{
+				messageOut << "budget ";
+				messageOut << i;
+				messageOut << " rate ";
+				messageOut << (double)budget.ratePerSecond;
+				messageOut << " used ";
+				messageOut << budget.usedPerSecond();
+				messageOut << " sent ";
+				messageOut << (uint64_t)budget.sent;
+				messageOut << " deferred ";
+				messageOut << (uint64_t)budget.deferred;
+				messageOut << " max wait ";
+				messageOut << (double)budget.maxDeferNs * 1.0e-6;
+				messageOut << " ms\n\r";
+			}
+		}
+	}
+
+	/**
+	* Replaces the link packets are sent on, when a link is reopened.
+	* When this returns the previous link is no longer in use.
+	* While the link is NULL, packets stay queued.
+	* @param The new link, or NULL to hold the packets.
+	*/
+	void set_link(CrtpLink* _link)
+	{
+		{
+			std::lock_guard<std::mutex> guard(linkMutex);
+			link = _link;
+		}
+		wake();
+	}
+
+	/**
+	* Attaches a mailbox to be sent at setpoint priority.
+	* @param The mailbox to attach.
+	* @returns true if the mailbox is attached.
+	*/
+	bool attach_mailbox(TxMailbox* mailbox)
+	{
+		bool result = false;
+		std::lock_guard<std::mutex> guard(mailboxMutex);
+		for (int32_t i = 0; i < MAX_MAILBOXES && !result; i++)
+		{
+			result = (mailboxes[i] == mailbox);
+		}
+		for (int32_t i = 0; i < MAX_MAILBOXES && !result; i++)
+		{
+			if (mailboxes[i] == NULL)
+			{
+				mailboxes[i] = mailbox;
+				result = true;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Detaches a mailbox.
+	* When this returns the transmit thread no longer uses the mailbox.
+	* @param The mailbox to detach.
+	*/
+	void detach_mailbox(TxMailbox* mailbox)
+	{
+		std::lock_guard<std::mutex> guard(mailboxMutex);
+		for (int32_t i = 0; i < MAX_MAILBOXES; i++)
+		{
+			if (mailboxes[i] == mailbox)
+			{
+				mailboxes[i] = NULL;
+			}
+		}
+	}
+
+	/**
+	* Posts a packet to a mailbox slot and wakes the transmit thread.
+	* @param The attached mailbox.
+	* @param The slot in the mailbox.
+	* @param The packet to post.
+	* @returns true if the packet was posted.
+	*/
+	bool post(TxMailbox& mailbox, int32_t slot, Packet& pk)
+	{
+		bool result = mailbox.post(slot, pk);
+		if (result)
+		{
+			wake();
+		}
+		return(result);
+	}
+
+	/**
+	* Wakes the transmit thread if it is waiting.
+	*/
+	void wake()
+	{
+		wakeCount++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping)
+		{
+			std::lock_guard<std::mutex> guard(wakeMutex);
+			wakeCondition.notify_one();
+		}
+	}
+
+	/**
+	* Checks if every class queue and mailbox is empty.
+	* @returns true if nothing is waiting to be sent.
+	*/
+	bool empty()
+	{
+		bool result = (deferredCount == 0);
+		for (int32_t i = 0; i < TX_CLASS_COUNT && result; i++)
+		{
+			if (queues[i].size() > 0 || holding[i])
+			{
+				result = false;
+				break;
+			}
+		}
+		std::lock_guard<std::mutex> guard(mailboxMutex);
+		for (int32_t i = 0; i < MAX_MAILBOXES && result; i++)
+		{
+			TxMailbox* mailbox = mailboxes[i];
+			if (mailbox != NULL && mailbox->pending())
+			{
+				result = false;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Waits until every queued packet has been sent.
+	* Without a transmit thread the packets are sent on the calling thread.
+	* @param The longest time to wait in milliseconds.
+	* @returns true if the queues are empty.
+	*/
+	bool flush(uint32_t timeoutMs)
+	{
+		bool result = false;
+		if (running && !txThread.joinable())
+		{
+			drain();
+			result = empty();
+		}
+		else
+		{
+			std::unique_lock<std::mutex> lock(wakeMutex);
+			result = idleCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {
+				return(!running || empty());
+				});
+		}
+		return(result);
+	}
+
+	/**
+	* Queues a copy of a packet, may be called from any thread.
+	* If the class queue is full the caller waits for room,
+	* packets are never dropped while the queue is running.
+	* @param The packet to send.
+	* @param The priority class, or TX_AUTO to classify the packet.
+	* @returns true if the packet was queued.
+	*/
+	bool enqueue(Packet& pk, TxClass txClass = TX_AUTO)
+	{
+		PacketRef ref = pool.alloc();
+		*ref = pk;
+		return(enqueue(ref, txClass));
+	}
+
+	/**
+	* Queues a packet built in a slot of the pool, may be called from any thread.
+	* The packet is sent without being copied.
+	* If the class queue is full the caller waits for room,
+	* packets are never dropped while the queue is running.
+	* @param The packet to send.
+	* @param The priority class, or TX_AUTO to classify the packet.
+	* @returns true if the packet was queued.
+	*/
+	bool enqueue(const PacketRef& pk, TxClass txClass = TX_AUTO)
+	{
+		bool result = false;
+		if (txClass >= TX_CLASS_COUNT)
+		{
+			txClass = classify(*pk);
+		}
+		TxEntry entry;
+		entry.pk = pk;
+		entry.queuedNs = steadyNowNs();
+
+		TxClassStats& classStats = stats[txClass];
+		while (running)
+		{
+			if (queues[txClass].push(entry))
+			{
+				result = true;
+				break;
+			}
+			classStats.fullWaits++;
+			std::this_thread::yield();
+		}
+		if (result)
+		{
+			classStats.enqueued++;
+			uint32_t depth = queues[txClass].size();
+			classStats.queueDepth = depth;
+			updateAtomicMax(classStats.maxQueueDepth, depth);
+			wake();
+		}
+		return(result);
+	}
+
+	/**
+	* Queues a copy of a packet without waiting, for the port thread
+	* which must not stall while the transmit thread drains the queue.
+	* @param The packet to send.
+	* @param The priority class, or TX_AUTO to classify the packet.
+	* @returns false if the class queue is full or the queue is stopped.
+	*/
+	bool try_enqueue(Packet& pk, TxClass txClass = TX_AUTO)
+	{
+		bool result = false;
+		if (txClass >= TX_CLASS_COUNT)
+		{
+			txClass = classify(pk);
+		}
+		TxClassStats& classStats = stats[txClass];
+		if (running)
+		{
+			TxEntry entry;
+			entry.pk = pool.alloc();
+			*entry.pk = pk;
+			entry.queuedNs = steadyNowNs();
+			result = queues[txClass].push(entry);
+		}
+		if (result)
+		{
+			classStats.enqueued++;
+			uint32_t depth = queues[txClass].size();
+			classStats.queueDepth = depth;
+			updateAtomicMax(classStats.maxQueueDepth, depth);
+			wake();
+		}
+		else
+		{
+			classStats.fullRejects++;
+		}
+		return(result);
+	}
+
+	/**
+	* Queues a run of packets in order, may be called from any thread.
+	* The transmit thread is woken once, after the last packet is queued.
+	* If a class queue is full the caller waits for room,
+	* packets are never dropped while the queue is running.
+	* @param The packets to send.
+	* @param The priority class, or TX_AUTO to classify each packet.
+	* @returns The number of packets queued.
+	*/
+	int32_t enqueue_batch(PacketSpan packets, TxClass txClass = TX_AUTO)
+	{
+		int32_t result = 0;
+		TxEntry entry;
+		entry.queuedNs = steadyNowNs();
+		for (size_t i = 0; i < packets.size() && running; i++)
+		{
+			entry.pk = pool.alloc();
+			*entry.pk = packets[i];
+			TxClass _txClass = txClass < TX_CLASS_COUNT ? txClass : classify(*entry.pk);
+			TxClassStats& classStats = stats[_txClass];
+			while (running && !queues[_txClass].push(entry))
+			{
+				classStats.fullWaits++;
+				wake();
+				std::this_thread::yield();
+			}
+			if (running)
+			{
+				classStats.enqueued++;
+				uint32_t depth = queues[_txClass].size();
+				classStats.queueDepth = depth;
+				updateAtomicMax(classStats.maxQueueDepth, depth);
+				result++;
+			}
+		}
+		if (result > 0)
+		{
+			wake();
+		}
+		return(result);
+	}
+
+	/**
+	* Notes the time a deferred packet will have a token.
+	* @param The nanoseconds until the token refills.
+	* @param The current steady_clock time.
+	* @param The earliest time found so far in this drain, updated.
+	*/
+	static void _defer(int64_t waitNs, int64_t nowNs, int64_t& untilNs)
+	{
+		int64_t readyNs = nowNs + waitNs;
+		if (untilNs == 0 || readyNs < untilNs)
+		{
+			untilNs = readyNs;
+		}
+	}
+
+	/**
+	* Takes the newest packet from the first mailbox that has one
+	* and a token in its budget.
+	* @param The returned entry.
+	* @param The current steady_clock time.
+	* @param The earliest time a deferred packet has a token, updated.
+	* @returns false if no mailbox has a packet ready.
+	*/
+	bool takeMailbox(TxPosted*& entry, int64_t nowNs, int64_t& untilNs)
+	{
+		bool result = false;
+		std::lock_guard<std::mutex> guard(mailboxMutex);
+		for (int32_t i = 0; i < MAX_MAILBOXES && !result; i++)
+		{
+			TxMailbox* mailbox = mailboxes[i];
+			if (mailbox == NULL || !mailbox->pending())
+			{
+				continue;
+			}
+			int64_t waitNs = mailbox->budget.take(nowNs);
+			if (waitNs > 0)
+			{
+				_defer(waitNs, nowNs, untilNs);
+			}
+			else if (mailbox->take(entry))
+			{
+				int64_t waitNs = steadyNowNs() - entry->queuedNs;
+				mailbox->sent++;
+				mailbox->lastWaitNs = waitNs;
+				updateAtomicMax(mailbox->maxWaitNs, waitNs);
+				result = true;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Takes the oldest deferred packet of a class whose budget has a token.
+	* @param The priority class.
+	* @param The returned entry.
+	* @param The current steady_clock time.
+	* @param The earliest time a deferred packet has a token, updated.
+	* @returns false if no deferred packet of the class is ready.
+	*/
+	bool _take_deferred(int32_t txClass, TxEntry& entry, int64_t nowNs, int64_t& untilNs)
+	{
+		bool result = false;
+		for (int32_t i = 0; i < MAX_BUDGETS && deferredCount > 0; i++)
+		{
+			if (deferred[i][txClass].count > 0)
+			{
+				int64_t waitNs = budgets[i].take(nowNs);
+				if (waitNs > 0)
+				{
+					_defer(waitNs, nowNs, untilNs);
+				}
+				else
+				{
+					deferred[i][txClass].pop(entry);
+					deferredCount--;
+					result = true;
+					break;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Pops the next queued packet of a class that is within its budget.
+	* A packet over its budget, or behind other deferred packets of its
+	* budget and class, moves to their deferred ring so the packets of
+	* other budgets in the class are sent. The class waits at its head
+	* only while that ring is full.
+	* @param The priority class.
+	* @param The returned entry.
+	* @param The current steady_clock time.
+	* @param The earliest time a deferred packet has a token, updated.
+	* @returns false if no packet of the class is ready.
+	*/
+	bool _take_queued(int32_t txClass, TxEntry& entry, int64_t nowNs, int64_t& untilNs)
+	{
+		bool result = false;
+		bool blocked = false;
+		while (!result && !blocked)
+		{
+			if (!holding[txClass] && queues[txClass].pop(held[txClass]))
+			{
+				holding[txClass] = true;
+			}
+			if (!holding[txClass])
+			{
+				break;
+			}
+			int8_t index = (txClass != TX_EMERGENCY) ? portBudgets[held[txClass].pk->port() & (PORT_COUNT - 1)].load() : NO_BUDGET;
+			TxDeferred* ring = (index != NO_BUDGET) ? &deferred[index][txClass] : NULL;
+			int64_t waitNs = 0;
+			if (ring != NULL && ring->count == 0)
+			{
+				waitNs = budgets[index].take(nowNs);
+			}
+			if (ring == NULL || (ring->count == 0 && waitNs == 0))
+			{
+				entry = std::move(held[txClass]);
+				holding[txClass] = false;
+				result = true;
+			}
+			else
+			{
+				if (waitNs > 0)
+				{
+					_defer(waitNs, nowNs, untilNs);
+				}
+				if (ring->push(held[txClass]))
+				{
+					holding[txClass] = false;
+					deferredCount++;
+				}
+				else
+				{
+					blocked = true;
+				}
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Pops the next packet to send, highest priority class first.
+	* Mailbox setpoints are sent ahead of queued setpoints, and the
+	* deferred packets of a class ahead of its newer queued packets.
+	* A packet over its budget waits for a token without holding up
+	* the packets of other budgets.
+	* @param The returned entry of a class queue.
+	* @param The returned entry of a mailbox, NULL if the packet was queued.
+	* @param The returned class of the entry.
+	* @param The current steady_clock time.
+	* @param The earliest time a deferred packet has a token, updated.
+	* @returns false if nothing is ready.
+	*/
+	bool next(TxEntry& entry, TxPosted*& posted, int32_t& txClass, int64_t nowNs, int64_t& untilNs)
+	{
+		bool result = false;
+		posted = NULL;
+		for (int32_t i = 0; i < TX_CLASS_COUNT; i++)
+		{
+			if (i == TX_SETPOINT && takeMailbox(posted, nowNs, untilNs))
+			{
+				txClass = i;
+				result = true;
+				break;
+			}
+			if (_take_deferred(i, entry, nowNs, untilNs) || _take_queued(i, entry, nowNs, untilNs))
+			{
+				txClass = i;
+				result = true;
+				break;
+			}
+		}
+		return(result);
+	}
+
+	/**
+	* Sends every queued packet, highest priority class first.
+	* @returns The number of packets sent.
+	*/
+	int32_t drain()
+	{
+		int32_t count = 0;
+		TxEntry entry;
+		TxPosted* posted = NULL;
+		int32_t txClass = 0;
+		int64_t untilNs = 0;
+		std::lock_guard<std::mutex> guard(linkMutex);
+		CrtpLink* sendLink = link;
+		while (sendLink != NULL && next(entry, posted, txClass, steadyNowNs(), untilNs))
+		{
+			Packet& pk = (posted != NULL) ? posted->pk : *entry.pk;
+			sendLink->send(pk);
+			if (metrics != NULL)
+			{
+				metrics->count_tx(pk);
+			}
+			if (posted == NULL)
+			{
+				TxClassStats& classStats = stats[txClass];
+				int64_t waitNs = steadyNowNs() - entry.queuedNs;
+				classStats.sent++;
+				classStats.queueDepth = queues[txClass].size();
+				classStats.lastWaitNs = waitNs;
+				classStats.totalWaitNs += waitNs;
+				updateAtomicMax(classStats.maxWaitNs, waitNs);
+				entry.pk.release();
+			}
+			count++;
+		}
+		deferUntilNs = untilNs;
+		return(count);
+	}
+
+	/**
+	* Sends packets until the queue is stopped.
+	* @param The owner TxQueue.
+	*/
+	static void txThreadFunc(void* data)
+	{
+		TxQueue* txQueue = (TxQueue*)data;
+		if (txQueue->threadSettings != NULL)
+		{
+			txQueue->threadSettings->apply("cf-tx");
+		}
+		while (txQueue->running)
+		{
+			uint32_t wakes = txQueue->wakeCount;
+			txQueue->drain();
+
+			std::unique_lock<std::mutex> lock(txQueue->wakeMutex);
+			txQueue->sleeping = true;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (txQueue->empty())
+			{
+				txQueue->idleCondition.notify_all();
+			}
+			int64_t untilNs = txQueue->deferUntilNs;
+			if (untilNs != 0)
+			{
+				// packets wait for their budget, sleep until a token refills or more are queued.
+				bool woken = txQueue->wakeCondition.wait_for(lock, std::chrono::nanoseconds(untilNs - steadyNowNs()), [txQueue, wakes] {
+					return(!txQueue->running || txQueue->wakeCount != wakes);
+					});
+				if (!woken && txQueue->wakeJitter != NULL)
+				{
+					ThreadMetrics::record_wake(*txQueue->wakeJitter, untilNs);
+				}
+			}
+			else
+			{
+				txQueue->wakeCondition.wait(lock, [txQueue] {
+					return(!txQueue->running || (txQueue->link != NULL && !txQueue->empty()));
+					});
+			}
+			txQueue->sleeping = false;
+		}
+		txQueue->idleCondition.notify_all();
+	}
+};
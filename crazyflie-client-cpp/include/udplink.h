@@ -0,0 +1,344 @@
+/*
+* Header-only CRTP over UDP for software in the loop crazyflies
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Implements interfaces found here...
+* https://github.com/bitcraze/crazyflie-clients-python
+* Using the c++ library found here...
+* https://github.com/bitcraze/crazyflie-link-cpp
+*
+*/
+
+#pragma once
+#include "crtplink.h"
+#include "messageout.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET UdpSocket;
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+typedef int UdpSocket;
+#endif
+
+/**
+* A CrtpLink on UDP, for a software in the loop crazyflie firmware
+* such as CrazySim, at a uri like udp://127.0.0.1:19850.
+* Each datagram is one CRTP packet, the header byte then the payload.
+* The firmware learns the address of the client from a connect
+* message and forgets it on a disconnect message.
+*/
+class UdpLink : public CrtpLink
+{
+public:
+	const static uint16_t DEFAULT_PORT = 19850;		/**< The port of the first simulated crazyflie. */
+
+	std::string linkUri;							/**< The uri the link was opened with. */
+	UdpSocket udpSocket;							/**< The socket, connected to the firmware, released by the destructor. */
+	std::atomic<bool> isOpen;						/**< true until the link is closed. */
+	bool socketsStarted;							/**< true if WSAStartup succeeded and needs a WSACleanup. */
+
+	/**
+	* Constructor, opens the socket and sends the connect message.
+	* @param The uri, udp://host:port.
+	*/
+	UdpLink(const std::string& uri)
+	{
+		linkUri = uri;
+		isOpen = false;
+		udpSocket = _invalid();
+		socketsStarted = true;
+		std::string host = "127.0.0.1";
+		uint16_t port = DEFAULT_PORT;
+		_parse_uri(uri, host, port);
+#if defined(_WIN32)
+		WSADATA wsaData;
+		socketsStarted = (WSAStartup(MAKEWORD(2, 2), &wsaData) == 0);
+#endif
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo* address = NULL;
+		if (socketsStarted && getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &address) == 0 && address != NULL)
+		{
+			udpSocket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (_valid(udpSocket) && connect(udpSocket, address->ai_addr, (int)address->ai_addrlen) == 0)
+			{
+				// receive() polls for the first packet, the rest are read without waiting.
+#if defined(_WIN32)
+				u_long nonBlocking = 1;
+				ioctlsocket(udpSocket, FIONBIO, &nonBlocking);
+#else
+				fcntl(udpSocket, F_SETFL, fcntl(udpSocket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+				isOpen = true;
+				static const uint8_t connectMessage[] = { 0xFF, 0x01, 0x01, 0x01 };
+				_send_raw(connectMessage, sizeof(connectMessage));
+			}
+			freeaddrinfo(address);
+		}
+		if (!isOpen)
+		{
+			_release();
+			messageOut << "Could not open ";
+			messageOut << uri;
+			messageOut << "\n\r";
+		}
+	}
+
+	/**
+	* Destructor, releases the socket once no thread uses the link.
+	*/
+	~UdpLink()
+	{
+		close();
+		_release();
+	}
+
+	/**
+	* Virtual CrtpLink call, sends the packet as one datagram.
+	* @param The packet to send.
+	*/
+	void send(const Packet& pk)
+	{
+		if (isOpen && pk.size() > 0)
+		{
+			_send_raw(pk.raw(), pk.size());
+		}
+	}
+
+	/**
+	* Virtual CrtpLink call, receives the next datagram.
+	* @param The longest wait in milliseconds.
+	* @returns The packet, with a size of 0 if none arrived.
+	*/
+	Packet receive(uint32_t timeoutMs)
+	{
+		Packet pk;
+		if (isOpen)
+		{
+			uint8_t buffer[CRTP_MAXSIZE + 1];
+			int32_t size = _receive_raw(buffer, sizeof(buffer));
+			if (size < 0 && timeoutMs > 0 && _wait(timeoutMs))
+			{
+				size = _receive_raw(buffer, sizeof(buffer));
+			}
+			if (size > 0 && size <= (int32_t)CRTP_MAXSIZE)
+			{
+				pk = Packet(buffer, (size_t)size);
+			}
+		}
+		return(pk);
+	}
+
+	/**
+	* Virtual CrtpLink call, sends the disconnect message and shuts the
+	* socket down. The port thread may still be waiting on the socket,
+	* so it stays valid until the destructor releases it.
+	*/
+	void close()
+	{
+		if (isOpen.exchange(false))
+		{
+			static const uint8_t disconnectMessage[] = { 0xFF, 0x01, 0x02, 0x02 };
+			_send_raw(disconnectMessage, sizeof(disconnectMessage));
+#if defined(_WIN32)
+			shutdown(udpSocket, SD_BOTH);
+#else
+			shutdown(udpSocket, SHUT_RDWR);
+#endif
+		}
+	}
+
+	/**
+	* Closes the socket and ends the use of winsock,
+	* on a failed open or from the destructor.
+	*/
+	void _release()
+	{
+		if (_valid(udpSocket))
+		{
+#if defined(_WIN32)
+			closesocket(udpSocket);
+#else
+			::close(udpSocket);
+#endif
+			udpSocket = _invalid();
+		}
+#if defined(_WIN32)
+		if (socketsStarted)
+		{
+			WSACleanup();
+		}
+#endif
+		socketsStarted = false;
+	}
+
+	/**
+	* @returns The uri the link was opened with.
+	*/
+	std::string uri()
+	{
+		return(linkUri);
+	}
+
+	/**
+	* Makes the uris of a fleet of simulated crazyflies on consecutive ports.
+	* @param The number of crazyflies.
+	* @param The host running the firmware.
+	* @param The port of the first crazyflie.
+	* @returns The uris.
+	*/
+	static std::vector<std::string> fleet_uris(int32_t count, const std::string& host = "127.0.0.1",
+		uint16_t firstPort = DEFAULT_PORT)
+	{
+		std::vector<std::string> result;
+		for (int32_t i = 0; i < count; i++)
+		{
+			result.push_back("udp://" + host + ":" + std::to_string(firstPort + i));
+		}
+		return(result);
+	}
+
+	/**
+	* Reads the host and port of a uri.
+	* @param The uri, udp://host:port.
+	* @param The returned host, unchanged if the uri has none.
+	* @param The returned port, unchanged if the uri has none.
+	*/
+	static void _parse_uri(const std::string& uri, std::string& host, uint16_t& port)
+	{
+		size_t start = uri.find("://");
+		start = start != std::string::npos ? start + 3 : 0;
+		size_t end = uri.find('/', start);
+		std::string address = uri.substr(start, end != std::string::npos ? end - start : std::string::npos);
+		size_t colon = address.rfind(':');
+		if (colon != std::string::npos)
+		{
+			port = (uint16_t)atoi(address.c_str() + colon + 1);
+			address = address.substr(0, colon);
+		}
+		if (address.size() > 0)
+		{
+			host = address;
+		}
+	}
+
+	/**
+	* @returns The value of a socket that was not created.
+	*/
+	static UdpSocket _invalid()
+	{
+#if defined(_WIN32)
+		return(INVALID_SOCKET);
+#else
+		return(-1);
+#endif
+	}
+
+	/**
+	* @param A socket.
+	* @returns true if the socket was created.
+	*/
+	static bool _valid(UdpSocket s)
+	{
+#if defined(_WIN32)
+		return(s != INVALID_SOCKET);
+#else
+		return(s >= 0);
+#endif
+	}
+
+	/**
+	* Sends bytes as one datagram.
+	* @param The bytes.
+	* @param The number of bytes.
+	*/
+	void _send_raw(const uint8_t* data, size_t size)
+	{
+		::send(udpSocket, (const char*)data, (int)size, 0);
+	}
+
+	/**
+	* Reads one datagram without waiting.
+	* @param The buffer.
+	* @param The size of the buffer.
+	* @returns The size of the datagram, or -1 if none is waiting.
+	*/
+	int32_t _receive_raw(uint8_t* buffer, size_t size)
+	{
+		return((int32_t)recv(udpSocket, (char*)buffer, (int)size, 0));
+	}
+
+	/**
+	* Waits for a datagram.
+	* @param The longest wait in milliseconds.
+	* @returns true if a datagram is waiting.
+	*/
+	bool _wait(uint32_t timeoutMs)
+	{
+		int32_t wait = timeoutMs < 0x7FFFFFFF ? (int32_t)timeoutMs : -1;
+#if defined(_WIN32)
+		WSAPOLLFD descriptor;
+		descriptor.fd = udpSocket;
+		descriptor.events = POLLRDNORM;
+		descriptor.revents = 0;
+		return(WSAPoll(&descriptor, 1, wait) > 0);
+#else
+		pollfd descriptor;
+		descriptor.fd = udpSocket;
+		descriptor.events = POLLIN;
+		descriptor.revents = 0;
+		return(poll(&descriptor, 1, wait) > 0);
+#endif
+	}
+};
+
+/**
+* A LinkFactory that opens a UdpLink.
+* @param Not used.
+* @param The uri, udp://host:port.
+* @returns The new UdpLink, or NULL if the socket could not be opened.
+*/
+inline CrtpLink* createUdpLink(void*, const std::string& uri)
+{
+	UdpLink* link = new UdpLink(uri);
+	if (!link->isOpen)
+	{
+		delete link;
+		link = NULL;
+	}
+	return(link);
+}
@@ -414,7 +414,7 @@ void drawScreen(CrazyFlie& cf, ControllerState &cs)
 
     setCursorPosition(xpos, ypos);
     std::cout << "packets per second: ";
-    std::cout << cf.portConnect->packetsPerSecond;
+    std::cout << cf.portConnect->linkMetrics.rxPerSecond;
     std::cout << "       ";
 
     xpos += spacing * 2;
@@ -41,6 +41,14 @@ public:
       seq_ = a.seq_;
   }
 
+  Packet& operator=(const Packet& a)
+  {
+      memcpy(&data_[0], &a.data_[0], CRTP_MAXSIZE);
+      size_ = a.size_;
+      seq_ = a.seq_;
+      return *this;
+  }
+
   Packet(const uint8_t* data, size_t size)
   {
     std::memcpy(data_.data(), data, size);
@@ -0,0 +1,87 @@
+/*
+* Header-only tests of the coroutine api against a simulated crazyflie
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+#include "cfasync.h"
+#include "simlink.h"
+#include "testrun.h"
+
+/**
+* Runs the coroutine api of cfasync.h against a SimLink.
+*/
+struct AsyncTests
+{
+	/**
+	* Connects, reads and writes a param and fetches the TOC, checking each step.
+	* @param The drone.
+	* @param The checks.
+	* @returns true when done.
+	*/
+	static CfTask<bool> _session(AsyncCrazyFlie& drone, TestRun& run)
+	{
+		run.check(co_await drone.connectAsync("sim://0", 1000), "async connect");
+		run.check(co_await drone.waitReady(10000), "async ready");
+		ParamResult before = co_await drone.get("stabilizer.estimator");
+		run.check(before.valid, "async get");
+		run.check(co_await drone.set("stabilizer.estimator", 3), "async set");
+		ParamResult after = co_await drone.get("stabilizer.estimator");
+		run.check(after.valid && after.value == 3, "async get after set");
+		ParamResult unknown = co_await drone.get("nope.nope");
+		run.check(!unknown.valid, "async get of an unknown param");
+		run.check(co_await drone.fetchToc(5000), "async fetch toc");
+		co_return true;
+	}
+
+	/**
+	* Awaits a request without a connection.
+	* @param The executor.
+	* @param The checks.
+	* @returns true when done.
+	*/
+	static CfTask<bool> _unconnected(CfExecutor& executor, TestRun& run)
+	{
+		Packet pk;
+		int32_t status = co_await executor.request(NULL, pk, PendingRequests::MATCH_COMMAND);
+		run.check(status == PendingRequests::REQUEST_CANCELLED, "async request without a connection");
+		bool waited = co_await executor.when([] { return(false); }, 20);
+		run.check(!waited, "async when times out");
+		co_return true;
+	}
+
+	/**
+	* Runs the tests.
+	* @param The checks.
+	*/
+	static void run(TestRun& run)
+	{
+		SimSettings settings;
+		CfExecutor executor;
+		CrazyFlie cf;
+		cf.defaultDirectory = TestRun::directory("async");
+		cf.linkFactory = createSimLink;
+		cf.linkContext = &settings;
+		{
+			AsyncCrazyFlie drone(&executor, &cf);
+			CfTask<bool> session = _session(drone, run);
+			run.check(executor.run(session), "async session");
+		}
+		cf.disconnect();
+		CfTask<bool> unconnected = _unconnected(executor, run);
+		run.check(executor.run(unconnected), "async unconnected");
+	}
+};
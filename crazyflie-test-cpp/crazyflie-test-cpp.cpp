@@ -0,0 +1,41 @@
+/*
+* Tests of the C++ header interface that implements the crazyflie client,
+* run against a simulated crazyflie, no Crazyradio is needed.
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+* Built as C++20 so the coroutine api of cfasync.h is compiled and run.
+* Returns 0 if every check held.
+*
+*/
+
+#include "testrun.h"
+#include "asynctests.h"
+#include "dispatchtests.h"
+#include "txqueuetests.h"
+#include "pendingtests.h"
+
+int main()
+{
+	TestRun run;
+	AsyncTests::run(run);
+	DispatchTests::run(run);
+	TxQueueTests::run(run);
+	PendingTests::run(run);
+	messageOut << run.passed;
+	messageOut << " checks passed, ";
+	messageOut << run.failed;
+	messageOut << " failed\n\r";
+	return(run.failed == 0 ? 0 : 1);
+}
@@ -0,0 +1,369 @@
+/*
+* Header-only tests of the receive dispatch of crazyflie-client-cpp
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+#include "portdispatch.h"
+#include "testrun.h"
+#include <thread>
+#include <vector>
+
+/**
+* A PortClient that records the first payload byte of each packet it handles.
+*/
+class RecordingClient : public PortClient
+{
+public:
+
+	std::vector<uint8_t> seen;		/**< The first payload byte of each packet, in the order handled. */
+
+	/**
+	* Virtual PortClient call, records the packet.
+	* @param The packet.
+	*/
+	void _new_packet_cb(Packet& pk)
+	{
+		seen.push_back(pk.payload()[0]);
+	}
+};
+
+/**
+* A RecordingClient that also records the runs of packets it is handed.
+*/
+class BatchClient : public RecordingClient
+{
+public:
+
+	size_t runs = 0;			/**< Runs of packets handled. */
+	size_t largestRun = 0;		/**< The most packets handed over in one run. */
+
+	/**
+	* Virtual PortClient call, records the run and each packet.
+	* @param The packets.
+	* @param The number of packets.
+	*/
+	void _new_packets_cb(PacketRef* packets, size_t count)
+	{
+		runs++;
+		largestRun = count > largestRun ? count : largestRun;
+		PortClient::_new_packets_cb(packets, count);
+	}
+};
+
+/**
+* A PortClient that removes itself from its dispatcher when it handles a packet.
+*/
+class RemovingClient : public PortClient
+{
+public:
+
+	PortDispatcher* dispatcher = NULL;		/**< The dispatcher to leave. */
+	std::atomic<int32_t> handledCount = 0;	/**< Packets handled. */
+
+	/**
+	* Virtual PortClient call, removes the client.
+	* @param The packet.
+	*/
+	void _new_packet_cb(Packet&)
+	{
+		handledCount++;
+		dispatcher->remove_client(this);
+	}
+};
+
+/**
+* Runs the SpscRing, the PortWorkers and the routes of a PortDispatcher.
+*/
+struct DispatchTests
+{
+	/**
+	* Makes a packet for a port and channel, with one payload byte.
+	* @param The pool to take the packet from.
+	* @param The port.
+	* @param The channel.
+	* @param The payload byte.
+	* @returns The packet.
+	*/
+	static PacketRef _packet(PacketPool& pool, uint8_t port, uint8_t channel, uint8_t value)
+	{
+		PacketRef result = pool.alloc();
+		result->setPort(port);
+		result->setChannel(channel);
+		result->payload()[0] = value;
+		result->setPayloadSize(1);
+		return(result);
+	}
+
+	/**
+	* Pushes and pops across the wraparound of the ring indices.
+	* @param The checks.
+	*/
+	static void ring_wraparound(TestRun& run)
+	{
+		SpscRing<uint32_t, 8> ring;
+		// start just below the wrap of the 32 bit indices, so they cross zero with items waiting.
+		ring.head = 0xFFFFFFFA;
+		ring.tail = 0xFFFFFFFA;
+		uint32_t next = 0;
+		uint32_t expected = 0;
+		uint32_t value = 0;
+		bool ordered = true;
+		for (int32_t pass = 0; pass < 8; pass++)
+		{
+			for (int32_t i = 0; i < 5; i++)
+			{
+				ordered = ring.push(next++) && ordered;
+			}
+			for (int32_t i = 0; i < 5; i++)
+			{
+				ordered = ring.pop(value) && value == expected++ && ordered;
+			}
+		}
+		run.check(ordered && ring.empty(), "SpscRing keeps its order across the index wraparound");
+
+		bool filled = true;
+		for (uint32_t i = 0; i < 8; i++)
+		{
+			filled = ring.push(i) && filled;
+		}
+		run.check(filled && !ring.push(8) && ring.size() == 8, "SpscRing refuses a push when full");
+		bool drained = true;
+		for (uint32_t i = 0; i < 8; i++)
+		{
+			drained = ring.pop(value) && value == i && drained;
+		}
+		run.check(drained && !ring.pop(value), "SpscRing pops a full ring in order");
+	}
+
+	/**
+	* Passes values from a producer thread to a consumer through a small ring.
+	* @param The checks.
+	*/
+	static void ring_threads(TestRun& run)
+	{
+		const static uint32_t COUNT = 200000;
+		SpscRing<uint32_t, 64> ring;
+		std::thread producer([&ring] {
+			for (uint32_t i = 0; i < COUNT;)
+			{
+				if (ring.push(i))
+				{
+					i++;
+				}
+				else
+				{
+					std::this_thread::yield();
+				}
+			}
+			});
+		bool ordered = true;
+		uint32_t expected = 0;
+		uint32_t value = 0;
+		while (expected < COUNT)
+		{
+			if (ring.pop(value))
+			{
+				ordered = ordered && value == expected;
+				expected++;
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+		producer.join();
+		run.check(ordered && ring.empty(), "SpscRing passes every value in order between threads");
+	}
+
+	/**
+	* Dispatches packets to a started worker and checks
+	* the client handles every one in order.
+	* @param The checks.
+	*/
+	static void worker_order(TestRun& run)
+	{
+		PacketPool pool;
+		RecordingClient client;
+		PortDispatcher dispatcher;
+		dispatcher.add_client(&client, LOGGING);
+		dispatcher.start();
+		bool flushed = true;
+		for (int32_t burst = 0; burst < 4; burst++)
+		{
+			for (int32_t i = 0; i < 200; i++)
+			{
+				dispatcher.dispatch(_packet(pool, LOGGING, i % CHANNEL_COUNT, (uint8_t)i));
+			}
+			flushed = dispatcher.flush(1000) && flushed;
+		}
+		PortWorker* worker = dispatcher.findWorker(&client);
+		bool ordered = client.seen.size() == 800;
+		for (size_t i = 0; i < client.seen.size() && ordered; i++)
+		{
+			ordered = client.seen[i] == (uint8_t)(i % 200);
+		}
+		run.check(flushed, "PortDispatcher flush waits for the worker");
+		run.check(ordered, "PortWorker hands every packet to its client in order");
+		run.check(worker != NULL && worker->received == 800 && worker->handled == 800 && worker->dropped == 0,
+			"PortWorker counts the packets it received and handled");
+		dispatcher.clear();
+	}
+
+	/**
+	* Dispatches a batch of packets for two ports and checks
+	* each client gets the packets of its port in order.
+	* @param The checks.
+	*/
+	static void batch_order(TestRun& run)
+	{
+		const static size_t COUNT = 200;
+		PacketPool pool;
+		BatchClient logClient;
+		BatchClient paramClient;
+		PortDispatcher dispatcher;
+		dispatcher.add_client(&logClient, LOGGING);
+		dispatcher.add_client(&paramClient, PARAM);
+		dispatcher.start();
+		std::vector<PacketRef> batch;
+		for (size_t i = 0; i < COUNT; i++)
+		{
+			batch.push_back(_packet(pool, (i % 3) == 0 ? PARAM : LOGGING, 1, (uint8_t)i));
+		}
+		int32_t queued = dispatcher.dispatch_batch(batch.data(), batch.size());
+		bool flushed = dispatcher.flush(1000);
+		bool ordered = paramClient.seen.size() + logClient.seen.size() == COUNT;
+		size_t param = 0;
+		size_t log = 0;
+		for (size_t i = 0; i < COUNT && ordered; i++)
+		{
+			if ((i % 3) == 0)
+			{
+				ordered = param < paramClient.seen.size() && paramClient.seen[param++] == (uint8_t)i;
+			}
+			else
+			{
+				ordered = log < logClient.seen.size() && logClient.seen[log++] == (uint8_t)i;
+			}
+		}
+		run.check(queued == (int32_t)COUNT && flushed && ordered, "dispatch_batch hands each client the packets of its port in order");
+		run.check(logClient.runs > 0 && logClient.runs < logClient.seen.size() && logClient.largestRun <= PortWorker::BATCH_SIZE,
+			"PortWorker hands its client runs of packets");
+		dispatcher.clear();
+	}
+
+	/**
+	* Adds and removes clients while another thread dispatches,
+	* and checks a client sees no packet once remove_client returns.
+	* @param The checks.
+	*/
+	static void routes_during_dispatch(TestRun& run)
+	{
+		const static int32_t CYCLES = 50;
+		PacketPool pool;
+		RecordingClient steady;
+		std::vector<RecordingClient> transient(CYCLES);
+		PortDispatcher dispatcher;
+		dispatcher.add_client(&steady, LOGGING);
+		dispatcher.start();
+		PortWorker* steadyWorker = dispatcher.findWorker(&steady);
+
+		std::atomic<bool> dispatching = true;
+		std::thread port([&] {
+			uint8_t value = 0;
+			while (dispatching)
+			{
+				// keep the steady ring from filling, so none of its packets are dropped.
+				while (steadyWorker->ring.size() > PortWorker::RING_SIZE / 2 && dispatching)
+				{
+					std::this_thread::yield();
+				}
+				dispatcher.dispatch(_packet(pool, LOGGING, 0, value++));
+			}
+			});
+
+		bool quiet = true;
+		size_t reached = 0;
+		for (int32_t i = 0; i < CYCLES; i++)
+		{
+			RecordingClient& client = transient[i];
+			dispatcher.add_client(&client, LOGGING, 0);
+			std::this_thread::sleep_for(std::chrono::microseconds(300));
+			dispatcher.remove_client(&client);
+			// the worker of a removed client is joined, its client may be read.
+			size_t removedAt = client.seen.size();
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			quiet = quiet && client.seen.size() == removedAt && !dispatcher.routes_client(&client, LOGGING);
+			reached += removedAt > 0 ? 1 : 0;
+		}
+		dispatching = false;
+		port.join();
+		bool flushed = dispatcher.flush(1000);
+
+		bool ordered = steady.seen.size() > 0;
+		for (size_t i = 1; i < steady.seen.size() && ordered; i++)
+		{
+			ordered = steady.seen[i] == (uint8_t)(steady.seen[i - 1] + 1);
+		}
+		run.check(quiet, "a removed client gets no packets once remove_client returns");
+		run.check(reached > 0, "a client added during dispatch gets packets");
+		run.check(flushed && ordered && steadyWorker->dropped == 0,
+			"a client keeps every packet in order while others are added and removed");
+		dispatcher.clear();
+	}
+
+	/**
+	* A client removes itself from its own handler.
+	* @param The checks.
+	*/
+	static void remove_from_handler(TestRun& run)
+	{
+		PacketPool pool;
+		RemovingClient client;
+		PortDispatcher dispatcher;
+		client.dispatcher = &dispatcher;
+		dispatcher.add_client(&client, PARAM);
+		dispatcher.start();
+		for (int32_t i = 0; i < 8; i++)
+		{
+			dispatcher.dispatch(_packet(pool, PARAM, 1, (uint8_t)i));
+		}
+		int64_t deadlineNs = steadyNowNs() + 1000000000LL;
+		while (dispatcher.routes_client(&client, PARAM) && steadyNowNs() < deadlineNs)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		bool removed = !dispatcher.routes_client(&client, PARAM);
+		dispatcher.dispatch(_packet(pool, PARAM, 1, 8));
+		dispatcher.clear();
+		run.check(removed && client.handledCount >= 1 && client.handledCount <= 8,
+			"a client removes itself from its handler without a deadlock");
+	}
+
+	/**
+	* Runs the tests.
+	* @param The checks.
+	*/
+	static void run(TestRun& run)
+	{
+		ring_wraparound(run);
+		ring_threads(run);
+		worker_order(run);
+		batch_order(run);
+		routes_during_dispatch(run);
+		remove_from_handler(run);
+	}
+};
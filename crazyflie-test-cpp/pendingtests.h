@@ -0,0 +1,220 @@
+/*
+* Header-only tests of the pending request table of crazyflie-client-cpp
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+#include "pendingrequests.h"
+#include "txqueuetests.h"
+#include "testrun.h"
+#include <thread>
+
+/**
+* The completion of a pending request, filled by PendingTests::_record.
+*/
+struct PendingOutcome
+{
+	int32_t status = -1;		/**< The last status, -1 until the request completes. */
+	int32_t calls = 0;			/**< Times the callback ran. */
+};
+
+/**
+* Runs the retransmits, timeouts and replies of PendingRequests.
+*/
+struct PendingTests
+{
+	const static uint8_t MATCH = PendingRequests::MATCH_COMMAND | PendingRequests::MATCH_IDENT8;	/**< The layout of the test requests. */
+
+	/**
+	* Makes a param request or reply with a command and identifier.
+	* @param The command.
+	* @param The identifier.
+	* @returns The packet.
+	*/
+	static Packet _packet(uint8_t command, uint8_t ident)
+	{
+		Packet result(PARAM, 1, 2);
+		result.payload()[0] = command;
+		result.payload()[1] = ident;
+		return(result);
+	}
+
+	/**
+	* PendingCallback that records the completion.
+	* @param The PendingOutcome.
+	* @param The request status.
+	*/
+	static void _record(void* context, int32_t status, Packet&)
+	{
+		PendingOutcome* outcome = (PendingOutcome*)context;
+		outcome->status = status;
+		outcome->calls++;
+	}
+
+	/**
+	* Services the table until it is empty or a time passes,
+	* sending each retransmit on the link.
+	* @param The table.
+	* @param The transmit queue, started without a thread.
+	* @param The longest time to service in milliseconds.
+	*/
+	static void _service_until_idle(PendingRequests& pending, TxQueue& txQueue, uint32_t timeoutMs)
+	{
+		int64_t deadlineNs = steadyNowNs() + (int64_t)timeoutMs * 1000000;
+		while (pending.activeCount > 0 && steadyNowNs() < deadlineNs)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(pending.waitMs(5)));
+			pending.service(txQueue);
+			txQueue.drain();
+		}
+	}
+
+	/**
+	* Lets a request go unanswered and checks it is retransmitted
+	* once for each retry, then times out.
+	* @param The checks.
+	*/
+	static void timeout_retransmit(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		PendingRequests pending;
+		PendingOutcome outcome;
+		txQueue.start(&link, false);
+		Packet request = _packet(3, 7);
+		int64_t startNs = steadyNowNs();
+		bool added = pending.add(request, MATCH, 10, 2, _record, &outcome, TX_PARAM);
+		bool early = pending.service(txQueue) == 0 && txQueue.drain() == 0;
+		_service_until_idle(pending, txQueue, 1000);
+		int64_t elapsedNs = steadyNowNs() - startNs;
+		bool resent = link.values.size() == 2 && link.values[0] == 3 && link.values[1] == 3;
+		run.check(added && early, "a request is not retransmitted before its deadline");
+		run.check(resent && pending.retransmits == 2, "a request is retransmitted once for each retry");
+		// the first send and two retransmits each wait 10 ms for a reply.
+		run.check(outcome.status == PendingRequests::REQUEST_TIMEOUT && outcome.calls == 1 &&
+			pending.timeouts == 1 && pending.activeCount == 0 && elapsedNs >= 30000000LL,
+			"a request times out after its last retry");
+		txQueue.stop();
+	}
+
+	/**
+	* Answers a request after a retransmit and checks it completes once,
+	* and that a reply with another identifier does not complete it.
+	* @param The checks.
+	*/
+	static void reply_completes(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		PendingRequests pending;
+		PendingOutcome outcome;
+		txQueue.start(&link, false);
+		Packet request = _packet(3, 7);
+		pending.add(request, MATCH, 10, 5, _record, &outcome, TX_PARAM);
+		std::this_thread::sleep_for(std::chrono::milliseconds(15));
+		pending.service(txQueue);
+		txQueue.drain();
+
+		Packet other = _packet(3, 8);
+		Packet otherCommand = _packet(4, 7);
+		bool ignored = !pending.observe_reply(other) && !pending.observe_reply(otherCommand) && outcome.calls == 0;
+		Packet reply = _packet(3, 7);
+		bool completed = pending.observe_reply(reply);
+		bool once = !pending.observe_reply(reply);
+		std::this_thread::sleep_for(std::chrono::milliseconds(15));
+		bool quiet = pending.service(txQueue) == 0 && txQueue.drain() == 0;
+		run.check(ignored, "a reply with another command or identifier does not complete a request");
+		run.check(completed && once && outcome.status == PendingRequests::REQUEST_DONE && outcome.calls == 1 &&
+			pending.completed == 1 && link.values.size() == 1,
+			"a reply completes its request once, after a retransmit");
+		run.check(quiet && pending.activeCount == 0 && pending.maxRoundTripNs >= 10000000LL,
+			"a completed request is not retransmitted");
+		txQueue.stop();
+	}
+
+	/**
+	* Replaces and cancels requests and checks each completes as cancelled.
+	* @param The checks.
+	*/
+	static void replace_cancel(TestRun& run)
+	{
+		PendingRequests pending;
+		PendingOutcome first;
+		PendingOutcome second;
+		PendingOutcome third;
+		Packet request = _packet(3, 7);
+		Packet another = _packet(3, 9);
+		pending.add(request, MATCH, 50, 1, _record, &first, TX_PARAM);
+		pending.add(request, MATCH, 50, 1, _record, &second, TX_PARAM);
+		pending.add(another, MATCH, 50, 1, _record, &third, TX_PARAM);
+		uint32_t waitMs = pending.waitMs(1000);
+		run.check(first.status == PendingRequests::REQUEST_CANCELLED && second.calls == 0 && pending.activeCount == 2,
+			"a request with the same key replaces the one waiting");
+		run.check(waitMs >= 1 && waitMs <= 50, "waitMs returns the time to the earliest deadline");
+		pending.cancel_all();
+		run.check(second.status == PendingRequests::REQUEST_CANCELLED && third.status == PendingRequests::REQUEST_CANCELLED &&
+			pending.activeCount == 0 && pending.waitMs(1000) == 1000,
+			"cancel_all cancels every waiting request");
+	}
+
+	/**
+	* Retransmits two requests while the queue of one of them is full
+	* and checks only the turned away request keeps its retry and is sent later.
+	* @param The checks.
+	*/
+	static void full_queue(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		PendingRequests pending;
+		txQueue.start(&link, false);
+		Packet filler = _packet(0x77, 0);
+		for (uint32_t i = 0; i < TxQueue::QUEUE_SIZE; i++)
+		{
+			txQueue.try_enqueue(filler, TX_PARAM);
+		}
+		Packet sent = _packet(3, 1);
+		Packet turnedAway = _packet(4, 2);
+		pending.add(sent, MATCH, 10, 2, NULL, NULL, TX_LOG_CONTROL);
+		pending.add(turnedAway, MATCH, 10, 2, NULL, NULL, TX_PARAM);
+		std::this_thread::sleep_for(std::chrono::milliseconds(15));
+		pending.service(txQueue);
+		run.check(pending.retransmits == 1 && pending.requests[0].retries == 1 && pending.requests[1].retries == 2,
+			"a retransmit turned away by a full queue keeps its retry");
+
+		txQueue.drain();
+		link.clear();
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		pending.service(txQueue);
+		txQueue.drain();
+		run.check(pending.retransmits == 2 && pending.requests[1].retries == 1 && link.values.size() == 1 && link.values[0] == 4,
+			"a retransmit turned away is sent once the queue has room");
+		pending.cancel_all();
+		txQueue.stop();
+	}
+
+	/**
+	* Runs the tests.
+	* @param The checks.
+	*/
+	static void run(TestRun& run)
+	{
+		timeout_retransmit(run);
+		reply_completes(run);
+		replace_cancel(run);
+		full_queue(run);
+	}
+};
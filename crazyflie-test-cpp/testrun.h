@@ -0,0 +1,67 @@
+/*
+* Header-only checks for the tests of crazyflie-client-cpp
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+#include "messageout.h"
+#include <string>
+#include <filesystem>
+
+/**
+* Counts the checks of a test run and reports the ones that fail.
+*/
+struct TestRun
+{
+	int32_t passed = 0;		/**< Checks that held. */
+	int32_t failed = 0;		/**< Checks that did not hold. */
+
+	/**
+	* Records a check.
+	* @param true if the check held.
+	* @param The name of the check, reported if it failed.
+	* @returns The check.
+	*/
+	bool check(bool ok, const char* name)
+	{
+		if (ok)
+		{
+			passed++;
+		}
+		else
+		{
+			failed++;
+			messageOut << "FAILED: ";
+			messageOut << name;
+			messageOut << "\n\r";
+		}
+		return(ok);
+	}
+
+	/**
+	* Makes an empty directory for the cached TOCs of a test.
+	* @param The name of the test.
+	* @returns The path of the directory.
+	*/
+	static std::string directory(const char* name)
+	{
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "crazyflie-test" / name;
+		std::error_code error;
+		std::filesystem::remove_all(path, error);
+		std::filesystem::create_directories(path, error);
+		return(path.string());
+	}
+};
@@ -0,0 +1,479 @@
+/*
+* Header-only tests of the transmit queue of crazyflie-client-cpp
+* Copyright (c) 2024-2025 Young Harvill
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+#
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program. If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+#include "txqueue.h"
+#include "testrun.h"
+#include <thread>
+#include <vector>
+
+/**
+* A CrtpLink that records the port and first payload byte of each packet sent.
+*/
+class RecordingLink : public CrtpLink
+{
+public:
+
+	std::vector<uint8_t> ports;		/**< The port of each packet, in the order sent. */
+	std::vector<uint8_t> values;	/**< The first payload byte of each packet, in the order sent. */
+
+	/**
+	* Records a packet.
+	* @param The packet to send.
+	*/
+	void send(const Packet& pk)
+	{
+		ports.push_back(pk.port());
+		values.push_back(pk.payload()[0]);
+	}
+
+	/**
+	* Receives nothing.
+	* @returns An empty packet.
+	*/
+	Packet receive(uint32_t)
+	{
+		return(Packet());
+	}
+
+	/**
+	* Closes the link.
+	*/
+	void close()
+	{
+	}
+
+	/**
+	* @returns The uri of the link.
+	*/
+	std::string uri()
+	{
+		return("record://0");
+	}
+
+	/**
+	* Forgets the packets sent.
+	*/
+	void clear()
+	{
+		ports.clear();
+		values.clear();
+	}
+};
+
+/**
+* Runs the MpscQueue, the priority classes, the batches, the mailboxes and the budgets of a TxQueue.
+*/
+struct TxQueueTests
+{
+	/**
+	* Makes a packet for a port and channel, with one payload byte.
+	* @param The port.
+	* @param The channel.
+	* @param The payload byte.
+	* @returns The packet.
+	*/
+	static Packet _packet(uint8_t port, uint8_t channel, uint8_t value)
+	{
+		Packet result(port, channel, 1);
+		result.payload()[0] = value;
+		return(result);
+	}
+
+	/**
+	* Pushes and pops across the wraparound of the queue positions.
+	* @param The checks.
+	*/
+	static void mpsc_wraparound(TestRun& run)
+	{
+		const static uint32_t SIZE = 8;
+		MpscQueue<uint32_t, SIZE> queue;
+		// start just below the wrap of the 32 bit positions, with each cell ready for its position.
+		uint32_t start = 0xFFFFFFFA;
+		for (uint32_t i = 0; i < SIZE; i++)
+		{
+			queue.cells[(start + i) & (SIZE - 1)].sequence = start + i;
+		}
+		queue.enqueuePos = start;
+		queue.dequeuePos = start;
+		uint32_t next = 0;
+		uint32_t expected = 0;
+		uint32_t value = 0;
+		bool ordered = true;
+		for (int32_t pass = 0; pass < 8; pass++)
+		{
+			for (int32_t i = 0; i < 5; i++)
+			{
+				ordered = queue.push(next++) && ordered;
+			}
+			for (int32_t i = 0; i < 5; i++)
+			{
+				ordered = queue.pop(value) && value == expected++ && ordered;
+			}
+		}
+		run.check(ordered && queue.size() == 0, "MpscQueue keeps its order across the position wraparound");
+
+		bool filled = true;
+		for (uint32_t i = 0; i < SIZE; i++)
+		{
+			filled = queue.push(i) && filled;
+		}
+		run.check(filled && !queue.push(SIZE) && queue.size() == SIZE, "MpscQueue refuses a push when full");
+		bool drained = true;
+		for (uint32_t i = 0; i < SIZE; i++)
+		{
+			drained = queue.pop(value) && value == i && drained;
+		}
+		run.check(drained && !queue.pop(value), "MpscQueue pops a full queue in order");
+	}
+
+	/**
+	* Pushes from several threads into a small queue and checks
+	* the values of each producer arrive in order.
+	* @param The checks.
+	*/
+	static void mpsc_producers(TestRun& run)
+	{
+		const static uint32_t PRODUCERS = 4;
+		const static uint32_t COUNT = 50000;
+		MpscQueue<uint32_t, 64> queue;
+		std::vector<std::thread> producers;
+		for (uint32_t p = 0; p < PRODUCERS; p++)
+		{
+			producers.push_back(std::thread([&queue, p] {
+				for (uint32_t i = 0; i < COUNT;)
+				{
+					if (queue.push((p << 24) | i))
+					{
+						i++;
+					}
+					else
+					{
+						std::this_thread::yield();
+					}
+				}
+				}));
+		}
+		uint32_t expected[PRODUCERS] = {};
+		uint32_t total = 0;
+		uint32_t value = 0;
+		bool ordered = true;
+		while (total < PRODUCERS * COUNT)
+		{
+			if (queue.pop(value))
+			{
+				uint32_t p = value >> 24;
+				ordered = ordered && p < PRODUCERS && (value & 0xFFFFFF) == expected[p];
+				if (p < PRODUCERS)
+				{
+					expected[p]++;
+				}
+				total++;
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+		for (std::thread& producer : producers)
+		{
+			producer.join();
+		}
+		run.check(ordered && queue.size() == 0, "MpscQueue keeps the order of each producer");
+	}
+
+	/**
+	* Queues packets lowest priority first and checks drain()
+	* sends them highest class first, in order within each class.
+	* @param The checks.
+	*/
+	static void priority_order(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		txQueue.start(&link, false);
+		for (int32_t txClass = TX_CLASS_COUNT - 1; txClass >= 0; txClass--)
+		{
+			for (uint8_t i = 0; i < 3; i++)
+			{
+				Packet pk = _packet(PARAM, 1, (uint8_t)(txClass * 16 + i));
+				txQueue.enqueue(pk, (TxClass)txClass);
+			}
+		}
+		Packet toc = _packet(LOGGING, TOC_CHANNEL, 0xF0);
+		Packet param = _packet(PARAM, 2, 0xF1);
+		txQueue.enqueue(toc);
+		txQueue.enqueue(param);
+		int32_t sent = txQueue.drain();
+
+		bool ordered = sent == TX_CLASS_COUNT * 3 + 2 && link.values.size() == (size_t)sent;
+		size_t at = 0;
+		for (int32_t txClass = 0; txClass < TX_CLASS_COUNT && ordered; txClass++)
+		{
+			for (uint8_t i = 0; i < 3 && ordered; i++)
+			{
+				ordered = link.values[at++] == (uint8_t)(txClass * 16 + i);
+			}
+			if (txClass == TX_PARAM && ordered)
+			{
+				ordered = link.values[at++] == 0xF1;
+			}
+			if (txClass == TX_TOC && ordered)
+			{
+				ordered = link.values[at++] == 0xF0;
+			}
+		}
+		run.check(ordered, "TxQueue sends the highest class first, in order within a class");
+		run.check(txQueue.empty() && txQueue.stats[TX_PARAM].sent == 4 && txQueue.stats[TX_TOC].sent == 4,
+			"TxQueue counts the packets sent in each class");
+		txQueue.stop();
+	}
+
+	/**
+	* Posts several packets to the slots of a mailbox and checks
+	* only the newest of each slot is sent, ahead of queued setpoints.
+	* @param The checks.
+	*/
+	static void mailbox_latest(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		TxMailbox mailbox;
+		txQueue.start(&link, false);
+		txQueue.attach_mailbox(&mailbox);
+		Packet queued = _packet(COMMANDER, 0, 0x20);
+		txQueue.enqueue(queued);
+		for (uint8_t i = 1; i <= 5; i++)
+		{
+			Packet pk = _packet(COMMANDER, 0, i);
+			txQueue.post(mailbox, 0, pk);
+		}
+		for (uint8_t i = 8; i <= 9; i++)
+		{
+			Packet pk = _packet(COMMANDER_GENERIC, 0, i);
+			txQueue.post(mailbox, 1, pk);
+		}
+		Packet outOfRange = _packet(COMMANDER, 0, 0x30);
+		bool refused = !txQueue.post(mailbox, TxMailbox::MAX_SLOTS, outOfRange);
+		int32_t sent = txQueue.drain();
+		run.check(sent == 3 && link.values.size() == 3 && link.values[0] == 5 && link.values[1] == 9 && link.values[2] == 0x20,
+			"TxMailbox sends only the newest packet of each slot, ahead of queued setpoints");
+		run.check(refused && mailbox.posted == 7 && mailbox.superseded == 5 && mailbox.sent == 2 && !mailbox.pending(),
+			"TxMailbox counts the packets posted, superseded and sent");
+
+		link.clear();
+		Packet late = _packet(COMMANDER, 0, 6);
+		txQueue.post(mailbox, 0, late);
+		int32_t discarded = mailbox.discard();
+		sent = txQueue.drain();
+		run.check(discarded == 1 && sent == 0 && link.values.empty() && mailbox.discarded == 1,
+			"TxMailbox discards an unsent packet");
+		txQueue.detach_mailbox(&mailbox);
+		txQueue.stop();
+	}
+
+	/**
+	* Posts rising values to a mailbox while the transmit thread sends
+	* and checks an older packet is never sent after a newer one.
+	* @param The checks.
+	*/
+	static void mailbox_threads(TestRun& run)
+	{
+		const static uint8_t COUNT = 250;
+		RecordingLink link;
+		TxQueue txQueue;
+		TxMailbox mailbox;
+		txQueue.attach_mailbox(&mailbox);
+		txQueue.start(&link);
+		for (uint8_t i = 1; i <= COUNT; i++)
+		{
+			Packet pk = _packet(COMMANDER, 0, i);
+			txQueue.post(mailbox, 0, pk);
+			if ((i & 0x7) == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		}
+		bool flushed = txQueue.flush(1000);
+		txQueue.stop();
+		txQueue.detach_mailbox(&mailbox);
+		bool rising = !link.values.empty() && link.values.back() == COUNT;
+		for (size_t i = 1; i < link.values.size() && rising; i++)
+		{
+			rising = link.values[i] > link.values[i - 1];
+		}
+		run.check(flushed && rising, "TxMailbox never sends an older packet after a newer one");
+		run.check(mailbox.sent + mailbox.superseded == COUNT && mailbox.sent == link.values.size(),
+			"TxMailbox sends or supersedes every packet posted");
+	}
+
+	/**
+	* Queues more packets than a budget allows and checks the deferred
+	* packets are sent in order once tokens refill, while unlimited
+	* packets of the same and other classes are not held up.
+	* @param The checks.
+	*/
+	static void budget_deferral(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		int32_t owner = 0;
+		int32_t index = txQueue.set_budget(&owner, 20.0, 2.0);
+		txQueue.assign_budget(PARAM, index);
+		txQueue.start(&link, false);
+		int64_t startNs = steadyNowNs();
+		for (uint8_t i = 1; i <= 6; i++)
+		{
+			Packet pk = _packet(PARAM, 2, i);
+			txQueue.enqueue(pk);
+		}
+		Packet unlimited = _packet(LOGGING, 1, 0x50);
+		txQueue.enqueue(unlimited, TX_PARAM);
+		for (uint8_t i = 0x41; i <= 0x43; i++)
+		{
+			Packet pk = _packet(LOGGING, 1, i);
+			txQueue.enqueue(pk);
+		}
+		Packet emergency = _packet(PARAM, 2, 0xE0);
+		txQueue.enqueue(emergency, TX_EMERGENCY);
+		txQueue.drain();
+
+		const uint8_t first[] = { 0xE0, 0x41, 0x42, 0x43, 1, 2, 0x50 };
+		bool ordered = link.values.size() == sizeof(first);
+		for (size_t i = 0; i < sizeof(first) && ordered; i++)
+		{
+			ordered = link.values[i] == first[i];
+		}
+		run.check(ordered, "TxBudget defers the packets over its burst without holding up the others");
+		run.check(txQueue.deferredCount == 4 && txQueue.deferUntilNs != 0 && txQueue.budgets[index].deferred >= 1,
+			"TxQueue keeps the deferred packets and the time a token refills");
+
+		link.clear();
+		int64_t deadlineNs = steadyNowNs() + 2000000000LL;
+		while (!txQueue.empty() && steadyNowNs() < deadlineNs)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			txQueue.drain();
+		}
+		int64_t elapsedNs = steadyNowNs() - startNs;
+		bool deferred = link.values.size() == 4;
+		for (size_t i = 0; i < link.values.size() && deferred; i++)
+		{
+			deferred = link.values[i] == (uint8_t)(i + 3);
+		}
+		run.check(deferred && txQueue.empty(), "TxBudget sends the deferred packets in the order queued");
+		// four packets past the burst at 20 per second wait at least 150 ms for their tokens.
+		run.check(elapsedNs >= 150000000LL && txQueue.budgets[index].sent == 6 && txQueue.budgets[index].maxDeferNs > 0,
+			"TxBudget holds the packets to its rate");
+		txQueue.stop();
+	}
+
+	/**
+	* Queues packets over a budget for the transmit thread
+	* and checks flush() waits for them to be sent in order.
+	* @param The checks.
+	*/
+	static void budget_thread(TestRun& run)
+	{
+		const static uint8_t COUNT = 10;
+		RecordingLink link;
+		TxQueue txQueue;
+		int32_t owner = 0;
+		txQueue.assign_budget(PARAM, txQueue.set_budget(&owner, 100.0, 1.0));
+		txQueue.start(&link);
+		int64_t startNs = steadyNowNs();
+		for (uint8_t i = 1; i <= COUNT; i++)
+		{
+			Packet pk = _packet(PARAM, 2, i);
+			txQueue.enqueue(pk);
+		}
+		bool flushed = txQueue.flush(2000);
+		int64_t elapsedNs = steadyNowNs() - startNs;
+		txQueue.stop();
+		bool ordered = link.values.size() == COUNT;
+		for (size_t i = 0; i < link.values.size() && ordered; i++)
+		{
+			ordered = link.values[i] == (uint8_t)(i + 1);
+		}
+		run.check(flushed && ordered && elapsedNs >= 80000000LL,
+			"the transmit thread waits for budget tokens and keeps the packets in order");
+	}
+
+	/**
+	* Queues runs of packets with enqueue_batch and checks they are sent
+	* in order, by class, and that a run larger than a class queue
+	* waits for room instead of dropping packets.
+	* @param The checks.
+	*/
+	static void batch_order(TestRun& run)
+	{
+		RecordingLink link;
+		TxQueue txQueue;
+		txQueue.start(&link, false);
+		std::vector<Packet> packets;
+		for (uint8_t i = 0; i < 40; i++)
+		{
+			packets.push_back(_packet((i & 1) ? PARAM : LOGGING, 2, i));
+		}
+		int32_t queued = txQueue.enqueue_batch(PacketSpan(packets));
+		int32_t sent = txQueue.drain();
+		bool ordered = queued == 40 && sent == 40 && link.values.size() == 40;
+		for (size_t i = 0; i < link.values.size() && ordered; i++)
+		{
+			// the log control packets are sent ahead of the param packets.
+			ordered = link.values[i] == (uint8_t)(i < 20 ? i * 2 : (i - 20) * 2 + 1);
+		}
+		run.check(ordered, "enqueue_batch keeps the order of each class");
+		txQueue.stop();
+
+		const static uint32_t COUNT = TxQueue::QUEUE_SIZE * 3;
+		RecordingLink threadLink;
+		TxQueue threadQueue;
+		threadQueue.start(&threadLink);
+		packets.clear();
+		for (uint32_t i = 0; i < COUNT; i++)
+		{
+			packets.push_back(_packet(PARAM, 2, (uint8_t)i));
+		}
+		queued = threadQueue.enqueue_batch(PacketSpan(packets));
+		bool flushed = threadQueue.flush(1000);
+		threadQueue.stop();
+		ordered = queued == (int32_t)COUNT && flushed && threadLink.values.size() == COUNT;
+		for (size_t i = 0; i < threadLink.values.size() && ordered; i++)
+		{
+			ordered = threadLink.values[i] == (uint8_t)i;
+		}
+		run.check(ordered, "enqueue_batch waits for room and sends a long run in order");
+	}
+
+	/**
+	* Runs the tests.
+	* @param The checks.
+	*/
+	static void run(TestRun& run)
+	{
+		mpsc_wraparound(run);
+		mpsc_producers(run);
+		priority_order(run);
+		batch_order(run);
+		mailbox_latest(run);
+		mailbox_threads(run);
+		budget_deferral(run);
+		budget_thread(run);
+	}
+};